@@ -0,0 +1,86 @@
+# encoding: utf-8
+
+# Measures the effect of Mosquitto::Client#socket_options on round trip latency of small QoS 0 messages and
+# on QoS 1 throughput of large payloads. Runs against the in-process broker from test/broker.rb, which delays
+# every packet it sends by BENCH_LATENCY milliseconds (default 5) - loopback without latency hides most effects.
+# Set MQTT_HOST / MQTT_PORT to measure against a real broker instead.
+#
+#   ruby examples/socket_options_bench.rb
+#   BENCH_LATENCY=20 ruby examples/socket_options_bench.rb
+#   MQTT_HOST=broker.local ruby examples/socket_options_bench.rb
+
+$:.unshift('.')
+$:.unshift(File.expand_path(File.dirname(__FILE__)) + '/../lib')
+
+require 'mosquitto'
+require 'thread'
+
+if ENV['MQTT_HOST']
+  HOST = ENV['MQTT_HOST']
+  PORT = Integer(ENV['MQTT_PORT'] || 1883)
+else
+  require File.expand_path('../../test/broker', __FILE__)
+  HOST = '127.0.0.1'
+  PORT = Integer(ENV['MQTT_PORT'] || 18830)
+  LATENCY = Float(ENV['BENCH_LATENCY'] || 5) / 1000
+  broker = TestBroker.new(:host => HOST, :port => PORT, :latency => LATENCY, :seed => 42).start
+  at_exit { broker.stop }
+end
+ROUND_TRIPS = 2_000
+BULK_MESSAGES = 500
+BULK_PAYLOAD = "x" * 64 * 1024
+
+VARIANTS = {
+  "defaults" => {},
+  "nodelay" => {:nodelay => true},
+  "4MB buffers" => {:sndbuf => 4 << 20, :rcvbuf => 4 << 20},
+  "busy_poll 50us" => {:busy_poll => 50},
+  "user_timeout 5s" => {:user_timeout => 5000},
+  "keepalive" => {:keepalive => true, :keepidle => 30, :keepintvl => 5, :keepcnt => 3},
+  "nodelay + 4MB buffers" => {:nodelay => true, :sndbuf => 4 << 20, :rcvbuf => 4 << 20}
+}
+
+def connected_client(options)
+  client = Mosquitto::Client.new
+  client.socket_options = options
+  client.loop_start
+  client.connect(HOST, PORT, 10)
+  client.wait_readable
+  client
+end
+
+def percentile(samples, pct)
+  samples.sort[(samples.size * pct / 100.0).ceil - 1]
+end
+
+def bench(name, options)
+  topic = "bench/socket_options/#{Process.pid}"
+  received = Queue.new
+  client = connected_client(options)
+  client.on_message{|msg| received << msg.length }
+  client.subscribe(nil, topic, Mosquitto::AT_MOST_ONCE)
+  sleep 0.5
+
+  latencies = Array.new(ROUND_TRIPS) do
+    started = Time.now
+    client.publish(nil, topic, "ping", Mosquitto::AT_MOST_ONCE, false)
+    received.pop
+    (Time.now - started) * 1_000_000
+  end
+
+  client.unsubscribe(nil, topic)
+  sleep 0.5
+  started = Time.now
+  BULK_MESSAGES.times{ client.publish(nil, "#{topic}/bulk", BULK_PAYLOAD, Mosquitto::AT_LEAST_ONCE, false) }
+  client.flush(60)
+  elapsed = Time.now - started
+
+  puts "%-24s p50 %7.0fus  p99 %7.0fus  %8.1f MB/s" % [name, percentile(latencies, 50), percentile(latencies, 99),
+    BULK_MESSAGES * BULK_PAYLOAD.bytesize / elapsed / (1 << 20)]
+ensure
+  client.loop_stop(true) if client
+end
+
+puts "round trip latency of #{ROUND_TRIPS} 4 byte QoS 0 messages, QoS 1 throughput of #{BULK_MESSAGES} 64KB messages"
+puts "embedded broker, #{(LATENCY * 1000).round}ms latency" if defined?(LATENCY)
+VARIANTS.each{|name, options| bench(name, options) }
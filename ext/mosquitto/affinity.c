@@ -0,0 +1,102 @@
+#define _GNU_SOURCE 1
+#include "mosquitto_ext.h"
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
+
+/*
+ * :nodoc:
+ *  CPU placement and naming for the libmosquitto network thread and the Ruby callback thread. Both are applied
+ *  to the calling thread - neither libmosquitto nor the Ruby VM hand out the native thread handle. Pure C and
+ *  free of Ruby VM calls, as the network thread tunes itself from the connect callback.
+ *
+ */
+
+int mosquitto_cpu_count(void)
+{
+    return (int)sysconf(_SC_NPROCESSORS_CONF);
+}
+
+/* What mosquitto_thread_restore puts back - the calling thread's placement and name before it was tuned */
+static __thread struct {
+    bool saved;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    bool pinned;
+    cpu_set_t cpus;
+#endif
+#ifdef HAVE_PTHREAD_GETNAME_NP
+    bool named;
+    char name[MOSQ_THREAD_NAME_MAX];
+#endif
+} mosquitto_thread_saved;
+
+bool mosquitto_thread_affinity_supported(void)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * :nodoc:
+ *  Pins the calling thread to a CPU (if not negative) and names it "<prefix><client_id>", truncated to what
+ *  the platform allows. Best effort - failures leave the thread as is. The previous placement and name are
+ *  kept for mosquitto_thread_restore.
+ *
+ */
+void mosquitto_thread_tune(int cpu, const char *prefix, const char *client_id)
+{
+    char name[MOSQ_THREAD_NAME_MAX];
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t cpus;
+#endif
+    if (!mosquitto_thread_saved.saved) {
+        mosquitto_thread_saved.saved = true;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+        mosquitto_thread_saved.pinned = (cpu >= 0 &&
+            pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &mosquitto_thread_saved.cpus) == 0);
+#endif
+#ifdef HAVE_PTHREAD_GETNAME_NP
+        mosquitto_thread_saved.named = (pthread_getname_np(pthread_self(), mosquitto_thread_saved.name, MOSQ_THREAD_NAME_MAX) == 0);
+#endif
+    }
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+    }
+#endif
+    snprintf(name, sizeof(name), "%s%s", prefix, client_id ? client_id : "");
+#ifdef HAVE_PTHREAD_SETNAME_NP
+#ifdef __APPLE__
+    pthread_setname_np(name);
+#else
+    pthread_setname_np(pthread_self(), name);
+#endif
+#endif
+}
+
+/*
+ * :nodoc:
+ *  Puts back the calling thread's placement and name from before mosquitto_thread_tune. For threads that outlive
+ *  their client - the Ruby VM may reuse the native thread of a callback thread.
+ *
+ */
+void mosquitto_thread_restore(void)
+{
+    if (!mosquitto_thread_saved.saved) return;
+    mosquitto_thread_saved.saved = false;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    if (mosquitto_thread_saved.pinned) pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &mosquitto_thread_saved.cpus);
+#endif
+#ifdef HAVE_PTHREAD_GETNAME_NP
+#ifdef __APPLE__
+    if (mosquitto_thread_saved.named) pthread_setname_np(mosquitto_thread_saved.name);
+#else
+    if (mosquitto_thread_saved.named) pthread_setname_np(pthread_self(), mosquitto_thread_saved.name);
+#endif
+#endif
+}
@@ -0,0 +1,12 @@
+#ifndef MOSQUITTO_AFFINITY_H
+#define MOSQUITTO_AFFINITY_H
+
+/* Linux caps thread names at 16 bytes, including the terminating NUL */
+#define MOSQ_THREAD_NAME_MAX 16
+
+int mosquitto_cpu_count(void);
+bool mosquitto_thread_affinity_supported(void);
+void mosquitto_thread_tune(int cpu, const char *prefix, const char *client_id);
+void mosquitto_thread_restore(void);
+
+#endif
@@ -3,6 +3,12 @@
 static void rb_mosquitto_run_callback(mosquitto_callback_t *callback);
 static void rb_mosquitto_free_callback(mosquitto_callback_t *callback);
 static void rb_mosquitto_client_reap_event_thread(mosquitto_client_wrapper *client);
+static void rb_mosquitto_client_unregister(mosquitto_client_wrapper *client);
+static void rb_mosquitto_client_abandon(mosquitto_client_wrapper *client);
+static void rb_mosquitto_client_check_target(mosquitto_client_wrapper *client);
+static void rb_mosquitto_client_cancel_retarget(mosquitto_client_wrapper *client, bool disconnect);
+static void *rb_mosquitto_client_retarget_nogvl(void *ptr);
+static void mosquitto_sink_flusher_kick(void);
 
 VALUE mosquitto_tls_password;
 
@@ -15,36 +21,176 @@ static int rb_mosquitto_tls_password_callback(char *buf, int size, int rwflag, v
 
 /*
  * :nodoc:
- *  Pushes a callback onto the client's callback queue. The callback runs within the context of an event thread.
+ *  Bytes held by a queued callback, including the copy of a message's topic and payload.
  *
  */
-static void mosquitto_callback_queue_push(mosquitto_callback_t *cb)
+static size_t mosquitto_callback_memsize(mosquitto_callback_t *cb)
 {
-    mosquitto_client_wrapper *client = cb->client;
-    cb->next = client->callback_queue;
-    client->callback_queue = cb;
+    size_t size = sizeof(mosquitto_callback_t);
+    if (cb->type == ON_MESSAGE_CALLBACK) {
+        size += sizeof(on_message_callback_args_t) + mosquitto_message_memsize(((on_message_callback_args_t *)cb->data)->msg);
+    }
+    return size;
+}
+
+/*
+ * :nodoc:
+ *  Appends a callback to a lane of the client's callback queue. The callback runs within the context of an event
+ *  thread.
+ *
+ */
+static void mosquitto_callback_lane_push(mosquitto_callback_lane_t *lane, mosquitto_callback_t *cb)
+{
+    cb->client->queued_bytes += mosquitto_callback_memsize(cb);
+    cb->next = NULL;
+    if (lane->tail) {
+        lane->tail->next = cb;
+    } else {
+        /* Read without the callback mutex by spinning waiters */
+        __atomic_store_n(&lane->head, cb, __ATOMIC_RELEASE);
+    }
+    lane->tail = cb;
 }
 
 /*
  * :nodoc:
- *  Pops a callback off the client's callback queue. The callback runs within the context of an event thread.
+ *  Pops the oldest callback off a lane of the client's callback queue.
  *
  */
-static mosquitto_callback_t *mosquitto_callback_queue_pop(mosquitto_client_wrapper *client)
+static mosquitto_callback_t *mosquitto_callback_lane_pop(mosquitto_callback_lane_t *lane)
 {
-    mosquitto_callback_t *cb = client->callback_queue;
+    mosquitto_callback_t *cb = lane->head;
     if(cb)
     {
-        client->callback_queue = cb->next;
+        lane->head = cb->next;
+        if (lane->head == NULL) lane->tail = NULL;
+        cb->next = NULL;
+        cb->client->queued_bytes -= mosquitto_callback_memsize(cb);
     }
 
     return cb;
 }
 
+/*
+ * :nodoc:
+ *  Puts a chain of callbacks back in front of a lane, preserving their order.
+ *
+ */
+static void mosquitto_callback_lane_unshift(mosquitto_callback_lane_t *lane, mosquitto_callback_t *chain)
+{
+    mosquitto_callback_t *last = chain;
+    if (chain == NULL) return;
+    chain->client->queued_bytes += mosquitto_callback_memsize(chain);
+    while (last->next) {
+        last = last->next;
+        last->client->queued_bytes += mosquitto_callback_memsize(last);
+    }
+    last->next = lane->head;
+    lane->head = chain;
+    if (lane->tail == NULL) lane->tail = last;
+}
+
+/*
+ * :nodoc:
+ *  Determines if a message callback sat in the queue for longer than its max age. Runs without the GVL.
+ *
+ */
+static bool mosquitto_callback_expired(mosquitto_callback_t *callback, struct timespec *now)
+{
+    on_message_callback_args_t *args;
+    if (callback->type != ON_MESSAGE_CALLBACK) return false;
+    args = (on_message_callback_args_t *)callback->data;
+    if (args->max_age_ms <= 0) return false;
+    return ((now->tv_sec - callback->enqueued_at.tv_sec) * 1000 + (now->tv_nsec - callback->enqueued_at.tv_nsec) / 1000000) > args->max_age_ms;
+}
+
+/*
+ * :nodoc:
+ *  Records how long a callback waited before being handed to its handler - queued, and behind earlier callbacks
+ *  of the same batch. Expects the callback mutex to be held.
+ *
+ */
+static void mosquitto_callback_record_latency(mosquitto_callback_t *callback, struct timespec *now)
+{
+    mosquitto_client_wrapper *client = callback->client;
+    unsigned long latency_us;
+    int bucket = 0;
+    latency_us = (now->tv_sec - callback->enqueued_at.tv_sec) * 1000000 + (now->tv_nsec - callback->enqueued_at.tv_nsec) / 1000;
+    while (bucket < MOSQ_LATENCY_BUCKETS - 1 && latency_us >= (1UL << bucket)) bucket++;
+    client->latency_histogram[bucket]++;
+    client->latency_count++;
+    if (latency_us > client->latency_max_us) client->latency_max_us = latency_us;
+}
+
+/*
+ * :nodoc:
+ *  Busy polls the callback queue for up to spin_us microseconds, without holding the callback mutex. Trades
+ *  CPU time for skipping the futex wake and scheduler hop of a condition variable. Returns true if callbacks
+ *  arrived in the meantime.
+ *
+ */
+static bool mosquitto_spin_for_callbacks(mosquitto_client_wrapper *client)
+{
+    struct timespec started, now;
+    mosquitto_callback_waiting_t *waiter = client->waiter;
+    unsigned int spins = 0;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (;;) {
+        if (__atomic_load_n(&client->control_lane.head, __ATOMIC_ACQUIRE) != NULL ||
+            __atomic_load_n(&client->message_lane.head, __ATOMIC_ACQUIRE) != NULL) return true;
+        if (__atomic_load_n(&waiter->abort, __ATOMIC_ACQUIRE)) return false;
+        MOSQ_CPU_RELAX();
+        if ((++spins & 63) == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - started.tv_sec) * 1000000 + (now.tv_nsec - started.tv_nsec) / 1000 >= client->spin_us) return false;
+        }
+    }
+}
+
+/*
+ * :nodoc:
+ *  Releases a callback that never got dispatched - expired messages and anything still queued when the callback
+ *  thread shuts down. Undispatched messages still own their libmosquitto message copy, as no Ruby object was
+ *  allocated for them. Safe to call without the GVL.
+ *
+ */
+static void mosquitto_discard_callback(mosquitto_callback_t *callback)
+{
+    if (callback->type == ON_MESSAGE_CALLBACK) {
+        on_message_callback_args_t *args = (on_message_callback_args_t *)callback->data;
+        mosquitto_message_free(&args->msg);
+    }
+    rb_mosquitto_free_callback(callback);
+}
+
+/*
+ * :nodoc:
+ *  Last check before dispatching a callback from a batch - a message may expire while earlier ones in the same
+ *  batch are being handled. Discards expired messages and returns false for them, records the queue latency of
+ *  everything else.
+ *
+ */
+static bool mosquitto_callback_dispatchable(mosquitto_client_wrapper *client, mosquitto_callback_t *callback)
+{
+    struct timespec now;
+    bool expired;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&client->callback_mutex);
+    expired = mosquitto_callback_expired(callback, &now);
+    if (expired) {
+        client->expired++;
+    } else {
+        mosquitto_callback_record_latency(callback, &now);
+    }
+    pthread_mutex_unlock(&client->callback_mutex);
+    if (expired) mosquitto_discard_callback(callback);
+    return !expired;
+}
+
 /*
  * :nodoc:
  *  Runs without the GIL (Global Interpreter Lock) and polls the client's callback queue for any callbacks
- *  to handle.
+ *  to handle. With a spin time configured, busy polls the queue once before parking on the condition variable.
  *
  *  Only applicable to clients that run with the threaded Mosquitto::Client#loop_start event loop
  *
@@ -53,10 +199,40 @@ static void *mosquitto_wait_for_callbacks(void *c)
 {
     mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)c;
     mosquitto_callback_waiting_t *waiter = client->waiter;
+    mosquitto_callback_t *callback, *tail = NULL;
+    struct timespec now;
+    int batched = 0;
+    bool spun = false;
 
     pthread_mutex_lock(&client->callback_mutex);
-    while (!waiter->abort && (waiter->callback = mosquitto_callback_queue_pop(client)) == NULL)
+    waiter->callback = NULL;
+    while (!waiter->abort)
     {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((waiter->callback = mosquitto_callback_lane_pop(&client->control_lane)) != NULL) break;
+        while (batched < MOSQ_CALLBACK_BATCH_SIZE && (callback = mosquitto_callback_lane_pop(&client->message_lane)) != NULL) {
+            if (mosquitto_callback_expired(callback, &now)) {
+                mosquitto_discard_callback(callback);
+                client->expired++;
+                continue;
+            }
+            if (tail) {
+                tail->next = callback;
+            } else {
+                waiter->callback = callback;
+            }
+            tail = callback;
+            batched++;
+        }
+        if (waiter->callback) break;
+        if (client->spin_us > 0 && !spun) {
+            spun = true;
+            pthread_mutex_unlock(&client->callback_mutex);
+            mosquitto_spin_for_callbacks(client);
+            pthread_mutex_lock(&client->callback_mutex);
+            continue;
+        }
+        spun = false;
         pthread_cond_wait(&client->callback_cond, &client->callback_mutex);
     }
     pthread_mutex_unlock(&client->callback_mutex);
@@ -64,6 +240,27 @@ static void *mosquitto_wait_for_callbacks(void *c)
     return (void *)Qnil;
 }
 
+/*
+ * :nodoc:
+ *  Puts the unprocessed remainder of a message batch back in the queue if control events arrived in the meantime,
+ *  or unconditionally when forced to. Returns true if the batch was yielded.
+ *
+ */
+static bool mosquitto_yield_callbacks(mosquitto_client_wrapper *client, bool force)
+{
+    mosquitto_callback_waiting_t *waiter = client->waiter;
+    bool yielded = false;
+    if (waiter->callback == NULL) return false;
+    pthread_mutex_lock(&client->callback_mutex);
+    if (force || client->control_lane.head != NULL) {
+        mosquitto_callback_lane_unshift(&client->message_lane, waiter->callback);
+        waiter->callback = NULL;
+        yielded = true;
+    }
+    pthread_mutex_unlock(&client->callback_mutex);
+    return yielded;
+}
+
 /*
  * :nodoc:
  *  Unblocking function for the callback poller - invoked when the event thread should exit.
@@ -79,16 +276,29 @@ static void mosquitto_stop_waiting_for_callbacks(void *c)
 
     pthread_mutex_lock(&client->callback_mutex);
     waiter->abort = 1;
-    while ((callback = mosquitto_callback_queue_pop(client)) != NULL) {
-        rb_mosquitto_free_callback(callback);
+    while ((callback = mosquitto_callback_lane_pop(&client->control_lane)) != NULL) {
+        mosquitto_discard_callback(callback);
+    }
+    while ((callback = mosquitto_callback_lane_pop(&client->message_lane)) != NULL) {
+        mosquitto_discard_callback(callback);
     }
     pthread_mutex_unlock(&client->callback_mutex);
     pthread_cond_signal(&client->callback_cond);
 }
 
+/* Fires a callback probe with the message topic, payload length and mid for message callbacks */
+#define MOSQ_CALLBACK_MESSAGE(cb) ((cb)->type == ON_MESSAGE_CALLBACK ? ((on_message_callback_args_t *)(cb)->data)->msg : NULL)
+#define MOSQ_CALLBACK_PROBE(name, cb) \
+    MOSQ_PROBE6(name, (cb)->client->client_id, (cb)->type, \
+                MOSQ_CALLBACK_MESSAGE(cb) ? MOSQ_CALLBACK_MESSAGE(cb)->topic : NULL, \
+                MOSQ_CALLBACK_MESSAGE(cb) ? MOSQ_CALLBACK_MESSAGE(cb)->payloadlen : 0, \
+                MOSQ_CALLBACK_MESSAGE(cb) ? MOSQ_CALLBACK_MESSAGE(cb)->mid : 0, (cb))
+
 /*
  * :nodoc:
- *  Enqueues a callback to be handled by the event thread for a given client.
+ *  Enqueues a callback to be handled by the event thread for a given client. Connection, publish and subscription
+ *  events go to the control lane and are always dispatched before anything in the message lane, which carries
+ *  messages and log lines and is drained in batches.
  *
  *  Callbacks for clients that don't use the threaded Mosquitto::Client#loop_start event loop are invoked
  *  directly within context of the current Ruby thread. Thus there's no locking overhead and associated
@@ -99,8 +309,14 @@ static void rb_mosquitto_queue_callback(mosquitto_callback_t *callback)
 {
     mosquitto_client_wrapper *client = callback->client;
     if (!NIL_P(client->callback_thread)) {
+        MOSQ_CALLBACK_PROBE(callback__enqueue, callback);
+        clock_gettime(CLOCK_MONOTONIC, &callback->enqueued_at);
         pthread_mutex_lock(&client->callback_mutex);
-        mosquitto_callback_queue_push(callback);
+        if (callback->type == ON_MESSAGE_CALLBACK || callback->type == ON_LOG_CALLBACK) {
+            mosquitto_callback_lane_push(&client->message_lane, callback);
+        } else {
+            mosquitto_callback_lane_push(&client->control_lane, callback);
+        }
         pthread_mutex_unlock(&client->callback_mutex);
         pthread_cond_signal(&client->callback_cond);
     } else {
@@ -151,11 +367,15 @@ static void rb_mosquitto_free_callback(mosquitto_callback_t *callback)
 {
     if (callback->type == ON_LOG_CALLBACK) {
         on_log_callback_args_t *args = (on_log_callback_args_t *)callback->data;
-        xfree(args->str);
+        free(args->str);
+    } else if (callback->type == ON_SUBSCRIBE_CALLBACK) {
+        on_subscribe_callback_args_t *args = (on_subscribe_callback_args_t *)callback->data;
+        free(args->granted_qos);
     }
 
-    xfree(callback->data);
-    xfree(callback);
+    /* Allocated with malloc(3) by MOSQ_ALLOC, on libmosquitto threads */
+    free(callback->data);
+    free(callback);
 }
 
 /*
@@ -168,6 +388,12 @@ static void rb_mosquitto_handle_callback(int *error_tag, mosquitto_callback_t *c
 {
     VALUE args[5];
     mosquitto_client_wrapper *client = callback->client;
+    /* Not every callback type dispatches to Ruby */
+    *error_tag = 0;
+    MOSQ_PROBE5(handler__start, client->client_id, callback->type,
+                MOSQ_CALLBACK_MESSAGE(callback) ? MOSQ_CALLBACK_MESSAGE(callback)->topic : NULL,
+                MOSQ_CALLBACK_MESSAGE(callback) ? MOSQ_CALLBACK_MESSAGE(callback)->payloadlen : 0,
+                MOSQ_CALLBACK_MESSAGE(callback) ? MOSQ_CALLBACK_MESSAGE(callback)->mid : 0);
     switch (callback->type) {
         case ON_CONNECT_CALLBACK: {
                                     on_connect_callback_args_t *cb = (on_connect_callback_args_t *)callback->data;
@@ -204,8 +430,19 @@ static void rb_mosquitto_handle_callback(int *error_tag, mosquitto_callback_t *c
                                     on_message_callback_args_t *cb = (on_message_callback_args_t *)callback->data;
                                     args[0] = client->message_cb;
                                     args[1] = (VALUE)1;
-                                    args[2] = rb_mosquitto_message_alloc(cb->msg);
-                                    rb_mosquitto_funcall_protected(error_tag, args);
+                                    if (client->borrow_messages) {
+                                        /* Flyweight - rebound for the duration of the handler, nothing allocated per message */
+                                        struct mosquitto_message *previous;
+                                        if (NIL_P(client->borrowed_message)) client->borrowed_message = rb_mosquitto_message_borrowed_alloc();
+                                        previous = rb_mosquitto_message_rebind(client->borrowed_message, cb->msg);
+                                        args[2] = client->borrowed_message;
+                                        rb_mosquitto_funcall_protected(error_tag, args);
+                                        rb_mosquitto_message_rebind(client->borrowed_message, previous);
+                                        mosquitto_message_free(&cb->msg);
+                                    } else {
+                                        args[2] = rb_mosquitto_message_alloc(cb->msg);
+                                        rb_mosquitto_funcall_protected(error_tag, args);
+                                    }
                                   }
                                   break;
 
@@ -242,7 +479,13 @@ static void rb_mosquitto_handle_callback(int *error_tag, mosquitto_callback_t *c
                                 rb_mosquitto_funcall_protected(error_tag, args);
                               }
                               break;
+
+        case ON_RETARGET_CALLBACK: {
+                                     rb_thread_call_without_gvl(rb_mosquitto_client_retarget_nogvl, (void *)client, RUBY_UBF_IO, 0);
+                                   }
+                                   break;
         }
+    MOSQ_PROBE3(handler__end, client->client_id, callback->type, *error_tag);
 }
 
 /*
@@ -261,26 +504,134 @@ static void rb_mosquitto_run_callback(mosquitto_callback_t *callback)
 
 /*
  * :nodoc:
- *  The callback thread - the main workhorse for the threaded Mosquitto::Client#loop_start event loop.
+ *  Dispatch loop of the callback thread.
  *
  */
-static VALUE rb_mosquitto_callback_thread(void *obj)
+static VALUE rb_mosquitto_callback_thread_loop(VALUE obj)
 {
     mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)obj;
     mosquitto_callback_waiting_t *waiter = client->waiter;
-    waiter->callback = NULL;
-    waiter->abort = 0;
+    mosquitto_callback_t *callback;
+    int error_tag;
     while (!waiter->abort)
     {
         rb_thread_call_without_gvl(mosquitto_wait_for_callbacks, (void *)client, mosquitto_stop_waiting_for_callbacks, (void *)client);
-        if (waiter->callback)
+        while (!waiter->abort && (callback = waiter->callback) != NULL)
         {
-            rb_mosquitto_run_callback(waiter->callback);
+            waiter->callback = callback->next;
+            if (!mosquitto_callback_dispatchable(client, callback)) continue;
+            MOSQ_CALLBACK_PROBE(callback__dequeue, callback);
+            rb_mosquitto_handle_callback(&error_tag, callback);
+            rb_mosquitto_free_callback(callback);
+            if (error_tag) {
+                mosquitto_yield_callbacks(client, true);
+                rb_jump_tag(error_tag);
+            }
+            /* Control events queued while handling a message batch take precedence over the remainder */
+            if (mosquitto_yield_callbacks(client, false)) break;
         }
     }
+    while ((callback = waiter->callback) != NULL) {
+        waiter->callback = callback->next;
+        mosquitto_discard_callback(callback);
+    }
+    return Qnil;
+}
+
+static VALUE rb_mosquitto_callback_thread_ensure(MOSQ_UNUSED VALUE obj)
+{
+    mosquitto_thread_restore();
     return Qnil;
 }
 
+/*
+ * :nodoc:
+ *  The callback thread - the main workhorse for the threaded Mosquitto::Client#loop_start event loop. Its native
+ *  thread may be reused by the Ruby VM, so its placement and name get restored on the way out.
+ *
+ */
+static VALUE rb_mosquitto_callback_thread(void *obj)
+{
+    mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)obj;
+    client->waiter->callback = NULL;
+    client->waiter->abort = 0;
+    mosquitto_thread_tune(client->callback_cpu, "mosq-cb:", client->client_id);
+    return rb_ensure(rb_mosquitto_callback_thread_loop, (VALUE)client, rb_mosquitto_callback_thread_ensure, Qnil);
+}
+
+static void rb_mosquitto_client_backoff_unlock(void *ptr)
+{
+    pthread_mutex_unlock((pthread_mutex_t *)ptr);
+}
+
+/*
+ * :nodoc:
+ *  Sleeps on the client's backoff condition variable. Returns false if cut short by
+ *  rb_mosquitto_client_backoff_cancel. The wait is a cancellation point for a forced Mosquitto::Client#loop_stop,
+ *  hence the cleanup handler.
+ *
+ */
+static bool rb_mosquitto_client_backoff_sleep(mosquitto_client_wrapper *client, long wait_ms)
+{
+    struct timespec deadline;
+    bool cancelled;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_nsec += (wait_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&client->backoff_mutex);
+    pthread_cleanup_push(rb_mosquitto_client_backoff_unlock, &client->backoff_mutex);
+    while (!client->backoff_cancelled && pthread_cond_timedwait(&client->backoff_cond, &client->backoff_mutex, &deadline) != ETIMEDOUT);
+    cancelled = client->backoff_cancelled;
+    pthread_cleanup_pop(1);
+    return !cancelled;
+}
+
+/*
+ * :nodoc:
+ *  Wakes up a backoff in progress - Mosquitto::Client#disconnect and Mosquitto::Client#loop_stop shouldn't wait
+ *  for a reconnect that isn't going to happen.
+ *
+ */
+static void rb_mosquitto_client_backoff_cancel(mosquitto_client_wrapper *client)
+{
+    pthread_mutex_lock(&client->backoff_mutex);
+    client->backoff_cancelled = true;
+    pthread_cond_broadcast(&client->backoff_cond);
+    pthread_mutex_unlock(&client->backoff_mutex);
+}
+
+/*
+ * :nodoc:
+ *  Delays libmosquitto's automatic reconnect after an unexpected disconnect. Sleeps for a random duration between
+ *  zero and an exponentially growing ceiling ("full jitter") so a fleet of clients doesn't reconnect in lockstep,
+ *  then waits for the process wide connect rate limit. Runs on the libmosquitto network thread.
+ *
+ */
+static bool rb_mosquitto_client_backoff(mosquitto_client_wrapper *client)
+{
+    long ceiling, wait;
+    bool first = true;
+    if (client->backoff_base_ms > 0) {
+        pthread_mutex_lock(&client->backoff_mutex);
+        client->backoff_cancelled = false;
+        pthread_mutex_unlock(&client->backoff_mutex);
+        ceiling = client->backoff_base_ms << (client->backoff_attempts < 20 ? client->backoff_attempts : 20);
+        if (ceiling > client->backoff_cap_ms) ceiling = client->backoff_cap_ms;
+        client->backoff_attempts++;
+        wait = (long)((double)rand_r(&client->backoff_seed) / ((double)RAND_MAX + 1) * ceiling);
+        if (wait > 0 && !rb_mosquitto_client_backoff_sleep(client, wait)) return false;
+        while ((wait = mosquitto_connect_throttle(first)) > 0) {
+            first = false;
+            if (!rb_mosquitto_client_backoff_sleep(client, wait)) return false;
+        }
+    }
+    return true;
+}
+
 /*
  * :nodoc:
  *  On connect callback - invoked by libmosquitto.
@@ -288,9 +639,24 @@ static VALUE rb_mosquitto_callback_thread(void *obj)
  */
 static void rb_mosquitto_client_on_connect_cb(MOSQ_UNUSED struct mosquitto *mosq, void *obj, int rc)
 {
+    mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)obj;
+    MOSQ_PROBE2(connect, client->client_id, rc);
+    if (rc == 0) client->backoff_attempts = 0;
+    /* The first connect callback of a threaded loop runs on the libmosquitto network thread */
+    if (!client->net_thread_tuned && !NIL_P(client->callback_thread)) {
+        mosquitto_thread_tune(client->net_cpu, "mosq-net:", client->client_id);
+        client->net_thread_tuned = true;
+    }
+    if (rc == 0 && client->auto_resubscribe) {
+        pthread_mutex_lock(&client->registry_mutex);
+        mosquitto_registry_replay(&client->registry, client->mosq);
+        pthread_mutex_unlock(&client->registry_mutex);
+    }
+    if (NIL_P(client->connect_cb)) return;
+
     mosquitto_callback_t *callback = MOSQ_ALLOC(mosquitto_callback_t);
     callback->type = ON_CONNECT_CALLBACK;
-    callback->client = (mosquitto_client_wrapper *)obj;
+    callback->client = client;
 
     on_connect_callback_args_t *args = MOSQ_ALLOC(on_connect_callback_args_t);
     args->rc = rc;
@@ -306,15 +672,34 @@ static void rb_mosquitto_client_on_connect_cb(MOSQ_UNUSED struct mosquitto *mosq
  */
 static void rb_mosquitto_client_on_disconnect_cb(MOSQ_UNUSED struct mosquitto *mosq, void *obj, int rc)
 {
-    mosquitto_callback_t *callback = MOSQ_ALLOC(mosquitto_callback_t);
-    callback->type = ON_DISCONNECT_CALLBACK;
-    callback->client = (mosquitto_client_wrapper *)obj;
+    mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)obj;
+    MOSQ_PROBE2(disconnect, client->client_id, rc);
+    if (client->futures != NULL) {
+        pthread_mutex_lock(&mosquitto_future_mutex);
+        mosquitto_future_fail_all(client->futures);
+        pthread_mutex_unlock(&mosquitto_future_mutex);
+    }
+    if (client->rpc != NULL) mosquitto_rpc_fail_all(client->rpc);
+    if (rc == 0) {
+        /* Client initiated disconnect - nothing left in flight will be acknowledged */
+        pthread_mutex_lock(&client->inflight_mutex);
+        client->inflight = 0;
+        pthread_cond_broadcast(&client->inflight_cond);
+        pthread_mutex_unlock(&client->inflight_mutex);
+    }
+    if (!NIL_P(client->disconnect_cb)) {
+        mosquitto_callback_t *callback = MOSQ_ALLOC(mosquitto_callback_t);
+        callback->type = ON_DISCONNECT_CALLBACK;
+        callback->client = client;
 
-    on_disconnect_callback_args_t *args = MOSQ_ALLOC(on_disconnect_callback_args_t);
-    args->rc = rc;
+        on_disconnect_callback_args_t *args = MOSQ_ALLOC(on_disconnect_callback_args_t);
+        args->rc = rc;
 
-    callback->data = (void *)args;
-    rb_mosquitto_queue_callback(callback);
+        callback->data = (void *)args;
+        rb_mosquitto_queue_callback(callback);
+    }
+    /* Unexpected disconnect - libmosquitto reconnects once we return */
+    if (rc != 0 && rb_mosquitto_client_backoff(client)) rb_mosquitto_client_check_target(client);
 }
 
 /*
@@ -324,9 +709,25 @@ static void rb_mosquitto_client_on_disconnect_cb(MOSQ_UNUSED struct mosquitto *m
  */
 static void rb_mosquitto_client_on_publish_cb(MOSQ_UNUSED struct mosquitto *mosq, void *obj, int mid)
 {
+    mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)obj;
+    pthread_mutex_lock(&client->inflight_mutex);
+    if (client->inflight > 0 && --client->inflight == 0) pthread_cond_broadcast(&client->inflight_cond);
+    pthread_mutex_unlock(&client->inflight_mutex);
+    if (client->futures != NULL) {
+        pthread_mutex_lock(&mosquitto_future_mutex);
+        if (mosquitto_mid_table_lookup(client->futures, mid) != NULL) {
+            mosquitto_future_resolve(client->futures, mid, MOSQ_FUTURE_ACKED);
+        } else if (client->futures_publishing > 0) {
+            /* Acknowledged before Mosquitto::Client#publish_async registered the future */
+            mosquitto_mid_table_insert(client->futures, mid, MOSQ_MID_TABLE_EARLY_ACK);
+        }
+        pthread_mutex_unlock(&mosquitto_future_mutex);
+    }
+    if (NIL_P(client->publish_cb)) return;
+
     mosquitto_callback_t *callback = MOSQ_ALLOC(mosquitto_callback_t);
     callback->type = ON_PUBLISH_CALLBACK;
-    callback->client = (mosquitto_client_wrapper *)obj;
+    callback->client = client;
 
     on_publish_callback_args_t *args = MOSQ_ALLOC(on_publish_callback_args_t);
     args->mid = mid;
@@ -335,6 +736,51 @@ static void rb_mosquitto_client_on_publish_cb(MOSQ_UNUSED struct mosquitto *mosq
     rb_mosquitto_queue_callback(callback);
 }
 
+/*
+ * :nodoc:
+ *  Hands a message off to the first native sink with a matching subscription filter. Returns true if the
+ *  message was consumed by a sink and should not be dispatched to Ruby.
+ *
+ */
+static bool rb_mosquitto_client_sink_message(mosquitto_client_wrapper *client, const struct mosquitto_message *msg)
+{
+    mosquitto_sink_t *sink;
+    bool consumed = false;
+    pthread_mutex_lock(&client->sink_mutex);
+    for (sink = client->sinks; sink != NULL; sink = sink->next) {
+        if (mosquitto_sink_matches(sink, msg->topic)) {
+            mosquitto_sink_write(sink, msg);
+            if (sink->buffered > 0) mosquitto_sink_flusher_kick();
+            consumed = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&client->sink_mutex);
+    return consumed;
+}
+
+/*
+ * :nodoc:
+ *  Evaluates the first inbound policy matching a message's topic. Runs on the libmosquitto network thread
+ *  before anything is allocated for the message - filtered messages never reach the Ruby VM.
+ *
+ */
+static bool rb_mosquitto_client_admit_message(mosquitto_client_wrapper *client, const struct mosquitto_message *msg, long *max_age_ms)
+{
+    mosquitto_inbound_policy_t *policy;
+    bool admitted = true, matched;
+    pthread_mutex_lock(&client->inbound_mutex);
+    for (policy = client->inbound_policies; policy != NULL; policy = policy->next) {
+        matched = false;
+        if (mosquitto_topic_matches_sub(policy->filter, msg->topic, &matched) != MOSQ_ERR_SUCCESS || !matched) continue;
+        admitted = mosquitto_inbound_policy_admit(policy, msg);
+        if (policy->max_age_ms > 0) *max_age_ms = policy->max_age_ms;
+        break;
+    }
+    pthread_mutex_unlock(&client->inbound_mutex);
+    return admitted;
+}
+
 /*
  * :nodoc:
  *  On message callback - invoked by libmosquitto.
@@ -342,13 +788,29 @@ static void rb_mosquitto_client_on_publish_cb(MOSQ_UNUSED struct mosquitto *mosq
  */
 static void rb_mosquitto_client_on_message_cb(MOSQ_UNUSED struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
 {
+    mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)obj;
+    long max_age_ms = client->max_age_ms;
+    if (client->rpc != NULL && mosquitto_rpc_is_reply(client->rpc, msg->topic)) {
+        mosquitto_rpc_resolve(client->rpc, msg);
+        return;
+    }
+    if (client->retain_cache != NULL) {
+        pthread_mutex_lock(&client->retain_mutex);
+        mosquitto_retain_cache_update(client->retain_cache, msg);
+        pthread_mutex_unlock(&client->retain_mutex);
+    }
+    if (client->sinks != NULL && rb_mosquitto_client_sink_message(client, msg)) return;
+    if (NIL_P(client->message_cb)) return;
+    if (client->inbound_policies != NULL && !rb_mosquitto_client_admit_message(client, msg, &max_age_ms)) return;
+
     mosquitto_callback_t *callback = MOSQ_ALLOC(mosquitto_callback_t);
     callback->type = ON_MESSAGE_CALLBACK;
-    callback->client = (mosquitto_client_wrapper *)obj;
+    callback->client = client;
 
     on_message_callback_args_t *args = MOSQ_ALLOC(on_message_callback_args_t);
     args->msg = MOSQ_ALLOC(struct mosquitto_message);
     mosquitto_message_copy(args->msg, msg);
+    args->max_age_ms = max_age_ms;
 
     callback->data = (void *)args;
     rb_mosquitto_queue_callback(callback);
@@ -361,6 +823,11 @@ static void rb_mosquitto_client_on_message_cb(MOSQ_UNUSED struct mosquitto *mosq
  */
 static void rb_mosquitto_client_on_subscribe_cb(MOSQ_UNUSED struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
 {
+    /* libmosquitto releases granted_qos once this callback returns - without a copy there's nothing to report */
+    int *granted_copy = malloc(sizeof(int) * (qos_count > 0 ? qos_count : 1));
+    if (granted_copy == NULL) return;
+    memcpy(granted_copy, granted_qos, sizeof(int) * qos_count);
+
     mosquitto_callback_t *callback = MOSQ_ALLOC(mosquitto_callback_t);
     callback->type = ON_SUBSCRIBE_CALLBACK;
     callback->client = (mosquitto_client_wrapper *)obj;
@@ -368,7 +835,7 @@ static void rb_mosquitto_client_on_subscribe_cb(MOSQ_UNUSED struct mosquitto *mo
     on_subscribe_callback_args_t *args = MOSQ_ALLOC(on_subscribe_callback_args_t);
     args->mid = mid;
     args->qos_count = qos_count;
-    args->granted_qos = granted_qos;
+    args->granted_qos = granted_copy;
 
     callback->data = (void *)args;
     rb_mosquitto_queue_callback(callback);
@@ -397,11 +864,51 @@ static void rb_mosquitto_client_on_unsubscribe_cb(MOSQ_UNUSED struct mosquitto *
  *  On log callback - invoked by libmosquitto.
  *
  */
-static void rb_mosquitto_client_on_log_cb(MOSQ_UNUSED struct mosquitto *mosq, void *obj, int level, const char *str)
+/*
+ * :nodoc:
+ *  Whether a log line is libmosquitto announcing a CONNECT packet - logged on every connect and reconnect, once
+ *  the socket is connected and before the packet is written.
+ *
+ */
+static bool rb_mosquitto_client_connecting(int level, const char *str)
+{
+    static const char suffix[] = " sending CONNECT";
+    size_t len;
+    if (level != MOSQ_LOG_DEBUG) return false;
+    len = strlen(str);
+    return len >= sizeof(suffix) - 1 && strcmp(str + len - (sizeof(suffix) - 1), suffix) == 0;
+}
+
+/*
+ * :nodoc:
+ *  Whether the client needs libmosquitto's log callback - for logging, or for applying socket options.
+ *
+ */
+static bool rb_mosquitto_client_wants_log(mosquitto_client_wrapper *client)
+{
+    return !NIL_P(client->log_cb) || client->log_mask != 0 || mosquitto_socket_options_set(&client->socket_options);
+}
+
+static void rb_mosquitto_client_on_log_cb(struct mosquitto *mosq, void *obj, int level, const char *str)
 {
+    mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)obj;
+    /* libmosquitto 1.3.1 has no hook for new sockets - covers its automatic reconnects too */
+    if (rb_mosquitto_client_connecting(level, str)) mosquitto_socket_options_apply(mosquitto_socket(mosq), &client->socket_options);
+    if (client->log_mask & level) {
+        pthread_mutex_lock(&client->sink_mutex);
+        if (client->log_sink != NULL) {
+            mosquitto_sink_write_log(client->log_sink, level, str);
+            if (client->log_sink->buffered > 0) mosquitto_sink_flusher_kick();
+        } else if (client->log_syslog) {
+            mosquitto_sink_syslog(level, str);
+        }
+        pthread_mutex_unlock(&client->sink_mutex);
+    }
+    if (NIL_P(client->log_cb)) return;
+
     mosquitto_callback_t *callback = MOSQ_ALLOC(mosquitto_callback_t);
     callback->type = ON_LOG_CALLBACK;
-    callback->client = (mosquitto_client_wrapper *)obj;
+    callback->client = client;
 
     on_log_callback_args_t *args = MOSQ_ALLOC(on_log_callback_args_t);
     args->level = level;
@@ -413,11 +920,14 @@ static void rb_mosquitto_client_on_log_cb(MOSQ_UNUSED struct mosquitto *mosq, vo
 
 /*
  * :nodoc:
- *  GC callback for Mosquitto::Client objects - invoked during the GC mark phase.
+ *  GC callback for Mosquitto::Client objects - invoked during the GC mark phase. Callback procs are kept alive
+ *  from here only. Registering their addresses as GC roots would leave dangling roots behind once the client
+ *  struct is freed.
  *
  */
 static void rb_mosquitto_mark_client(void *ptr)
 {
+    mosquitto_sink_t *sink;
     mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)ptr;
     if (client) {
         rb_gc_mark(client->connect_cb);
@@ -428,6 +938,71 @@ static void rb_mosquitto_mark_client(void *ptr)
         rb_gc_mark(client->unsubscribe_cb);
         rb_gc_mark(client->log_cb);
         rb_gc_mark(client->callback_thread);
+        rb_gc_mark(client->borrowed_message);
+        rb_gc_mark(client->settings);
+        /* Pins the object - compaction would otherwise leave a stale reference behind */
+        rb_gc_mark(client->self);
+        for (sink = client->sinks; sink != NULL; sink = sink->next) {
+            rb_gc_mark(sink->ring_obj);
+        }
+    }
+}
+
+/*
+ * :nodoc:
+ *  Releases all publish rate limits registered for a client.
+ *
+ */
+static void rb_mosquitto_client_free_buckets(mosquitto_client_wrapper *client)
+{
+    mosquitto_bucket_t *bucket, *next;
+    for (bucket = client->buckets; bucket != NULL; bucket = next) {
+        next = bucket->next;
+        mosquitto_bucket_free(bucket);
+    }
+    client->buckets = NULL;
+}
+
+/*
+ * :nodoc:
+ *  Releases all inbound policies registered for a client.
+ *
+ */
+static void rb_mosquitto_client_free_inbound_policies(mosquitto_client_wrapper *client)
+{
+    mosquitto_inbound_policy_t *policy, *next;
+    pthread_mutex_lock(&client->inbound_mutex);
+    policy = client->inbound_policies;
+    client->inbound_policies = NULL;
+    pthread_mutex_unlock(&client->inbound_mutex);
+    for (; policy != NULL; policy = next) {
+        next = policy->next;
+        mosquitto_inbound_policy_free(policy);
+    }
+}
+
+/*
+ * :nodoc:
+ *  Flushes and releases all native sinks registered for a client, including the log sink.
+ *
+ */
+static void rb_mosquitto_client_free_sinks(mosquitto_client_wrapper *client)
+{
+    mosquitto_sink_t *sink, *next;
+    pthread_mutex_lock(&client->sink_mutex);
+    sink = client->sinks;
+    client->sinks = NULL;
+    if (client->log_sink != NULL) {
+        client->log_sink->next = sink;
+        sink = client->log_sink;
+        client->log_sink = NULL;
+    }
+    client->log_mask = 0;
+    pthread_mutex_unlock(&client->sink_mutex);
+    while (sink != NULL) {
+        next = sink->next;
+        mosquitto_sink_free(sink);
+        sink = next;
     }
 }
 
@@ -440,6 +1015,8 @@ static void rb_mosquitto_free_client(void *ptr)
 {
     mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)ptr;
     if (client) {
+        rb_mosquitto_client_unregister(client);
+        if (client->forked) rb_mosquitto_client_abandon(client);
         if (client->mosq != NULL) {
             if (!NIL_P(client->callback_thread)) {
                 mosquitto_stop_waiting_for_callbacks(client);
@@ -448,49 +1025,425 @@ static void rb_mosquitto_free_client(void *ptr)
             }
             if (client->mosq != NULL) mosquitto_destroy(client->mosq);
         }
+        rb_mosquitto_client_free_sinks(client);
+        pthread_mutex_destroy(&client->sink_mutex);
+        free(client->client_id);
+        if (client->futures != NULL) {
+            pthread_mutex_lock(&mosquitto_future_mutex);
+            mosquitto_future_detach_all(client->futures);
+            mosquitto_mid_table_free(client->futures);
+            pthread_mutex_unlock(&mosquitto_future_mutex);
+        }
+        rb_mosquitto_client_free_buckets(client);
+        rb_mosquitto_client_free_inbound_policies(client);
+        pthread_mutex_destroy(&client->inbound_mutex);
+        if (client->retain_cache != NULL) mosquitto_retain_cache_free(client->retain_cache);
+        pthread_mutex_destroy(&client->retain_mutex);
+        if (client->rpc != NULL) mosquitto_rpc_free(client->rpc);
+        mosquitto_registry_clear(&client->registry);
+        pthread_mutex_destroy(&client->registry_mutex);
+        pthread_mutex_destroy(&client->inflight_mutex);
+        pthread_cond_destroy(&client->inflight_cond);
+        pthread_mutex_destroy(&client->backoff_mutex);
+        pthread_cond_destroy(&client->backoff_cond);
+        free(client->target.host);
+        free(client->target.bind_address);
+        pthread_mutex_destroy(&client->target.mutex);
         xfree(client);
     }
 }
 
 /*
- * call-seq:
- *   Mosquitto::Client.new("some-id") -> Mosquitto::Client
- *
- * Create a new mosquitto client instance.
- *
- * @param identifier [String] the client identifier. Set to nil to have a random one generated.
- *                            clean_session must be true if the identifier is nil.
- * @param clean_session [true, false] set to true to instruct the broker to clean all messages
- *                                    and subscriptions on disconnect, false to instruct it to
- *                                    keep them
- * @return [Mosquitto::Client] mosquitto client instance
- * @raise [Mosquitto::Error] on invalid input params
- * @note As per the MQTT spec, client identifiers cannot exceed 23 characters
- * @example
- *   Mosquitto::Client.new("session_id") -> Mosquitto::Client
- *   Mosquitto::Client.new(nil, true) -> Mosquitto::Client
+ * :nodoc:
+ *  GC callback for ObjectSpace.memsize_of - the client struct, queued callbacks (including message payloads),
+ *  sink buffers, publish futures, inbound policy state, the retained message cache, pending requests and the
+ *  subscription registry.
  *
  */
-static VALUE rb_mosquitto_client_s_new(int argc, VALUE *argv, VALUE client)
+static size_t rb_mosquitto_client_memsize(const void *ptr)
 {
-    VALUE client_id;
-    VALUE cl_session;
-    char *cl_id = NULL;
-    mosquitto_client_wrapper *cl = NULL;
-    bool clean_session;
-    rb_scan_args(argc, argv, "02", &client_id, &cl_session);
-    if (NIL_P(client_id)) {
-        clean_session = true;
-    } else {
-        clean_session = false;
-        Check_Type(client_id, T_STRING);
-        MosquittoEncode(client_id);
-        cl_id = StringValueCStr(client_id);
+    mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)ptr;
+    mosquitto_sink_t *sink;
+    mosquitto_bucket_t *bucket;
+    mosquitto_inbound_policy_t *policy;
+    mosquitto_registry_entry_t *entry;
+    size_t size;
+    if (!client) return 0;
+    size = sizeof(mosquitto_client_wrapper);
+    if (!NIL_P(client->callback_thread)) {
+        pthread_mutex_lock(&client->callback_mutex);
+        size += client->queued_bytes;
+        pthread_mutex_unlock(&client->callback_mutex);
     }
-    client = Data_Make_Struct(rb_cMosquittoClient, mosquitto_client_wrapper, rb_mosquitto_mark_client, rb_mosquitto_free_client, cl);
+    pthread_mutex_lock(&client->sink_mutex);
+    for (sink = client->sinks; sink != NULL; sink = sink->next) {
+        size += sizeof(mosquitto_sink_t) + strlen(sink->filter) + 1;
+        if (sink->buffer != NULL) size += MOSQ_SINK_BUFFER_SIZE;
+    }
+    if (client->log_sink != NULL) size += sizeof(mosquitto_sink_t) + MOSQ_SINK_BUFFER_SIZE;
+    pthread_mutex_unlock(&client->sink_mutex);
+    if (client->futures != NULL) {
+        size += sizeof(mosquitto_mid_table_t) + client->futures->capacity * sizeof(mosquitto_mid_table_entry_t);
+    }
+    for (bucket = client->buckets; bucket != NULL; bucket = bucket->next) {
+        size += sizeof(mosquitto_bucket_t);
+    }
+    pthread_mutex_lock(&client->inbound_mutex);
+    for (policy = client->inbound_policies; policy != NULL; policy = policy->next) {
+        size += sizeof(mosquitto_inbound_policy_t) + policy->digests_capacity * sizeof(mosquitto_digest_entry_t);
+        if (policy->bucket != NULL) size += sizeof(mosquitto_bucket_t);
+    }
+    pthread_mutex_unlock(&client->inbound_mutex);
+    pthread_mutex_lock(&client->retain_mutex);
+    if (client->retain_cache != NULL) {
+        size += sizeof(mosquitto_retain_cache_t) + client->retain_cache->capacity * sizeof(mosquitto_retain_entry_t *) + client->retain_cache->bytes;
+    }
+    pthread_mutex_unlock(&client->retain_mutex);
+    if (client->rpc != NULL) {
+        pthread_mutex_lock(&client->rpc->mutex);
+        size += sizeof(mosquitto_rpc_t) + client->rpc->pending->capacity * sizeof(mosquitto_mid_table_entry_t);
+        size += client->rpc->pending->count * sizeof(mosquitto_rpc_call_t);
+        pthread_mutex_unlock(&client->rpc->mutex);
+    }
+    pthread_mutex_lock(&client->registry_mutex);
+    for (entry = client->registry.head; entry != NULL; entry = entry->next) {
+        size += sizeof(mosquitto_registry_entry_t) + strlen(entry->filter) + 1;
+    }
+    pthread_mutex_unlock(&client->registry_mutex);
+    return size;
+}
+
+const rb_data_type_t mosquitto_client_type = {
+    "Mosquitto::Client",
+    {
+        rb_mosquitto_mark_client,
+        rb_mosquitto_free_client,
+        rb_mosquitto_client_memsize,
+    },
+};
+
+/*
+ * :nodoc:
+ *  Records the arguments of a setting applied to the libmosquitto handle, for Mosquitto::Client#after_fork to
+ *  replay on the handle it creates in a forked child. Settings are keyed by the method that applied them.
+ *
+ */
+static void rb_mosquitto_client_remember(mosquitto_client_wrapper *client, const char *setting, VALUE args)
+{
+    if (NIL_P(client->settings)) client->settings = rb_hash_new();
+    rb_hash_aset(client->settings, ID2SYM(rb_intern(setting)), args);
+}
+
+static void rb_mosquitto_client_forget(mosquitto_client_wrapper *client, const char *setting)
+{
+    if (!NIL_P(client->settings)) rb_hash_delete(client->settings, ID2SYM(rb_intern(setting)));
+}
+
+static pthread_mutex_t mosquitto_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when the sink flusher is done with a client */
+static pthread_cond_t mosquitto_clients_cond = PTHREAD_COND_INITIALIZER;
+static mosquitto_client_wrapper *mosquitto_clients = NULL;
+
+static void rb_mosquitto_client_register(mosquitto_client_wrapper *client)
+{
+    pthread_mutex_lock(&mosquitto_clients_mutex);
+    client->prev = NULL;
+    client->next = mosquitto_clients;
+    if (mosquitto_clients != NULL) mosquitto_clients->prev = client;
+    mosquitto_clients = client;
+    pthread_mutex_unlock(&mosquitto_clients_mutex);
+}
+
+static void rb_mosquitto_client_unregister(mosquitto_client_wrapper *client)
+{
+    pthread_mutex_lock(&mosquitto_clients_mutex);
+    if (client->prev != NULL) {
+        client->prev->next = client->next;
+    } else if (mosquitto_clients == client) {
+        mosquitto_clients = client->next;
+    }
+    if (client->next != NULL) client->next->prev = client->prev;
+    client->prev = NULL;
+    client->next = NULL;
+    while (client->flush_refs > 0) pthread_cond_wait(&mosquitto_clients_cond, &mosquitto_clients_mutex);
+    pthread_mutex_unlock(&mosquitto_clients_mutex);
+}
+
+/*
+ * :nodoc:
+ *  Background flusher for native sinks and log_to files. Writes only flush data buffered for longer than
+ *  MOSQ_SINK_FLUSH_INTERVAL_MS, which never happens on a topic gone quiet. A write that leaves data buffered wakes
+ *  this thread, which flushes all sinks of all clients one interval later and parks again once nothing is
+ *  buffered anymore. It's started on first use, in forked children too.
+ *
+ *  Sinks may be pipes or sockets with a stalled reader, so the list lock is never held across a write - each
+ *  client is referenced under it and flushed after releasing it, tagged with the current round so the walk
+ *  can restart from the head of a list that changed in the meantime.
+ *
+ */
+static pthread_mutex_t mosquitto_flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mosquitto_flusher_cond = PTHREAD_COND_INITIALIZER;
+static bool mosquitto_flusher_running = false;
+static bool mosquitto_flusher_pending = false;
+
+static void *mosquitto_sink_flusher(MOSQ_UNUSED void *unused)
+{
+    mosquitto_client_wrapper *client;
+    mosquitto_sink_t *sink;
+    struct timespec delay;
+    unsigned long round = 0;
+    delay.tv_sec = MOSQ_SINK_FLUSH_INTERVAL_MS / 1000;
+    delay.tv_nsec = (MOSQ_SINK_FLUSH_INTERVAL_MS % 1000) * 1000000L;
+    pthread_mutex_lock(&mosquitto_flusher_mutex);
+    for (;;) {
+        while (!mosquitto_flusher_pending) pthread_cond_wait(&mosquitto_flusher_cond, &mosquitto_flusher_mutex);
+        pthread_mutex_unlock(&mosquitto_flusher_mutex);
+        nanosleep(&delay, NULL);
+        /* Writes from here on wake us up again */
+        pthread_mutex_lock(&mosquitto_flusher_mutex);
+        __atomic_store_n(&mosquitto_flusher_pending, false, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&mosquitto_flusher_mutex);
+        round++;
+        pthread_mutex_lock(&mosquitto_clients_mutex);
+        for (;;) {
+            for (client = mosquitto_clients; client != NULL && client->flush_round == round; client = client->next);
+            if (client == NULL) break;
+            client->flush_round = round;
+            client->flush_refs++;
+            pthread_mutex_unlock(&mosquitto_clients_mutex);
+            pthread_mutex_lock(&client->sink_mutex);
+            for (sink = client->sinks; sink != NULL; sink = sink->next) {
+                if (sink->buffered > 0) mosquitto_sink_flush(sink);
+            }
+            if (client->log_sink != NULL && client->log_sink->buffered > 0) mosquitto_sink_flush(client->log_sink);
+            pthread_mutex_unlock(&client->sink_mutex);
+            pthread_mutex_lock(&mosquitto_clients_mutex);
+            if (--client->flush_refs == 0) pthread_cond_broadcast(&mosquitto_clients_cond);
+        }
+        pthread_mutex_unlock(&mosquitto_clients_mutex);
+        pthread_mutex_lock(&mosquitto_flusher_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * :nodoc:
+ *  Schedules a flush of buffered sink data. Called with a sink mutex held, on the libmosquitto network thread.
+ *
+ */
+static void mosquitto_sink_flusher_kick(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    if (__atomic_load_n(&mosquitto_flusher_pending, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&mosquitto_flusher_mutex);
+    if (!mosquitto_flusher_running) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        mosquitto_flusher_running = (pthread_create(&thread, &attr, mosquitto_sink_flusher, NULL) == 0);
+        pthread_attr_destroy(&attr);
+    }
+    mosquitto_flusher_pending = true;
+    pthread_cond_signal(&mosquitto_flusher_cond);
+    pthread_mutex_unlock(&mosquitto_flusher_mutex);
+}
+
+/*
+ * :nodoc:
+ *  pthread_atfork(3) handlers. Every lock of the extension and of each live client is taken before fork(2) so the
+ *  child never inherits a lock held by a thread that doesn't exist there, or a structure that thread was halfway
+ *  through updating. The prepare handler takes them in the one order they may nest in :
+ *
+ *    client list, connect throttle, resolver, futures, then per client registry, RPC, retain cache, inbound
+ *    policies, inflight, backoff, sink, callback queue - and the flusher lock last
+ *
+ *  Nested today are registry -> sink and registry -> callback queue (replaying subscriptions logs from within
+ *  mosquitto_subscribe) and sink -> flusher (buffered writes kick the flusher). Any new nesting has to follow this
+ *  order. The sink lock is held across sink writes, so a fork waits for a write to a stalled pipe to complete.
+ *
+ *  The child runs before any Ruby code and can't allocate - it only releases the locks, resets condition variables
+ *  that may count waiters of threads gone in the child, drops sink buffers the parent will flush and flags clients
+ *  for Mosquitto::Client#after_fork.
+ *
+ */
+static void mosquitto_atfork_prepare(void)
+{
+    mosquitto_client_wrapper *client;
+    pthread_mutex_lock(&mosquitto_clients_mutex);
+    pthread_mutex_lock(&mosquitto_connect_mutex);
+    mosquitto_resolver_atfork_prepare();
+    pthread_mutex_lock(&mosquitto_future_mutex);
+    for (client = mosquitto_clients; client != NULL; client = client->next) {
+        /* In lock order, see above */
+        pthread_mutex_lock(&client->registry_mutex);
+        if (client->rpc != NULL) pthread_mutex_lock(&client->rpc->mutex);
+        pthread_mutex_lock(&client->retain_mutex);
+        pthread_mutex_lock(&client->inbound_mutex);
+        pthread_mutex_lock(&client->inflight_mutex);
+        pthread_mutex_lock(&client->backoff_mutex);
+        pthread_mutex_lock(&client->sink_mutex);
+        if (!NIL_P(client->callback_thread)) pthread_mutex_lock(&client->callback_mutex);
+    }
+    pthread_mutex_lock(&mosquitto_flusher_mutex);
+}
+
+static void mosquitto_atfork_release(mosquitto_client_wrapper *client)
+{
+    if (!NIL_P(client->callback_thread)) pthread_mutex_unlock(&client->callback_mutex);
+    pthread_mutex_unlock(&client->sink_mutex);
+    pthread_mutex_unlock(&client->backoff_mutex);
+    pthread_mutex_unlock(&client->inflight_mutex);
+    pthread_mutex_unlock(&client->inbound_mutex);
+    pthread_mutex_unlock(&client->retain_mutex);
+    if (client->rpc != NULL) pthread_mutex_unlock(&client->rpc->mutex);
+    pthread_mutex_unlock(&client->registry_mutex);
+}
+
+static void mosquitto_atfork_parent(void)
+{
+    mosquitto_client_wrapper *client;
+    pthread_mutex_unlock(&mosquitto_flusher_mutex);
+    for (client = mosquitto_clients; client != NULL; client = client->next) {
+        mosquitto_atfork_release(client);
+    }
+    pthread_mutex_unlock(&mosquitto_future_mutex);
+    mosquitto_resolver_atfork_parent();
+    pthread_mutex_unlock(&mosquitto_connect_mutex);
+    pthread_mutex_unlock(&mosquitto_clients_mutex);
+}
+
+static void mosquitto_atfork_child(void)
+{
+    mosquitto_client_wrapper *client;
+    mosquitto_sink_t *sink;
+    /* The flusher thread doesn't exist in the child - the next buffered write starts a new one */
+    mosquitto_flusher_running = false;
+    mosquitto_flusher_pending = false;
+    pthread_cond_init(&mosquitto_flusher_cond, NULL);
+    pthread_mutex_unlock(&mosquitto_flusher_mutex);
+    pthread_cond_init(&mosquitto_clients_cond, NULL);
+    for (client = mosquitto_clients; client != NULL; client = client->next) {
+        client->flush_refs = 0;
+        if (!NIL_P(client->callback_thread)) pthread_cond_init(&client->callback_cond, NULL);
+        pthread_cond_init(&client->inflight_cond, NULL);
+        pthread_cond_init(&client->backoff_cond, NULL);
+        /* Only ever held briefly by a thread that doesn't exist in the child */
+        pthread_mutex_init(&client->target.mutex, NULL);
+        for (sink = client->sinks; sink != NULL; sink = sink->next) {
+            sink->buffered = 0;
+        }
+        if (client->log_sink != NULL) client->log_sink->buffered = 0;
+        if (client->futures != NULL) mosquitto_future_unlink_all(client->futures);
+        client->forked = (client->mosq != NULL);
+        mosquitto_atfork_release(client);
+    }
+    pthread_mutex_unlock(&mosquitto_future_mutex);
+    mosquitto_resolver_atfork_child();
+    pthread_mutex_unlock(&mosquitto_connect_mutex);
+    pthread_mutex_unlock(&mosquitto_clients_mutex);
+}
+
+/*
+ * :nodoc:
+ *  GC root for clients inherited from the parent process - they're marked from here until
+ *  Mosquitto::Client#after_fork or Mosquitto::Client#destroy is done with them, referenced from Ruby or not. Runs
+ *  under the GVL, like every change to the list.
+ *
+ */
+static void mosquitto_mark_inherited_clients(MOSQ_UNUSED void *ptr)
+{
+    mosquitto_client_wrapper *client;
+    pthread_mutex_lock(&mosquitto_clients_mutex);
+    for (client = mosquitto_clients; client != NULL; client = client->next) {
+        if (client->forked) rb_gc_mark(client->self);
+    }
+    pthread_mutex_unlock(&mosquitto_clients_mutex);
+}
+
+static const rb_data_type_t mosquitto_inherited_clients_type = {
+    "mosquitto_inherited_clients",
+    {
+        mosquitto_mark_inherited_clients,
+        NULL,
+        NULL,
+    },
+};
+
+/*
+ * call-seq:
+ *   Mosquitto.inherited_clients -> Array
+ *
+ * Clients inherited from the parent process that still have to be reinitialised with Mosquitto::Client#after_fork.
+ * Walks the extension's own list of live clients rather than the object space.
+ *
+ * @return [Array<Mosquitto::Client>] clients inherited from the parent process
+ * @see Mosquitto.after_fork
+ *
+ */
+static VALUE rb_mosquitto_inherited_clients(MOSQ_UNUSED VALUE obj)
+{
+    mosquitto_client_wrapper *client;
+    VALUE clients;
+    long count = 0;
+    /* Allocated up front - nothing below may allocate with the list locked */
+    pthread_mutex_lock(&mosquitto_clients_mutex);
+    for (client = mosquitto_clients; client != NULL; client = client->next) {
+        if (client->forked) count++;
+    }
+    pthread_mutex_unlock(&mosquitto_clients_mutex);
+    clients = rb_ary_new2(count);
+    pthread_mutex_lock(&mosquitto_clients_mutex);
+    for (client = mosquitto_clients; client != NULL && RARRAY_LEN(clients) < count; client = client->next) {
+        /* Skips zombies - clients freed, but not finalized yet */
+        if (client->forked && BUILTIN_TYPE(client->self) == T_DATA) rb_ary_push(clients, client->self);
+    }
+    pthread_mutex_unlock(&mosquitto_clients_mutex);
+    return clients;
+}
+
+/*
+ * call-seq:
+ *   Mosquitto::Client.new("some-id") -> Mosquitto::Client
+ *
+ * Create a new mosquitto client instance.
+ *
+ * @param identifier [String] the client identifier. Set to nil to have a random one generated.
+ *                            clean_session must be true if the identifier is nil.
+ * @param clean_session [true, false] set to true to instruct the broker to clean all messages
+ *                                    and subscriptions on disconnect, false to instruct it to
+ *                                    keep them
+ * @return [Mosquitto::Client] mosquitto client instance
+ * @raise [Mosquitto::Error] on invalid input params
+ * @note As per the MQTT spec, client identifiers cannot exceed 23 characters
+ * @example
+ *   Mosquitto::Client.new("session_id") -> Mosquitto::Client
+ *   Mosquitto::Client.new(nil, true) -> Mosquitto::Client
+ *
+ */
+static VALUE rb_mosquitto_client_s_new(int argc, VALUE *argv, VALUE client)
+{
+    VALUE client_id;
+    VALUE cl_session;
+    char *cl_id = NULL, *id_copy = NULL;
+    mosquitto_client_wrapper *cl = NULL;
+    bool clean_session;
+    rb_scan_args(argc, argv, "02", &client_id, &cl_session);
+    if (NIL_P(client_id)) {
+        clean_session = true;
+    } else {
+        clean_session = false;
+        Check_Type(client_id, T_STRING);
+        MosquittoEncode(client_id);
+        cl_id = StringValueCStr(client_id);
+    }
+    /* Kept for naming threads */
+    if (cl_id && (id_copy = strdup(cl_id)) == NULL) rb_memerror();
+    client = TypedData_Make_Struct(rb_cMosquittoClient, mosquitto_client_wrapper, &mosquitto_client_type, cl);
     cl->mosq = mosquitto_new(cl_id, clean_session, (void *)cl);
     if (cl->mosq == NULL) {
+        DATA_PTR(client) = NULL;
         xfree(cl);
+        free(id_copy);
         switch (errno) {
             case EINVAL:
                 MosquittoError("invalid input params");
@@ -510,8 +1463,70 @@ static VALUE rb_mosquitto_client_s_new(int argc, VALUE *argv, VALUE client)
     cl->unsubscribe_cb = Qnil;
     cl->log_cb = Qnil;
     cl->callback_thread = Qnil;
-    cl->callback_queue = NULL;
+    cl->borrowed_message = Qnil;
+    cl->borrow_messages = false;
+    cl->control_lane.head = NULL;
+    cl->control_lane.tail = NULL;
+    cl->message_lane.head = NULL;
+    cl->message_lane.tail = NULL;
+    cl->queued_bytes = 0;
+    cl->spin_us = 0;
+    memset(cl->latency_histogram, 0, sizeof(cl->latency_histogram));
+    cl->latency_count = 0;
+    cl->latency_max_us = 0;
     cl->waiter = NULL;
+    cl->sinks = NULL;
+    cl->log_sink = NULL;
+    cl->log_mask = 0;
+    cl->log_syslog = false;
+    pthread_mutex_init(&cl->sink_mutex, NULL);
+    cl->futures = NULL;
+    cl->futures_publishing = 0;
+    cl->inflight = 0;
+    cl->buckets = NULL;
+    cl->inbound_policies = NULL;
+    cl->max_age_ms = 0;
+    cl->expired = 0;
+    cl->backoff_base_ms = 0;
+    cl->backoff_cap_ms = 0;
+    cl->backoff_attempts = 0;
+    cl->tls_certs = false;
+    cl->tls_insecure = false;
+    mosquitto_socket_options_init(&cl->socket_options);
+    pthread_mutex_init(&cl->target.mutex, NULL);
+    cl->target.host = NULL;
+    cl->target.bind_address = NULL;
+    cl->target.address[0] = '\0';
+    cl->target.wanted = false;
+    cl->target.retarget = false;
+    cl->target.looping_forever = false;
+    cl->client_id = id_copy;
+    cl->net_cpu = -1;
+    cl->callback_cpu = -1;
+    cl->net_thread_tuned = false;
+    pthread_mutex_init(&cl->retain_mutex, NULL);
+    cl->retain_cache = NULL;
+    cl->rpc = NULL;
+    pthread_mutex_init(&cl->registry_mutex, NULL);
+    mosquitto_registry_init(&cl->registry);
+    cl->auto_resubscribe = false;
+    cl->settings = Qnil;
+    cl->forked = false;
+    cl->restart_loop = false;
+    cl->flush_round = 0;
+    cl->flush_refs = 0;
+    cl->self = client;
+    cl->backoff_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid() ^ (unsigned int)(uintptr_t)cl;
+    pthread_mutex_init(&cl->inbound_mutex, NULL);
+    pthread_mutex_init(&cl->inflight_mutex, NULL);
+    pthread_cond_init(&cl->inflight_cond, NULL);
+    pthread_mutex_init(&cl->backoff_mutex, NULL);
+    pthread_cond_init(&cl->backoff_cond, NULL);
+    cl->backoff_cancelled = false;
+    mosquitto_connect_callback_set(cl->mosq, rb_mosquitto_client_on_connect_cb);
+    mosquitto_publish_callback_set(cl->mosq, rb_mosquitto_client_on_publish_cb);
+    mosquitto_disconnect_callback_set(cl->mosq, rb_mosquitto_client_on_disconnect_cb);
+    rb_mosquitto_client_register(cl);
     rb_obj_call_init(client, 0, NULL);
     return client;
 }
@@ -548,7 +1563,7 @@ static VALUE rb_mosquitto_client_reinitialise(int argc, VALUE *argv, VALUE obj)
     VALUE client_id;
     int ret;
     bool clean_session;
-    char *cl_id = NULL;
+    char *cl_id = NULL, *id_copy = NULL;
     MosquittoGetClient(obj);
     rb_scan_args(argc, argv, "01", &client_id);
     if (NIL_P(client_id)) {
@@ -559,11 +1574,44 @@ static VALUE rb_mosquitto_client_reinitialise(int argc, VALUE *argv, VALUE obj)
         MosquittoEncode(client_id);
         cl_id = StringValueCStr(client_id);
     }
+    if (cl_id && (id_copy = strdup(cl_id)) == NULL) rb_memerror();
     args.mosq = client->mosq;
     args.client_id = cl_id;
     args.clean_session = clean_session;
-    args.obj = (void *)obj;
+    args.obj = (void *)client;
     ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_reinitialise_nogvl, (void *)&args, RUBY_UBF_IO, 0);
+    /* libmosquitto resets all callbacks - same conditions as Mosquitto::Client#after_fork */
+    mosquitto_connect_callback_set(client->mosq, rb_mosquitto_client_on_connect_cb);
+    mosquitto_publish_callback_set(client->mosq, rb_mosquitto_client_on_publish_cb);
+    mosquitto_disconnect_callback_set(client->mosq, rb_mosquitto_client_on_disconnect_cb);
+    mosquitto_message_callback_set(client->mosq, rb_mosquitto_client_on_message_cb);
+    if (!NIL_P(client->subscribe_cb)) mosquitto_subscribe_callback_set(client->mosq, rb_mosquitto_client_on_subscribe_cb);
+    if (!NIL_P(client->unsubscribe_cb)) mosquitto_unsubscribe_callback_set(client->mosq, rb_mosquitto_client_on_unsubscribe_cb);
+    if (rb_mosquitto_client_wants_log(client)) mosquitto_log_callback_set(client->mosq, rb_mosquitto_client_on_log_cb);
+    if (ret == MOSQ_ERR_SUCCESS) {
+        free(client->client_id);
+        client->client_id = id_copy;
+        /* libmosquitto resets will, credentials and TLS settings */
+        client->settings = Qnil;
+        /* Subscriptions don't survive reinitialisation - nothing to replay, and the next request subscribes for
+           replies again */
+        pthread_mutex_lock(&client->registry_mutex);
+        mosquitto_registry_clear(&client->registry);
+        pthread_mutex_unlock(&client->registry_mutex);
+        if (client->rpc != NULL) mosquitto_rpc_fail_all(client->rpc);
+        /* Neither do messages in flight - release Mosquitto::Client#flush and publish futures */
+        pthread_mutex_lock(&mosquitto_future_mutex);
+        if (client->futures != NULL) mosquitto_future_fail_all(client->futures);
+        pthread_mutex_unlock(&mosquitto_future_mutex);
+        pthread_mutex_lock(&client->inflight_mutex);
+        client->inflight = 0;
+        pthread_cond_broadcast(&client->inflight_cond);
+        pthread_mutex_unlock(&client->inflight_mutex);
+        /* Nor does the connection */
+        rb_mosquitto_client_cancel_retarget(client, true);
+    } else {
+        free(id_copy);
+    }
     switch (ret) {
        case MOSQ_ERR_INVAL:
            MosquittoError("invalid input params");
@@ -617,6 +1665,7 @@ static VALUE rb_mosquitto_client_will_set(VALUE obj, VALUE topic, VALUE payload,
            MosquittoError("payload too large");
            break;
        default:
+           rb_mosquitto_client_remember(client, "will_set", rb_ary_new3(4, topic, payload, qos, retain));
            return Qtrue;
     }
 }
@@ -644,6 +1693,7 @@ static VALUE rb_mosquitto_client_will_clear(VALUE obj)
            MosquittoError("invalid input params");
            break;
        default:
+           rb_mosquitto_client_forget(client, "will_set");
            return Qtrue;
     }
 }
@@ -686,6 +1736,7 @@ static VALUE rb_mosquitto_client_auth(VALUE obj, VALUE username, VALUE password)
            rb_memerror();
            break;
        default:
+           rb_mosquitto_client_remember(client, "auth", rb_ary_new3(2, username, password));
            return Qtrue;
     }
 }
@@ -765,6 +1816,8 @@ static VALUE rb_mosquitto_client_tls_set(VALUE obj, VALUE cafile, VALUE capath,
        case MOSQ_ERR_NOT_SUPPORTED:
            MosquittoError("TLS support is not available");
        default:
+           client->tls_certs = true;
+           rb_mosquitto_client_remember(client, "tls_set", rb_ary_new3(5, cafile, capath, certfile, keyfile, password));
            return Qtrue;
     }
 }
@@ -807,6 +1860,8 @@ static VALUE rb_mosquitto_client_tls_insecure_set(VALUE obj, VALUE insecure)
        case MOSQ_ERR_NOT_SUPPORTED:
            MosquittoError("TLS support is not available");
        default:
+           client->tls_insecure = (insecure == Qtrue);
+           rb_mosquitto_client_remember(client, "tls_insecure=", rb_ary_new3(1, insecure));
            return Qtrue;
     }
 }
@@ -861,6 +1916,7 @@ static VALUE rb_mosquitto_client_tls_opts_set(VALUE obj, VALUE cert_reqs, VALUE
        case MOSQ_ERR_NOT_SUPPORTED:
            MosquittoError("TLS support is not available");
        default:
+           rb_mosquitto_client_remember(client, "tls_opts_set", rb_ary_new3(3, cert_reqs, tls_version, ciphers));
            return Qtrue;
     }
 }
@@ -906,33 +1962,196 @@ static VALUE rb_mosquitto_client_tls_psk_set(VALUE obj, VALUE psk, VALUE identit
        case MOSQ_ERR_NOT_SUPPORTED:
            MosquittoError("TLS support is not available");
        default:
+           rb_mosquitto_client_remember(client, "tls_psk_set", rb_ary_new3(3, psk, identity, ciphers));
            return Qtrue;
     }
 }
 
+/*
+ * :nodoc:
+ *  Connects to a single host or numeric address with the parameters given.
+ *
+ */
+static int rb_mosquitto_client_connect_to(struct nogvl_connect_args *args, const char *host)
+{
+    struct mosquitto *mosq = args->client->mosq;
+    if (args->async) return mosquitto_connect_bind_async(mosq, host, args->port, args->keepalive, args->bind_address);
+    return mosquitto_connect_bind(mosq, host, args->port, args->keepalive, args->bind_address);
+}
+
+/*
+ * :nodoc:
+ *  Connects through the resolver cache if enabled - tries each cached address in turn and falls back to the
+ *  hostname, which libmosquitto then resolves and reports errors for as usual. Records the address connected to.
+ *
+ *  Blocks on DNS and the network - never call with the GVL held.
+ *
+ */
 static void *rb_mosquitto_client_connect_nogvl(void *ptr)
 {
     struct nogvl_connect_args *args = ptr;
-    return (void *)mosquitto_connect(args->mosq, args->host, args->port, args->keepalive);
+    mosquitto_resolver_address_t addresses[MOSQ_RESOLVER_MAX_ADDRESSES];
+    int count = args->resolve ? mosquitto_resolver_lookup(args->host, addresses) : 0;
+    int i, ret = MOSQ_ERR_ERRNO;
+    args->address[0] = '\0';
+    for (i = 0; i < count; i++) {
+        /* Only socket errors are specific to an address */
+        if ((ret = rb_mosquitto_client_connect_to(args, addresses[i])) != MOSQ_ERR_ERRNO) break;
+    }
+    if (i == count) {
+        ret = rb_mosquitto_client_connect_to(args, args->host);
+    } else if (ret == MOSQ_ERR_SUCCESS) {
+        strcpy(args->address, addresses[i]);
+    }
+    return (void *)(intptr_t)ret;
 }
 
 /*
- * call-seq:
- *   client.connect("localhost", 1883, 10) -> Boolean
+ * :nodoc:
+ *  Records the target of a successful connect, for rb_mosquitto_client_check_target.
  *
- * Connect to an MQTT broker.
+ */
+static void rb_mosquitto_client_set_target(mosquitto_client_wrapper *client, struct nogvl_connect_args *args)
+{
+    mosquitto_connect_target_t *target = &client->target;
+    char *host = strdup(args->host);
+    char *bind_address = args->bind_address ? strdup(args->bind_address) : NULL;
+    pthread_mutex_lock(&target->mutex);
+    free(target->host);
+    free(target->bind_address);
+    target->host = host;
+    target->bind_address = bind_address;
+    target->port = args->port;
+    target->keepalive = args->keepalive;
+    target->resolve = args->resolve;
+    /* Without a complete target, leave reconnects to libmosquitto */
+    if (host == NULL || (args->bind_address != NULL && bind_address == NULL)) {
+        target->address[0] = '\0';
+    } else {
+        strcpy(target->address, args->address);
+    }
+    target->wanted = true;
+    target->retarget = false;
+    pthread_mutex_unlock(&target->mutex);
+}
+
+/*
+ * :nodoc:
+ *  Whether libmosquitto would reconnect to an address the resolver cache no longer maps the host to - expired,
+ *  flushed or replaced. Expects the target mutex to be held.
  *
- * @param host [String] the hostname or ip address of the broker to connect to.
- * @param port [Integer] the network port to connect to. Usually 1883 (or 8883 for TLS)
- * @param keepalive [Integer] the number of seconds after which the broker should send a PING message
- *                            to the client if no other messages have been exchanged in that time.
- * @return [true] on success
- * @raise [Mosquitto::Error, SystemCallError] on invalid input params or system call errors
- * @example
- *   client.connect("localhost", 1883, 10)
+ */
+static bool rb_mosquitto_client_target_stale(mosquitto_client_wrapper *client)
+{
+    mosquitto_connect_target_t *target = &client->target;
+    return target->host != NULL && target->address[0] != '\0' && !mosquitto_resolver_current(target->host, target->address);
+}
+
+/*
+ * :nodoc:
+ *  Connects to the recorded target through the resolver cache again. Expects the target mutex to be held.
  *
  */
-static VALUE rb_mosquitto_client_connect(VALUE obj, VALUE host, VALUE port, VALUE keepalive)
+static int rb_mosquitto_client_connect_target(mosquitto_client_wrapper *client, bool async)
+{
+    mosquitto_connect_target_t *target = &client->target;
+    struct nogvl_connect_args args;
+    int ret;
+    args.client = client;
+    args.host = target->host;
+    args.port = target->port;
+    args.keepalive = target->keepalive;
+    args.bind_address = target->bind_address;
+    args.resolve = target->resolve;
+    args.async = async;
+    ret = (int)(intptr_t)rb_mosquitto_client_connect_nogvl(&args);
+    strcpy(target->address, args.address);
+    return ret;
+}
+
+/*
+ * :nodoc:
+ *  Reconnects a client whose libmosquitto loop rb_mosquitto_client_check_target stopped - restarts the threaded
+ *  loop, or reconnects for Mosquitto::Client#loop_forever to loop again. Returns false if Mosquitto::Client#disconnect
+ *  or Mosquitto::Client#loop_stop got there first.
+ *
+ *  Blocks on DNS and the network - never call with the GVL held.
+ *
+ */
+static void *rb_mosquitto_client_retarget_nogvl(void *ptr)
+{
+    mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)ptr;
+    mosquitto_connect_target_t *target = &client->target;
+    bool threaded;
+    pthread_mutex_lock(&target->mutex);
+    if (!target->retarget) {
+        pthread_mutex_unlock(&target->mutex);
+        return (void *)false;
+    }
+    target->retarget = false;
+    threaded = !target->looping_forever;
+    if (threaded) {
+        /* The network thread exits once the disconnect callback returns */
+        mosquitto_loop_stop(client->mosq, false);
+        client->net_thread_tuned = false;
+    }
+    /* If that fails, libmosquitto keeps trying the hostname */
+    rb_mosquitto_client_connect_target(client, threaded);
+    if (threaded) mosquitto_loop_start(client->mosq);
+    pthread_mutex_unlock(&target->mutex);
+    return (void *)true;
+}
+
+/*
+ * :nodoc:
+ *  Runs before libmosquitto's automatic reconnect on the network thread. libmosquitto 1.3.1 reconnects to the
+ *  numeric address it was handed and offers no way to change it without connecting - if the resolver cache no
+ *  longer maps the host to that address, ends libmosquitto's loop with a disconnect instead. Threaded clients
+ *  restart it from the callback thread, Mosquitto::Client#loop_forever loops again.
+ *
+ */
+static void rb_mosquitto_client_check_target(mosquitto_client_wrapper *client)
+{
+    mosquitto_connect_target_t *target = &client->target;
+    mosquitto_callback_t *callback;
+    bool threaded = !NIL_P(client->callback_thread), stale;
+    pthread_mutex_lock(&target->mutex);
+    stale = target->wanted && (threaded || target->looping_forever) && rb_mosquitto_client_target_stale(client);
+    if (stale) {
+        target->retarget = true;
+        mosquitto_disconnect(client->mosq);
+    }
+    pthread_mutex_unlock(&target->mutex);
+    if (!stale || !threaded) return;
+
+    callback = MOSQ_ALLOC(mosquitto_callback_t);
+    if (callback == NULL) return;
+    callback->type = ON_RETARGET_CALLBACK;
+    callback->client = client;
+    callback->data = NULL;
+    rb_mosquitto_queue_callback(callback);
+}
+
+/*
+ * :nodoc:
+ *  Mosquitto::Client#disconnect and Mosquitto::Client#loop_stop take precedence over a reconnect to a fresh
+ *  address.
+ *
+ */
+static void rb_mosquitto_client_cancel_retarget(mosquitto_client_wrapper *client, bool disconnect)
+{
+    pthread_mutex_lock(&client->target.mutex);
+    client->target.retarget = false;
+    if (disconnect) client->target.wanted = false;
+    pthread_mutex_unlock(&client->target.mutex);
+}
+
+/*
+ * :nodoc:
+ *  Shared implementation of Mosquitto::Client#connect and friends.
+ *
+ */
+static VALUE rb_mosquitto_client_connect0(VALUE obj, VALUE host, VALUE port, VALUE keepalive, VALUE bind_address, bool async)
 {
     struct nogvl_connect_args args;
     int ret;
@@ -941,27 +2160,62 @@ static VALUE rb_mosquitto_client_connect(VALUE obj, VALUE host, VALUE port, VALU
     MosquittoEncode(host);
     Check_Type(port, T_FIXNUM);
     Check_Type(keepalive, T_FIXNUM);
-    args.mosq = client->mosq;
+    if (!NIL_P(bind_address)) {
+        Check_Type(bind_address, T_STRING);
+        MosquittoEncode(bind_address);
+    }
+    args.client = client;
     args.host = StringValueCStr(host);
     args.port = NUM2INT(port);
     args.keepalive = NUM2INT(keepalive);
-    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_connect_nogvl, (void *)&args, RUBY_UBF_IO, 0);
+    args.bind_address = NIL_P(bind_address) ? NULL : StringValueCStr(bind_address);
+    args.resolve = !client->tls_certs || client->tls_insecure;
+    args.async = async;
+    rb_mosquitto_connect_throttle();
+    ret = (int)(intptr_t)rb_thread_call_without_gvl(rb_mosquitto_client_connect_nogvl, (void *)&args, RUBY_UBF_IO, 0);
+    if (ret == MOSQ_ERR_SUCCESS) {
+        rb_mosquitto_client_set_target(client, &args);
+        if (NIL_P(bind_address)) {
+            rb_mosquitto_client_remember(client, "connect", rb_ary_new3(3, host, port, keepalive));
+        } else {
+            rb_mosquitto_client_remember(client, "connect", rb_ary_new3(4, host, port, keepalive, bind_address));
+        }
+    }
     switch (ret) {
        case MOSQ_ERR_INVAL:
            MosquittoError("invalid input params");
            break;
        case MOSQ_ERR_ERRNO:
-           rb_sys_fail("mosquitto_connect");
+           if (async) {
+               rb_sys_fail(NIL_P(bind_address) ? "mosquitto_connect_async" : "mosquitto_connect_bind_async");
+           } else {
+               rb_sys_fail(NIL_P(bind_address) ? "mosquitto_connect" : "mosquitto_connect_bind");
+           }
            break;
        default:
            return Qtrue;
     }
 }
 
-static void *rb_mosquitto_client_connect_bind_nogvl(void *ptr)
+/*
+ * call-seq:
+ *   client.connect("localhost", 1883, 10) -> Boolean
+ *
+ * Connect to an MQTT broker.
+ *
+ * @param host [String] the hostname or ip address of the broker to connect to.
+ * @param port [Integer] the network port to connect to. Usually 1883 (or 8883 for TLS)
+ * @param keepalive [Integer] the number of seconds after which the broker should send a PING message
+ *                            to the client if no other messages have been exchanged in that time.
+ * @return [true] on success
+ * @raise [Mosquitto::Error, SystemCallError] on invalid input params or system call errors
+ * @example
+ *   client.connect("localhost", 1883, 10)
+ *
+ */
+static VALUE rb_mosquitto_client_connect(VALUE obj, VALUE host, VALUE port, VALUE keepalive)
 {
-    struct nogvl_connect_args *args = ptr;
-    return (void *)mosquitto_connect_bind(args->mosq, args->host, args->port, args->keepalive, args->bind_address);
+    return rb_mosquitto_client_connect0(obj, host, port, keepalive, Qnil, false);
 }
 
 /*
@@ -984,37 +2238,7 @@ static void *rb_mosquitto_client_connect_bind_nogvl(void *ptr)
  */
 static VALUE rb_mosquitto_client_connect_bind(VALUE obj, VALUE host, VALUE port, VALUE keepalive, VALUE bind_address)
 {
-    struct nogvl_connect_args args;
-    int ret;
-    MosquittoGetClient(obj);
-    Check_Type(host, T_STRING);
-    MosquittoEncode(host);
-    Check_Type(port, T_FIXNUM);
-    Check_Type(keepalive, T_FIXNUM);
-    Check_Type(bind_address, T_STRING);
-    MosquittoEncode(bind_address);
-    args.mosq = client->mosq;
-    args.host = StringValueCStr(host);
-    args.port = NUM2INT(port);
-    args.keepalive = NUM2INT(keepalive);
-    args.bind_address = StringValueCStr(bind_address);
-    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_connect_bind_nogvl, (void *)&args, RUBY_UBF_IO, 0);
-    switch (ret) {
-       case MOSQ_ERR_INVAL:
-           MosquittoError("invalid input params");
-           break;
-       case MOSQ_ERR_ERRNO:
-           rb_sys_fail("mosquitto_connect_bind");
-           break;
-       default:
-           return Qtrue;
-    }
-}
-
-static void *rb_mosquitto_client_connect_async_nogvl(void *ptr)
-{
-    struct nogvl_connect_args *args = ptr;
-    return mosquitto_connect_async(args->mosq, args->host, args->port, args->keepalive);
+    return rb_mosquitto_client_connect0(obj, host, port, keepalive, bind_address, false);
 }
 
 /*
@@ -1038,34 +2262,7 @@ static void *rb_mosquitto_client_connect_async_nogvl(void *ptr)
  */
 static VALUE rb_mosquitto_client_connect_async(VALUE obj, VALUE host, VALUE port, VALUE keepalive)
 {
-    struct nogvl_connect_args args;
-    int ret;
-    MosquittoGetClient(obj);
-    Check_Type(host, T_STRING);
-    MosquittoEncode(host);
-    Check_Type(port, T_FIXNUM);
-    Check_Type(keepalive, T_FIXNUM);
-    args.mosq = client->mosq;
-    args.host = StringValueCStr(host);
-    args.port = NUM2INT(port);
-    args.keepalive = NUM2INT(keepalive);
-    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_connect_async_nogvl, (void *)&args, RUBY_UBF_IO, 0);
-    switch (ret) {
-       case MOSQ_ERR_INVAL:
-           MosquittoError("invalid input params");
-           break;
-       case MOSQ_ERR_ERRNO:
-           rb_sys_fail("mosquitto_connect_async");
-           break;
-       default:
-           return Qtrue;
-    }
-}
-
-static void *rb_mosquitto_client_connect_bind_async_nogvl(void *ptr)
-{
-    struct nogvl_connect_args *args = ptr;
-    return mosquitto_connect_bind_async(args->mosq, args->host, args->port, args->keepalive, args->bind_address);
+    return rb_mosquitto_client_connect0(obj, host, port, keepalive, Qnil, true);
 }
 
 /*
@@ -1094,36 +2291,22 @@ static void *rb_mosquitto_client_connect_bind_async_nogvl(void *ptr)
  */
 static VALUE rb_mosquitto_client_connect_bind_async(VALUE obj, VALUE host, VALUE port, VALUE keepalive, VALUE bind_address)
 {
-    struct nogvl_connect_args args;
-    int ret;
-    MosquittoGetClient(obj);
-    Check_Type(host, T_STRING);
-    MosquittoEncode(host);
-    Check_Type(port, T_FIXNUM);
-    Check_Type(keepalive, T_FIXNUM);
-    Check_Type(bind_address, T_STRING);
-    MosquittoEncode(bind_address);
-    args.mosq = client->mosq;
-    args.host = StringValueCStr(host);
-    args.port = NUM2INT(port);
-    args.keepalive = NUM2INT(keepalive);
-    args.bind_address = StringValueCStr(bind_address);
-    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_connect_bind_async_nogvl, (void *)&args, RUBY_UBF_IO, 0);
-    switch (ret) {
-       case MOSQ_ERR_INVAL:
-           MosquittoError("invalid input params");
-           break;
-       case MOSQ_ERR_ERRNO:
-           rb_sys_fail("mosquitto_connect_bind_async");
-           break;
-       default:
-           return Qtrue;
-    }
+    return rb_mosquitto_client_connect0(obj, host, port, keepalive, bind_address, true);
 }
 
 static void *rb_mosquitto_client_reconnect_nogvl(void *ptr)
 {
-    return mosquitto_reconnect((struct mosquitto *)ptr);
+    mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)ptr;
+    int ret;
+    pthread_mutex_lock(&client->target.mutex);
+    if (rb_mosquitto_client_target_stale(client)) {
+        ret = rb_mosquitto_client_connect_target(client, false);
+    } else {
+        ret = mosquitto_reconnect(client->mosq);
+    }
+    if (ret == MOSQ_ERR_SUCCESS) client->target.wanted = true;
+    pthread_mutex_unlock(&client->target.mutex);
+    return (void *)(intptr_t)ret;
 }
 
 /*
@@ -1133,7 +2316,8 @@ static void *rb_mosquitto_client_reconnect_nogvl(void *ptr)
  * Reconnect to a broker.
  *
  * This function provides an easy way of reconnecting to a broker after a connection has been lost.
- * It uses the values that were provided in the Mosquitto::Client#connect call.
+ * It uses the values that were provided in the Mosquitto::Client#connect call, going through the resolver
+ * cache again if the address connected to expired (see Mosquitto.resolver_cache).
  *
  * @return [true] on success
  * @note It must not be called before Mosquitto::Client#connect
@@ -1146,7 +2330,8 @@ static VALUE rb_mosquitto_client_reconnect(VALUE obj)
 {
     int ret;
     MosquittoGetClient(obj);
-    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_reconnect_nogvl, (void *)client->mosq, RUBY_UBF_IO, 0);
+    rb_mosquitto_connect_throttle();
+    ret = (int)(intptr_t)rb_thread_call_without_gvl(rb_mosquitto_client_reconnect_nogvl, (void *)client, RUBY_UBF_IO, 0);
     switch (ret) {
        case MOSQ_ERR_INVAL:
            MosquittoError("invalid input params");
@@ -1184,6 +2369,8 @@ static VALUE rb_mosquitto_client_disconnect(VALUE obj)
     MosquittoGetClient(obj);
   retry_once:
     ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_disconnect_nogvl, (void *)client->mosq, RUBY_UBF_IO, 0);
+    rb_mosquitto_client_backoff_cancel(client);
+    rb_mosquitto_client_cancel_retarget(client, true);
     switch (ret) {
        case MOSQ_ERR_INVAL:
            MosquittoError("invalid input params");
@@ -1193,10 +2380,84 @@ static VALUE rb_mosquitto_client_disconnect(VALUE obj)
            MosquittoError("client not connected to broker");
            break;
        default:
+           rb_mosquitto_client_forget(client, "connect");
            return Qtrue;
     }
 }
 
+/*
+ * :nodoc:
+ *  Adjusts the number of messages published but not yet acknowledged and wakes up flush waiters once
+ *  everything has been acknowledged.
+ *
+ */
+static void rb_mosquitto_client_inflight_add(mosquitto_client_wrapper *client, long count)
+{
+    pthread_mutex_lock(&client->inflight_mutex);
+    client->inflight += count;
+    if (client->inflight <= 0) {
+        client->inflight = 0;
+        pthread_cond_broadcast(&client->inflight_cond);
+    }
+    pthread_mutex_unlock(&client->inflight_mutex);
+}
+
+/*
+ * :nodoc:
+ *  Evaluates publish rate limits matching a topic. Tokens are only taken once every matching bucket has one
+ *  to spare. Exhausted buckets either block the caller (sleeping without the GVL), raise or drop QoS 0
+ *  messages, as per the bucket's policy. Buckets are only ever touched with the GVL held.
+ *
+ *  Returns false if the message should be dropped.
+ *
+ */
+static bool rb_mosquitto_client_throttle(mosquitto_client_wrapper *client, const char *topic, int qos)
+{
+    mosquitto_bucket_t *bucket;
+    struct timeval time;
+    long wait, wait_ms;
+    bool throttled = false;
+  rescan:
+    wait_ms = 0;
+    for (bucket = client->buckets; bucket != NULL; bucket = bucket->next) {
+        if (!mosquitto_bucket_matches(bucket, topic)) continue;
+        if ((wait = mosquitto_bucket_wait_ms(bucket)) == 0) continue;
+        if (!throttled) bucket->throttled++;
+        if (bucket->policy == MOSQ_THROTTLE_RAISE) {
+            MosquittoError("publish rate limit exceeded");
+        } else if (bucket->policy == MOSQ_THROTTLE_DROP && qos == 0) {
+            bucket->dropped++;
+            return false;
+        }
+        if (wait > wait_ms) wait_ms = wait;
+    }
+    if (wait_ms > 0) {
+        throttled = true;
+        time.tv_sec  = wait_ms / 1000;
+        time.tv_usec = (wait_ms % 1000) * 1000;
+        rb_thread_wait_for(time);
+        goto rescan;
+    }
+    for (bucket = client->buckets; bucket != NULL; bucket = bucket->next) {
+        if (mosquitto_bucket_matches(bucket, topic)) mosquitto_bucket_take(bucket);
+    }
+    return true;
+}
+
+/*
+ * :nodoc:
+ *  Refunds tokens taken by rb_mosquitto_client_throttle for a publish that failed, so that errors don't eat
+ *  into the rate limit.
+ *
+ */
+static void rb_mosquitto_client_throttle_refund(mosquitto_client_wrapper *client, const char *topic)
+{
+    mosquitto_bucket_t *bucket;
+    for (bucket = client->buckets; bucket != NULL; bucket = bucket->next) {
+        if (mosquitto_bucket_matches(bucket, topic)) mosquitto_bucket_refund(bucket);
+    }
+}
+
 static void *rb_mosquitto_client_publish_nogvl(void *ptr)
 {
     struct nogvl_publish_args *args = ptr;
@@ -1217,8 +2478,9 @@ static void *rb_mosquitto_client_publish_nogvl(void *ptr)
  * @param qos [Mosquitto::AT_MOST_ONCE, Mosquitto::AT_LEAST_ONCE, Mosquitto::EXACTLY_ONCE] Quality of Service to be
  *            used for the message.
  * @param retain [true, false] set to true to make the message retained
- * @return [true] on success
+ * @return [true, false] true on success, false if dropped by a rate limit
  * @raise [Mosquitto::Error, SystemCallError] on invalid input params or system call errors
+ * @see Mosquitto::Client#rate_limit
  * @example
  *   client.publish(3, "publish", "test", Mosquitto::AT_MOST_ONCE, true)
  *
@@ -1226,7 +2488,7 @@ static void *rb_mosquitto_client_publish_nogvl(void *ptr)
 static VALUE rb_mosquitto_client_publish(VALUE obj, VALUE mid, VALUE topic, VALUE payload, VALUE qos, VALUE retain)
 {
     struct nogvl_publish_args args;
-    int ret, msg_id;
+    int ret, msg_id = 0;
     struct timeval time;
     bool retried = false;
     MosquittoGetClient(obj);
@@ -1240,14 +2502,123 @@ static VALUE rb_mosquitto_client_publish(VALUE obj, VALUE mid, VALUE topic, VALU
         msg_id = NUM2INT(mid);
     }
     args.mosq = client->mosq;
-    args.mid = NIL_P(mid) ? NULL : &msg_id;
+    /* Always collect the message id - the publish probes report it */
+    args.mid = &msg_id;
+    args.topic = StringValueCStr(topic);
+    args.payloadlen = (int)RSTRING_LEN(payload);
+    args.payload = (const char *)(args.payloadlen == 0 ? NULL : RSTRING_PTR(payload));
+    args.qos = NUM2INT(qos);
+    args.retain = (retain == Qtrue) ? true : false;
+    if (client->buckets != NULL && !rb_mosquitto_client_throttle(client, args.topic, args.qos)) return Qfalse;
+  retry_once:
+    rb_mosquitto_client_inflight_add(client, 1);
+    MOSQ_PROBE4(publish__start, client->client_id, args.topic, args.payloadlen, args.qos);
+    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_publish_nogvl, (void *)&args, RUBY_UBF_IO, 0);
+    MOSQ_PROBE4(publish__end, client->client_id, args.topic, *args.mid, ret);
+    if (ret != MOSQ_ERR_SUCCESS) rb_mosquitto_client_inflight_add(client, -1);
+    /* A reconnect and retry keeps the token */
+    if (ret != MOSQ_ERR_SUCCESS && (ret != MOSQ_ERR_NO_CONN || retried)) rb_mosquitto_client_throttle_refund(client, args.topic);
+    switch (ret) {
+       case MOSQ_ERR_INVAL:
+           MosquittoError("invalid input params");
+           break;
+       case MOSQ_ERR_NOMEM:
+           rb_memerror();
+           break;
+       case MOSQ_ERR_NO_CONN:
+           RetryNotConnectedOnce();
+           MosquittoError("client not connected to broker");
+           break;
+       case MOSQ_ERR_PROTOCOL:
+           MosquittoError("protocol error communicating with broker");
+           break;
+       case MOSQ_ERR_PAYLOAD_SIZE:
+           MosquittoError("payload too large");
+           break;
+       default:
+           return Qtrue;
+    }
+}
+
+/*
+ * call-seq:
+ *   client.publish_async("publish", "test", Mosquitto::AT_LEAST_ONCE, false) -> Mosquitto::Future
+ *
+ * Publish a message on a given topic and return a future that completes once the broker acknowledged
+ * the message (or it has been sent, for QoS 0). The future fails if the client disconnects first.
+ *
+ * Acknowledgements are matched to futures natively from the libmosquitto publish callback - no Ruby
+ * side bookkeeping of message ids is needed and Mosquitto::Client#on_publish keeps working as before.
+ *
+ * @param topic [String] the topic to publish on
+ * @param payload [String] Message payload to send. Max 256MB
+ * @param qos [Mosquitto::AT_MOST_ONCE, Mosquitto::AT_LEAST_ONCE, Mosquitto::EXACTLY_ONCE] Quality of Service to be
+ *            used for the message.
+ * @param retain [true, false] set to true to make the message retained
+ * @return [Mosquitto::Future, nil] completion object, nil if dropped by a rate limit
+ * @raise [Mosquitto::Error, SystemCallError] on invalid input params or system call errors
+ * @see Mosquitto.wait_all
+ * @example
+ *   future = client.publish_async("publish", "test", Mosquitto::AT_LEAST_ONCE, false)
+ *   future.value(1.5) -> true
+ *
+ */
+static VALUE rb_mosquitto_client_publish_async(VALUE obj, VALUE topic, VALUE payload, VALUE qos, VALUE retain)
+{
+    struct nogvl_publish_args args;
+    VALUE future_obj;
+    mosquitto_future_t *future = NULL;
+    int ret, msg_id = 0;
+    struct timeval time;
+    bool retried = false;
+    MosquittoGetClient(obj);
+    Check_Type(topic, T_STRING);
+    MosquittoEncode(topic);
+    Check_Type(payload, T_STRING);
+    MosquittoEncode(payload);
+    Check_Type(qos, T_FIXNUM);
+    future_obj = rb_mosquitto_future_alloc(obj);
+    Data_Get_Struct(future_obj, mosquitto_future_t, future);
+    args.mosq = client->mosq;
+    args.mid = &msg_id;
     args.topic = StringValueCStr(topic);
     args.payloadlen = (int)RSTRING_LEN(payload);
-    args.payload = (const char *)(args.payloadlen == 0 ? NULL : StringValueCStr(payload));
+    args.payload = (const char *)(args.payloadlen == 0 ? NULL : RSTRING_PTR(payload));
     args.qos = NUM2INT(qos);
     args.retain = (retain == Qtrue) ? true : false;
+    if (client->buckets != NULL && !rb_mosquitto_client_throttle(client, args.topic, args.qos)) return Qnil;
+
+    pthread_mutex_lock(&mosquitto_future_mutex);
+    if (client->futures == NULL) client->futures = mosquitto_mid_table_new();
+    pthread_mutex_unlock(&mosquitto_future_mutex);
+    if (client->futures == NULL) rb_memerror();
+
   retry_once:
+    pthread_mutex_lock(&mosquitto_future_mutex);
+    client->futures_publishing++;
+    pthread_mutex_unlock(&mosquitto_future_mutex);
+    rb_mosquitto_client_inflight_add(client, 1);
+    MOSQ_PROBE4(publish__start, client->client_id, args.topic, args.payloadlen, args.qos);
     ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_publish_nogvl, (void *)&args, RUBY_UBF_IO, 0);
+    MOSQ_PROBE4(publish__end, client->client_id, args.topic, *args.mid, ret);
+    if (ret != MOSQ_ERR_SUCCESS) rb_mosquitto_client_inflight_add(client, -1);
+    if (ret != MOSQ_ERR_SUCCESS && (ret != MOSQ_ERR_NO_CONN || retried)) rb_mosquitto_client_throttle_refund(client, args.topic);
+    pthread_mutex_lock(&mosquitto_future_mutex);
+    client->futures_publishing--;
+    if (ret == MOSQ_ERR_SUCCESS) {
+        future->mid = msg_id;
+        if (mosquitto_mid_table_lookup(client->futures, msg_id) == MOSQ_MID_TABLE_EARLY_ACK) {
+            mosquitto_mid_table_remove(client->futures, msg_id);
+            future->state = MOSQ_FUTURE_ACKED;
+        } else if (mosquitto_mid_table_insert(client->futures, msg_id, future) == 0) {
+            future->table = client->futures;
+        } else {
+            ret = MOSQ_ERR_NOMEM;
+        }
+    }
+    if (client->futures_publishing == 0) mosquitto_mid_table_purge(client->futures, MOSQ_MID_TABLE_EARLY_ACK);
+    pthread_mutex_unlock(&mosquitto_future_mutex);
+
     switch (ret) {
        case MOSQ_ERR_INVAL:
            MosquittoError("invalid input params");
@@ -1265,125 +2636,1593 @@ static VALUE rb_mosquitto_client_publish(VALUE obj, VALUE mid, VALUE topic, VALU
        case MOSQ_ERR_PAYLOAD_SIZE:
            MosquittoError("payload too large");
            break;
+       default:
+           return future_obj;
+    }
+}
+
+struct nogvl_flush_args {
+    mosquitto_client_wrapper *client;
+    long timeout_ms;
+    struct timespec deadline;
+    bool interrupted;
+    bool flushed;
+    bool expired;
+};
+
+static void *rb_mosquitto_client_flush_nogvl(void *ptr)
+{
+    struct nogvl_flush_args *args = ptr;
+    mosquitto_client_wrapper *client = args->client;
+    pthread_mutex_lock(&client->inflight_mutex);
+    while (client->inflight > 0 && !args->interrupted) {
+        if (args->timeout_ms < 0) {
+            pthread_cond_wait(&client->inflight_cond, &client->inflight_mutex);
+        } else if (pthread_cond_timedwait(&client->inflight_cond, &client->inflight_mutex, &args->deadline) == ETIMEDOUT) {
+            args->expired = true;
+            break;
+        }
+    }
+    args->flushed = (client->inflight == 0);
+    pthread_mutex_unlock(&client->inflight_mutex);
+    return NULL;
+}
+
+static void rb_mosquitto_client_flush_ubf(void *ptr)
+{
+    struct nogvl_flush_args *args = ptr;
+    pthread_mutex_lock(&args->client->inflight_mutex);
+    args->interrupted = true;
+    pthread_cond_broadcast(&args->client->inflight_cond);
+    pthread_mutex_unlock(&args->client->inflight_mutex);
+}
+
+/*
+ * call-seq:
+ *   client.flush(5) -> Boolean
+ *
+ * Blocks until every message published so far has been acknowledged by the broker (or sent, for QoS 0).
+ * Waits on a condition variable without holding the GVL - no sleeping or polling. Useful as a barrier
+ * before shutdown or checkpointing.
+ *
+ * @param timeout [Integer, Float, nil] seconds to wait. nil waits indefinitely.
+ * @return [true, false] true once nothing is in flight, false on timeout
+ * @note Requires a running network loop to process acknowledgements, such as Mosquitto::Client#loop_start
+ * @example
+ *   client.flush(5) -> true
+ *
+ */
+static VALUE rb_mosquitto_client_flush(int argc, VALUE *argv, VALUE obj)
+{
+    struct nogvl_flush_args args;
+    VALUE timeout;
+    MosquittoGetClient(obj);
+    rb_scan_args(argc, argv, "01", &timeout);
+    args.client = client;
+    args.timeout_ms = NIL_P(timeout) ? -1 : (long)(NUM2DBL(timeout) * 1000);
+    args.interrupted = false;
+    args.flushed = false;
+    args.expired = false;
+    if (args.timeout_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &args.deadline);
+        args.deadline.tv_sec += args.timeout_ms / 1000;
+        args.deadline.tv_nsec += (args.timeout_ms % 1000) * 1000000;
+        if (args.deadline.tv_nsec >= 1000000000) {
+            args.deadline.tv_sec++;
+            args.deadline.tv_nsec -= 1000000000;
+        }
+    }
+    for (;;) {
+        rb_thread_call_without_gvl(rb_mosquitto_client_flush_nogvl, (void *)&args, rb_mosquitto_client_flush_ubf, (void *)&args);
+        if (args.flushed || args.expired || !args.interrupted) break;
+        /* Woken up for pending interrupts - handle them and keep waiting, up to the same deadline */
+        rb_thread_check_ints();
+        args.interrupted = false;
+    }
+    return args.flushed ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   client.inflight -> Integer
+ *
+ * Number of messages published through this client that haven't been acknowledged yet.
+ *
+ * @return [Integer] messages in flight
+ * @example
+ *   client.inflight -> 3
+ *
+ */
+static VALUE rb_mosquitto_client_inflight(VALUE obj)
+{
+    long inflight;
+    MosquittoGetClient(obj);
+    pthread_mutex_lock(&client->inflight_mutex);
+    inflight = client->inflight;
+    pthread_mutex_unlock(&client->inflight_mutex);
+    return LONG2NUM(inflight);
+}
+
+static void *rb_mosquitto_client_subscribe_nogvl(void *ptr)
+{
+    struct nogvl_subscribe_args *args = ptr;
+    return (VALUE)mosquitto_subscribe(args->mosq, args->mid, args->subscription, args->qos);
+}
+
+/*
+ * call-seq:
+ *   client.subscribe(3, "subscribe", Mosquitto::AT_MOST_ONCE) -> Boolean
+ *
+ * Subscribe to a topic.
+ *
+ * @param mid [Integer, nil] If not nil, the function will set this to the message id of this particular message.
+ *                           This can be then used with the subscribe callback to determine when the message has been
+ *                           sent.
+ * @param subscription [String] The subscription pattern
+ * @param qos [Mosquitto::AT_MOST_ONCE, Mosquitto::AT_LEAST_ONCE, Mosquitto::EXACTLY_ONCE] Quality of Service to be
+ *            used for the subscription
+ * @return [true] on success
+ * @raise [Mosquitto::Error, SystemCallError] on invalid input params or system call errors
+ * @example
+ *   client.subscribe(3, "subscribe", Mosquitto::AT_MOST_ONCE)
+ *
+ */
+static VALUE rb_mosquitto_client_subscribe(VALUE obj, VALUE mid, VALUE subscription, VALUE qos)
+{
+    struct nogvl_subscribe_args args;
+    int ret, msg_id;
+    struct timeval time;
+    bool retried = false;
+    MosquittoGetClient(obj);
+    Check_Type(subscription, T_STRING);
+    MosquittoEncode(subscription);
+    Check_Type(qos, T_FIXNUM);
+    if (!NIL_P(mid)) {
+        Check_Type(mid, T_FIXNUM);
+        msg_id = NUM2INT(mid);
+    }
+    args.mosq = client->mosq;
+    args.mid = NIL_P(mid) ? NULL : &msg_id;
+    args.subscription = StringValueCStr(subscription);
+    args.qos = NUM2INT(qos);
+  retry_once:
+    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_subscribe_nogvl, (void *)&args, RUBY_UBF_IO, 0);
+    if (ret == MOSQ_ERR_SUCCESS) {
+        /* The SUBSCRIBE is already queued - a subscription that can't be recorded only misses replays */
+        pthread_mutex_lock(&client->registry_mutex);
+        if (mosquitto_registry_add(&client->registry, args.subscription, args.qos) != 0) client->registry.failures++;
+        pthread_mutex_unlock(&client->registry_mutex);
+    }
+    switch (ret) {
+       case MOSQ_ERR_INVAL:
+           MosquittoError("invalid input params");
+           break;
+       case MOSQ_ERR_NOMEM:
+           rb_memerror();
+           break;
+       case MOSQ_ERR_NO_CONN:
+           RetryNotConnectedOnce();
+           MosquittoError("client not connected to broker");
+           break;
        default:
            return Qtrue;
     }
 }
 
-static void *rb_mosquitto_client_subscribe_nogvl(void *ptr)
+static void *rb_mosquitto_client_unsubscribe_nogvl(void *ptr)
+{
+    struct nogvl_subscribe_args *args = ptr;
+    return (VALUE)mosquitto_unsubscribe(args->mosq, args->mid, args->subscription);
+}
+
+/*
+ * call-seq:
+ *   client.unsubscribe(3, "unsubscribe") -> Boolean
+ *
+ * Unsubscribe from a topic.
+ *
+ * @param mid [Integer, nil] If not nil, the function will set this to the message id of this particular message.
+ *                           This can be then used with the unsubscribe callback to determine when the message has been
+ *                           sent.
+ * @param subscription [String] the unsubscription pattern.
+ * @return [true] on success
+ * @raise [Mosquitto::Error, SystemCallError] on invalid input params or system call errors
+ * @example
+ *   client.unsubscribe(3, "unsubscribe")
+ *
+ */
+static VALUE rb_mosquitto_client_unsubscribe(VALUE obj, VALUE mid, VALUE subscription)
+{
+    struct nogvl_subscribe_args args;
+    int ret, msg_id;
+    struct timeval time;
+    bool retried = false;
+    MosquittoGetClient(obj);
+    Check_Type(subscription, T_STRING);
+    MosquittoEncode(subscription);
+    if (!NIL_P(mid)) {
+        Check_Type(mid, T_FIXNUM);
+        msg_id = NUM2INT(mid);
+    }
+    args.mosq = client->mosq;
+    args.mid = NIL_P(mid) ? NULL : &msg_id;
+    args.subscription = StringValueCStr(subscription);
+  retry_once:
+    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_unsubscribe_nogvl, (void *)&args, RUBY_UBF_IO, 0);
+    if (ret == MOSQ_ERR_SUCCESS) {
+        pthread_mutex_lock(&client->registry_mutex);
+        mosquitto_registry_remove(&client->registry, args.subscription);
+        pthread_mutex_unlock(&client->registry_mutex);
+    }
+    switch (ret) {
+       case MOSQ_ERR_INVAL:
+           MosquittoError("invalid input params");
+           break;
+       case MOSQ_ERR_NOMEM:
+           rb_memerror();
+           break;
+       case MOSQ_ERR_NO_CONN:
+           RetryNotConnectedOnce();
+           MosquittoError("client not connected to broker");
+           break;
+       default:
+           return Qtrue;
+    }
+}
+
+/*
+ * call-seq:
+ *   client.auto_resubscribe = true -> Boolean
+ *
+ * Replay all subscriptions as soon as the broker acknowledges a (re)connect. The client keeps a registry of
+ * the subscriptions made with Mosquitto::Client#subscribe and not undone with Mosquitto::Client#unsubscribe.
+ * On CONNACK, before Mosquitto::Client#on_connect runs, the network thread queues a SUBSCRIBE for each of them -
+ * written back to back, without waiting for SUBACKs in between. Subscriptions lost by a clean session
+ * reconnect are back within a round trip.
+ *
+ * Subscribe once, after connecting - subscribing again from Mosquitto::Client#on_connect duplicates the replay.
+ * Disabled by default.
+ *
+ * @param resubscribe [true, false] whether to replay subscriptions on connect
+ * @return [true, false] the setting
+ * @see Mosquitto::Client#subscriptions
+ * @example
+ *   client.auto_resubscribe = true
+ *
+ */
+static VALUE rb_mosquitto_client_auto_resubscribe_set(VALUE obj, VALUE resubscribe)
+{
+    MosquittoGetClient(obj);
+    client->auto_resubscribe = RTEST(resubscribe);
+    return resubscribe;
+}
+
+/*
+ * call-seq:
+ *   client.auto_resubscribe? -> Boolean
+ *
+ * Whether subscriptions are replayed on connect.
+ *
+ * @return [true, false] the setting
+ * @example
+ *   client.auto_resubscribe? -> true
+ *
+ */
+static VALUE rb_mosquitto_client_auto_resubscribe_p(VALUE obj)
+{
+    MosquittoGetClient(obj);
+    return client->auto_resubscribe ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   client.subscriptions -> Hash
+ *
+ * Registered subscriptions and their QoS, in subscription order.
+ *
+ * @return [Hash] subscription pattern => QoS
+ * @see Mosquitto::Client#auto_resubscribe=
+ * @example
+ *   client.subscriptions -> {"sensors/#" => 1, "alerts/+" => 2}
+ *
+ */
+static VALUE rb_mosquitto_client_subscriptions(VALUE obj)
+{
+    VALUE subscriptions;
+    mosquitto_registry_entry_t *entry, *snapshot = NULL;
+    size_t i, count = 0;
+    bool failed = false;
+    MosquittoGetClient(obj);
+    /* Copied out under the registry mutex - the network thread replays subscriptions while holding it */
+    pthread_mutex_lock(&client->registry_mutex);
+    for (entry = client->registry.head; entry != NULL; entry = entry->next) count++;
+    if (count > 0 && (snapshot = calloc(count, sizeof(mosquitto_registry_entry_t))) == NULL) failed = true;
+    for (entry = client->registry.head, i = 0; !failed && entry != NULL; entry = entry->next, i++) {
+        if ((snapshot[i].filter = strdup(entry->filter)) == NULL) failed = true;
+        snapshot[i].qos = entry->qos;
+    }
+    pthread_mutex_unlock(&client->registry_mutex);
+    if (failed) {
+        for (i = 0; snapshot != NULL && i < count; i++) free(snapshot[i].filter);
+        free(snapshot);
+        rb_memerror();
+    }
+    subscriptions = rb_hash_new();
+    for (i = 0; i < count; i++) {
+        rb_hash_aset(subscriptions, MosquittoEncode(rb_str_new2(snapshot[i].filter)), INT2NUM(snapshot[i].qos));
+    }
+    for (i = 0; i < count; i++) free(snapshot[i].filter);
+    free(snapshot);
+    return subscriptions;
+}
+
+/*
+ * call-seq:
+ *   client.resubscribe_stats -> Hash
+ *
+ * Subscription replay counters - connects that triggered a replay, subscriptions replayed and subscriptions
+ * that could not be queued, or not be recorded for replay in the first place.
+ *
+ * @return [Hash] replay counters
+ * @example
+ *   client.resubscribe_stats -> {:subscriptions => 2, :replays => 3, :replayed => 6, :failures => 0}
+ *
+ */
+static VALUE rb_mosquitto_client_resubscribe_stats(VALUE obj)
+{
+    VALUE stats;
+    mosquitto_registry_t counters;
+    MosquittoGetClient(obj);
+    pthread_mutex_lock(&client->registry_mutex);
+    counters = client->registry;
+    pthread_mutex_unlock(&client->registry_mutex);
+    stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("subscriptions")), SIZET2NUM(counters.count));
+    rb_hash_aset(stats, ID2SYM(rb_intern("replays")), ULONG2NUM(counters.replays));
+    rb_hash_aset(stats, ID2SYM(rb_intern("replayed")), ULONG2NUM(counters.replayed));
+    rb_hash_aset(stats, ID2SYM(rb_intern("failures")), ULONG2NUM(counters.failures));
+    return stats;
+}
+
+/*
+ * :nodoc:
+ *  Appends a sink to the client's sink list and makes sure libmosquitto hands us messages.
+ *
+ */
+static void rb_mosquitto_client_add_sink(mosquitto_client_wrapper *client, mosquitto_sink_t *sink)
+{
+    mosquitto_sink_t **tail;
+    pthread_mutex_lock(&client->sink_mutex);
+    for (tail = &client->sinks; *tail != NULL; tail = &(*tail)->next);
+    *tail = sink;
+    pthread_mutex_unlock(&client->sink_mutex);
+    mosquitto_message_callback_set(client->mosq, rb_mosquitto_client_on_message_cb);
+}
+
+/*
+ * :nodoc:
+ *  Opens or duplicates the file descriptor a sink writes to - the sink owns it.
+ *
+ */
+static int rb_mosquitto_client_sink_fd(VALUE target)
+{
+    int fd;
+    switch (TYPE(target)) {
+        case T_STRING:
+            fd = open(StringValueCStr(target), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd == -1) rb_sys_fail(StringValueCStr(target));
+            break;
+        case T_FIXNUM:
+            fd = fcntl(NUM2INT(target), F_DUPFD_CLOEXEC, 0);
+            if (fd == -1) rb_sys_fail("dup");
+            break;
+        default:
+            if (!rb_respond_to(target, rb_intern("fileno"))) {
+                rb_raise(rb_eTypeError, "expected an IO, a file path or a file descriptor");
+            }
+            if (rb_respond_to(target, rb_intern("flush"))) rb_funcall(target, rb_intern("flush"), 0);
+            fd = fcntl(NUM2INT(rb_funcall(target, rb_intern("fileno"), 0)), F_DUPFD_CLOEXEC, 0);
+            if (fd == -1) rb_sys_fail("dup");
+    }
+    return fd;
+}
+
+/*
+ * call-seq:
+ *   client.sink("archive/#", "/var/log/archive.bin", :format => :length_prefixed) -> Boolean
+ *
+ * Archive messages matching a subscription filter to a file, pipe or socket without dispatching them
+ * to Ruby. Matching messages are written straight from the libmosquitto network thread with buffered
+ * writev(2) calls and never allocate Ruby objects or acquire the GVL. Mosquitto::Client#on_message is
+ * not called for messages consumed by a sink. The first matching sink wins.
+ *
+ * Supported formats are :length_prefixed (default) and :raw. Length prefixed records are framed as a
+ * 32 bit network order topic length, the topic, a 32 bit network order payload length and the payload.
+ * Raw records are the message payload only.
+ *
+ * The sink writes to its own copy of the given descriptor - closing the IO from Ruby does not stop the
+ * sink. Buffered data is written out at least every 100ms while messages arrive, on
+ * Mosquitto::Client#flush_sinks, Mosquitto::Client#unsink and when the client is released.
+ *
+ * @param filter [String] subscription filter, wildcards supported
+ * @param target [IO, String, Integer, Mosquitto::SharedRing] an IO instance, a file path to append to,
+ *                                                            a file descriptor or a shared ring to fan
+ *                                                            messages out to worker processes
+ * @param opts [Hash] sink options, currently only :format
+ * @return [true] on success
+ * @raise [TypeError, ArgumentError, SystemCallError] on invalid input params or system call errors
+ * @note The sink does not subscribe - use Mosquitto::Client#subscribe for the filter as well
+ * @example
+ *   client.sink("archive/#", "/var/log/archive.bin")
+ *   client.sink("metrics/+", STDOUT, :format => :raw)
+ *   client.sink("jobs/#", Mosquitto::SharedRing.new)
+ *
+ */
+static VALUE rb_mosquitto_client_sink(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE filter, target, opts, format;
+    mosquitto_sink_t *sink;
+    int fd, sink_format = MOSQ_SINK_FORMAT_LENGTH_PREFIXED;
+    MosquittoGetClient(obj);
+    rb_scan_args(argc, argv, "21", &filter, &target, &opts);
+    Check_Type(filter, T_STRING);
+    MosquittoEncode(filter);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        format = rb_hash_aref(opts, ID2SYM(rb_intern("format")));
+        if (format == ID2SYM(rb_intern("raw"))) {
+            sink_format = MOSQ_SINK_FORMAT_RAW;
+        } else if (!NIL_P(format) && format != ID2SYM(rb_intern("length_prefixed"))) {
+            rb_raise(rb_eArgError, "unsupported sink format, expected one of :length_prefixed or :raw");
+        }
+    }
+
+    if (rb_obj_is_kind_of(target, rb_cMosquittoSharedRing)) {
+        MosquittoGetRing(target);
+        sink = mosquitto_sink_ring_new(StringValueCStr(filter), ring, target);
+        if (sink == NULL) rb_memerror();
+        rb_mosquitto_client_add_sink(client, sink);
+        return Qtrue;
+    }
+
+    fd = rb_mosquitto_client_sink_fd(target);
+    sink = mosquitto_sink_new(StringValueCStr(filter), fd, sink_format);
+    if (sink == NULL) {
+        close(fd);
+        rb_memerror();
+    }
+    rb_mosquitto_client_add_sink(client, sink);
+    return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   client.unsink("archive/#") -> Boolean
+ *
+ * Flush and remove native sinks registered for a given subscription filter.
+ *
+ * @param filter [String] subscription filter the sink was registered with
+ * @return [true, false] true if a sink was removed
+ * @raise [TypeError] on invalid input params
+ * @example
+ *   client.unsink("archive/#")
+ *
+ */
+static VALUE rb_mosquitto_client_unsink(VALUE obj, VALUE filter)
+{
+    mosquitto_sink_t *sink, **link, *removed = NULL;
+    const char *name;
+    MosquittoGetClient(obj);
+    Check_Type(filter, T_STRING);
+    name = StringValueCStr(filter);
+    pthread_mutex_lock(&client->sink_mutex);
+    link = &client->sinks;
+    while ((sink = *link) != NULL) {
+        if (strcmp(sink->filter, name) == 0) {
+            *link = sink->next;
+            sink->next = removed;
+            removed = sink;
+        } else {
+            link = &sink->next;
+        }
+    }
+    pthread_mutex_unlock(&client->sink_mutex);
+    if (removed == NULL) return Qfalse;
+    while ((sink = removed) != NULL) {
+        removed = sink->next;
+        mosquitto_sink_free(sink);
+    }
+    return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   client.flush_sinks -> Boolean
+ *
+ * Write out any messages buffered by native sinks and log lines buffered by Mosquitto::Client#log_to.
+ *
+ * @return [true] on success
+ * @raise [SystemCallError] on write errors
+ * @example
+ *   client.flush_sinks
+ *
+ */
+static VALUE rb_mosquitto_client_flush_sinks(VALUE obj)
+{
+    mosquitto_sink_t *sink;
+    int ret = 0;
+    MosquittoGetClient(obj);
+    pthread_mutex_lock(&client->sink_mutex);
+    for (sink = client->sinks; sink != NULL; sink = sink->next) {
+        if (mosquitto_sink_flush(sink) != 0) ret = errno;
+    }
+    if (client->log_sink != NULL && mosquitto_sink_flush(client->log_sink) != 0) ret = errno;
+    pthread_mutex_unlock(&client->sink_mutex);
+    if (ret != 0) {
+        errno = ret;
+        rb_sys_fail("mosquitto_sink_flush");
+    }
+    return Qtrue;
+}
+
+/* Sink counters copied out under the sink mutex - Ruby objects are only allocated once it's released */
+typedef struct {
+    char *filter;
+    unsigned long long messages;
+    unsigned long long bytes;
+    unsigned long long errors;
+} mosquitto_sink_stats_t;
+
+/*
+ * call-seq:
+ *   client.sink_stats -> Array
+ *
+ * Per sink counters for messages and bytes written as well as write errors.
+ *
+ * @return [Array] an array of hashes, one per sink
+ * @example
+ *   client.sink_stats -> [{:filter => "archive/#", :messages => 10, :bytes => 220, :errors => 0}]
+ *
+ */
+static VALUE rb_mosquitto_client_sink_stats(VALUE obj)
+{
+    VALUE stats, sink_stats;
+    mosquitto_sink_t *sink;
+    mosquitto_sink_stats_t *snapshot = NULL;
+    size_t i, count = 0;
+    bool failed = false;
+    MosquittoGetClient(obj);
+    pthread_mutex_lock(&client->sink_mutex);
+    for (sink = client->sinks; sink != NULL; sink = sink->next) count++;
+    if (count > 0 && (snapshot = calloc(count, sizeof(mosquitto_sink_stats_t))) == NULL) failed = true;
+    for (sink = client->sinks, i = 0; !failed && sink != NULL; sink = sink->next, i++) {
+        if ((snapshot[i].filter = strdup(sink->filter)) == NULL) failed = true;
+        snapshot[i].messages = sink->messages;
+        snapshot[i].bytes = sink->bytes;
+        snapshot[i].errors = sink->errors;
+    }
+    pthread_mutex_unlock(&client->sink_mutex);
+    if (failed) {
+        for (i = 0; snapshot != NULL && i < count; i++) free(snapshot[i].filter);
+        free(snapshot);
+        rb_memerror();
+    }
+    stats = rb_ary_new();
+    for (i = 0; i < count; i++) {
+        sink_stats = rb_hash_new();
+        rb_hash_aset(sink_stats, ID2SYM(rb_intern("filter")), MosquittoEncode(rb_str_new2(snapshot[i].filter)));
+        rb_hash_aset(sink_stats, ID2SYM(rb_intern("messages")), ULL2NUM(snapshot[i].messages));
+        rb_hash_aset(sink_stats, ID2SYM(rb_intern("bytes")), ULL2NUM(snapshot[i].bytes));
+        rb_hash_aset(sink_stats, ID2SYM(rb_intern("errors")), ULL2NUM(snapshot[i].errors));
+        rb_ary_push(stats, sink_stats);
+    }
+    for (i = 0; i < count; i++) free(snapshot[i].filter);
+    free(snapshot);
+    return stats;
+}
+
+/*
+ * call-seq:
+ *   client.log_to("/var/log/mqtt.log") -> Boolean
+ *   client.log_to(STDERR, Mosquitto::LOG_ERR | Mosquitto::LOG_WARNING) -> Boolean
+ *   client.log_to(:syslog) -> Boolean
+ *   client.log_to(nil) -> Boolean
+ *
+ * Write libmosquitto log messages to a file, pipe or socket, or to syslog, without dispatching them to Ruby.
+ * Log lines are formatted as "<UTC timestamp> <level> <message>" on the libmosquitto network thread and go
+ * through the same buffered writev(2) path as native sinks - they never allocate Ruby objects or acquire the
+ * GVL. Errors and warnings are written out right away, other levels at least every 100ms while logs arrive
+ * and on Mosquitto::Client#flush_sinks.
+ *
+ * Replaces any previous target, nil stops native logging. Mosquitto::Client#on_log keeps receiving log
+ * messages if set.
+ *
+ * @param target [IO, String, Integer, Symbol, nil] an IO instance, a file path to append to, a file
+ *                                                  descriptor, :syslog or nil
+ * @param level_mask [Integer] bitwise OR of the Mosquitto::LOG_* levels to write, Mosquitto::LOG_ALL by default
+ * @return [true] on success
+ * @raise [TypeError, ArgumentError, SystemCallError] on invalid input params or system call errors
+ * @see Mosquitto::Client#flush_sinks
+ * @example
+ *   client.log_to("/var/log/mqtt.log", Mosquitto::LOG_ALL & ~Mosquitto::LOG_DEBUG)
+ *
+ */
+static VALUE rb_mosquitto_client_log_to(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE target, level_mask;
+    mosquitto_sink_t *sink = NULL, *previous;
+    bool log_syslog = false;
+    int fd, mask = MOSQ_LOG_ALL;
+    MosquittoGetClient(obj);
+    rb_scan_args(argc, argv, "11", &target, &level_mask);
+    if (!NIL_P(level_mask)) {
+        Check_Type(level_mask, T_FIXNUM);
+        mask = NUM2INT(level_mask);
+    }
+    if (NIL_P(target)) {
+        mask = 0;
+    } else if (SYMBOL_P(target)) {
+        if (target != ID2SYM(rb_intern("syslog"))) rb_raise(rb_eArgError, "unsupported log target, expected :syslog");
+        log_syslog = true;
+    } else {
+        fd = rb_mosquitto_client_sink_fd(target);
+        sink = mosquitto_sink_new("$log", fd, MOSQ_SINK_FORMAT_RAW);
+        if (sink == NULL) {
+            close(fd);
+            rb_memerror();
+        }
+    }
+    pthread_mutex_lock(&client->sink_mutex);
+    previous = client->log_sink;
+    client->log_sink = sink;
+    client->log_syslog = log_syslog;
+    client->log_mask = mask;
+    pthread_mutex_unlock(&client->sink_mutex);
+    if (previous != NULL) mosquitto_sink_free(previous);
+    if (mask != 0) mosquitto_log_callback_set(client->mosq, rb_mosquitto_client_on_log_cb);
+    return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   client.rate_limit("sensors/#", 100) -> Boolean
+ *   client.rate_limit(nil, 1000, :burst => 2000, :policy => :raise) -> Boolean
+ *
+ * Limit the publish rate for topics matching a subscription filter, or for the whole client with a nil filter.
+ * Limits are token buckets evaluated natively in Mosquitto::Client#publish and Mosquitto::Client#publish_async,
+ * before anything is handed to libmosquitto. A message has to pass every matching limit. Registering a
+ * limit for a filter that is already limited replaces it.
+ *
+ * Exhaustion policies :
+ *
+ * :block - wait for a token, sleeping without holding the GVL (default)
+ * :raise - raise Mosquitto::Error
+ * :drop  - drop QoS 0 messages (publish returns false), block for QoS 1 and 2
+ *
+ * @param filter [String, nil] subscription filter to limit, nil for all topics
+ * @param rate [Integer, Float] messages per second
+ * @param opts [Hash] options :burst (bucket size, defaults to rate) and :policy
+ * @return [true] on success
+ * @raise [ArgumentError, TypeError] on invalid rates or policies
+ * @example
+ *   client.rate_limit("sensors/#", 100, :policy => :drop)
+ *
+ */
+static VALUE rb_mosquitto_client_rate_limit(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE filter, rate, opts, burst, policy;
+    mosquitto_bucket_t *bucket, **link;
+    int bucket_policy = MOSQ_THROTTLE_BLOCK;
+    double bucket_rate, bucket_burst;
+    MosquittoGetClient(obj);
+    rb_scan_args(argc, argv, "21", &filter, &rate, &opts);
+    if (!NIL_P(filter)) {
+        Check_Type(filter, T_STRING);
+        MosquittoEncode(filter);
+    }
+    bucket_rate = NUM2DBL(rate);
+    if (bucket_rate <= 0) rb_raise(rb_eArgError, "rate must be positive");
+    bucket_burst = bucket_rate;
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        burst = rb_hash_aref(opts, ID2SYM(rb_intern("burst")));
+        if (!NIL_P(burst)) bucket_burst = NUM2DBL(burst);
+        policy = rb_hash_aref(opts, ID2SYM(rb_intern("policy")));
+        if (policy == ID2SYM(rb_intern("raise"))) {
+            bucket_policy = MOSQ_THROTTLE_RAISE;
+        } else if (policy == ID2SYM(rb_intern("drop"))) {
+            bucket_policy = MOSQ_THROTTLE_DROP;
+        } else if (!NIL_P(policy) && policy != ID2SYM(rb_intern("block"))) {
+            rb_raise(rb_eArgError, "invalid rate limit policy, expected :block, :raise or :drop");
+        }
+    }
+    bucket = mosquitto_bucket_new(NIL_P(filter) ? NULL : StringValueCStr(filter), bucket_rate, bucket_burst, bucket_policy);
+    if (bucket == NULL) rb_memerror();
+    for (link = &client->buckets; *link != NULL; link = &(*link)->next) {
+        if (((*link)->filter == NULL && bucket->filter == NULL) ||
+            ((*link)->filter != NULL && bucket->filter != NULL && strcmp((*link)->filter, bucket->filter) == 0)) {
+            bucket->next = (*link)->next;
+            mosquitto_bucket_free(*link);
+            break;
+        }
+    }
+    *link = bucket;
+    return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   client.remove_rate_limit("sensors/#") -> Boolean
+ *
+ * Remove a publish rate limit registered with Mosquitto::Client#rate_limit.
+ *
+ * @param filter [String, nil] subscription filter, nil for the client wide limit
+ * @return [true, false] true if a limit was removed
+ * @example
+ *   client.remove_rate_limit("sensors/#")
+ *
+ */
+static VALUE rb_mosquitto_client_remove_rate_limit(VALUE obj, VALUE filter)
+{
+    mosquitto_bucket_t *bucket, **link;
+    const char *filter_str = NULL;
+    MosquittoGetClient(obj);
+    if (!NIL_P(filter)) {
+        Check_Type(filter, T_STRING);
+        MosquittoEncode(filter);
+        filter_str = StringValueCStr(filter);
+    }
+    for (link = &client->buckets; *link != NULL; link = &(*link)->next) {
+        bucket = *link;
+        if ((bucket->filter == NULL && filter_str == NULL) ||
+            (bucket->filter != NULL && filter_str != NULL && strcmp(bucket->filter, filter_str) == 0)) {
+            *link = bucket->next;
+            mosquitto_bucket_free(bucket);
+            return Qtrue;
+        }
+    }
+    return Qfalse;
+}
+
+/*
+ * call-seq:
+ *   client.throttle_stats -> Array
+ *
+ * Per rate limit counters : messages passed, publishes that found the bucket exhausted and QoS 0 messages dropped.
+ *
+ * @return [Array] an array of hashes, one per rate limit
+ * @example
+ *   client.throttle_stats -> [{:filter => "sensors/#", :passed => 100, :throttled => 4, :dropped => 4}]
+ *
+ */
+static VALUE rb_mosquitto_client_throttle_stats(VALUE obj)
+{
+    VALUE stats, bucket_stats;
+    mosquitto_bucket_t *bucket;
+    MosquittoGetClient(obj);
+    stats = rb_ary_new();
+    for (bucket = client->buckets; bucket != NULL; bucket = bucket->next) {
+        bucket_stats = rb_hash_new();
+        rb_hash_aset(bucket_stats, ID2SYM(rb_intern("filter")), bucket->filter == NULL ? Qnil : MosquittoEncode(rb_str_new2(bucket->filter)));
+        rb_hash_aset(bucket_stats, ID2SYM(rb_intern("passed")), ULONG2NUM(bucket->passed));
+        rb_hash_aset(bucket_stats, ID2SYM(rb_intern("throttled")), ULONG2NUM(bucket->throttled));
+        rb_hash_aset(bucket_stats, ID2SYM(rb_intern("dropped")), ULONG2NUM(bucket->dropped));
+        rb_ary_push(stats, bucket_stats);
+    }
+    return stats;
+}
+
+/*
+ * call-seq:
+ *   client.inbound_policy("sensors/#", :max_rate => 5) -> Boolean
+ *   client.inbound_policy("vibration/+", :sample => 100, :changed_only => true) -> Boolean
+ *
+ * Filter messages matching a subscription filter before they reach the Ruby VM. Policies are evaluated on the
+ * libmosquitto network thread - filtered messages cost no allocation and no GVL time. Only the first matching
+ * policy (in registration order) applies to a message. Registering a policy for a filter that already has one
+ * replaces it.
+ *
+ * Options, evaluated in this order :
+ *
+ * :changed_only - only deliver a message if its payload differs from the previous one on the same topic
+ * :sample       - only deliver 1 in N messages
+ * :max_rate     - deliver at most N messages per second, dropping the rest
+ *
+ * A :max_age_ms option overrides Mosquitto::Client#max_age_ms for matching messages.
+ *
+ * @param filter [String] subscription filter
+ * @param opts [Hash] policy options
+ * @return [true] on success
+ * @raise [ArgumentError, TypeError] on invalid filters or options
+ * @see Mosquitto::Client#inbound_stats
+ * @example
+ *   client.inbound_policy("sensors/#", :max_rate => 5)
+ *
+ */
+static VALUE rb_mosquitto_client_inbound_policy(VALUE obj, VALUE filter, VALUE opts)
+{
+    mosquitto_inbound_policy_t *policy, **link;
+    VALUE max_rate, sample, changed_only, max_age;
+    double policy_rate = 0;
+    unsigned long policy_sample = 0;
+    MosquittoGetClient(obj);
+    Check_Type(filter, T_STRING);
+    MosquittoEncode(filter);
+    Check_Type(opts, T_HASH);
+    max_rate = rb_hash_aref(opts, ID2SYM(rb_intern("max_rate")));
+    if (!NIL_P(max_rate) && (policy_rate = NUM2DBL(max_rate)) <= 0) rb_raise(rb_eArgError, "max rate must be positive");
+    sample = rb_hash_aref(opts, ID2SYM(rb_intern("sample")));
+    if (!NIL_P(sample)) {
+        Check_Type(sample, T_FIXNUM);
+        if (NUM2LONG(sample) < 1) rb_raise(rb_eArgError, "sample rate must be at least 1");
+        policy_sample = NUM2ULONG(sample);
+    }
+    max_age = rb_hash_aref(opts, ID2SYM(rb_intern("max_age_ms")));
+    if (!NIL_P(max_age)) {
+        Check_Type(max_age, T_FIXNUM);
+        if (NUM2LONG(max_age) < 0) rb_raise(rb_eArgError, "max age must not be negative");
+    }
+    changed_only = rb_hash_aref(opts, ID2SYM(rb_intern("changed_only")));
+    policy = mosquitto_inbound_policy_new(StringValueCStr(filter), policy_rate, policy_sample, RTEST(changed_only));
+    if (policy == NULL) rb_memerror();
+    if (!NIL_P(max_age)) policy->max_age_ms = NUM2LONG(max_age);
+    pthread_mutex_lock(&client->inbound_mutex);
+    for (link = &client->inbound_policies; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->filter, policy->filter) == 0) {
+            policy->next = (*link)->next;
+            mosquitto_inbound_policy_free(*link);
+            break;
+        }
+    }
+    *link = policy;
+    pthread_mutex_unlock(&client->inbound_mutex);
+    return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   client.remove_inbound_policy("sensors/#") -> Boolean
+ *
+ * Remove an inbound policy registered with Mosquitto::Client#inbound_policy.
+ *
+ * @param filter [String] subscription filter
+ * @return [true, false] true if a policy was removed
+ * @example
+ *   client.remove_inbound_policy("sensors/#")
+ *
+ */
+static VALUE rb_mosquitto_client_remove_inbound_policy(VALUE obj, VALUE filter)
+{
+    mosquitto_inbound_policy_t *policy = NULL, **link;
+    const char *name;
+    MosquittoGetClient(obj);
+    Check_Type(filter, T_STRING);
+    MosquittoEncode(filter);
+    name = StringValueCStr(filter);
+    pthread_mutex_lock(&client->inbound_mutex);
+    for (link = &client->inbound_policies; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->filter, name) == 0) {
+            policy = *link;
+            *link = policy->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&client->inbound_mutex);
+    if (policy == NULL) return Qfalse;
+    mosquitto_inbound_policy_free(policy);
+    return Qtrue;
+}
+
+/* Policy counters copied out under the inbound mutex - Ruby objects are only allocated once it's released */
+typedef struct {
+    char *filter;
+    unsigned long passed;
+    unsigned long filtered;
+} mosquitto_inbound_stats_t;
+
+/*
+ * call-seq:
+ *   client.inbound_stats -> Array
+ *
+ * Per inbound policy counters for messages delivered and filtered.
+ *
+ * @return [Array] an array of hashes, one per policy
+ * @example
+ *   client.inbound_stats -> [{:filter => "sensors/#", :passed => 5, :filtered => 995}]
+ *
+ */
+static VALUE rb_mosquitto_client_inbound_stats(VALUE obj)
+{
+    VALUE stats, policy_stats;
+    mosquitto_inbound_policy_t *policy;
+    mosquitto_inbound_stats_t *snapshot = NULL;
+    size_t i, count = 0;
+    bool failed = false;
+    MosquittoGetClient(obj);
+    pthread_mutex_lock(&client->inbound_mutex);
+    for (policy = client->inbound_policies; policy != NULL; policy = policy->next) count++;
+    if (count > 0 && (snapshot = calloc(count, sizeof(mosquitto_inbound_stats_t))) == NULL) failed = true;
+    for (policy = client->inbound_policies, i = 0; !failed && policy != NULL; policy = policy->next, i++) {
+        if ((snapshot[i].filter = strdup(policy->filter)) == NULL) failed = true;
+        snapshot[i].passed = policy->passed;
+        snapshot[i].filtered = policy->filtered;
+    }
+    pthread_mutex_unlock(&client->inbound_mutex);
+    if (failed) {
+        for (i = 0; snapshot != NULL && i < count; i++) free(snapshot[i].filter);
+        free(snapshot);
+        rb_memerror();
+    }
+    stats = rb_ary_new();
+    for (i = 0; i < count; i++) {
+        policy_stats = rb_hash_new();
+        rb_hash_aset(policy_stats, ID2SYM(rb_intern("filter")), MosquittoEncode(rb_str_new2(snapshot[i].filter)));
+        rb_hash_aset(policy_stats, ID2SYM(rb_intern("passed")), ULONG2NUM(snapshot[i].passed));
+        rb_hash_aset(policy_stats, ID2SYM(rb_intern("filtered")), ULONG2NUM(snapshot[i].filtered));
+        rb_ary_push(stats, policy_stats);
+    }
+    for (i = 0; i < count; i++) free(snapshot[i].filter);
+    free(snapshot);
+    return stats;
+}
+
+/*
+ * call-seq:
+ *   client.retain_cache("config/#") -> Boolean
+ *   client.retain_cache("status/+", :latest => true, :max_topics => 1000) -> Boolean
+ *
+ * Cache the latest retained message per topic for topics matching a subscription filter. The cache is updated
+ * from the libmosquitto network thread as messages arrive, whether or not an on_message callback is set or a
+ * sink consumes them, and is queried with Mosquitto::Client#retained and Mosquitto::Client#retained_snapshot
+ * without a broker round trip. Once a topic is cached, every message on it replaces the cached one, as brokers
+ * forward retained messages to established subscriptions without the RETAIN flag. Messages with an empty
+ * payload clear a topic.
+ *
+ * The filter only selects what gets cached - the client still needs a matching subscription. When several
+ * filters match a topic the most specific one applies : "status/a" over "status/+" over "status/#".
+ *
+ * @param filter [String] subscription filter
+ * @param opts [Hash] cache options
+ * @option opts [true, false] :latest cache the latest message of any kind, not only retained ones
+ * @option opts [Integer] :max_topics max number of cached topics, for all filters (default 65536). Messages on
+ *                                    new topics are not cached once full.
+ * @return [true] on success
+ * @raise [TypeError, ArgumentError] on invalid filters or options
+ * @see Mosquitto::Client#retained
+ * @example
+ *   client.retain_cache("config/#")
+ *   client.subscribe(nil, "config/#", Mosquitto::AT_LEAST_ONCE)
+ *
+ */
+static VALUE rb_mosquitto_client_retain_cache(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE filter, opts, latest = Qnil, max_topics = Qnil;
+    char *cache_filter;
+    int ret = 0;
+    MosquittoGetClient(obj);
+    rb_scan_args(argc, argv, "11", &filter, &opts);
+    Check_Type(filter, T_STRING);
+    MosquittoEncode(filter);
+    cache_filter = StringValueCStr(filter);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        latest = rb_hash_aref(opts, ID2SYM(rb_intern("latest")));
+        max_topics = rb_hash_aref(opts, ID2SYM(rb_intern("max_topics")));
+        if (!NIL_P(max_topics)) {
+            Check_Type(max_topics, T_FIXNUM);
+            if (NUM2LONG(max_topics) < 1) rb_raise(rb_eArgError, "max topics must be positive");
+        }
+    }
+    pthread_mutex_lock(&client->retain_mutex);
+    if (client->retain_cache == NULL) client->retain_cache = mosquitto_retain_cache_new();
+    if (client->retain_cache == NULL) {
+        ret = -1;
+    } else {
+        if (!NIL_P(max_topics)) client->retain_cache->max_topics = NUM2ULONG(max_topics);
+        ret = mosquitto_retain_cache_add_filter(client->retain_cache, cache_filter, RTEST(latest));
+    }
+    pthread_mutex_unlock(&client->retain_mutex);
+    if (ret != 0) rb_memerror();
+    mosquitto_message_callback_set(client->mosq, rb_mosquitto_client_on_message_cb);
+    return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   client.remove_retain_cache("config/#") -> Boolean
+ *
+ * Stop caching topics for a filter registered with Mosquitto::Client#retain_cache. Cached topics no other
+ * filter matches are evicted.
+ *
+ * @param filter [String] subscription filter
+ * @return [true, false] true if a filter was removed
+ * @example
+ *   client.remove_retain_cache("config/#")
+ *
+ */
+static VALUE rb_mosquitto_client_remove_retain_cache(VALUE obj, VALUE filter)
+{
+    char *cache_filter;
+    bool removed = false;
+    MosquittoGetClient(obj);
+    Check_Type(filter, T_STRING);
+    MosquittoEncode(filter);
+    cache_filter = StringValueCStr(filter);
+    pthread_mutex_lock(&client->retain_mutex);
+    if (client->retain_cache != NULL) removed = mosquitto_retain_cache_remove_filter(client->retain_cache, cache_filter);
+    pthread_mutex_unlock(&client->retain_mutex);
+    return removed ? Qtrue : Qfalse;
+}
+
+/*
+ * :nodoc:
+ *  Copies a cached message for handing it to a Mosquitto::Message, which takes ownership. Expects the retain
+ *  mutex to be held.
+ *
+ */
+static struct mosquitto_message *rb_mosquitto_client_retained_copy(const struct mosquitto_message *msg)
+{
+    struct mosquitto_message *copy = MOSQ_ALLOC(struct mosquitto_message);
+    if (copy == NULL) return NULL;
+    if (mosquitto_message_copy(copy, msg) != MOSQ_ERR_SUCCESS) {
+        free(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+/*
+ * call-seq:
+ *   client.retained("config/limits") -> Mosquitto::Message or nil
+ *
+ * The latest cached message for a topic, nil if there's none. Constant time, served from the cache populated
+ * by Mosquitto::Client#retain_cache.
+ *
+ * @param topic [String] topic name (not a filter)
+ * @return [Mosquitto::Message, nil] cached message
+ * @raise [TypeError] on invalid topics
+ * @example
+ *   client.retained("config/limits").to_s -> "{\"max\": 10}"
+ *
+ */
+static VALUE rb_mosquitto_client_retained(VALUE obj, VALUE topic)
+{
+    const struct mosquitto_message *cached;
+    struct mosquitto_message *copy = NULL;
+    char *cache_topic;
+    bool failed = false;
+    MosquittoGetClient(obj);
+    Check_Type(topic, T_STRING);
+    MosquittoEncode(topic);
+    cache_topic = StringValueCStr(topic);
+    pthread_mutex_lock(&client->retain_mutex);
+    if (client->retain_cache != NULL && (cached = mosquitto_retain_cache_lookup(client->retain_cache, cache_topic)) != NULL) {
+        failed = (copy = rb_mosquitto_client_retained_copy(cached)) == NULL;
+    }
+    pthread_mutex_unlock(&client->retain_mutex);
+    if (failed) rb_memerror();
+    return copy == NULL ? Qnil : rb_mosquitto_message_alloc(copy);
+}
+
+/* Message copies taken under the retain mutex, handed over to Ruby objects one at a time */
+struct rb_mosquitto_retained_snapshot_args {
+    VALUE snapshot;
+    struct mosquitto_message **copies;
+    size_t count;
+    size_t next;
+};
+
+static VALUE rb_mosquitto_client_retained_snapshot_build(VALUE ptr)
+{
+    struct rb_mosquitto_retained_snapshot_args *args = (struct rb_mosquitto_retained_snapshot_args *)ptr;
+    VALUE topic, message;
+    while (args->next < args->count) {
+        topic = MosquittoEncode(rb_str_new2(args->copies[args->next]->topic));
+        message = rb_mosquitto_message_alloc(args->copies[args->next]);
+        args->next++;
+        rb_hash_aset(args->snapshot, topic, message);
+    }
+    return args->snapshot;
+}
+
+/*
+ * :nodoc:
+ *  Frees the copies not yet owned by a message, left behind if allocating the snapshot raised.
+ *
+ */
+static VALUE rb_mosquitto_client_retained_snapshot_release(VALUE ptr)
+{
+    struct rb_mosquitto_retained_snapshot_args *args = (struct rb_mosquitto_retained_snapshot_args *)ptr;
+    size_t i;
+    for (i = args->next; i < args->count; i++) mosquitto_message_free(&args->copies[i]);
+    free(args->copies);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   client.retained_snapshot -> Hash
+ *   client.retained_snapshot("config/+/limits") -> Hash
+ *
+ * All cached messages with topics matching a subscription filter, keyed by topic.
+ *
+ * @param filter [String] subscription filter, defaults to all cached topics
+ * @return [Hash] topic => Mosquitto::Message
+ * @raise [TypeError] on invalid filters
+ * @example
+ *   client.retained_snapshot("config/#") -> {"config/limits" => #<Mosquitto::Message>, ...}
+ *
+ */
+static VALUE rb_mosquitto_client_retained_snapshot(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE filter, snapshot;
+    struct rb_mosquitto_retained_snapshot_args args;
+    mosquitto_retain_cache_t *cache;
+    mosquitto_retain_entry_t *entry;
+    struct mosquitto_message **copies = NULL;
+    char *cache_filter = NULL;
+    size_t i, count = 0;
+    bool matches, failed = false;
+    MosquittoGetClient(obj);
+    rb_scan_args(argc, argv, "01", &filter);
+    if (!NIL_P(filter)) {
+        Check_Type(filter, T_STRING);
+        MosquittoEncode(filter);
+        cache_filter = StringValueCStr(filter);
+    }
+    snapshot = rb_hash_new();
+    pthread_mutex_lock(&client->retain_mutex);
+    if ((cache = client->retain_cache) != NULL && cache->count > 0) {
+        /* Copy out under the lock, allocate Ruby objects after releasing it */
+        if ((copies = malloc(sizeof(struct mosquitto_message *) * cache->count)) == NULL) failed = true;
+        for (i = 0; !failed && i < cache->capacity; i++) {
+            for (entry = cache->buckets[i]; !failed && entry != NULL; entry = entry->next) {
+                matches = true;
+                if (cache_filter != NULL && mosquitto_topic_matches_sub(cache_filter, entry->msg->topic, &matches) != MOSQ_ERR_SUCCESS) matches = false;
+                if (!matches) continue;
+                if ((copies[count] = rb_mosquitto_client_retained_copy(entry->msg)) == NULL) {
+                    failed = true;
+                } else {
+                    count++;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&client->retain_mutex);
+    if (failed) {
+        for (i = 0; i < count; i++) mosquitto_message_free(&copies[i]);
+        free(copies);
+        rb_memerror();
+    }
+    args.snapshot = snapshot;
+    args.copies = copies;
+    args.count = count;
+    args.next = 0;
+    return rb_ensure(rb_mosquitto_client_retained_snapshot_build, (VALUE)&args, rb_mosquitto_client_retained_snapshot_release, (VALUE)&args);
+}
+
+/*
+ * call-seq:
+ *   client.retain_cache_stats -> Hash or nil
+ *
+ * Retained message cache counters, nil if Mosquitto::Client#retain_cache was never called.
+ *
+ * @return [Hash, nil] cache counters
+ * @example
+ *   client.retain_cache_stats -> {:topics => 12, :bytes => 4096, :hits => 1000, :misses => 2, :updates => 40, :overflows => 0}
+ *
+ */
+static VALUE rb_mosquitto_client_retain_cache_stats(VALUE obj)
+{
+    VALUE stats;
+    mosquitto_retain_cache_t counters;
+    bool enabled;
+    MosquittoGetClient(obj);
+    pthread_mutex_lock(&client->retain_mutex);
+    if ((enabled = (client->retain_cache != NULL))) counters = *client->retain_cache;
+    pthread_mutex_unlock(&client->retain_mutex);
+    if (!enabled) return Qnil;
+    stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("topics")), SIZET2NUM(counters.count));
+    rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), SIZET2NUM(counters.bytes));
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULONG2NUM(counters.hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULONG2NUM(counters.misses));
+    rb_hash_aset(stats, ID2SYM(rb_intern("updates")), ULONG2NUM(counters.updates));
+    rb_hash_aset(stats, ID2SYM(rb_intern("overflows")), ULONG2NUM(counters.overflows));
+    return stats;
+}
+
+/*
+ * call-seq:
+ *   client.max_age_ms = 250 -> Integer
+ *
+ * Discard messages that waited in the callback queue for longer than the given number of milliseconds, instead
+ * of dispatching stale data to Mosquitto::Client#on_message after a GC pause or a slow handler. Expired messages
+ * are released before any Ruby object is allocated for them. Zero (the default) disables expiry.
+ *
+ * Only applicable to clients that run with the threaded Mosquitto::Client#loop_start event loop.
+ *
+ * @param max_age [Integer] max age in milliseconds
+ * @return [Integer] max age in milliseconds
+ * @raise [TypeError, ArgumentError] on invalid max ages
+ * @see Mosquitto::Client#expired_messages
+ * @example
+ *   client.max_age_ms = 250
+ *
+ */
+static VALUE rb_mosquitto_client_max_age_ms_set(VALUE obj, VALUE max_age)
+{
+    MosquittoGetClient(obj);
+    Check_Type(max_age, T_FIXNUM);
+    if (NUM2LONG(max_age) < 0) rb_raise(rb_eArgError, "max age must not be negative");
+    client->max_age_ms = NUM2LONG(max_age);
+    return max_age;
+}
+
+/*
+ * call-seq:
+ *   client.max_age_ms -> Integer
+ *
+ * Max age of queued messages in milliseconds, zero if disabled.
+ *
+ * @return [Integer] max age in milliseconds
+ * @example
+ *   client.max_age_ms -> 250
+ *
+ */
+static VALUE rb_mosquitto_client_max_age_ms(VALUE obj)
+{
+    MosquittoGetClient(obj);
+    return LONG2NUM(client->max_age_ms);
+}
+
+/*
+ * :nodoc:
+ *  Subscribes for replies once per connection. Replies can't overtake the subscription - the broker handles
+ *  SUBSCRIBE before the request PUBLISH that follows it on the same connection.
+ *
+ */
+static void rb_mosquitto_client_rpc_subscribe(mosquitto_client_wrapper *client)
+{
+    struct nogvl_subscribe_args args;
+    char subscription[MOSQ_RPC_TOPIC_MAX + 2];
+    bool subscribe;
+    int ret;
+    pthread_mutex_lock(&client->rpc->mutex);
+    subscribe = !client->rpc->subscribed;
+    client->rpc->subscribed = true;
+    pthread_mutex_unlock(&client->rpc->mutex);
+    if (!subscribe) return;
+    snprintf(subscription, sizeof(subscription), "%s+", client->rpc->reply_prefix);
+    args.mosq = client->mosq;
+    args.mid = NULL;
+    args.subscription = subscription;
+    args.qos = 1;
+    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_subscribe_nogvl, (void *)&args, RUBY_UBF_IO, 0);
+    if (ret == MOSQ_ERR_SUCCESS) return;
+    pthread_mutex_lock(&client->rpc->mutex);
+    client->rpc->subscribed = false;
+    pthread_mutex_unlock(&client->rpc->mutex);
+    switch (ret) {
+       case MOSQ_ERR_NOMEM:
+           rb_memerror();
+           break;
+       case MOSQ_ERR_NO_CONN:
+           MosquittoError("client not connected to broker");
+           break;
+       default:
+           MosquittoError("could not subscribe for replies");
+    }
+}
+
+struct rb_mosquitto_request_args {
+    VALUE obj;
+    VALUE topic;
+    VALUE payload;
+    VALUE qos;
+    VALUE timeout;
+    mosquitto_rpc_t *rpc;
+    mosquitto_rpc_call_t *call;
+};
+
+static VALUE rb_mosquitto_client_request_call(VALUE ptr)
+{
+    struct rb_mosquitto_request_args *args = (struct rb_mosquitto_request_args *)ptr;
+    char reply_topic[MOSQ_RPC_TOPIC_MAX + 16];
+    struct mosquitto_message *reply;
+    VALUE envelope;
+    int len, state;
+    len = snprintf(reply_topic, sizeof(reply_topic), "%s%d", args->rpc->reply_prefix, args->call->id);
+    envelope = rb_str_buf_new(len + 1 + RSTRING_LEN(args->payload));
+    rb_str_buf_cat(envelope, reply_topic, len + 1);
+    rb_str_buf_cat(envelope, RSTRING_PTR(args->payload), RSTRING_LEN(args->payload));
+    if (rb_mosquitto_client_publish(args->obj, Qnil, args->topic, envelope, args->qos, Qfalse) == Qfalse) return Qfalse;
+    args->call->sent = true;
+    if (!rb_mosquitto_rpc_wait(args->rpc, args->call, args->timeout)) return Qnil;
+    pthread_mutex_lock(&args->rpc->mutex);
+    state = args->call->state;
+    reply = args->call->reply;
+    args->call->reply = NULL;
+    pthread_mutex_unlock(&args->rpc->mutex);
+    if (state == MOSQ_RPC_FAILED) MosquittoError("client disconnected before a reply was received");
+    return rb_mosquitto_message_alloc(reply);
+}
+
+static VALUE rb_mosquitto_client_request_ensure(VALUE ptr)
+{
+    struct rb_mosquitto_request_args *args = (struct rb_mosquitto_request_args *)ptr;
+    mosquitto_rpc_call_free(args->rpc, args->call);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   client.request("svc/time", "utc") -> Mosquitto::Message or nil
+ *   client.request("svc/time", "utc", :timeout => 0.5, :qos => Mosquitto::AT_MOST_ONCE) -> Mosquitto::Message or nil
+ *
+ * Publishes a request and waits for its reply, without holding the GVL. The reply subscription and the table of
+ * in flight requests live in C - replies are matched to callers on the network thread, never dispatched to
+ * Mosquitto::Client#on_message and wake exactly the thread waiting on them. Any number of threads may have
+ * requests in flight on the same client.
+ *
+ * MQTT 3.1 has no response topic property - the request payload is wrapped in an envelope that carries the
+ * reply topic. Responders reply with Mosquitto::Client#respond and read the request body with
+ * Mosquitto::Message#request_payload.
+ *
+ * Requires a running network loop, such as Mosquitto::Client#loop_start.
+ *
+ * @param topic [String] the topic to publish the request on
+ * @param payload [String] the request body
+ * @param opts [Hash] request options
+ * @option opts [Integer, Float, nil] :timeout seconds to wait for the reply, 5 by default. nil waits indefinitely.
+ * @option opts [Mosquitto::AT_MOST_ONCE, Mosquitto::AT_LEAST_ONCE, Mosquitto::EXACTLY_ONCE] :qos Quality of Service
+ *         of the request, Mosquitto::AT_LEAST_ONCE by default
+ * @return [Mosquitto::Message, nil, false] the reply, nil on timeout, false if dropped by a rate limit
+ * @raise [Mosquitto::Error] if the client is not connected or disconnected before the reply arrived
+ * @raise [TypeError, ArgumentError] on invalid input params
+ * @see Mosquitto::Client#respond
+ * @example
+ *   client.request("svc/time", "utc", :timeout => 0.5).to_s -> "2014-01-01T00:00:00Z"
+ *
+ */
+static VALUE rb_mosquitto_client_request(int argc, VALUE *argv, VALUE obj)
+{
+    struct rb_mosquitto_request_args args;
+    struct timespec now;
+    VALUE topic, payload, opts, value;
+    MosquittoGetClient(obj);
+    rb_scan_args(argc, argv, "21", &topic, &payload, &opts);
+    Check_Type(topic, T_STRING);
+    Check_Type(payload, T_STRING);
+    args.obj = obj;
+    args.topic = topic;
+    args.payload = payload;
+    args.qos = INT2NUM(1);
+    args.timeout = DBL2NUM(MOSQ_RPC_DEFAULT_TIMEOUT);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        value = rb_hash_aref(opts, ID2SYM(rb_intern("qos")));
+        if (!NIL_P(value)) {
+            Check_Type(value, T_FIXNUM);
+            args.qos = value;
+        }
+        if (RTEST(rb_funcall(opts, rb_intern("key?"), 1, ID2SYM(rb_intern("timeout"))))) {
+            args.timeout = rb_hash_aref(opts, ID2SYM(rb_intern("timeout")));
+            if (!NIL_P(args.timeout) && NUM2DBL(args.timeout) < 0) rb_raise(rb_eArgError, "timeout must not be negative");
+        }
+    }
+    if (client->rpc == NULL) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        client->rpc = mosquitto_rpc_new((unsigned int)now.tv_nsec ^ (unsigned int)getpid() ^ (unsigned int)(uintptr_t)client);
+        if (client->rpc == NULL) rb_memerror();
+        mosquitto_message_callback_set(client->mosq, rb_mosquitto_client_on_message_cb);
+    }
+    rb_mosquitto_client_rpc_subscribe(client);
+    args.rpc = client->rpc;
+    if ((args.call = mosquitto_rpc_call_new(client->rpc)) == NULL) rb_memerror();
+    return rb_ensure(rb_mosquitto_client_request_call, (VALUE)&args, rb_mosquitto_client_request_ensure, (VALUE)&args);
+}
+
+/*
+ * call-seq:
+ *   client.respond(request, "2014-01-01T00:00:00Z") -> Boolean
+ *
+ * Replies to a request sent with Mosquitto::Client#request, with the Quality of Service of the request.
+ *
+ * @param request [Mosquitto::Message] the request as received by Mosquitto::Client#on_message
+ * @param payload [String] the reply
+ * @return [true, false] true on success, false if dropped by a rate limit
+ * @raise [Mosquitto::Error] if the client is not connected or on a too large payload size
+ * @raise [ArgumentError] if the message is not a request
+ * @see Mosquitto::Client#request
+ * @example
+ *   client.on_message{|msg| client.respond(msg, Time.now.utc.iso8601) }
+ *
+ */
+static VALUE rb_mosquitto_client_respond(VALUE obj, VALUE request, VALUE payload)
+{
+    const char *reply_topic;
+    const void *body;
+    int body_len;
+    MosquittoGetClient(obj);
+    MosquittoGetMessage(request);
+    Check_Type(payload, T_STRING);
+    if (!mosquitto_rpc_envelope(message->msg, &reply_topic, &body, &body_len)) rb_raise(rb_eArgError, "message is not a request");
+    return rb_mosquitto_client_publish(obj, Qnil, rb_str_new2(reply_topic), payload, INT2NUM(message->msg->qos), Qfalse);
+}
+
+/*
+ * call-seq:
+ *   client.request_stats -> Hash or nil
+ *
+ * Request / response counters, nil if Mosquitto::Client#request was never called. Unsent requests were dropped
+ * by a rate limit or failed to publish, timeouts were published but never replied to. Orphans are replies that
+ * arrived after their request timed out.
+ *
+ * @return [Hash, nil] request counters
+ * @example
+ *   client.request_stats -> {:pending => 2, :requests => 1000, :replies => 996, :timeouts => 1, :unsent => 1, :failures => 0, :orphans => 1}
+ *
+ */
+static VALUE rb_mosquitto_client_request_stats(VALUE obj)
+{
+    VALUE stats;
+    unsigned long requests, replies, timeouts, unsent, failures, orphans;
+    int pending;
+    MosquittoGetClient(obj);
+    if (client->rpc == NULL) return Qnil;
+    pthread_mutex_lock(&client->rpc->mutex);
+    pending = client->rpc->pending->count;
+    requests = client->rpc->requests;
+    replies = client->rpc->replies;
+    timeouts = client->rpc->timeouts;
+    unsent = client->rpc->unsent;
+    failures = client->rpc->failures;
+    orphans = client->rpc->orphans;
+    pthread_mutex_unlock(&client->rpc->mutex);
+    stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("pending")), INT2NUM(pending));
+    rb_hash_aset(stats, ID2SYM(rb_intern("requests")), ULONG2NUM(requests));
+    rb_hash_aset(stats, ID2SYM(rb_intern("replies")), ULONG2NUM(replies));
+    rb_hash_aset(stats, ID2SYM(rb_intern("timeouts")), ULONG2NUM(timeouts));
+    rb_hash_aset(stats, ID2SYM(rb_intern("unsent")), ULONG2NUM(unsent));
+    rb_hash_aset(stats, ID2SYM(rb_intern("failures")), ULONG2NUM(failures));
+    rb_hash_aset(stats, ID2SYM(rb_intern("orphans")), ULONG2NUM(orphans));
+    return stats;
+}
+
+/*
+ * call-seq:
+ *   client.callback_spin_us = 50 -> Integer
+ *
+ * Busy poll the callback queue for up to the given number of microseconds before the callback thread parks
+ * on a condition variable. Callbacks arriving within that window skip the futex wake-up and scheduler hop,
+ * which shaves tens of microseconds off dispatch latency at the cost of a spinning core. Zero (the default)
+ * parks right away.
+ *
+ * Only applicable to clients that run with the threaded Mosquitto::Client#loop_start event loop.
+ *
+ * @param spin_us [Integer] spin time in microseconds
+ * @return [Integer] spin time in microseconds
+ * @raise [TypeError, ArgumentError] on invalid spin times
+ * @see Mosquitto::Client#callback_latency
+ * @example
+ *   client.callback_spin_us = 50
+ *
+ */
+static VALUE rb_mosquitto_client_callback_spin_us_set(VALUE obj, VALUE spin_us)
+{
+    MosquittoGetClient(obj);
+    Check_Type(spin_us, T_FIXNUM);
+    if (NUM2LONG(spin_us) < 0) rb_raise(rb_eArgError, "spin time must not be negative");
+    client->spin_us = NUM2LONG(spin_us);
+    return spin_us;
+}
+
+/*
+ * call-seq:
+ *   client.callback_spin_us -> Integer
+ *
+ * Time in microseconds the callback thread busy polls for callbacks before parking.
+ *
+ * @return [Integer] spin time in microseconds
+ * @see Mosquitto::Client#callback_spin_us=
+ *
+ */
+static VALUE rb_mosquitto_client_callback_spin_us(VALUE obj)
+{
+    MosquittoGetClient(obj);
+    return LONG2NUM(client->spin_us);
+}
+
+/*
+ * :nodoc:
+ *  Upper bound in microseconds of the histogram bucket holding the given percentile.
+ *
+ */
+static unsigned long rb_mosquitto_latency_percentile(unsigned long *histogram, unsigned long count, double percentile)
 {
-    struct nogvl_subscribe_args *args = ptr;
-    return (VALUE)mosquitto_subscribe(args->mosq, args->mid, args->subscription, args->qos);
+    unsigned long seen = 0, rank = (unsigned long)(count * percentile / 100.0);
+    int bucket;
+    if (rank == 0) rank = 1;
+    for (bucket = 0; bucket < MOSQ_LATENCY_BUCKETS; bucket++) {
+        seen += histogram[bucket];
+        if (seen >= rank) return 1UL << bucket;
+    }
+    return 1UL << (MOSQ_LATENCY_BUCKETS - 1);
 }
 
 /*
  * call-seq:
- *   client.subscribe(3, "subscribe", Mosquitto::AT_MOST_ONCE) -> Boolean
+ *   client.callback_latency -> Hash
+ *   client.callback_latency(true) -> Hash
  *
- * Subscribe to a topic.
+ * Distribution of the time callbacks spent queued between the libmosquitto network thread and their handler on
+ * the callback thread, in microseconds - including time spent behind earlier callbacks of the same batch.
+ * Percentiles are upper bounds of power of two histogram buckets.
  *
- * @param mid [Integer, nil] If not nil, the function will set this to the message id of this particular message.
- *                           This can be then used with the subscribe callback to determine when the message has been
- *                           sent.
- * @param subscription [String] The subscription pattern
- * @param qos [Mosquitto::AT_MOST_ONCE, Mosquitto::AT_LEAST_ONCE, Mosquitto::EXACTLY_ONCE] Quality of Service to be
- *            used for the subscription
- * @return [true] on success
- * @raise [Mosquitto::Error, SystemCallError] on invalid input params or system call errors
+ * @param reset [true, false] reset the counters after reading them
+ * @return [Hash] latency distribution
  * @example
- *   client.subscribe(3, "subscribe", Mosquitto::AT_MOST_ONCE)
+ *   client.callback_latency -> {:count => 10000, :p50 => 16, :p90 => 32, :p99 => 128, :p999 => 512, :max => 431,
+ *                               :histogram => {8 => 1200, 16 => 6000, ...}}
  *
  */
-static VALUE rb_mosquitto_client_subscribe(VALUE obj, VALUE mid, VALUE subscription, VALUE qos)
+static VALUE rb_mosquitto_client_callback_latency(int argc, VALUE *argv, VALUE obj)
 {
-    struct nogvl_subscribe_args args;
-    int ret, msg_id;
-    struct timeval time;
-    bool retried = false;
+    VALUE reset, stats, buckets;
+    unsigned long histogram[MOSQ_LATENCY_BUCKETS];
+    unsigned long count = 0, max = 0;
+    int bucket;
     MosquittoGetClient(obj);
-    Check_Type(subscription, T_STRING);
-    MosquittoEncode(subscription);
-    Check_Type(qos, T_FIXNUM);
-    if (!NIL_P(mid)) {
-        Check_Type(mid, T_FIXNUM);
-        msg_id = NUM2INT(mid);
+    rb_scan_args(argc, argv, "01", &reset);
+    memset(histogram, 0, sizeof(histogram));
+    if (!NIL_P(client->callback_thread)) pthread_mutex_lock(&client->callback_mutex);
+    memcpy(histogram, client->latency_histogram, sizeof(histogram));
+    count = client->latency_count;
+    max = client->latency_max_us;
+    if (RTEST(reset)) {
+        memset(client->latency_histogram, 0, sizeof(client->latency_histogram));
+        client->latency_count = 0;
+        client->latency_max_us = 0;
     }
-    args.mosq = client->mosq;
-    args.mid = NIL_P(mid) ? NULL : &msg_id;
-    args.subscription = StringValueCStr(subscription);
-    args.qos = NUM2INT(qos);
-  retry_once:
-    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_subscribe_nogvl, (void *)&args, RUBY_UBF_IO, 0);
-    switch (ret) {
-       case MOSQ_ERR_INVAL:
-           MosquittoError("invalid input params");
-           break;
-       case MOSQ_ERR_NOMEM:
-           rb_memerror();
-           break;
-       case MOSQ_ERR_NO_CONN:
-           RetryNotConnectedOnce();
-           MosquittoError("client not connected to broker");
-           break;
-       default:
-           return Qtrue;
+    if (!NIL_P(client->callback_thread)) pthread_mutex_unlock(&client->callback_mutex);
+    stats = rb_hash_new();
+    buckets = rb_hash_new();
+    for (bucket = 0; bucket < MOSQ_LATENCY_BUCKETS; bucket++) {
+        if (histogram[bucket] > 0) rb_hash_aset(buckets, ULONG2NUM(1UL << bucket), ULONG2NUM(histogram[bucket]));
     }
-}
-
-static void *rb_mosquitto_client_unsubscribe_nogvl(void *ptr)
-{
-    struct nogvl_subscribe_args *args = ptr;
-    return (VALUE)mosquitto_unsubscribe(args->mosq, args->mid, args->subscription);
+    rb_hash_aset(stats, ID2SYM(rb_intern("count")), ULONG2NUM(count));
+    if (count > 0) {
+        rb_hash_aset(stats, ID2SYM(rb_intern("p50")), ULONG2NUM(rb_mosquitto_latency_percentile(histogram, count, 50)));
+        rb_hash_aset(stats, ID2SYM(rb_intern("p90")), ULONG2NUM(rb_mosquitto_latency_percentile(histogram, count, 90)));
+        rb_hash_aset(stats, ID2SYM(rb_intern("p99")), ULONG2NUM(rb_mosquitto_latency_percentile(histogram, count, 99)));
+        rb_hash_aset(stats, ID2SYM(rb_intern("p999")), ULONG2NUM(rb_mosquitto_latency_percentile(histogram, count, 99.9)));
+    }
+    rb_hash_aset(stats, ID2SYM(rb_intern("max")), ULONG2NUM(max));
+    rb_hash_aset(stats, ID2SYM(rb_intern("histogram")), buckets);
+    return stats;
 }
 
 /*
  * call-seq:
- *   client.unsubscribe(3, "unsubscribe") -> Boolean
+ *   client.expired_messages -> Integer
  *
- * Unsubscribe from a topic.
+ * Number of messages discarded from the callback queue for exceeding their max age.
  *
- * @param mid [Integer, nil] If not nil, the function will set this to the message id of this particular message.
- *                           This can be then used with the unsubscribe callback to determine when the message has been
- *                           sent.
- * @param subscription [String] the unsubscription pattern.
- * @return [true] on success
- * @raise [Mosquitto::Error, SystemCallError] on invalid input params or system call errors
+ * @return [Integer] expired message count
  * @example
- *   client.unsubscribe(3, "unsubscribe")
+ *   client.expired_messages -> 12
  *
  */
-static VALUE rb_mosquitto_client_unsubscribe(VALUE obj, VALUE mid, VALUE subscription)
+static VALUE rb_mosquitto_client_expired_messages(VALUE obj)
 {
-    struct nogvl_subscribe_args args;
-    int ret, msg_id;
-    struct timeval time;
-    bool retried = false;
+    unsigned long expired;
     MosquittoGetClient(obj);
-    Check_Type(subscription, T_STRING);
-    MosquittoEncode(subscription);
-    if (!NIL_P(mid)) {
-        Check_Type(mid, T_FIXNUM);
-        msg_id = NUM2INT(mid);
-    }
-    args.mosq = client->mosq;
-    args.mid = NIL_P(mid) ? NULL : &msg_id;
-    args.subscription = StringValueCStr(subscription);
-  retry_once:
-    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_unsubscribe_nogvl, (void *)&args, RUBY_UBF_IO, 0);
-    switch (ret) {
-       case MOSQ_ERR_INVAL:
-           MosquittoError("invalid input params");
-           break;
-       case MOSQ_ERR_NOMEM:
-           rb_memerror();
-           break;
-       case MOSQ_ERR_NO_CONN:
-           RetryNotConnectedOnce();
-           MosquittoError("client not connected to broker");
-           break;
-       default:
-           return Qtrue;
-    }
+    if (!NIL_P(client->callback_thread)) pthread_mutex_lock(&client->callback_mutex);
+    expired = client->expired;
+    if (!NIL_P(client->callback_thread)) pthread_mutex_unlock(&client->callback_mutex);
+    return ULONG2NUM(expired);
 }
 
 /*
@@ -1487,9 +4326,24 @@ static void *rb_mosquitto_client_loop_forever_nogvl(void *ptr)
     return (VALUE)mosquitto_loop_forever(args->mosq, args->timeout, args->max_packets);
 }
 
+/*
+ * :nodoc:
+ *  Tracks whether Mosquitto::Client#loop_forever runs - rb_mosquitto_client_check_target only stops
+ *  libmosquitto's loop if something restarts it.
+ *
+ */
+static void rb_mosquitto_client_looping_forever(mosquitto_client_wrapper *client, bool looping)
+{
+    pthread_mutex_lock(&client->target.mutex);
+    client->target.looping_forever = looping;
+    if (!looping) client->target.retarget = false;
+    pthread_mutex_unlock(&client->target.mutex);
+}
+
 static void rb_mosquitto_client_loop_forever_ubf(void *ptr)
 {
     mosquitto_client_wrapper *client = (mosquitto_client_wrapper *)ptr;
+    rb_mosquitto_client_looping_forever(client, false);
     mosquitto_disconnect(client->mosq);
 }
 
@@ -1525,8 +4379,13 @@ static VALUE rb_mosquitto_client_loop_forever(VALUE obj, VALUE timeout, VALUE ma
     args.mosq = client->mosq;
     args.timeout = NUM2INT(timeout);
     args.max_packets = NUM2INT(max_packets);
+    rb_mosquitto_client_looping_forever(client, true);
   retry_once:
-    ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_loop_forever_nogvl, (void *)&args, rb_mosquitto_client_loop_forever_ubf, client);
+    /* Loops again if a reconnect to a fresh address stopped libmosquitto's loop */
+    do {
+        ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_loop_forever_nogvl, (void *)&args, rb_mosquitto_client_loop_forever_ubf, client);
+    } while (rb_thread_call_without_gvl(rb_mosquitto_client_retarget_nogvl, (void *)client, RUBY_UBF_IO, 0));
+    rb_mosquitto_client_looping_forever(client, false);
     switch (ret) {
        case MOSQ_ERR_INVAL:
            MosquittoError("invalid input params");
@@ -1557,27 +4416,63 @@ static void *rb_mosquitto_client_loop_start_nogvl(void *ptr)
     return (VALUE)mosquitto_loop_start((struct mosquitto *)ptr);
 }
 
+/*
+ * :nodoc:
+ *  Validates a CPU number given as a Mosquitto::Client#loop_start option.
+ *
+ */
+static int rb_mosquitto_client_loop_cpu(VALUE opts, const char *name)
+{
+    VALUE cpu = rb_hash_aref(opts, ID2SYM(rb_intern(name)));
+    if (NIL_P(cpu)) return -1;
+    Check_Type(cpu, T_FIXNUM);
+    if (NUM2INT(cpu) < 0 || NUM2INT(cpu) >= mosquitto_cpu_count()) rb_raise(rb_eArgError, "no such CPU: %d", NUM2INT(cpu));
+    if (!mosquitto_thread_affinity_supported()) rb_raise(rb_eNotImpError, "CPU affinity is not supported on this platform");
+    return NUM2INT(cpu);
+}
+
 /*
  * call-seq:
  *   client.loop_start -> Boolean
+ *   client.loop_start(:cpu => 2, :callback_cpu => 3) -> Boolean
  *
  * This is part of the threaded client interface. Call this once to start a new
  * thread to process network traffic. This provides an alternative to repeatedly calling
  * Mosquitto::Client#loop yourself.
  *
+ * The network thread and the callback thread are named "mosq-net:<client id>" and "mosq-cb:<client id>"
+ * (truncated to 15 characters on Linux) for readable profiler and top output. Either can be pinned to
+ * a CPU. The network thread names and pins itself on the first successful connect.
+ *
+ * @param opts [Hash] thread placement options
+ * @option opts [Integer] :cpu CPU to pin the libmosquitto network thread to
+ * @option opts [Integer] :callback_cpu CPU to pin the callback thread to
  * @return [true] on success
  * @raise [Mosquitto::Error] on invalid input params or if thread support is not available
+ * @raise [ArgumentError] on invalid CPU numbers
+ * @raise [NotImplementedError] if CPU affinity is not supported on this platform
  * @example
  *   client.loop_start
+ *   client.loop_start(:cpu => 2, :callback_cpu => 3)
  *
  */
-static VALUE rb_mosquitto_client_loop_start(VALUE obj)
+static VALUE rb_mosquitto_client_loop_start(int argc, VALUE *argv, VALUE obj)
 {
-    int ret;
+    VALUE opts;
+    int ret, net_cpu = -1, callback_cpu = -1;
     struct timeval time;
     MosquittoGetClient(obj);
+    rb_scan_args(argc, argv, "01", &opts);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        net_cpu = rb_mosquitto_client_loop_cpu(opts, "cpu");
+        callback_cpu = rb_mosquitto_client_loop_cpu(opts, "callback_cpu");
+    }
     /* Let's not spawn duplicate threaded loops */
     if (!NIL_P(client->callback_thread)) return Qtrue;
+    client->net_cpu = net_cpu;
+    client->callback_cpu = callback_cpu;
+    client->net_thread_tuned = false;
     ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_loop_start_nogvl, (void *)client->mosq, RUBY_UBF_IO, 0);
     switch (ret) {
        case MOSQ_ERR_INVAL:
@@ -1588,6 +4483,10 @@ static VALUE rb_mosquitto_client_loop_start(VALUE obj)
            break;
        default:
            client->waiter = MOSQ_ALLOC(mosquitto_callback_waiting_t);
+           if (client->waiter == NULL) {
+               mosquitto_loop_stop(client->mosq, true);
+               rb_memerror();
+           }
            if (pthread_mutex_init(&client->callback_mutex, NULL) != 0) MosquittoError("failed to create callback thread mutex");
            if (pthread_cond_init(&client->callback_cond, NULL) != 0) MosquittoError("failed to create callback thread condition var");
            client->callback_thread = rb_thread_create(rb_mosquitto_callback_thread, client);
@@ -1615,7 +4514,8 @@ static void rb_mosquitto_client_reap_event_thread(mosquitto_client_wrapper *clie
     rb_thread_wait_for(time);
     if (pthread_mutex_destroy(&client->callback_mutex) == EINVAL) MosquittoError("could not destroy callback thread mutex");
     if (pthread_cond_destroy(&client->callback_cond) == EINVAL) MosquittoError("could not destroy callback condition var");
-    xfree(client->waiter);
+    free(client->waiter);
+    client->waiter = NULL;
     client->callback_thread = Qnil;
 }
 
@@ -1642,8 +4542,11 @@ static VALUE rb_mosquitto_client_loop_stop(VALUE obj, VALUE force)
     struct nogvl_loop_stop_args args;
     int ret;
     MosquittoGetClient(obj);
+    if (client->forked) MosquittoError("client inherited from the parent process - see Mosquitto::Client#after_fork");
     args.mosq = client->mosq;
     args.force = ((force == Qtrue) ? true : false);
+    rb_mosquitto_client_backoff_cancel(client);
+    rb_mosquitto_client_cancel_retarget(client, false);
     ret = (int)rb_thread_call_without_gvl(rb_mosquitto_client_loop_stop_nogvl, (void *)&args, RUBY_UBF_IO, 0);
     switch (ret) {
        case MOSQ_ERR_INVAL:
@@ -1838,6 +4741,118 @@ static VALUE rb_mosquitto_client_want_write(VALUE obj)
 static VALUE rb_mosquitto_client_destroy(VALUE obj)
 {
     MosquittoGetClient(obj);
+    if (client->forked) {
+        rb_mosquitto_client_abandon(client);
+        return Qtrue;
+    }
+    if (!NIL_P(client->callback_thread)) {
+        mosquitto_stop_waiting_for_callbacks(client);
+        mosquitto_loop_stop(client->mosq, true);
+        rb_mosquitto_client_reap_event_thread(client);
+    }
+    mosquitto_destroy(client->mosq);
+    client->mosq = NULL;
+    return Qtrue;
+}
+
+/*
+ * :nodoc:
+ *  Drops the libmosquitto handle and callback thread state a forked child inherited. The parent's network thread
+ *  doesn't exist in the child and mosquitto_destroy would join it - the child closes its copy of the socket and
+ *  leaks the rest of the handle. The parent's connection is left untouched.
+ *
+ */
+static void rb_mosquitto_client_abandon(mosquitto_client_wrapper *client)
+{
+    mosquitto_callback_t *callback;
+    if (client->mosq != NULL && mosquitto_socket(client->mosq) >= 0) close(mosquitto_socket(client->mosq));
+    client->mosq = NULL;
+    if (!NIL_P(client->callback_thread)) {
+        while ((callback = mosquitto_callback_lane_pop(&client->control_lane)) != NULL) {
+            mosquitto_discard_callback(callback);
+        }
+        while ((callback = mosquitto_callback_lane_pop(&client->message_lane)) != NULL) {
+            mosquitto_discard_callback(callback);
+        }
+        /* The batch the callback thread was dispatching when the parent forked */
+        while ((callback = client->waiter->callback) != NULL) {
+            client->waiter->callback = callback->next;
+            mosquitto_discard_callback(callback);
+        }
+        pthread_mutex_destroy(&client->callback_mutex);
+        pthread_cond_destroy(&client->callback_cond);
+        free(client->waiter);
+        client->waiter = NULL;
+        client->callback_thread = Qnil;
+        client->restart_loop = true;
+    }
+    client->forked = false;
+}
+
+/*
+ * :nodoc:
+ *  Client identifier for a forked child - a child connecting with its parent's identifier would take over the
+ *  parent's session, so named clients get the child's pid appended.
+ *
+ */
+static char *rb_mosquitto_client_fork_id(mosquitto_client_wrapper *client, VALUE client_id, char *buf)
+{
+    char suffix[16];
+    int len;
+    if (!NIL_P(client_id)) return StringValueCStr(client_id);
+    if (client->client_id == NULL) return NULL;
+    len = snprintf(suffix, sizeof(suffix), "-%d", (int)getpid());
+    snprintf(buf, MOSQ_CLIENT_ID_MAX + 1, "%.*s%s", MOSQ_CLIENT_ID_MAX - len, client->client_id, suffix);
+    return buf;
+}
+
+/*
+ * :nodoc:
+ *  Replays the settings recorded in the parent on the new handle, restarts the threaded loop and reconnects. Runs
+ *  under rb_protect - any of these may raise and leave the client to be reinitialised again.
+ *
+ */
+static VALUE rb_mosquitto_client_fork_replay(VALUE ptr)
+{
+    struct rb_mosquitto_fork_args *args = (struct rb_mosquitto_fork_args *)ptr;
+    mosquitto_client_wrapper *client = args->client;
+    VALUE keys, key, setting, loop_opts, connect = args->connect;
+    VALUE connect_key = ID2SYM(rb_intern("connect"));
+    long i;
+    if (!NIL_P(client->settings)) {
+        keys = rb_funcall(client->settings, rb_intern("keys"), 0);
+        for (i = 0; i < RARRAY_LEN(keys); i++) {
+            key = RARRAY_PTR(keys)[i];
+            if (key == connect_key) continue;
+            setting = rb_hash_aref(client->settings, key);
+            rb_funcall2(args->obj, SYM2ID(key), (int)RARRAY_LEN(setting), RARRAY_PTR(setting));
+        }
+    }
+    if (args->threaded) {
+        loop_opts = rb_hash_new();
+        if (client->net_cpu >= 0) rb_hash_aset(loop_opts, ID2SYM(rb_intern("cpu")), INT2NUM(client->net_cpu));
+        if (client->callback_cpu >= 0) rb_hash_aset(loop_opts, ID2SYM(rb_intern("callback_cpu")), INT2NUM(client->callback_cpu));
+        rb_funcall(args->obj, rb_intern("loop_start"), 1, loop_opts);
+    }
+    if (!NIL_P(connect)) {
+        /* connect_async requires the threaded loop, blocking clients connect right away */
+        if (RARRAY_LEN(connect) == 4) {
+            rb_funcall2(args->obj, rb_intern(args->threaded ? "connect_bind_async" : "connect_bind"), 4, RARRAY_PTR(connect));
+        } else {
+            rb_funcall2(args->obj, rb_intern(args->threaded ? "connect_async" : "connect"), 3, RARRAY_PTR(connect));
+        }
+    }
+    return Qnil;
+}
+
+/*
+ * :nodoc:
+ *  Rolls back a failed Mosquitto::Client#after_fork - the new handle and callback thread go away and the client is
+ *  flagged as inherited again, so the caller can retry.
+ *
+ */
+static void rb_mosquitto_client_fork_failed(mosquitto_client_wrapper *client)
+{
     if (!NIL_P(client->callback_thread)) {
         mosquitto_stop_waiting_for_callbacks(client);
         mosquitto_loop_stop(client->mosq, true);
@@ -1845,6 +4860,125 @@ static VALUE rb_mosquitto_client_destroy(VALUE obj)
     }
     mosquitto_destroy(client->mosq);
     client->mosq = NULL;
+    client->forked = true;
+}
+
+/*
+ * call-seq:
+ *   client.after_fork -> Boolean
+ *   client.after_fork(:client_id => "worker-1") -> Boolean
+ *
+ * Reinitialises a client inherited from a parent process in a forked child, giving the child a connection of its
+ * own without paying for a full client setup. Locks and sink buffers are already reset by fork handlers by the time
+ * the child runs - this replaces the libmosquitto handle and restarts what the parent had running :
+ *
+ * * will, credentials, TLS and reconnect settings are applied to the new handle
+ * * the threaded loop is restarted with the same thread placement if the parent called Mosquitto::Client#loop_start
+ * * the client connects to the broker the parent connected to, unless the parent disconnected
+ *
+ * Named clients get the child's pid appended to their identifier - the broker would otherwise hand the parent's
+ * session to the child. Such a session would never be resumed, so it's a clean one - pass :client_id for a
+ * persistent session. Subscriptions are restored on connect with Mosquitto::Client#auto_resubscribe= enabled.
+ * Callbacks, sinks, rate limits, inbound policies and the retained message cache carry over as is. Publish futures,
+ * flush waiters and requests still pending in the parent are failed or dropped in the child.
+ *
+ * If replaying a setting, restarting the loop or connecting raises, the client is left inherited and this can be
+ * called again. On Ruby 3.1 and later this runs in forked children with Mosquitto.auto_after_fork= enabled.
+ *
+ * @param opts [Hash] reinitialisation options
+ * @option opts [String] :client_id identifier for the child's connection, with a persistent session
+ * @option opts [Boolean] :blocking set to false to leave a client without the threaded loop, which would connect
+ *                                  right away, inherited
+ * @return [true, false] true if the client was reinitialised, false if it wasn't inherited from a parent process
+ *                       or would have to connect with :blocking => false
+ * @raise [Mosquitto::Error] on invalid input params or when called from one of the client's own callbacks
+ * @raise [SystemCallError] if reconnecting fails
+ * @see Mosquitto.after_fork
+ * @example
+ *   client = Mosquitto::Client.new("app")
+ *   client.loop_start
+ *   client.connect("localhost", 1883, 10)
+ *   fork do
+ *     client.after_fork
+ *     client.publish(nil, "workers", Process.pid.to_s, Mosquitto::AT_MOST_ONCE, false)
+ *   end
+ *
+ */
+static VALUE rb_mosquitto_client_after_fork(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE opts, client_id = Qnil, blocking = Qtrue;
+    struct rb_mosquitto_fork_args args;
+    struct mosquitto *mosq;
+    char buf[MOSQ_CLIENT_ID_MAX + 1];
+    char *cl_id, *id_copy = NULL;
+    int state = 0;
+    MosquittoGetClient(obj);
+    rb_scan_args(argc, argv, "01", &opts);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        client_id = rb_hash_aref(opts, ID2SYM(rb_intern("client_id")));
+        if (!NIL_P(client_id)) {
+            Check_Type(client_id, T_STRING);
+            MosquittoEncode(client_id);
+        }
+        if (rb_hash_lookup2(opts, ID2SYM(rb_intern("blocking")), Qundef) != Qundef) {
+            blocking = rb_hash_aref(opts, ID2SYM(rb_intern("blocking")));
+        }
+    }
+    if (!client->forked) return Qfalse;
+    args.obj = obj;
+    args.client = client;
+    args.threaded = !NIL_P(client->callback_thread) || client->restart_loop;
+    args.connect = NIL_P(client->settings) ? Qnil : rb_hash_aref(client->settings, ID2SYM(rb_intern("connect")));
+    if (!NIL_P(client->callback_thread) && rb_thread_current() == client->callback_thread) MosquittoError("cannot reinitialise a client from its own callbacks");
+    /* Without the threaded loop the client would connect right here */
+    if (!RTEST(blocking) && !args.threaded && !NIL_P(args.connect)) return Qfalse;
+    cl_id = rb_mosquitto_client_fork_id(client, client_id, buf);
+    if (cl_id && (id_copy = strdup(cl_id)) == NULL) rb_memerror();
+    /* A session keyed by a pid is never resumed - only identifiers given explicitly keep theirs */
+    mosq = mosquitto_new(cl_id, NIL_P(client_id), (void *)client);
+    if (mosq == NULL) {
+        free(id_copy);
+        switch (errno) {
+            case EINVAL:
+                MosquittoError("invalid input params");
+                break;
+            case ENOMEM:
+                rb_memerror();
+                break;
+            default:
+                return Qfalse;
+        }
+    }
+    rb_mosquitto_client_abandon(client);
+    client->mosq = mosq;
+    free(client->client_id);
+    client->client_id = id_copy;
+    pthread_mutex_lock(&mosquitto_future_mutex);
+    if (client->futures != NULL) mosquitto_future_fail_all(client->futures);
+    client->futures_publishing = 0;
+    pthread_mutex_unlock(&mosquitto_future_mutex);
+    pthread_mutex_lock(&client->inflight_mutex);
+    client->inflight = 0;
+    pthread_mutex_unlock(&client->inflight_mutex);
+    if (client->rpc != NULL) mosquitto_rpc_after_fork(client->rpc, client->backoff_seed ^ (unsigned int)getpid());
+    client->backoff_attempts = 0;
+    client->net_thread_tuned = false;
+
+    mosquitto_connect_callback_set(client->mosq, rb_mosquitto_client_on_connect_cb);
+    mosquitto_publish_callback_set(client->mosq, rb_mosquitto_client_on_publish_cb);
+    mosquitto_disconnect_callback_set(client->mosq, rb_mosquitto_client_on_disconnect_cb);
+    mosquitto_message_callback_set(client->mosq, rb_mosquitto_client_on_message_cb);
+    if (!NIL_P(client->subscribe_cb)) mosquitto_subscribe_callback_set(client->mosq, rb_mosquitto_client_on_subscribe_cb);
+    if (!NIL_P(client->unsubscribe_cb)) mosquitto_unsubscribe_callback_set(client->mosq, rb_mosquitto_client_on_unsubscribe_cb);
+    if (rb_mosquitto_client_wants_log(client)) mosquitto_log_callback_set(client->mosq, rb_mosquitto_client_on_log_cb);
+
+    rb_protect(rb_mosquitto_client_fork_replay, (VALUE)&args, &state);
+    if (state) {
+        rb_mosquitto_client_fork_failed(client);
+        rb_jump_tag(state);
+    }
+    client->restart_loop = false;
     return Qtrue;
 }
 
@@ -1876,6 +5010,7 @@ static VALUE rb_mosquitto_client_destroy(VALUE obj)
                                         Set to true to enable exponential backoff.
  * @return [true] on success
  * @raise [Mosquitto::Error] on invalid input params
+ * @see Mosquitto::Client#reconnect_backoff
  * @example
  *   client.reconnect_delay_set(2, 10, true)
  *
@@ -1886,16 +5021,123 @@ static VALUE rb_mosquitto_client_reconnect_delay_set(VALUE obj, VALUE delay, VAL
     MosquittoGetClient(obj);
     Check_Type(delay, T_FIXNUM);
     Check_Type(delay_max, T_FIXNUM);
-    ret = mosquitto_reconnect_delay_set(client->mosq, INT2NUM(delay), INT2NUM(delay_max), ((exp_backoff == Qtrue) ? true : false));
+    ret = mosquitto_reconnect_delay_set(client->mosq, NUM2INT(delay), NUM2INT(delay_max), ((exp_backoff == Qtrue) ? true : false));
     switch (ret) {
        case MOSQ_ERR_INVAL:
            MosquittoError("invalid input params");
            break;
        default:
+           rb_mosquitto_client_remember(client, "reconnect_delay_set", rb_ary_new3(3, delay, delay_max, exp_backoff));
            return Qtrue;
     }
 }
 
+/*
+ * :nodoc:
+ *  Reads an integer socket option from a Hash, or a boolean one if as_bool is set. Returns -1 if not present.
+ *
+ */
+static int rb_mosquitto_socket_option(VALUE opts, const char *name, bool as_bool)
+{
+    VALUE value = rb_hash_aref(opts, ID2SYM(rb_intern(name)));
+    if (NIL_P(value)) return -1;
+    if (as_bool) return RTEST(value) ? 1 : 0;
+    Check_Type(value, T_FIXNUM);
+    if (NUM2INT(value) < 0) rb_raise(rb_eArgError, "socket option :%s must not be negative", name);
+    return NUM2INT(value);
+}
+
+/*
+ * call-seq:
+ *   client.socket_options = {:nodelay => true, :sndbuf => 1 << 20} -> Hash
+ *
+ * Tune the client's TCP socket. Options are applied on every connect and reconnect, including libmosquitto's
+ * automatic reconnects, as soon as the socket is connected and before the MQTT CONNECT packet goes out - and
+ * immediately if the client is connected. Options not given keep the system defaults, or revert to them on a
+ * connected client.
+ *
+ * libmosquitto creates and connects the socket itself, so buffer sizes can't take part in the TCP handshake :
+ * the window scale is negotiated before :rcvbuf applies. Linux derives it from net.ipv4.tcp_rmem and
+ * net.core.rmem_max - raise those for windows beyond 64KB with a high bandwidth delay product.
+ *
+ * :nodelay      - disable Nagle's algorithm (TCP_NODELAY), for low latency small publishes
+ * :sndbuf       - send buffer size in bytes (SO_SNDBUF)
+ * :rcvbuf       - receive buffer size in bytes (SO_RCVBUF)
+ * :busy_poll    - busy poll the device queue for this many microseconds on reads (SO_BUSY_POLL, Linux)
+ * :user_timeout - drop the connection if sent data stays unacknowledged for this many milliseconds
+ *                 (TCP_USER_TIMEOUT, Linux)
+ * :keepalive    - enable TCP keepalive probes (SO_KEEPALIVE)
+ * :keepidle     - seconds of idle time before the first keepalive probe (TCP_KEEPIDLE)
+ * :keepintvl    - seconds between keepalive probes (TCP_KEEPINTVL)
+ * :keepcnt      - unanswered probes before the connection is dropped (TCP_KEEPCNT)
+ *
+ * Options unsupported by the platform are ignored.
+ *
+ * @param options [Hash] socket options
+ * @return [Hash] socket options
+ * @raise [TypeError, ArgumentError] on invalid options
+ * @raise [SystemCallError] if the client is connected and the system rejected an option
+ * @example
+ *   client.socket_options = {:nodelay => true, :keepalive => true, :keepidle => 30}
+ *
+ */
+static VALUE rb_mosquitto_client_socket_options_set(VALUE obj, VALUE opts)
+{
+    mosquitto_socket_options_t options, previous;
+    MosquittoGetClient(obj);
+    Check_Type(opts, T_HASH);
+    options.nodelay = rb_mosquitto_socket_option(opts, "nodelay", true);
+    options.sndbuf = rb_mosquitto_socket_option(opts, "sndbuf", false);
+    options.rcvbuf = rb_mosquitto_socket_option(opts, "rcvbuf", false);
+    options.busy_poll = rb_mosquitto_socket_option(opts, "busy_poll", false);
+    options.user_timeout = rb_mosquitto_socket_option(opts, "user_timeout", false);
+    options.keepalive = rb_mosquitto_socket_option(opts, "keepalive", true);
+    options.keepidle = rb_mosquitto_socket_option(opts, "keepidle", false);
+    options.keepintvl = rb_mosquitto_socket_option(opts, "keepintvl", false);
+    options.keepcnt = rb_mosquitto_socket_option(opts, "keepcnt", false);
+    previous = client->socket_options;
+    client->socket_options = options;
+    if (mosquitto_socket_options_set(&options)) mosquitto_log_callback_set(client->mosq, rb_mosquitto_client_on_log_cb);
+    if (mosquitto_socket_options_reapply(mosquitto_socket(client->mosq), &previous, &options) != 0) rb_sys_fail("setsockopt");
+    return opts;
+}
+
+/*
+ * call-seq:
+ *   client.reconnect_backoff(0.5, 30) -> Boolean
+ *
+ * Randomize automatic reconnects after an unexpected disconnect with "full jitter" exponential backoff : each
+ * reconnect waits a random duration between zero and min(cap, base * 2 ^ attempt). The attempt counter resets
+ * on a successful connection. Clients that lose a broker at the same time then come back spread out instead
+ * of in synchronized waves. Reconnects are also paced by Mosquitto.connect_rate_limit, if set. A pending delay
+ * is cut short by Mosquitto::Client#disconnect and Mosquitto::Client#loop_stop.
+ *
+ * The delay is added in front of libmosquitto's own reconnect delay, which still applies between failed
+ * attempts - combine with a small Mosquitto::Client#reconnect_delay_set delay.
+ *
+ * @param base [Integer, Float, nil] base delay in seconds, nil or 0 to disable
+ * @param cap [Integer, Float] max delay in seconds
+ * @return [true] on success
+ * @raise [ArgumentError] on invalid delays
+ * @see Mosquitto.connect_rate_limit
+ * @example
+ *   client.reconnect_delay_set(1, 1, false)
+ *   client.reconnect_backoff(0.5, 30)
+ *
+ */
+static VALUE rb_mosquitto_client_reconnect_backoff(VALUE obj, VALUE base, VALUE cap)
+{
+    long base_ms = 0, cap_ms;
+    MosquittoGetClient(obj);
+    if (!NIL_P(base)) base_ms = (long)(NUM2DBL(base) * 1000);
+    cap_ms = (long)(NUM2DBL(cap) * 1000);
+    if (base_ms < 0 || cap_ms < base_ms) rb_raise(rb_eArgError, "expected 0 <= base <= cap");
+    client->backoff_base_ms = base_ms;
+    client->backoff_cap_ms = cap_ms;
+    client->backoff_attempts = 0;
+    return Qtrue;
+}
+
 /*
  * call-seq:
  *   client.max_inflight_messages = 10 -> Boolean
@@ -1929,6 +5171,7 @@ static VALUE rb_mosquitto_client_max_inflight_messages_equals(VALUE obj, VALUE m
            MosquittoError("invalid input params");
            break;
        default:
+           rb_mosquitto_client_remember(client, "max_inflight_messages=", rb_ary_new3(1, max_messages));
            return Qtrue;
     }
 }
@@ -1952,6 +5195,7 @@ static VALUE rb_mosquitto_client_message_retry_equals(VALUE obj, VALUE seconds)
     MosquittoGetClient(obj);
     Check_Type(seconds, T_FIXNUM);
     mosquitto_message_retry_set(client->mosq, INT2NUM(seconds));
+    rb_mosquitto_client_remember(client, "message_retry=", rb_ary_new3(1, seconds));
     return Qtrue;
 }
 
@@ -1979,10 +5223,8 @@ static VALUE rb_mosquitto_client_on_connect(int argc, VALUE *argv, VALUE obj)
     MosquittoGetClient(obj);
     rb_scan_args(argc, argv, "01&", &proc, &cb);
     MosquittoAssertCallback(cb, 1);
-    if (!NIL_P(client->connect_cb)) rb_gc_unregister_address(&client->connect_cb);
     mosquitto_connect_callback_set(client->mosq, rb_mosquitto_client_on_connect_cb);
     client->connect_cb = cb;
-    rb_gc_register_address(&client->connect_cb);
     return Qtrue;
 }
 
@@ -2009,10 +5251,8 @@ static VALUE rb_mosquitto_client_on_disconnect(int argc, VALUE *argv, VALUE obj)
     MosquittoGetClient(obj);
     rb_scan_args(argc, argv, "01&", &proc, &cb);
     MosquittoAssertCallback(cb, 1);
-    if (!NIL_P(client->disconnect_cb)) rb_gc_unregister_address(&client->disconnect_cb);
     mosquitto_disconnect_callback_set(client->mosq, rb_mosquitto_client_on_disconnect_cb);
     client->disconnect_cb = cb;
-    rb_gc_register_address(&client->disconnect_cb);
     return Qtrue;
 }
 
@@ -2037,10 +5277,8 @@ static VALUE rb_mosquitto_client_on_publish(int argc, VALUE *argv, VALUE obj)
     MosquittoGetClient(obj);
     rb_scan_args(argc, argv, "01&", &proc, &cb);
     MosquittoAssertCallback(cb, 1);
-    if (!NIL_P(client->publish_cb)) rb_gc_unregister_address(&client->publish_cb);
     mosquitto_publish_callback_set(client->mosq, rb_mosquitto_client_on_publish_cb);
     client->publish_cb = cb;
-    rb_gc_register_address(&client->publish_cb);
     return Qtrue;
 }
 
@@ -2065,13 +5303,55 @@ static VALUE rb_mosquitto_client_on_message(int argc, VALUE *argv, VALUE obj)
     MosquittoGetClient(obj);
     rb_scan_args(argc, argv, "01&", &proc, &cb);
     MosquittoAssertCallback(cb, 1);
-    if (!NIL_P(client->message_cb)) rb_gc_unregister_address(&client->message_cb);
     mosquitto_message_callback_set(client->mosq, rb_mosquitto_client_on_message_cb);
     client->message_cb = cb;
-    rb_gc_register_address(&client->message_cb);
     return Qtrue;
 }
 
+/*
+ * call-seq:
+ *   client.borrow_messages = true -> Boolean
+ *
+ * Hand Mosquitto::Client#on_message handlers a borrowed flyweight message instead of allocating a new
+ * Mosquitto::Message per delivery. The same object is rebound to each incoming message and is only valid until
+ * the handler returns - any use afterwards raises Mosquitto::Error. Handlers that keep messages around have
+ * to retain a copy with Mosquitto::Message#dup. Strings returned by the message readers are regular, owned
+ * objects.
+ *
+ * Disabled by default.
+ *
+ * @param borrow [true, false] whether to borrow messages
+ * @return [true, false] the setting
+ * @see Mosquitto::Message#dup
+ * @example
+ *   client.borrow_messages = true
+ *   client.on_message{|msg| counts[msg.topic] += 1 }
+ *
+ */
+static VALUE rb_mosquitto_client_borrow_messages_set(VALUE obj, VALUE borrow)
+{
+    MosquittoGetClient(obj);
+    client->borrow_messages = RTEST(borrow);
+    return borrow;
+}
+
+/*
+ * call-seq:
+ *   client.borrow_messages? -> Boolean
+ *
+ * Whether on_message handlers receive a borrowed flyweight message.
+ *
+ * @return [true, false] the setting
+ * @example
+ *   client.borrow_messages? -> true
+ *
+ */
+static VALUE rb_mosquitto_client_borrow_messages_p(VALUE obj)
+{
+    MosquittoGetClient(obj);
+    return client->borrow_messages ? Qtrue : Qfalse;
+}
+
 /*
  * call-seq:
  *   client.on_subscribe{|mid, granted_qos| p :subscribed } -> Boolean
@@ -2095,10 +5375,8 @@ static VALUE rb_mosquitto_client_on_subscribe(int argc, VALUE *argv, VALUE obj)
     MosquittoGetClient(obj);
     rb_scan_args(argc, argv, "01&", &proc, &cb);
     MosquittoAssertCallback(cb, 2);
-    if (!NIL_P(client->subscribe_cb)) rb_gc_unregister_address(&client->subscribe_cb);
     mosquitto_subscribe_callback_set(client->mosq, rb_mosquitto_client_on_subscribe_cb);
     client->subscribe_cb = cb;
-    rb_gc_register_address(&client->subscribe_cb);
     return Qtrue;
 }
 
@@ -2124,10 +5402,8 @@ static VALUE rb_mosquitto_client_on_unsubscribe(int argc, VALUE *argv, VALUE obj
     MosquittoGetClient(obj);
     rb_scan_args(argc, argv, "01&", &proc, &cb);
     MosquittoAssertCallback(cb, 1);
-    if (!NIL_P(client->unsubscribe_cb)) rb_gc_unregister_address(&client->unsubscribe_cb);
     mosquitto_unsubscribe_callback_set(client->mosq, rb_mosquitto_client_on_unsubscribe_cb);
     client->unsubscribe_cb = cb;
-    rb_gc_register_address(&client->unsubscribe_cb);
     return Qtrue;
 }
 
@@ -2154,10 +5430,8 @@ static VALUE rb_mosquitto_client_on_log(int argc, VALUE *argv, VALUE obj)
     MosquittoGetClient(obj);
     rb_scan_args(argc, argv, "01&", &proc, &cb);
     MosquittoAssertCallback(cb, 2);
-    if (!NIL_P(client->log_cb)) rb_gc_unregister_address(&client->log_cb);
     mosquitto_log_callback_set(client->mosq, rb_mosquitto_client_on_log_cb);
     client->log_cb = cb;
-    rb_gc_register_address(&client->log_cb);
     return Qtrue;
 }
 
@@ -2165,6 +5439,9 @@ void _init_rb_mosquitto_client()
 {
     mosquitto_tls_password = Qnil;
 
+    /* Quiesce clients across fork(2) - see Mosquitto::Client#after_fork */
+    pthread_atfork(mosquitto_atfork_prepare, mosquitto_atfork_parent, mosquitto_atfork_child);
+
     rb_cMosquittoClient = rb_define_class_under(rb_mMosquitto, "Client", rb_cObject);
 
     /* Init / setup specific methods */
@@ -2187,14 +5464,49 @@ void _init_rb_mosquitto_client()
     /* Messaging specific methods */
 
     rb_define_method(rb_cMosquittoClient, "publish", rb_mosquitto_client_publish, 5);
+    rb_define_method(rb_cMosquittoClient, "publish_async", rb_mosquitto_client_publish_async, 4);
+    rb_define_method(rb_cMosquittoClient, "flush", rb_mosquitto_client_flush, -1);
+    rb_define_method(rb_cMosquittoClient, "inflight", rb_mosquitto_client_inflight, 0);
+    rb_define_method(rb_cMosquittoClient, "rate_limit", rb_mosquitto_client_rate_limit, -1);
+    rb_define_method(rb_cMosquittoClient, "remove_rate_limit", rb_mosquitto_client_remove_rate_limit, 1);
+    rb_define_method(rb_cMosquittoClient, "throttle_stats", rb_mosquitto_client_throttle_stats, 0);
+    rb_define_method(rb_cMosquittoClient, "inbound_policy", rb_mosquitto_client_inbound_policy, 2);
+    rb_define_method(rb_cMosquittoClient, "remove_inbound_policy", rb_mosquitto_client_remove_inbound_policy, 1);
+    rb_define_method(rb_cMosquittoClient, "inbound_stats", rb_mosquitto_client_inbound_stats, 0);
+    rb_define_method(rb_cMosquittoClient, "max_age_ms=", rb_mosquitto_client_max_age_ms_set, 1);
+    rb_define_method(rb_cMosquittoClient, "max_age_ms", rb_mosquitto_client_max_age_ms, 0);
+    rb_define_method(rb_cMosquittoClient, "expired_messages", rb_mosquitto_client_expired_messages, 0);
+    rb_define_method(rb_cMosquittoClient, "retain_cache", rb_mosquitto_client_retain_cache, -1);
+    rb_define_method(rb_cMosquittoClient, "remove_retain_cache", rb_mosquitto_client_remove_retain_cache, 1);
+    rb_define_method(rb_cMosquittoClient, "retained", rb_mosquitto_client_retained, 1);
+    rb_define_method(rb_cMosquittoClient, "retained_snapshot", rb_mosquitto_client_retained_snapshot, -1);
+    rb_define_method(rb_cMosquittoClient, "retain_cache_stats", rb_mosquitto_client_retain_cache_stats, 0);
+    rb_define_method(rb_cMosquittoClient, "request", rb_mosquitto_client_request, -1);
+    rb_define_method(rb_cMosquittoClient, "respond", rb_mosquitto_client_respond, 2);
+    rb_define_method(rb_cMosquittoClient, "request_stats", rb_mosquitto_client_request_stats, 0);
+    rb_define_method(rb_cMosquittoClient, "callback_spin_us=", rb_mosquitto_client_callback_spin_us_set, 1);
+    rb_define_method(rb_cMosquittoClient, "callback_spin_us", rb_mosquitto_client_callback_spin_us, 0);
+    rb_define_method(rb_cMosquittoClient, "callback_latency", rb_mosquitto_client_callback_latency, -1);
     rb_define_method(rb_cMosquittoClient, "subscribe", rb_mosquitto_client_subscribe, 3);
     rb_define_method(rb_cMosquittoClient, "unsubscribe", rb_mosquitto_client_unsubscribe, 2);
+    rb_define_method(rb_cMosquittoClient, "auto_resubscribe=", rb_mosquitto_client_auto_resubscribe_set, 1);
+    rb_define_method(rb_cMosquittoClient, "auto_resubscribe?", rb_mosquitto_client_auto_resubscribe_p, 0);
+    rb_define_method(rb_cMosquittoClient, "subscriptions", rb_mosquitto_client_subscriptions, 0);
+    rb_define_method(rb_cMosquittoClient, "resubscribe_stats", rb_mosquitto_client_resubscribe_stats, 0);
+
+    /* Native sink specific methods */
+
+    rb_define_method(rb_cMosquittoClient, "sink", rb_mosquitto_client_sink, -1);
+    rb_define_method(rb_cMosquittoClient, "unsink", rb_mosquitto_client_unsink, 1);
+    rb_define_method(rb_cMosquittoClient, "flush_sinks", rb_mosquitto_client_flush_sinks, 0);
+    rb_define_method(rb_cMosquittoClient, "sink_stats", rb_mosquitto_client_sink_stats, 0);
+    rb_define_method(rb_cMosquittoClient, "log_to", rb_mosquitto_client_log_to, -1);
 
     /* Main / event loop specific methods */
 
     rb_define_method(rb_cMosquittoClient, "socket", rb_mosquitto_client_socket, 0);
     rb_define_method(rb_cMosquittoClient, "loop", rb_mosquitto_client_loop, 2);
-    rb_define_method(rb_cMosquittoClient, "loop_start", rb_mosquitto_client_loop_start, 0);
+    rb_define_method(rb_cMosquittoClient, "loop_start", rb_mosquitto_client_loop_start, -1);
     rb_define_method(rb_cMosquittoClient, "loop_forever", rb_mosquitto_client_loop_forever, 2);
     rb_define_method(rb_cMosquittoClient, "loop_stop", rb_mosquitto_client_loop_stop, 1);
     rb_define_method(rb_cMosquittoClient, "loop_read", rb_mosquitto_client_loop_read, 1);
@@ -2205,6 +5517,8 @@ void _init_rb_mosquitto_client()
     /* Tuning specific methods */
 
     rb_define_method(rb_cMosquittoClient, "reconnect_delay_set", rb_mosquitto_client_reconnect_delay_set, 3);
+    rb_define_method(rb_cMosquittoClient, "reconnect_backoff", rb_mosquitto_client_reconnect_backoff, 2);
+    rb_define_method(rb_cMosquittoClient, "socket_options=", rb_mosquitto_client_socket_options_set, 1);
     rb_define_method(rb_cMosquittoClient, "max_inflight_messages=", rb_mosquitto_client_max_inflight_messages_equals, 1);
     rb_define_method(rb_cMosquittoClient, "message_retry=", rb_mosquitto_client_message_retry_equals, 1);
 
@@ -2221,11 +5535,17 @@ void _init_rb_mosquitto_client()
     rb_define_method(rb_cMosquittoClient, "on_disconnect", rb_mosquitto_client_on_disconnect, -1);
     rb_define_method(rb_cMosquittoClient, "on_publish", rb_mosquitto_client_on_publish, -1);
     rb_define_method(rb_cMosquittoClient, "on_message", rb_mosquitto_client_on_message, -1);
+    rb_define_method(rb_cMosquittoClient, "borrow_messages=", rb_mosquitto_client_borrow_messages_set, 1);
+    rb_define_method(rb_cMosquittoClient, "borrow_messages?", rb_mosquitto_client_borrow_messages_p, 0);
     rb_define_method(rb_cMosquittoClient, "on_subscribe", rb_mosquitto_client_on_subscribe, -1);
     rb_define_method(rb_cMosquittoClient, "on_unsubscribe", rb_mosquitto_client_on_unsubscribe, -1);
     rb_define_method(rb_cMosquittoClient, "on_log", rb_mosquitto_client_on_log, -1);
 
     /* For integration testing only (will) */
     rb_define_method(rb_cMosquittoClient, "destroy", rb_mosquitto_client_destroy, 0);
+    rb_define_method(rb_cMosquittoClient, "after_fork", rb_mosquitto_client_after_fork, -1);
+    rb_define_module_function(rb_mMosquitto, "inherited_clients", rb_mosquitto_inherited_clients, 0);
+    /* Data pointers of NULL aren't marked */
+    rb_gc_register_mark_object(TypedData_Wrap_Struct(0, &mosquitto_inherited_clients_type, (void *)&mosquitto_clients));
 
 }
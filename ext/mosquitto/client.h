@@ -1,10 +1,37 @@
 #ifndef MOSQUITTO_CLIENT_H
 #define MOSQUITTO_CLIENT_H
 
+/* Queue latency histogram buckets : bucket N counts latencies below 2^N microseconds */
+#define MOSQ_LATENCY_BUCKETS 32
+
 typedef struct mosquitto_callback_t mosquitto_callback_t;
 typedef struct mosquitto_callback_waiting_t mosquitto_callback_waiting_t;
+typedef struct mosquitto_client_wrapper mosquitto_client_wrapper;
 
+/* Where the client last connected to, for reconnecting through the resolver cache once the address expired */
 typedef struct {
+    pthread_mutex_t mutex;
+    char *host;
+    char *bind_address;
+    int port;
+    int keepalive;
+    bool resolve;
+    /* Numeric address libmosquitto reconnects to, empty if connected by hostname */
+    char address[MOSQ_RESOLVER_ADDRSTRLEN];
+    /* Cleared by Mosquitto::Client#disconnect */
+    bool wanted;
+    /* libmosquitto's loop was stopped to reconnect to a fresh address */
+    bool retarget;
+    bool looping_forever;
+} mosquitto_connect_target_t;
+
+/* FIFO of pending callbacks */
+typedef struct {
+    mosquitto_callback_t *head;
+    mosquitto_callback_t *tail;
+} mosquitto_callback_lane_t;
+
+struct mosquitto_client_wrapper {
     struct mosquitto *mosq;
     VALUE connect_cb;
     VALUE disconnect_cb;
@@ -14,15 +41,73 @@ typedef struct {
     VALUE unsubscribe_cb;
     VALUE log_cb;
     VALUE callback_thread;
+    VALUE borrowed_message;
+    bool borrow_messages;
     pthread_mutex_t callback_mutex;
     pthread_cond_t callback_cond;
     mosquitto_callback_waiting_t *waiter;
-    mosquitto_callback_t *callback_queue;
-} mosquitto_client_wrapper;
+    mosquitto_callback_lane_t control_lane;
+    mosquitto_callback_lane_t message_lane;
+    size_t queued_bytes;
+    long spin_us;
+    unsigned long latency_histogram[MOSQ_LATENCY_BUCKETS];
+    unsigned long latency_count;
+    unsigned long latency_max_us;
+    pthread_mutex_t sink_mutex;
+    mosquitto_sink_t *sinks;
+    mosquitto_sink_t *log_sink;
+    int log_mask;
+    bool log_syslog;
+    mosquitto_mid_table_t *futures;
+    int futures_publishing;
+    pthread_mutex_t inflight_mutex;
+    pthread_cond_t inflight_cond;
+    long inflight;
+    mosquitto_bucket_t *buckets;
+    pthread_mutex_t inbound_mutex;
+    mosquitto_inbound_policy_t *inbound_policies;
+    long max_age_ms;
+    unsigned long expired;
+    long backoff_base_ms;
+    long backoff_cap_ms;
+    unsigned int backoff_attempts;
+    unsigned int backoff_seed;
+    pthread_mutex_t backoff_mutex;
+    pthread_cond_t backoff_cond;
+    bool backoff_cancelled;
+    bool tls_certs;
+    bool tls_insecure;
+    mosquitto_socket_options_t socket_options;
+    mosquitto_connect_target_t target;
+    char *client_id;
+    int net_cpu;
+    int callback_cpu;
+    bool net_thread_tuned;
+    pthread_mutex_t retain_mutex;
+    mosquitto_retain_cache_t *retain_cache;
+    mosquitto_rpc_t *rpc;
+    pthread_mutex_t registry_mutex;
+    mosquitto_registry_t registry;
+    bool auto_resubscribe;
+    VALUE settings;
+    bool forked;
+    /* Set while an inherited threaded loop still has to be restarted by Mosquitto::Client#after_fork */
+    bool restart_loop;
+    /* The Ruby object wrapping this client, for walking the list of clients */
+    VALUE self;
+    /* Sink flusher bookkeeping, guarded by the list lock - a client isn't freed while the flusher writes its sinks */
+    unsigned long flush_round;
+    unsigned int flush_refs;
+    /* Process wide list of live clients, walked by the fork handlers */
+    mosquitto_client_wrapper *prev;
+    mosquitto_client_wrapper *next;
+};
+
+extern const rb_data_type_t mosquitto_client_type;
 
 #define MosquittoGetClient(obj) \
     mosquitto_client_wrapper *client = NULL; \
-    Data_Get_Struct(obj, mosquitto_client_wrapper, client); \
+    TypedData_Get_Struct(obj, mosquitto_client_wrapper, &mosquitto_client_type, client); \
     if (!client) rb_raise(rb_eTypeError, "uninitialized Mosquitto client!");
 
 #define RetryNotConnectedOnce() \
@@ -56,6 +141,22 @@ typedef struct {
 #define ON_SUBSCRIBE_CALLBACK 0x08
 #define ON_UNSUBSCRIBE_CALLBACK 0x10
 #define ON_LOG_CALLBACK 0x20
+/* Internal - restarts the threaded loop against a fresh address, see rb_mosquitto_client_check_target */
+#define ON_RETARGET_CALLBACK 0x40
+
+/* MQTT 3.1 limit on client identifier length */
+#define MOSQ_CLIENT_ID_MAX 23
+
+/* Max messages handed to the callback thread per GVL acquisition */
+#define MOSQ_CALLBACK_BATCH_SIZE 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MOSQ_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define MOSQ_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define MOSQ_CPU_RELAX()
+#endif
 
 typedef struct on_connect_callback_args_t on_connect_callback_args_t;
 struct on_connect_callback_args_t {
@@ -75,13 +176,14 @@ struct on_publish_callback_args_t {
 typedef struct on_message_callback_args_t on_message_callback_args_t;
 struct on_message_callback_args_t {
     struct mosquitto_message *msg;
+    long max_age_ms;
 };
 
 typedef struct on_subscribe_callback_args_t on_subscribe_callback_args_t;
 struct on_subscribe_callback_args_t {
     int mid;
     int qos_count;
-    const int *granted_qos;
+    int *granted_qos;
 };
 
 typedef struct on_unsubscribe_callback_args_t on_unsubscribe_callback_args_t;
@@ -99,6 +201,7 @@ struct mosquitto_callback_t {
     int type;
     mosquitto_client_wrapper *client;
     void *data;
+    struct timespec enqueued_at;
     mosquitto_callback_t *next;
 };
 
@@ -108,11 +211,15 @@ struct mosquitto_callback_waiting_t {
 };
 
 struct nogvl_connect_args {
-    struct mosquitto *mosq;
-    char *host;
+    mosquitto_client_wrapper *client;
+    const char *host;
     int port;
     int keepalive;
-    char *bind_address;
+    const char *bind_address;
+    bool resolve;
+    bool async;
+    /* The cached address connected to, empty if connected by hostname */
+    char address[MOSQ_RESOLVER_ADDRSTRLEN];
 };
 
 struct nogvl_loop_stop_args {
@@ -150,6 +257,13 @@ struct nogvl_subscribe_args {
     int qos;
 };
 
+struct rb_mosquitto_fork_args {
+    VALUE obj;
+    mosquitto_client_wrapper *client;
+    VALUE connect;
+    bool threaded;
+};
+
 void _init_rb_mosquitto_client();
 
 #endif
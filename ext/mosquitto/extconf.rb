@@ -42,6 +42,12 @@ end
 (have_header("mosquitto.h") && have_library('mosquitto')) or abort("libmosquitto missing!")
 have_header("pthread.h") or abort('pthread support required!')
 have_macro("LIBMOSQUITTO_VERSION_NUMBER", "mosquitto.h")
+have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+have_func('pthread_setaffinity_np', 'pthread.h')
+have_func('pthread_setname_np', 'pthread.h')
+have_func('pthread_getname_np', 'pthread.h')
+have_func('pthread_condattr_setclock', 'pthread.h')
+have_header('sys/sdt.h')
 
 $defs << "-pedantic"
 $CFLAGS << ' -Wall -funroll-loops'
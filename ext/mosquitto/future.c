@@ -0,0 +1,554 @@
+#include "mosquitto_ext.h"
+
+/*
+ * :nodoc:
+ *  Publish futures - completion objects for Mosquitto::Client#publish_async. Pending futures are tracked in
+ *  a per client open addressing table keyed by message id and resolved from the libmosquitto on_publish and
+ *  on_disconnect callbacks. A single process wide mutex guards all tables and future states, which lets
+ *  Mosquitto.wait_all park on futures spanning several clients. Each waiting thread parks on a condition
+ *  variable of its own, linked into the futures it waits on, and is only signaled once all of them completed.
+ *
+ */
+
+pthread_mutex_t mosquitto_future_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct mosquitto_future_waiter_s {
+    pthread_cond_t cond;
+    long pending;
+};
+
+#define MOSQ_MID_TABLE_INITIAL_CAPACITY 64
+
+static unsigned int mosquitto_mid_table_hash(int key)
+{
+    unsigned int h = (unsigned int)key;
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h;
+}
+
+mosquitto_mid_table_t *mosquitto_mid_table_new(void)
+{
+    mosquitto_mid_table_t *table = MOSQ_ALLOC(mosquitto_mid_table_t);
+    if (table == NULL) return NULL;
+    table->entries = calloc(MOSQ_MID_TABLE_INITIAL_CAPACITY, sizeof(mosquitto_mid_table_entry_t));
+    if (table->entries == NULL) {
+        free(table);
+        return NULL;
+    }
+    table->capacity = MOSQ_MID_TABLE_INITIAL_CAPACITY;
+    table->count = 0;
+    table->used = 0;
+    return table;
+}
+
+void mosquitto_mid_table_free(mosquitto_mid_table_t *table)
+{
+    free(table->entries);
+    free(table);
+}
+
+/*
+ * :nodoc:
+ *  Rehashes into a table of the given capacity, dropping tombstones.
+ *
+ */
+static int mosquitto_mid_table_resize(mosquitto_mid_table_t *table, int capacity)
+{
+    mosquitto_mid_table_entry_t *entries = table->entries;
+    int i, old_capacity = table->capacity;
+    table->entries = calloc(capacity, sizeof(mosquitto_mid_table_entry_t));
+    if (table->entries == NULL) {
+        table->entries = entries;
+        return -1;
+    }
+    table->capacity = capacity;
+    table->count = 0;
+    table->used = 0;
+    for (i = 0; i < old_capacity; i++) {
+        if (entries[i].key > 0) mosquitto_mid_table_insert(table, entries[i].key, entries[i].value);
+    }
+    free(entries);
+    return 0;
+}
+
+int mosquitto_mid_table_insert(mosquitto_mid_table_t *table, int key, void *value)
+{
+    unsigned int i, mask;
+    int tombstone = -1;
+    if ((table->used + 1) * 4 > table->capacity * 3) {
+        if (mosquitto_mid_table_resize(table, (table->count + 1) * 2 > table->capacity ? table->capacity * 2 : table->capacity) != 0) return -1;
+    }
+    mask = table->capacity - 1;
+    for (i = mosquitto_mid_table_hash(key) & mask; ; i = (i + 1) & mask) {
+        if (table->entries[i].key == key) {
+            table->entries[i].value = value;
+            return 0;
+        }
+        if (table->entries[i].key == MOSQ_MID_TABLE_TOMBSTONE && tombstone == -1) tombstone = (int)i;
+        if (table->entries[i].key == MOSQ_MID_TABLE_EMPTY) break;
+    }
+    if (tombstone != -1) {
+        i = (unsigned int)tombstone;
+    } else {
+        table->used++;
+    }
+    table->entries[i].key = key;
+    table->entries[i].value = value;
+    table->count++;
+    return 0;
+}
+
+static mosquitto_mid_table_entry_t *mosquitto_mid_table_find(mosquitto_mid_table_t *table, int key)
+{
+    unsigned int i, mask = table->capacity - 1;
+    for (i = mosquitto_mid_table_hash(key) & mask; table->entries[i].key != MOSQ_MID_TABLE_EMPTY; i = (i + 1) & mask) {
+        if (table->entries[i].key == key) return &table->entries[i];
+    }
+    return NULL;
+}
+
+void *mosquitto_mid_table_lookup(mosquitto_mid_table_t *table, int key)
+{
+    mosquitto_mid_table_entry_t *entry = mosquitto_mid_table_find(table, key);
+    return entry ? entry->value : NULL;
+}
+
+void *mosquitto_mid_table_remove(mosquitto_mid_table_t *table, int key)
+{
+    void *value;
+    mosquitto_mid_table_entry_t *entry = mosquitto_mid_table_find(table, key);
+    if (entry == NULL) return NULL;
+    value = entry->value;
+    entry->key = MOSQ_MID_TABLE_TOMBSTONE;
+    entry->value = NULL;
+    table->count--;
+    return value;
+}
+
+/*
+ * :nodoc:
+ *  Removes all entries carrying a given value. Used to expire early acknowledgements.
+ *
+ */
+void mosquitto_mid_table_purge(mosquitto_mid_table_t *table, void *value)
+{
+    int i;
+    for (i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key > 0 && table->entries[i].value == value) {
+            table->entries[i].key = MOSQ_MID_TABLE_TOMBSTONE;
+            table->entries[i].value = NULL;
+            table->count--;
+        }
+    }
+}
+
+/*
+ * :nodoc:
+ *  Completes a future and signals the threads waiting on it that have nothing else left pending. The caller
+ *  holds mosquitto_future_mutex.
+ *
+ */
+static void mosquitto_future_complete(mosquitto_future_t *future, int state)
+{
+    mosquitto_future_link_t *link;
+    future->state = state;
+    future->table = NULL;
+    for (link = future->waiters; link != NULL; link = link->next) {
+        if (--link->waiter->pending == 0) pthread_cond_signal(&link->waiter->cond);
+    }
+    future->waiters = NULL;
+}
+
+/*
+ * :nodoc:
+ *  Resolves the pending future for a given message id. The caller holds mosquitto_future_mutex.
+ *
+ */
+void mosquitto_future_resolve(mosquitto_mid_table_t *table, int mid, int state)
+{
+    mosquitto_future_t *future = mosquitto_mid_table_remove(table, mid);
+    if (future != NULL && future != MOSQ_MID_TABLE_EARLY_ACK) mosquitto_future_complete(future, state);
+}
+
+/*
+ * :nodoc:
+ *  Fails all pending futures of a client, on disconnect. The caller holds mosquitto_future_mutex.
+ *
+ */
+void mosquitto_future_fail_all(mosquitto_mid_table_t *table)
+{
+    int i;
+    mosquitto_future_t *future;
+    for (i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key > 0) {
+            future = table->entries[i].value;
+            if (future != MOSQ_MID_TABLE_EARLY_ACK) mosquitto_future_complete(future, MOSQ_FUTURE_FAILED);
+            table->entries[i].key = MOSQ_MID_TABLE_TOMBSTONE;
+            table->entries[i].value = NULL;
+        }
+    }
+    table->count = 0;
+}
+
+/*
+ * :nodoc:
+ *  Detaches pending futures from a table about to be released with its client. The caller holds
+ *  mosquitto_future_mutex.
+ *
+ */
+void mosquitto_future_detach_all(mosquitto_mid_table_t *table)
+{
+    int i;
+    mosquitto_future_t *future;
+    for (i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key > 0) {
+            future = table->entries[i].value;
+            if (future != MOSQ_MID_TABLE_EARLY_ACK) future->table = NULL;
+        }
+    }
+}
+
+/*
+ * :nodoc:
+ *  Drops links to waiting threads, in a forked child where those threads don't exist. The caller holds
+ *  mosquitto_future_mutex.
+ *
+ */
+void mosquitto_future_unlink_all(mosquitto_mid_table_t *table)
+{
+    int i;
+    mosquitto_future_t *future;
+    for (i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key > 0) {
+            future = table->entries[i].value;
+            if (future != MOSQ_MID_TABLE_EARLY_ACK) future->waiters = NULL;
+        }
+    }
+}
+
+/*
+ * :nodoc:
+ *  GC callback for Mosquitto::Future objects - invoked during the GC mark phase.
+ *
+ */
+static void rb_mosquitto_mark_future(void *ptr)
+{
+    mosquitto_future_t *future = (mosquitto_future_t *)ptr;
+    if (future) {
+        rb_gc_mark(future->client);
+    }
+}
+
+/*
+ * :nodoc:
+ *  GC callback for releasing an out of scope Mosquitto::Future object
+ *
+ */
+static void rb_mosquitto_free_future(void *ptr)
+{
+    mosquitto_future_t *future = (mosquitto_future_t *)ptr;
+    if (future) {
+        pthread_mutex_lock(&mosquitto_future_mutex);
+        if (future->table != NULL && mosquitto_mid_table_lookup(future->table, future->mid) == future) {
+            mosquitto_mid_table_remove(future->table, future->mid);
+        }
+        pthread_mutex_unlock(&mosquitto_future_mutex);
+        xfree(future);
+    }
+}
+
+/*
+ * :nodoc:
+ *  Allocator function for Mosquitto::Future. This is only ever called from Mosquitto::Client#publish_async,
+ *  NEVER by the user.
+ *
+ */
+VALUE rb_mosquitto_future_alloc(VALUE client)
+{
+    VALUE obj;
+    mosquitto_future_t *future = NULL;
+    obj = Data_Make_Struct(rb_cMosquittoFuture, mosquitto_future_t, rb_mosquitto_mark_future, rb_mosquitto_free_future, future);
+    future->mid = 0;
+    future->state = MOSQ_FUTURE_PENDING;
+    future->client = client;
+    future->table = NULL;
+    future->waiters = NULL;
+    return obj;
+}
+
+typedef struct {
+    mosquitto_future_t *future;
+    mosquitto_future_link_t link;
+} mosquitto_future_wait_entry_t;
+
+struct nogvl_future_wait_args {
+    mosquitto_future_wait_entry_t *entries;
+    mosquitto_future_waiter_t waiter;
+    bool allocated;
+    long count;
+    long timeout_ms;
+    bool interrupted;
+    bool completed;
+};
+
+static void mosquitto_future_deadline(struct timespec *deadline, long timeout_ms)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * :nodoc:
+ *  Links the calling thread into all pending futures. The caller holds mosquitto_future_mutex.
+ *
+ */
+static void mosquitto_future_link(struct nogvl_future_wait_args *args)
+{
+    long i;
+    args->waiter.pending = 0;
+    mosquitto_future_wait_entry_t *entry;
+    for (i = 0; i < args->count; i++) {
+        entry = &args->entries[i];
+        if (entry->future->state != MOSQ_FUTURE_PENDING) continue;
+        entry->link.waiter = &args->waiter;
+        entry->link.next = entry->future->waiters;
+        entry->future->waiters = &entry->link;
+        args->waiter.pending++;
+    }
+}
+
+/*
+ * :nodoc:
+ *  Unlinks the calling thread from futures still pending. The caller holds mosquitto_future_mutex.
+ *
+ */
+static void mosquitto_future_unlink(struct nogvl_future_wait_args *args)
+{
+    mosquitto_future_link_t **link;
+    long i;
+    mosquitto_future_wait_entry_t *entry;
+    for (i = 0; i < args->count; i++) {
+        entry = &args->entries[i];
+        if (entry->future->state != MOSQ_FUTURE_PENDING) continue;
+        for (link = &entry->future->waiters; *link != NULL; link = &(*link)->next) {
+            if (*link == &entry->link) {
+                *link = entry->link.next;
+                break;
+            }
+        }
+    }
+}
+
+static void *rb_mosquitto_future_wait_nogvl(void *ptr)
+{
+    struct nogvl_future_wait_args *args = ptr;
+    struct timespec deadline;
+    if (args->timeout_ms >= 0) mosquitto_future_deadline(&deadline, args->timeout_ms);
+    pthread_mutex_lock(&mosquitto_future_mutex);
+    mosquitto_future_link(args);
+    while (args->waiter.pending > 0 && !args->interrupted) {
+        if (args->timeout_ms < 0) {
+            pthread_cond_wait(&args->waiter.cond, &mosquitto_future_mutex);
+        } else if (pthread_cond_timedwait(&args->waiter.cond, &mosquitto_future_mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    args->completed = (args->waiter.pending == 0);
+    if (!args->completed) mosquitto_future_unlink(args);
+    pthread_mutex_unlock(&mosquitto_future_mutex);
+    return NULL;
+}
+
+static void rb_mosquitto_future_wait_ubf(void *ptr)
+{
+    struct nogvl_future_wait_args *args = ptr;
+    pthread_mutex_lock(&mosquitto_future_mutex);
+    args->interrupted = true;
+    pthread_cond_signal(&args->waiter.cond);
+    pthread_mutex_unlock(&mosquitto_future_mutex);
+}
+
+/*
+ * :nodoc:
+ *  Blocks without the GVL until all given futures completed or the timeout expired. Sets args->completed
+ *  if all futures completed. Raises on pending interrupts - callers release their buffers with rb_ensure.
+ *
+ */
+static VALUE rb_mosquitto_future_wait(VALUE ptr)
+{
+    struct nogvl_future_wait_args *args = (struct nogvl_future_wait_args *)ptr;
+    while (!args->completed) {
+        rb_thread_call_without_gvl(rb_mosquitto_future_wait_nogvl, (void *)args, rb_mosquitto_future_wait_ubf, (void *)args);
+        if (!args->interrupted || args->completed) break;
+        /* Woken up for pending interrupts - handle them and keep waiting if the thread wasn't killed */
+        rb_thread_check_ints();
+        args->interrupted = false;
+    }
+    return Qnil;
+}
+
+static VALUE rb_mosquitto_future_wait_ensure(VALUE ptr)
+{
+    struct nogvl_future_wait_args *args = (struct nogvl_future_wait_args *)ptr;
+    pthread_cond_destroy(&args->waiter.cond);
+    if (args->allocated) xfree(args->entries);
+    return Qnil;
+}
+
+static void rb_mosquitto_future_wait_init(struct nogvl_future_wait_args *args, long count, VALUE timeout)
+{
+    args->count = count;
+    args->allocated = false;
+    args->timeout_ms = NIL_P(timeout) ? -1 : (long)(NUM2DBL(timeout) * 1000);
+    args->interrupted = false;
+    args->completed = false;
+}
+
+/*
+ * call-seq:
+ *   future.mid -> Integer
+ *
+ * Message identifier of the published message.
+ *
+ * @return [Integer] message identifier
+ * @example
+ *   future.mid -> 2
+ *
+ */
+static VALUE rb_mosquitto_future_mid(VALUE obj)
+{
+    MosquittoGetFuture(obj);
+    return INT2NUM(future->mid);
+}
+
+/*
+ * call-seq:
+ *   future.value(1.5) -> Boolean or nil
+ *
+ * Waits for the broker to acknowledge the message, without holding the GVL.
+ *
+ * @param timeout [Integer, Float, nil] seconds to wait. nil waits indefinitely.
+ * @return [true, nil] true once acknowledged, nil on timeout
+ * @raise [Mosquitto::Error] if the client disconnected before the message was acknowledged
+ * @example
+ *   future.value(1.5) -> true
+ *
+ */
+static VALUE rb_mosquitto_future_value(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE timeout;
+    struct nogvl_future_wait_args args;
+    mosquitto_future_wait_entry_t entry;
+    MosquittoGetFuture(obj);
+    rb_scan_args(argc, argv, "01", &timeout);
+    if (future->state == MOSQ_FUTURE_PENDING) {
+        rb_mosquitto_future_wait_init(&args, 1, timeout);
+        entry.future = future;
+        args.entries = &entry;
+        pthread_cond_init(&args.waiter.cond, NULL);
+        rb_ensure(rb_mosquitto_future_wait, (VALUE)&args, rb_mosquitto_future_wait_ensure, (VALUE)&args);
+        if (!args.completed) return Qnil;
+    }
+    if (future->state == MOSQ_FUTURE_FAILED) MosquittoError("client disconnected before the message was acknowledged");
+    return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   future.done? -> Boolean
+ *
+ * Whether the future completed - either acknowledged or failed.
+ *
+ * @return [true, false] completion status
+ * @example
+ *   future.done? -> true
+ *
+ */
+static VALUE rb_mosquitto_future_done_p(VALUE obj)
+{
+    MosquittoGetFuture(obj);
+    return (future->state != MOSQ_FUTURE_PENDING) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   future.failed? -> Boolean
+ *
+ * Whether the client disconnected before the message was acknowledged.
+ *
+ * @return [true, false] failure status
+ * @example
+ *   future.failed? -> false
+ *
+ */
+static VALUE rb_mosquitto_future_failed_p(VALUE obj)
+{
+    MosquittoGetFuture(obj);
+    return (future->state == MOSQ_FUTURE_FAILED) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   Mosquitto.wait_all(futures, 5) -> Boolean
+ *
+ * Waits for a batch of publish futures to complete, without holding the GVL and without polling.
+ * Futures may belong to different clients.
+ *
+ * @param futures [Array<Mosquitto::Future>] futures returned from Mosquitto::Client#publish_async
+ * @param timeout [Integer, Float, nil] seconds to wait. nil waits indefinitely.
+ * @return [true, false] true if all futures completed (acknowledged or failed), false on timeout
+ * @raise [TypeError] on invalid input params
+ * @example
+ *   Mosquitto.wait_all(futures, 5) -> true
+ *
+ */
+static VALUE rb_mosquitto_wait_all(int argc, VALUE *argv, MOSQ_UNUSED VALUE obj)
+{
+    VALUE futures, timeout;
+    struct nogvl_future_wait_args args;
+    long i;
+    rb_scan_args(argc, argv, "11", &futures, &timeout);
+    Check_Type(futures, T_ARRAY);
+    for (i = 0; i < RARRAY_LEN(futures); i++) {
+        if (!rb_obj_is_kind_of(RARRAY_PTR(futures)[i], rb_cMosquittoFuture)) {
+            rb_raise(rb_eTypeError, "expected an Array of Mosquitto::Future instances");
+        }
+    }
+    if (RARRAY_LEN(futures) == 0) return Qtrue;
+    /* Everything that may raise runs before allocating - the wait itself releases the buffer with rb_ensure */
+    rb_mosquitto_future_wait_init(&args, RARRAY_LEN(futures), timeout);
+    args.entries = ALLOC_N(mosquitto_future_wait_entry_t, args.count);
+    args.allocated = true;
+    for (i = 0; i < args.count; i++) {
+        Data_Get_Struct(RARRAY_PTR(futures)[i], mosquitto_future_t, args.entries[i].future);
+    }
+    pthread_cond_init(&args.waiter.cond, NULL);
+    rb_ensure(rb_mosquitto_future_wait, (VALUE)&args, rb_mosquitto_future_wait_ensure, (VALUE)&args);
+    RB_GC_GUARD(futures);
+    return args.completed ? Qtrue : Qfalse;
+}
+
+/*
+ *  Completion objects for messages published with Mosquitto::Client#publish_async. They're resolved
+ *  natively when the broker acknowledges the message, or failed when the client disconnects.
+ *
+ */
+
+void _init_rb_mosquitto_future()
+{
+    rb_cMosquittoFuture = rb_define_class_under(rb_mMosquitto, "Future", rb_cObject);
+
+    rb_define_module_function(rb_mMosquitto, "wait_all", rb_mosquitto_wait_all, -1);
+
+    rb_define_method(rb_cMosquittoFuture, "mid", rb_mosquitto_future_mid, 0);
+    rb_define_method(rb_cMosquittoFuture, "value", rb_mosquitto_future_value, -1);
+    rb_define_method(rb_cMosquittoFuture, "done?", rb_mosquitto_future_done_p, 0);
+    rb_define_method(rb_cMosquittoFuture, "failed?", rb_mosquitto_future_failed_p, 0);
+}
@@ -0,0 +1,67 @@
+#ifndef MOSQUITTO_FUTURE_H
+#define MOSQUITTO_FUTURE_H
+
+#define MOSQ_FUTURE_PENDING 0x00
+#define MOSQ_FUTURE_ACKED 0x01
+#define MOSQ_FUTURE_FAILED 0x02
+
+#define MOSQ_MID_TABLE_EMPTY 0
+#define MOSQ_MID_TABLE_TOMBSTONE -1
+
+/* Marks a mid acknowledged before its future was registered */
+#define MOSQ_MID_TABLE_EARLY_ACK ((void *)1)
+
+/*
+ * Open addressing (linear probing) hash table keyed by positive integer ids - message ids for publish
+ * futures. Not thread safe - callers serialize access with mosquitto_future_mutex.
+ */
+typedef struct {
+    int key;
+    void *value;
+} mosquitto_mid_table_entry_t;
+
+typedef struct {
+    mosquitto_mid_table_entry_t *entries;
+    int capacity;
+    int count;
+    int used;
+} mosquitto_mid_table_t;
+
+typedef struct mosquitto_future_waiter_s mosquitto_future_waiter_t;
+
+/* Links a pending future to a thread blocked on it - one per future and waiting thread */
+typedef struct mosquitto_future_link_s {
+    mosquitto_future_waiter_t *waiter;
+    struct mosquitto_future_link_s *next;
+} mosquitto_future_link_t;
+
+typedef struct {
+    int mid;
+    int state;
+    VALUE client;
+    mosquitto_mid_table_t *table;
+    mosquitto_future_link_t *waiters;
+} mosquitto_future_t;
+
+#define MosquittoGetFuture(obj) \
+    mosquitto_future_t *future = NULL; \
+    Data_Get_Struct(obj, mosquitto_future_t, future); \
+    if (!future) rb_raise(rb_eTypeError, "uninitialized Mosquitto future!");
+
+extern pthread_mutex_t mosquitto_future_mutex;
+
+mosquitto_mid_table_t *mosquitto_mid_table_new(void);
+void mosquitto_mid_table_free(mosquitto_mid_table_t *table);
+int mosquitto_mid_table_insert(mosquitto_mid_table_t *table, int key, void *value);
+void *mosquitto_mid_table_lookup(mosquitto_mid_table_t *table, int key);
+void *mosquitto_mid_table_remove(mosquitto_mid_table_t *table, int key);
+void mosquitto_mid_table_purge(mosquitto_mid_table_t *table, void *value);
+
+VALUE rb_mosquitto_future_alloc(VALUE client);
+void mosquitto_future_resolve(mosquitto_mid_table_t *table, int mid, int state);
+void mosquitto_future_fail_all(mosquitto_mid_table_t *table);
+void mosquitto_future_detach_all(mosquitto_mid_table_t *table);
+void mosquitto_future_unlink_all(mosquitto_mid_table_t *table);
+void _init_rb_mosquitto_future();
+
+#endif
@@ -1,5 +1,27 @@
 #include "mosquitto_ext.h"
 
+/*
+ * :nodoc:
+ *  Bytes malloc'ed by libmosquitto for a message - the struct, topic and payload. Safe to call without the GVL.
+ *
+ */
+size_t mosquitto_message_memsize(const struct mosquitto_message *msg)
+{
+    if (msg == NULL) return 0;
+    return sizeof(struct mosquitto_message) + (msg->topic ? strlen(msg->topic) + 1 : 0) + msg->payloadlen;
+}
+
+/*
+ * :nodoc:
+ *  GC callback for marking the thread a borrowed message is bound to.
+ *
+ */
+static void rb_mosquitto_mark_message(void *ptr)
+{
+    mosquitto_message_wrapper *message = (mosquitto_message_wrapper *)ptr;
+    if (message) rb_gc_mark(message->owner);
+}
+
 /*
  * :nodoc:
  *  GC callback for releasing an out of scope Mosquitto::Message object
@@ -9,27 +31,96 @@ static void rb_mosquitto_free_message(void *ptr)
 {
     mosquitto_message_wrapper *message = (mosquitto_message_wrapper *)ptr;
     if (message) {
-        mosquitto_message_free(&message->msg);
+        /* Borrowed messages never own the libmosquitto message they're bound to */
+        if (!message->borrowed) {
+            rb_gc_adjust_memory_usage(-(ssize_t)mosquitto_message_memsize(message->msg));
+            mosquitto_message_free(&message->msg);
+        }
         xfree(message);
     }
 }
 
+/*
+ * :nodoc:
+ *  GC callback for ObjectSpace.memsize_of - includes the topic and payload pinned by the message.
+ *
+ */
+static size_t rb_mosquitto_message_memsize(const void *ptr)
+{
+    const mosquitto_message_wrapper *message = (const mosquitto_message_wrapper *)ptr;
+    if (!message) return 0;
+    if (message->borrowed) return sizeof(mosquitto_message_wrapper);
+    return sizeof(mosquitto_message_wrapper) + mosquitto_message_memsize(message->msg);
+}
+
+const rb_data_type_t mosquitto_message_type = {
+    "Mosquitto::Message",
+    {
+        rb_mosquitto_mark_message,
+        rb_mosquitto_free_message,
+        rb_mosquitto_message_memsize,
+    },
+};
+
 /*
  * :nodoc:
  *  Allocator function for Mosquitto::Message. This is only ever called from within an on_message callback
  *  within the binding scope, NEVER by the user.
  *
+ *  The message copy is malloc'ed by libmosquitto, outside of the Ruby heap - its size is reported to the GC
+ *  so that GC pacing accounts for large payloads.
+ *
  */
 VALUE rb_mosquitto_message_alloc(const struct mosquitto_message *msg)
 {
     VALUE message;
     mosquitto_message_wrapper *wrapper = NULL;
-    message = Data_Make_Struct(rb_cMosquittoMessage, mosquitto_message_wrapper, 0, rb_mosquitto_free_message, wrapper);
-    wrapper->msg = msg;
+    message = TypedData_Make_Struct(rb_cMosquittoMessage, mosquitto_message_wrapper, &mosquitto_message_type, wrapper);
+    wrapper->msg = (struct mosquitto_message *)msg;
+    wrapper->borrowed = false;
+    wrapper->owner = Qnil;
+    rb_gc_adjust_memory_usage((ssize_t)mosquitto_message_memsize(msg));
     rb_obj_call_init(message, 0, NULL);
     return message;
 }
 
+/*
+ * :nodoc:
+ *  Allocates an unbound, borrowed Mosquitto::Message - the flyweight that Mosquitto::Client#borrow_messages
+ *  rebinds to each incoming message for the duration of the on_message handler.
+ *
+ */
+VALUE rb_mosquitto_message_borrowed_alloc(void)
+{
+    VALUE message;
+    mosquitto_message_wrapper *wrapper = NULL;
+    message = TypedData_Make_Struct(rb_cMosquittoMessage, mosquitto_message_wrapper, &mosquitto_message_type, wrapper);
+    wrapper->msg = NULL;
+    wrapper->borrowed = true;
+    wrapper->owner = Qnil;
+    rb_obj_call_init(message, 0, NULL);
+    return message;
+}
+
+/*
+ * :nodoc:
+ *  Binds a borrowed message to a libmosquitto message, or unbinds it with NULL. Returns the previously bound
+ *  message, which callers restore for nested dispatch. The caller retains ownership of the message. A bound
+ *  message is only usable from the dispatching thread - another thread holding on to it would otherwise read
+ *  whatever message it gets rebound to next.
+ *
+ */
+struct mosquitto_message *rb_mosquitto_message_rebind(VALUE obj, struct mosquitto_message *msg)
+{
+    struct mosquitto_message *previous;
+    mosquitto_message_wrapper *message = NULL;
+    TypedData_Get_Struct(obj, mosquitto_message_wrapper, &mosquitto_message_type, message);
+    previous = message->msg;
+    message->msg = msg;
+    message->owner = msg == NULL ? Qnil : rb_thread_current();
+    return previous;
+}
+
 /*
  * call-seq:
  *   msg.mid -> Integer
@@ -149,6 +240,129 @@ static VALUE rb_mosquitto_message_retain_p(VALUE obj)
     return (msg->retain == true) ? Qtrue : Qfalse;
 }
 
+/*
+ * call-seq:
+ *   msg.borrowed? -> Boolean
+ *
+ * Set to true for the flyweight message handed to Mosquitto::Client#on_message handlers of clients with
+ * Mosquitto::Client#borrow_messages enabled. A borrowed message is only valid until the handler returns.
+ *
+ * @return [true, false] whether the message is borrowed
+ * @see Mosquitto::Message#dup
+ * @example
+ *   msg.borrowed? -> true
+ *
+ */
+static VALUE rb_mosquitto_message_borrowed_p(VALUE obj)
+{
+    mosquitto_message_wrapper *message = NULL;
+    TypedData_Get_Struct(obj, mosquitto_message_wrapper, &mosquitto_message_type, message);
+    return message->borrowed ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   msg.dup -> Mosquitto::Message
+ *
+ * An owned copy of the message, including topic and payload. Borrowed messages have to be duplicated to be
+ * retained past their Mosquitto::Client#on_message handler.
+ *
+ * @return [Mosquitto::Message] message copy
+ * @example
+ *   client.on_message{|msg| messages << msg.dup }
+ *
+ */
+static VALUE rb_mosquitto_message_dup(VALUE obj)
+{
+    struct mosquitto_message *copy;
+    MosquittoGetMessage(obj);
+    copy = MOSQ_ALLOC(struct mosquitto_message);
+    if (copy == NULL) rb_memerror();
+    if (mosquitto_message_copy(copy, message->msg) != MOSQ_ERR_SUCCESS) {
+        free(copy);
+        rb_memerror();
+    }
+    return rb_mosquitto_message_alloc(copy);
+}
+
+/*
+ * call-seq:
+ *   msg.clone -> Mosquitto::Message
+ *   msg.clone(:freeze => true) -> Mosquitto::Message
+ *
+ * An owned copy of the message, like Mosquitto::Message#dup. Frozen if the message is, or as requested with
+ * the :freeze option of Object#clone.
+ *
+ * @param opts [Hash] clone options
+ * @option opts [true, false, nil] :freeze whether to freeze the copy, nil keeps the frozen state of the message
+ * @return [Mosquitto::Message] message copy
+ * @raise [ArgumentError] on unknown options
+ * @example
+ *   client.on_message{|msg| messages << msg.clone(:freeze => true) }
+ *
+ */
+static VALUE rb_mosquitto_message_clone(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE opts, freeze = Qnil, copy;
+    size_t known = 0;
+    rb_scan_args(argc, argv, "01", &opts);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        if (RTEST(rb_funcall(opts, rb_intern("key?"), 1, ID2SYM(rb_intern("freeze"))))) {
+            freeze = rb_hash_aref(opts, ID2SYM(rb_intern("freeze")));
+            known = 1;
+        }
+        if (RHASH_SIZE(opts) > known) rb_raise(rb_eArgError, "unknown keyword - only :freeze is supported");
+        if (!NIL_P(freeze) && freeze != Qtrue && freeze != Qfalse) rb_raise(rb_eArgError, "unexpected value for freeze: %s", RSTRING_PTR(rb_inspect(freeze)));
+    }
+    copy = rb_mosquitto_message_dup(obj);
+    if (freeze == Qtrue || (NIL_P(freeze) && OBJ_FROZEN(obj))) OBJ_FREEZE(copy);
+    return copy;
+}
+
+/*
+ * call-seq:
+ *   msg.request? -> Boolean
+ *
+ * Set to true if this message is a request sent with Mosquitto::Client#request.
+ *
+ * @return [true, false] whether the message expects a reply
+ * @see Mosquitto::Client#respond
+ * @example
+ *   msg.request? -> true
+ *
+ */
+static VALUE rb_mosquitto_message_request_p(VALUE obj)
+{
+    const char *reply_topic;
+    const void *body;
+    int body_len;
+    MosquittoGetMessage(obj);
+    return mosquitto_rpc_envelope(message->msg, &reply_topic, &body, &body_len) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   msg.request_payload -> String
+ *
+ * The body of a request sent with Mosquitto::Client#request - the payload without the reply topic envelope.
+ * Same as Mosquitto::Message#to_s for messages that aren't requests.
+ *
+ * @return [String] request body
+ * @example
+ *   msg.request_payload -> "utc"
+ *
+ */
+static VALUE rb_mosquitto_message_request_payload(VALUE obj)
+{
+    const char *reply_topic;
+    const void *body;
+    int body_len;
+    MosquittoGetMessage(obj);
+    if (!mosquitto_rpc_envelope(message->msg, &reply_topic, &body, &body_len)) return rb_mosquitto_message_to_s(obj);
+    return MosquittoEncode(rb_str_new(body, body_len));
+}
+
 /*
  *  Represents libmosquitto messages. They cannot be allocated or initialized from user code - they are
  *  spawned exclusively from within on_message callbacks and are thus read-only wrapper objects.
@@ -165,4 +379,9 @@ void _init_rb_mosquitto_message()
     rb_define_method(rb_cMosquittoMessage, "length", rb_mosquitto_message_length, 0);
     rb_define_method(rb_cMosquittoMessage, "qos", rb_mosquitto_message_qos, 0);
     rb_define_method(rb_cMosquittoMessage, "retain?", rb_mosquitto_message_retain_p, 0);
+    rb_define_method(rb_cMosquittoMessage, "borrowed?", rb_mosquitto_message_borrowed_p, 0);
+    rb_define_method(rb_cMosquittoMessage, "dup", rb_mosquitto_message_dup, 0);
+    rb_define_method(rb_cMosquittoMessage, "clone", rb_mosquitto_message_clone, -1);
+    rb_define_method(rb_cMosquittoMessage, "request?", rb_mosquitto_message_request_p, 0);
+    rb_define_method(rb_cMosquittoMessage, "request_payload", rb_mosquitto_message_request_payload, 0);
 }
@@ -3,14 +3,23 @@
 
 typedef struct {
     struct mosquitto_message *msg;
+    bool borrowed;
+    VALUE owner;
 } mosquitto_message_wrapper;
 
+extern const rb_data_type_t mosquitto_message_type;
+
 #define MosquittoGetMessage(obj) \
     mosquitto_message_wrapper *message = NULL; \
-    Data_Get_Struct(obj, mosquitto_message_wrapper, message); \
-    if (!message) rb_raise(rb_eTypeError, "uninitialized Mosquitto message!");
+    TypedData_Get_Struct(obj, mosquitto_message_wrapper, &mosquitto_message_type, message); \
+    if (!message) rb_raise(rb_eTypeError, "uninitialized Mosquitto message!"); \
+    if (!message->msg) MosquittoError("borrowed message used outside of its on_message handler - use Mosquitto::Message#dup to retain it"); \
+    if (message->borrowed && message->owner != rb_thread_current()) MosquittoError("borrowed message used from another thread than its on_message handler - use Mosquitto::Message#dup to share it");
 
+size_t mosquitto_message_memsize(const struct mosquitto_message *msg);
 VALUE rb_mosquitto_message_alloc(const struct mosquitto_message *msg);
+VALUE rb_mosquitto_message_borrowed_alloc(void);
+struct mosquitto_message *rb_mosquitto_message_rebind(VALUE obj, struct mosquitto_message *msg);
 void _init_rb_mosquitto_message();
 
 #endif
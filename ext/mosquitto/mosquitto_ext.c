@@ -4,6 +4,8 @@ VALUE rb_mMosquitto;
 VALUE rb_eMosquittoError;
 VALUE rb_cMosquittoClient;
 VALUE rb_cMosquittoMessage;
+VALUE rb_cMosquittoSharedRing;
+VALUE rb_cMosquittoFuture;
 
 VALUE intern_call;
 
@@ -78,6 +80,15 @@ void Init_mosquitto_ext()
     rb_define_const(rb_mMosquitto, "SSL_VERIFY_NONE", INT2NUM(0));
     rb_define_const(rb_mMosquitto, "SSL_VERIFY_PEER", INT2NUM(1));
 
+    /*
+     * Whether the extension carries USDT probes - see probes.h
+     */
+#ifdef HAVE_SYS_SDT_H
+    rb_define_const(rb_mMosquitto, "PROBES", Qtrue);
+#else
+    rb_define_const(rb_mMosquitto, "PROBES", Qfalse);
+#endif
+
     rb_eMosquittoError = rb_define_class_under(rb_mMosquitto, "Error", rb_eStandardError);
 
     rb_define_module_function(rb_mMosquitto, "version", rb_mosquitto_version, 0);
@@ -85,4 +96,8 @@ void Init_mosquitto_ext()
 
     _init_rb_mosquitto_client();
     _init_rb_mosquitto_message();
+    _init_rb_mosquitto_shared_ring();
+    _init_rb_mosquitto_future();
+    _init_rb_mosquitto_throttle();
+    _init_rb_mosquitto_resolver();
 }
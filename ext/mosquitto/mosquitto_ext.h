@@ -26,9 +26,22 @@ extern VALUE rb_mMosquitto;
 extern VALUE rb_eMosquittoError;
 extern VALUE rb_cMosquittoClient;
 extern VALUE rb_cMosquittoMessage;
+extern VALUE rb_cMosquittoSharedRing;
+extern VALUE rb_cMosquittoFuture;
 
 extern VALUE intern_call;
 
+#include "probes.h"
+#include "ring.h"
+#include "throttle.h"
+#include "retain.h"
+#include "resolver.h"
+#include "sockopt.h"
+#include "affinity.h"
+#include "future.h"
+#include "rpc.h"
+#include "registry.h"
+#include "sink.h"
 #include "client.h"
 #include "message.h"
 
@@ -5,6 +5,10 @@
 #define RFLOAT_VALUE(v) (RFLOAT(v)->value)
 #endif
 
+#ifndef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+#define rb_gc_adjust_memory_usage(diff)
+#endif
+
 #if LIBMOSQUITTO_VERSION_NUMBER != 1003001
 #error libmosquitto version 1.3.1 required
 #endif
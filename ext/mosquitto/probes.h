@@ -0,0 +1,36 @@
+#ifndef MOSQUITTO_PROBES_H
+#define MOSQUITTO_PROBES_H
+
+/*
+ * Static tracepoints (USDT) for the "mosquitto" provider. With sys/sdt.h available each probe compiles down to
+ * a single nop plus an ELF note, so they stay in release builds. List them with
+ *
+ *   bpftrace -l 'usdt:/path/to/mosquitto_ext.so:mosquitto:*'
+ *
+ * callback__enqueue, callback__dequeue (client id, callback type, topic, payload length, mid, callback)
+ *   Topic, payload length and mid are only set for message callbacks. The callback address ties an enqueue
+ *   to its dequeue.
+ * handler__start (client id, callback type, topic, payload length, mid)
+ * handler__end (client id, callback type, error tag)
+ * publish__start (client id, topic, payload length, qos)
+ * publish__end (client id, topic, mid, libmosquitto return code)
+ * connect, disconnect (client id, return code)
+ *
+ * The client id is NULL for clients created without one.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define MOSQ_PROBE2(name, a, b) DTRACE_PROBE2(mosquitto, name, a, b)
+#define MOSQ_PROBE3(name, a, b, c) DTRACE_PROBE3(mosquitto, name, a, b, c)
+#define MOSQ_PROBE4(name, a, b, c, d) DTRACE_PROBE4(mosquitto, name, a, b, c, d)
+#define MOSQ_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(mosquitto, name, a, b, c, d, e)
+#define MOSQ_PROBE6(name, a, b, c, d, e, f) DTRACE_PROBE6(mosquitto, name, a, b, c, d, e, f)
+#else
+#define MOSQ_PROBE2(name, a, b)
+#define MOSQ_PROBE3(name, a, b, c)
+#define MOSQ_PROBE4(name, a, b, c, d)
+#define MOSQ_PROBE5(name, a, b, c, d, e)
+#define MOSQ_PROBE6(name, a, b, c, d, e, f)
+#endif
+
+#endif
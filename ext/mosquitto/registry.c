@@ -0,0 +1,95 @@
+#include "mosquitto_ext.h"
+
+/*
+ * :nodoc:
+ *  Subscription registry. Mosquitto::Client#subscribe and #unsubscribe keep it up to date and the connect
+ *  callback replays it on the libmosquitto network thread as soon as the CONNACK arrives.
+ *
+ */
+
+void mosquitto_registry_init(mosquitto_registry_t *registry)
+{
+    registry->head = NULL;
+    registry->count = 0;
+    registry->replays = 0;
+    registry->replayed = 0;
+    registry->failures = 0;
+}
+
+/*
+ * :nodoc:
+ *  Registers a subscription, or updates the QoS of an existing one in place.
+ *
+ */
+int mosquitto_registry_add(mosquitto_registry_t *registry, const char *filter, int qos)
+{
+    mosquitto_registry_entry_t *entry, **tail;
+    for (tail = &registry->head; (entry = *tail) != NULL; tail = &entry->next) {
+        if (strcmp(entry->filter, filter) == 0) {
+            entry->qos = qos;
+            return 0;
+        }
+    }
+    entry = MOSQ_ALLOC(mosquitto_registry_entry_t);
+    if (entry == NULL) return -1;
+    if ((entry->filter = strdup(filter)) == NULL) {
+        free(entry);
+        return -1;
+    }
+    entry->qos = qos;
+    entry->next = NULL;
+    *tail = entry;
+    registry->count++;
+    return 0;
+}
+
+bool mosquitto_registry_remove(mosquitto_registry_t *registry, const char *filter)
+{
+    mosquitto_registry_entry_t *entry, **link;
+    for (link = &registry->head; (entry = *link) != NULL; link = &entry->next) {
+        if (strcmp(entry->filter, filter) == 0) {
+            *link = entry->next;
+            free(entry->filter);
+            free(entry);
+            registry->count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * :nodoc:
+ *  Queues a SUBSCRIBE for every registered subscription. libmosquitto only queues packets from within its
+ *  callbacks - they're written back to back by the network loop, without waiting for SUBACKs in between.
+ *  Returns the number of subscriptions that could not be queued.
+ *
+ */
+int mosquitto_registry_replay(mosquitto_registry_t *registry, struct mosquitto *mosq)
+{
+    mosquitto_registry_entry_t *entry;
+    int failed = 0;
+    if (registry->head == NULL) return 0;
+    registry->replays++;
+    for (entry = registry->head; entry != NULL; entry = entry->next) {
+        if (mosquitto_subscribe(mosq, NULL, entry->filter, entry->qos) == MOSQ_ERR_SUCCESS) {
+            registry->replayed++;
+        } else {
+            failed++;
+        }
+    }
+    registry->failures += failed;
+    return failed;
+}
+
+void mosquitto_registry_clear(mosquitto_registry_t *registry)
+{
+    mosquitto_registry_entry_t *entry, *next;
+    for (entry = registry->head; entry != NULL; entry = next) {
+        next = entry->next;
+        free(entry->filter);
+        free(entry);
+    }
+    registry->head = NULL;
+    registry->count = 0;
+}
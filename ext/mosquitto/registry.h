@@ -0,0 +1,29 @@
+#ifndef MOSQUITTO_REGISTRY_H
+#define MOSQUITTO_REGISTRY_H
+
+typedef struct mosquitto_registry_entry_t mosquitto_registry_entry_t;
+struct mosquitto_registry_entry_t {
+    char *filter;
+    int qos;
+    mosquitto_registry_entry_t *next;
+};
+
+/*
+ * Subscriptions acknowledged by the client, in subscription order, for replay after reconnects. Not thread
+ * safe - callers serialize access.
+ */
+typedef struct {
+    mosquitto_registry_entry_t *head;
+    size_t count;
+    unsigned long replays;
+    unsigned long replayed;
+    unsigned long failures;
+} mosquitto_registry_t;
+
+void mosquitto_registry_init(mosquitto_registry_t *registry);
+int mosquitto_registry_add(mosquitto_registry_t *registry, const char *filter, int qos);
+bool mosquitto_registry_remove(mosquitto_registry_t *registry, const char *filter);
+int mosquitto_registry_replay(mosquitto_registry_t *registry, struct mosquitto *mosq);
+void mosquitto_registry_clear(mosquitto_registry_t *registry);
+
+#endif
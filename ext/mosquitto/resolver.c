@@ -0,0 +1,357 @@
+#include "mosquitto_ext.h"
+
+/*
+ * :nodoc:
+ *  Resolver cache for connect and reconnect. libmosquitto resolves the broker hostname with a blocking
+ *  getaddrinfo(3) call on every connect - when the cache is enabled, clients hand it a numeric address instead,
+ *  trying each cached address in turn and falling back to the hostname. libmosquitto keeps that address for its
+ *  own reconnects, which then skip DNS while the entry is current - see rb_mosquitto_client_check_target.
+ *
+ *  getaddrinfo(3) doesn't expose record TTLs, so entries expire after a configurable TTL. Expired entries are
+ *  released as new hosts get cached.
+ *
+ */
+
+static pthread_mutex_t mosquitto_resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mosquitto_resolver_cond = PTHREAD_COND_INITIALIZER;
+static mosquitto_resolver_entry_t *mosquitto_resolver_entries = NULL;
+static long mosquitto_resolver_ttl_ms = -1;
+static unsigned long mosquitto_resolver_hits = 0;
+static unsigned long mosquitto_resolver_misses = 0;
+static unsigned long mosquitto_resolver_failures = 0;
+
+static bool mosquitto_resolver_expired(mosquitto_resolver_entry_t *entry)
+{
+    struct timespec now;
+    if (entry->pinned) return false;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > entry->expires_at.tv_sec ||
+        (now.tv_sec == entry->expires_at.tv_sec && now.tv_nsec >= entry->expires_at.tv_nsec);
+}
+
+static void mosquitto_resolver_expire_in(mosquitto_resolver_entry_t *entry, long ttl_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, &entry->expires_at);
+    entry->expires_at.tv_sec += ttl_ms / 1000;
+    entry->expires_at.tv_nsec += (ttl_ms % 1000) * 1000000;
+    if (entry->expires_at.tv_nsec >= 1000000000) {
+        entry->expires_at.tv_sec++;
+        entry->expires_at.tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * :nodoc:
+ *  Releases entries no lookup waits on - expired ones only, unless all is set. Expects the resolver mutex to be
+ *  held.
+ *
+ */
+static void mosquitto_resolver_prune(bool all)
+{
+    mosquitto_resolver_entry_t *entry, **link = &mosquitto_resolver_entries;
+    while ((entry = *link) != NULL) {
+        if (!entry->resolving && (all || mosquitto_resolver_expired(entry))) {
+            *link = entry->next;
+            free(entry->host);
+            free(entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+}
+
+static mosquitto_resolver_entry_t *mosquitto_resolver_find(const char *host)
+{
+    mosquitto_resolver_entry_t *entry;
+    for (entry = mosquitto_resolver_entries; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->host, host) == 0) return entry;
+    }
+    return NULL;
+}
+
+/*
+ * :nodoc:
+ *  Finds or creates the cache entry for a host. Expects the resolver mutex to be held.
+ *
+ */
+static mosquitto_resolver_entry_t *mosquitto_resolver_entry(const char *host)
+{
+    mosquitto_resolver_entry_t *entry;
+    if ((entry = mosquitto_resolver_find(host)) != NULL) return entry;
+    mosquitto_resolver_prune(false);
+    entry = MOSQ_ALLOC(mosquitto_resolver_entry_t);
+    if (entry == NULL) return NULL;
+    if ((entry->host = strdup(host)) == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->count = 0;
+    entry->pinned = false;
+    entry->resolving = false;
+    entry->expires_at.tv_sec = 0;
+    entry->expires_at.tv_nsec = 0;
+    entry->next = mosquitto_resolver_entries;
+    mosquitto_resolver_entries = entry;
+    return entry;
+}
+
+/*
+ * :nodoc:
+ *  Resolves up to MOSQ_RESOLVER_MAX_ADDRESSES distinct numeric addresses for a host, in getaddrinfo(3) order - the
+ *  same order libmosquitto would try them in. Returns the number of addresses, 0 on failure.
+ *
+ */
+static int mosquitto_resolver_getaddrinfo(const char *host, mosquitto_resolver_address_t *addresses)
+{
+    struct addrinfo hints, *result = NULL, *ai;
+    int count = 0, i;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &result) != 0) return 0;
+    for (ai = result; ai != NULL && count < MOSQ_RESOLVER_MAX_ADDRESSES; ai = ai->ai_next) {
+        if (getnameinfo(ai->ai_addr, ai->ai_addrlen, addresses[count], MOSQ_RESOLVER_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST) != 0) continue;
+        for (i = 0; i < count && strcmp(addresses[i], addresses[count]) != 0; i++);
+        if (i == count) count++;
+    }
+    freeaddrinfo(result);
+    return count;
+}
+
+/*
+ * :nodoc:
+ *  Maps a hostname to numeric addresses through the cache, resolving it at most once per TTL across all threads.
+ *  Copies up to MOSQ_RESOLVER_MAX_ADDRESSES addresses to the given buffer and returns how many. Returns 0 if the
+ *  cache is disabled or resolution failed - callers then hand libmosquitto the hostname, which resolves and
+ *  reports errors as usual.
+ *
+ *  Blocks on DNS - never call with the GVL held.
+ *
+ */
+int mosquitto_resolver_lookup(const char *host, mosquitto_resolver_address_t *addresses)
+{
+    mosquitto_resolver_entry_t *entry;
+    mosquitto_resolver_address_t resolved[MOSQ_RESOLVER_MAX_ADDRESSES];
+    int count;
+    pthread_mutex_lock(&mosquitto_resolver_mutex);
+    for (;;) {
+        if (mosquitto_resolver_ttl_ms < 0 || (entry = mosquitto_resolver_entry(host)) == NULL) {
+            pthread_mutex_unlock(&mosquitto_resolver_mutex);
+            return 0;
+        }
+        if (!entry->resolving) break;
+        /* The entry may be flushed once resolved - look it up again */
+        pthread_cond_wait(&mosquitto_resolver_cond, &mosquitto_resolver_mutex);
+    }
+    if (entry->count > 0 && !mosquitto_resolver_expired(entry)) {
+        mosquitto_resolver_hits++;
+        count = entry->count;
+        memcpy(addresses, entry->addresses, count * sizeof(mosquitto_resolver_address_t));
+        pthread_mutex_unlock(&mosquitto_resolver_mutex);
+        return count;
+    }
+    mosquitto_resolver_misses++;
+    entry->resolving = true;
+    pthread_mutex_unlock(&mosquitto_resolver_mutex);
+
+    count = mosquitto_resolver_getaddrinfo(host, resolved);
+
+    pthread_mutex_lock(&mosquitto_resolver_mutex);
+    entry->resolving = false;
+    if (count > 0) {
+        memcpy(entry->addresses, resolved, count * sizeof(mosquitto_resolver_address_t));
+        entry->count = count;
+        mosquitto_resolver_expire_in(entry, mosquitto_resolver_ttl_ms);
+        memcpy(addresses, resolved, count * sizeof(mosquitto_resolver_address_t));
+    } else {
+        mosquitto_resolver_failures++;
+    }
+    pthread_cond_broadcast(&mosquitto_resolver_cond);
+    pthread_mutex_unlock(&mosquitto_resolver_mutex);
+    return count;
+}
+
+/*
+ * :nodoc:
+ *  Whether the cache still maps a host to a given address, without going through DNS.
+ *
+ */
+bool mosquitto_resolver_current(const char *host, const char *address)
+{
+    mosquitto_resolver_entry_t *entry;
+    bool current = false;
+    int i;
+    pthread_mutex_lock(&mosquitto_resolver_mutex);
+    entry = mosquitto_resolver_find(host);
+    if (mosquitto_resolver_ttl_ms >= 0 && entry != NULL && !entry->resolving && !mosquitto_resolver_expired(entry)) {
+        for (i = 0; i < entry->count && !current; i++) {
+            current = (strcmp(entry->addresses[i], address) == 0);
+        }
+    }
+    pthread_mutex_unlock(&mosquitto_resolver_mutex);
+    return current;
+}
+
+/*
+ * :nodoc:
+ *  Fork handlers - the cache is locked across fork(2) so children never inherit it mid update. Lookups in flight
+ *  on other threads never complete in the child and are reset for the next lookup to retry.
+ *
+ */
+void mosquitto_resolver_atfork_prepare(void)
+{
+    pthread_mutex_lock(&mosquitto_resolver_mutex);
+}
+
+void mosquitto_resolver_atfork_parent(void)
+{
+    pthread_mutex_unlock(&mosquitto_resolver_mutex);
+}
+
+void mosquitto_resolver_atfork_child(void)
+{
+    mosquitto_resolver_entry_t *entry;
+    for (entry = mosquitto_resolver_entries; entry != NULL; entry = entry->next) {
+        entry->resolving = false;
+    }
+    pthread_cond_init(&mosquitto_resolver_cond, NULL);
+    pthread_mutex_unlock(&mosquitto_resolver_mutex);
+}
+
+/*
+ * call-seq:
+ *   Mosquitto.resolver_cache(60) -> Boolean
+ *
+ * Enable the process wide resolver cache for broker hostnames. Clients connect to a cached numeric address
+ * and many clients connecting to the same broker share a single lookup. Concurrent lookups for the same host
+ * wait for the first one instead of hitting DNS in parallel. Every address a host resolves to is cached and
+ * tried in turn, falling back to the hostname. libmosquitto reuses the address for automatic reconnects and
+ * Mosquitto::Client#reconnect while it's current - once it expired, clients reconnect through the cache again.
+ *
+ * Clients configured with Mosquitto::Client#tls_set verify the broker certificate against the hostname and
+ * thus bypass the cache, unless Mosquitto::Client#tls_insecure= is set.
+ *
+ * @param ttl [Integer, Float, nil] seconds to keep resolved addresses, nil to disable the cache and drop all
+ *                                 entries
+ * @return [true, false] true if enabled, false if disabled
+ * @raise [ArgumentError] on negative TTLs
+ * @example
+ *   Mosquitto.resolver_cache(60)
+ *
+ */
+static VALUE rb_mosquitto_resolver_cache(VALUE obj, VALUE ttl)
+{
+    long ttl_ms = -1;
+    if (!NIL_P(ttl) && (ttl_ms = (long)(NUM2DBL(ttl) * 1000)) < 0) rb_raise(rb_eArgError, "TTL must not be negative");
+    pthread_mutex_lock(&mosquitto_resolver_mutex);
+    mosquitto_resolver_ttl_ms = ttl_ms;
+    if (ttl_ms < 0) mosquitto_resolver_prune(true);
+    pthread_mutex_unlock(&mosquitto_resolver_mutex);
+    return ttl_ms < 0 ? Qfalse : Qtrue;
+}
+
+/*
+ * call-seq:
+ *   Mosquitto.resolver_seed("broker.local", "10.0.0.5") -> Boolean
+ *
+ * Seed the resolver cache with a pre-resolved address. Clients connecting to the host never go through DNS.
+ * Enables the resolver cache with a 60 second TTL if it isn't enabled yet.
+ *
+ * @param host [String] broker hostname
+ * @param address [String] numeric IPv4 or IPv6 address
+ * @param ttl [Integer, Float, nil] seconds until the address expires, nil to pin it
+ * @return [true] on success
+ * @raise [ArgumentError] if the address isn't numeric
+ * @example
+ *   Mosquitto.resolver_seed("broker.local", "10.0.0.5")
+ *
+ */
+static VALUE rb_mosquitto_resolver_seed(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE host, address, ttl;
+    mosquitto_resolver_entry_t *entry;
+    unsigned char buf[sizeof(struct in6_addr)];
+    const char *host_name, *numeric;
+    long ttl_ms = -1;
+    rb_scan_args(argc, argv, "21", &host, &address, &ttl);
+    Check_Type(host, T_STRING);
+    Check_Type(address, T_STRING);
+    host_name = StringValueCStr(host);
+    numeric = StringValueCStr(address);
+    if (RSTRING_LEN(address) >= MOSQ_RESOLVER_ADDRSTRLEN ||
+        (inet_pton(AF_INET, numeric, buf) != 1 && inet_pton(AF_INET6, numeric, buf) != 1)) {
+        rb_raise(rb_eArgError, "expected a numeric IPv4 or IPv6 address");
+    }
+    if (!NIL_P(ttl) && (ttl_ms = (long)(NUM2DBL(ttl) * 1000)) < 0) rb_raise(rb_eArgError, "TTL must not be negative");
+    pthread_mutex_lock(&mosquitto_resolver_mutex);
+    if ((entry = mosquitto_resolver_entry(host_name)) == NULL) {
+        pthread_mutex_unlock(&mosquitto_resolver_mutex);
+        rb_memerror();
+    }
+    strcpy(entry->addresses[0], numeric);
+    entry->count = 1;
+    entry->pinned = NIL_P(ttl);
+    if (!entry->pinned) mosquitto_resolver_expire_in(entry, ttl_ms);
+    if (mosquitto_resolver_ttl_ms < 0) mosquitto_resolver_ttl_ms = 60 * 1000;
+    pthread_mutex_unlock(&mosquitto_resolver_mutex);
+    return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   Mosquitto.resolver_flush -> Boolean
+ *
+ * Drop all cached addresses, including pinned ones. Lookups in progress finish undisturbed. Clients connected
+ * through a dropped address reconnect through the cache the next time they lose their connection.
+ *
+ * @return [true] on success
+ * @example
+ *   Mosquitto.resolver_flush
+ *
+ */
+static VALUE rb_mosquitto_resolver_flush(VALUE obj)
+{
+    pthread_mutex_lock(&mosquitto_resolver_mutex);
+    mosquitto_resolver_prune(true);
+    pthread_mutex_unlock(&mosquitto_resolver_mutex);
+    return Qtrue;
+}
+
+/*
+ * call-seq:
+ *   Mosquitto.resolver_stats -> Hash
+ *
+ * Resolver cache counters : cache hits, lookups that went to DNS, failed lookups and cached hosts.
+ *
+ * @return [Hash] counters
+ * @example
+ *   Mosquitto.resolver_stats -> {:hits => 1999, :misses => 1, :failures => 0, :entries => 1}
+ *
+ */
+static VALUE rb_mosquitto_resolver_stats(VALUE obj)
+{
+    VALUE stats = rb_hash_new();
+    mosquitto_resolver_entry_t *entry;
+    unsigned long hits, misses, failures, entries = 0;
+    pthread_mutex_lock(&mosquitto_resolver_mutex);
+    hits = mosquitto_resolver_hits;
+    misses = mosquitto_resolver_misses;
+    failures = mosquitto_resolver_failures;
+    for (entry = mosquitto_resolver_entries; entry != NULL; entry = entry->next) {
+        if (entry->count > 0) entries++;
+    }
+    pthread_mutex_unlock(&mosquitto_resolver_mutex);
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULONG2NUM(hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULONG2NUM(misses));
+    rb_hash_aset(stats, ID2SYM(rb_intern("failures")), ULONG2NUM(failures));
+    rb_hash_aset(stats, ID2SYM(rb_intern("entries")), ULONG2NUM(entries));
+    return stats;
+}
+
+void _init_rb_mosquitto_resolver()
+{
+    rb_define_module_function(rb_mMosquitto, "resolver_cache", rb_mosquitto_resolver_cache, 1);
+    rb_define_module_function(rb_mMosquitto, "resolver_seed", rb_mosquitto_resolver_seed, -1);
+    rb_define_module_function(rb_mMosquitto, "resolver_flush", rb_mosquitto_resolver_flush, 0);
+    rb_define_module_function(rb_mMosquitto, "resolver_stats", rb_mosquitto_resolver_stats, 0);
+}
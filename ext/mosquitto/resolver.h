@@ -0,0 +1,34 @@
+#ifndef MOSQUITTO_RESOLVER_H
+#define MOSQUITTO_RESOLVER_H
+
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define MOSQ_RESOLVER_ADDRSTRLEN INET6_ADDRSTRLEN
+#define MOSQ_RESOLVER_MAX_ADDRESSES 8
+
+typedef char mosquitto_resolver_address_t[MOSQ_RESOLVER_ADDRSTRLEN];
+
+/*
+ * Process wide cache of hostname to numeric addresses mappings, in getaddrinfo(3) order. Entries being resolved
+ * block concurrent lookups for the same host (single flight). Seeded entries with no expiry never go through DNS.
+ */
+typedef struct mosquitto_resolver_entry_t mosquitto_resolver_entry_t;
+struct mosquitto_resolver_entry_t {
+    char *host;
+    mosquitto_resolver_address_t addresses[MOSQ_RESOLVER_MAX_ADDRESSES];
+    int count;
+    struct timespec expires_at;
+    bool pinned;
+    bool resolving;
+    mosquitto_resolver_entry_t *next;
+};
+
+int mosquitto_resolver_lookup(const char *host, mosquitto_resolver_address_t *addresses);
+bool mosquitto_resolver_current(const char *host, const char *address);
+void mosquitto_resolver_atfork_prepare(void);
+void mosquitto_resolver_atfork_parent(void);
+void mosquitto_resolver_atfork_child(void);
+void _init_rb_mosquitto_resolver();
+
+#endif
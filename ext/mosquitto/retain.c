@@ -0,0 +1,252 @@
+#include "mosquitto_ext.h"
+
+/*
+ * :nodoc:
+ *  Retained message cache. Updated from the libmosquitto network thread - pure C and free of Ruby VM calls.
+ *
+ */
+
+static bool mosquitto_retain_matches(const char *filter, const char *topic)
+{
+    bool result = false;
+    if (mosquitto_topic_matches_sub(filter, topic, &result) != MOSQ_ERR_SUCCESS) return false;
+    return result;
+}
+
+/*
+ * :nodoc:
+ *  Orders two filters matching the same topic, level by level : the end of a filter beats a literal level, a
+ *  literal level beats '+' and '+' beats '#'. Distinct filters matching one topic always differ somewhere.
+ *  Returns > 0 when a is the more specific one.
+ *
+ */
+static int mosquitto_retain_level_rank(const char *level)
+{
+    if (*level == '\0') return 3;
+    if (*level == '#') return 0;
+    if (*level == '+' && (level[1] == '/' || level[1] == '\0')) return 1;
+    return 2;
+}
+
+static int mosquitto_retain_specificity(const char *a, const char *b)
+{
+    int rank_a, rank_b;
+    while (true) {
+        rank_a = mosquitto_retain_level_rank(a);
+        rank_b = mosquitto_retain_level_rank(b);
+        if (rank_a != rank_b) return rank_a - rank_b;
+        if (rank_a == 3 || rank_a == 0) return 0;
+        while (*a != '\0' && *a != '/') a++;
+        while (*b != '\0' && *b != '/') b++;
+        if (*a == '/') a++;
+        if (*b == '/') b++;
+    }
+}
+
+mosquitto_retain_cache_t *mosquitto_retain_cache_new(void)
+{
+    mosquitto_retain_cache_t *cache = MOSQ_ALLOC(mosquitto_retain_cache_t);
+    if (cache == NULL) return NULL;
+    cache->capacity = 64;
+    cache->buckets = calloc(cache->capacity, sizeof(mosquitto_retain_entry_t *));
+    if (cache->buckets == NULL) {
+        free(cache);
+        return NULL;
+    }
+    cache->filters = NULL;
+    cache->count = 0;
+    cache->bytes = 0;
+    cache->max_topics = MOSQ_RETAIN_MAX_TOPICS;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->updates = 0;
+    cache->overflows = 0;
+    return cache;
+}
+
+/*
+ * :nodoc:
+ *  Adds a filter, or changes whether an existing one caches the latest message of any kind.
+ *
+ */
+int mosquitto_retain_cache_add_filter(mosquitto_retain_cache_t *cache, const char *filter, bool latest)
+{
+    mosquitto_retain_filter_t *f;
+    for (f = cache->filters; f != NULL; f = f->next) {
+        if (strcmp(f->filter, filter) == 0) {
+            f->latest = latest;
+            return 0;
+        }
+    }
+    f = MOSQ_ALLOC(mosquitto_retain_filter_t);
+    if (f == NULL) return -1;
+    if ((f->filter = strdup(filter)) == NULL) {
+        free(f);
+        return -1;
+    }
+    f->latest = latest;
+    f->next = cache->filters;
+    cache->filters = f;
+    return 0;
+}
+
+static void mosquitto_retain_entry_free(mosquitto_retain_cache_t *cache, mosquitto_retain_entry_t *entry)
+{
+    cache->bytes -= sizeof(mosquitto_retain_entry_t) + mosquitto_message_memsize(entry->msg);
+    cache->count--;
+    mosquitto_message_free(&entry->msg);
+    free(entry);
+}
+
+/*
+ * :nodoc:
+ *  Removes a filter along with cached topics no other filter matches.
+ *
+ */
+bool mosquitto_retain_cache_remove_filter(mosquitto_retain_cache_t *cache, const char *filter)
+{
+    mosquitto_retain_filter_t **f, *removed = NULL, *other;
+    mosquitto_retain_entry_t **entry, *stale;
+    size_t i;
+    bool matched;
+    for (f = &cache->filters; *f != NULL; f = &(*f)->next) {
+        if (strcmp((*f)->filter, filter) == 0) {
+            removed = *f;
+            *f = removed->next;
+            break;
+        }
+    }
+    if (removed == NULL) return false;
+    for (i = 0; i < cache->capacity; i++) {
+        entry = &cache->buckets[i];
+        while (*entry != NULL) {
+            matched = false;
+            for (other = cache->filters; other != NULL && !matched; other = other->next) {
+                matched = mosquitto_retain_matches(other->filter, (*entry)->msg->topic);
+            }
+            if (matched) {
+                entry = &(*entry)->next;
+            } else {
+                stale = *entry;
+                *entry = stale->next;
+                mosquitto_retain_entry_free(cache, stale);
+            }
+        }
+    }
+    free(removed->filter);
+    free(removed);
+    return true;
+}
+
+static void mosquitto_retain_cache_grow(mosquitto_retain_cache_t *cache)
+{
+    mosquitto_retain_entry_t **buckets, *entry, *next;
+    size_t i, capacity = cache->capacity * 2;
+    buckets = calloc(capacity, sizeof(mosquitto_retain_entry_t *));
+    if (buckets == NULL) return;
+    for (i = 0; i < cache->capacity; i++) {
+        for (entry = cache->buckets[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (capacity - 1)];
+            buckets[entry->hash & (capacity - 1)] = entry;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->capacity = capacity;
+}
+
+/*
+ * :nodoc:
+ *  Stores a message if the most specific filter matching its topic accepts it. Brokers clear the RETAIN flag on
+ *  messages forwarded to established subscriptions, so any message on a topic already cached replaces it.
+ *  Empty payloads clear the topic, as they do on the broker.
+ *
+ */
+void mosquitto_retain_cache_update(mosquitto_retain_cache_t *cache, const struct mosquitto_message *msg)
+{
+    mosquitto_retain_filter_t *f, *match = NULL;
+    mosquitto_retain_entry_t **entry, *stale;
+    struct mosquitto_message *copy;
+    uint64_t hash;
+    for (f = cache->filters; f != NULL; f = f->next) {
+        if (!mosquitto_retain_matches(f->filter, msg->topic)) continue;
+        if (match == NULL || mosquitto_retain_specificity(f->filter, match->filter) > 0) match = f;
+    }
+    if (match == NULL) return;
+    hash = mosquitto_fnv1a(msg->topic, strlen(msg->topic));
+    for (entry = &cache->buckets[hash & (cache->capacity - 1)]; *entry != NULL; entry = &(*entry)->next) {
+        if ((*entry)->hash == hash && strcmp((*entry)->msg->topic, msg->topic) == 0) break;
+    }
+    if (*entry == NULL && !match->latest && !msg->retain) return;
+    if (msg->payloadlen == 0) {
+        if (*entry != NULL) {
+            stale = *entry;
+            *entry = stale->next;
+            mosquitto_retain_entry_free(cache, stale);
+        }
+        return;
+    }
+    if ((copy = MOSQ_ALLOC(struct mosquitto_message)) == NULL) return;
+    if (mosquitto_message_copy(copy, msg) != MOSQ_ERR_SUCCESS) {
+        free(copy);
+        return;
+    }
+    cache->updates++;
+    if (*entry != NULL) {
+        cache->bytes += mosquitto_message_memsize(copy) - mosquitto_message_memsize((*entry)->msg);
+        mosquitto_message_free(&(*entry)->msg);
+        (*entry)->msg = copy;
+        return;
+    }
+    if (cache->count >= cache->max_topics) {
+        cache->overflows++;
+        mosquitto_message_free(&copy);
+        return;
+    }
+    if ((*entry = MOSQ_ALLOC(mosquitto_retain_entry_t)) == NULL) {
+        mosquitto_message_free(&copy);
+        return;
+    }
+    (*entry)->hash = hash;
+    (*entry)->msg = copy;
+    (*entry)->next = NULL;
+    cache->count++;
+    cache->bytes += sizeof(mosquitto_retain_entry_t) + mosquitto_message_memsize(copy);
+    if (cache->count * 4 > cache->capacity * 3) mosquitto_retain_cache_grow(cache);
+}
+
+const struct mosquitto_message *mosquitto_retain_cache_lookup(mosquitto_retain_cache_t *cache, const char *topic)
+{
+    mosquitto_retain_entry_t *entry;
+    uint64_t hash = mosquitto_fnv1a(topic, strlen(topic));
+    for (entry = cache->buckets[hash & (cache->capacity - 1)]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->msg->topic, topic) == 0) {
+            cache->hits++;
+            return entry->msg;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+void mosquitto_retain_cache_free(mosquitto_retain_cache_t *cache)
+{
+    mosquitto_retain_filter_t *f, *next_filter;
+    mosquitto_retain_entry_t *entry, *next;
+    size_t i;
+    for (i = 0; i < cache->capacity; i++) {
+        for (entry = cache->buckets[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            mosquitto_message_free(&entry->msg);
+            free(entry);
+        }
+    }
+    for (f = cache->filters; f != NULL; f = next_filter) {
+        next_filter = f->next;
+        free(f->filter);
+        free(f);
+    }
+    free(cache->buckets);
+    free(cache);
+}
@@ -0,0 +1,45 @@
+#ifndef MOSQUITTO_RETAIN_H
+#define MOSQUITTO_RETAIN_H
+
+#define MOSQ_RETAIN_MAX_TOPICS 65536
+
+typedef struct mosquitto_retain_filter_t mosquitto_retain_filter_t;
+struct mosquitto_retain_filter_t {
+    char *filter;
+    bool latest;
+    mosquitto_retain_filter_t *next;
+};
+
+typedef struct mosquitto_retain_entry_t mosquitto_retain_entry_t;
+struct mosquitto_retain_entry_t {
+    uint64_t hash;
+    struct mosquitto_message *msg;
+    mosquitto_retain_entry_t *next;
+};
+
+/*
+ * Latest message per topic, for topics matching any of the cache filters. Filters cache retained messages
+ * only, or the latest message of any kind. Chained hash table keyed by topic. Not thread safe - callers
+ * serialize access.
+ */
+typedef struct {
+    mosquitto_retain_filter_t *filters;
+    mosquitto_retain_entry_t **buckets;
+    size_t capacity;
+    size_t count;
+    size_t bytes;
+    size_t max_topics;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long updates;
+    unsigned long overflows;
+} mosquitto_retain_cache_t;
+
+mosquitto_retain_cache_t *mosquitto_retain_cache_new(void);
+int mosquitto_retain_cache_add_filter(mosquitto_retain_cache_t *cache, const char *filter, bool latest);
+bool mosquitto_retain_cache_remove_filter(mosquitto_retain_cache_t *cache, const char *filter);
+void mosquitto_retain_cache_update(mosquitto_retain_cache_t *cache, const struct mosquitto_message *msg);
+const struct mosquitto_message *mosquitto_retain_cache_lookup(mosquitto_retain_cache_t *cache, const char *topic);
+void mosquitto_retain_cache_free(mosquitto_retain_cache_t *cache);
+
+#endif
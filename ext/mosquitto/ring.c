@@ -0,0 +1,429 @@
+#include "mosquitto_ext.h"
+#include <limits.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * :nodoc:
+ *  A shared memory ring buffer for fanning out messages to pre-forked worker processes. The mapping is
+ *  anonymous shared memory inherited across fork(2) - create the ring in the master, attach it to a client
+ *  with Mosquitto::Client#sink and consume from workers with Mosquitto::SharedRing#shift.
+ *
+ *  Producers and consumers claim slots with lock-free sequence cursors (a bounded MPMC queue), so any
+ *  number of workers can consume concurrently and each message is delivered to exactly one of them. A full
+ *  ring drops new messages rather than blocking the network thread.
+ *
+ *  Consumers copy a message out before claiming it, so a claimed slot holds nothing anyone still needs. A
+ *  consumer killed between claiming and releasing a slot thus can't wedge the ring - the producer releases
+ *  the slot on its behalf when it wraps around to it.
+ *
+ */
+
+static size_t mosquitto_ring_stride(mosquitto_ring_header_t *header)
+{
+    return (sizeof(mosquitto_ring_slot_t) + header->slot_size + 7) & ~((size_t)7);
+}
+
+static mosquitto_ring_slot_t *mosquitto_ring_slot(mosquitto_ring_header_t *header, uint64_t pos)
+{
+    char *slots = (char *)header + ((sizeof(mosquitto_ring_header_t) + MOSQ_RING_CACHELINE - 1) & ~((size_t)MOSQ_RING_CACHELINE - 1));
+    return (mosquitto_ring_slot_t *)(slots + (pos & (header->slots - 1)) * mosquitto_ring_stride(header));
+}
+
+static void mosquitto_ring_wake(mosquitto_ring_header_t *header)
+{
+    __atomic_add_fetch(&header->futex, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+    if (__atomic_load_n(&header->waiters, __ATOMIC_ACQUIRE) > 0) {
+        syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+#endif
+}
+
+/*
+ * :nodoc:
+ *  Parks the calling thread until a producer signals or the timeout (in milliseconds, negative for none)
+ *  expires. Uses a process shared futex on Linux and falls back to polling elsewhere.
+ *
+ */
+static void mosquitto_ring_park(mosquitto_ring_header_t *header, uint32_t seen, long timeout_ms)
+{
+    struct timespec ts;
+    if (timeout_ms < 0 || timeout_ms > 100) timeout_ms = 100;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+#ifdef __linux__
+    __atomic_add_fetch(&header->waiters, 1, __ATOMIC_ACQ_REL);
+    syscall(SYS_futex, &header->futex, FUTEX_WAIT, seen, &ts, NULL, 0);
+    __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_ACQ_REL);
+#else
+    if (ts.tv_sec == 0 && ts.tv_nsec > 1000000) ts.tv_nsec = 1000000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+/*
+ * :nodoc:
+ *  Appends a message to the ring. Safe to call from any thread or process without the GVL. Returns 0 on
+ *  success, -1 if the ring is full or the message doesn't fit a slot.
+ *
+ */
+int mosquitto_ring_push(mosquitto_ring_t *ring, const struct mosquitto_message *msg)
+{
+    mosquitto_ring_header_t *header = ring->header;
+    mosquitto_ring_slot_t *slot;
+    uint64_t pos, seq;
+    int64_t diff;
+    size_t topic_len = strlen(msg->topic);
+
+    if (topic_len + (size_t)msg->payloadlen > header->slot_size) {
+        __atomic_add_fetch(&header->dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    pos = __atomic_load_n(&header->enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = mosquitto_ring_slot(header, pos);
+        seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        diff = (int64_t)seq - (int64_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&header->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            /* Claimed by a consumer but not released yet */
+            if (pos >= header->slots && seq == pos - header->slots + 1 &&
+                __atomic_load_n(&header->dequeue_pos, __ATOMIC_ACQUIRE) > pos - header->slots) {
+                __atomic_compare_exchange_n(&slot->sequence, &seq, pos, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+                continue;
+            }
+            __atomic_add_fetch(&header->dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        } else {
+            pos = __atomic_load_n(&header->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->topic_len = (uint32_t)topic_len;
+    slot->payload_len = (uint32_t)msg->payloadlen;
+    slot->qos = msg->qos;
+    slot->retain = msg->retain ? 1 : 0;
+    memcpy(slot->data, msg->topic, topic_len);
+    if (msg->payloadlen > 0) memcpy(slot->data + topic_len, msg->payload, msg->payloadlen);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->written, 1, __ATOMIC_RELAXED);
+    mosquitto_ring_wake(header);
+    return 0;
+}
+
+/*
+ * :nodoc:
+ *  Copies a slot out into a libmosquitto message. The slot may be concurrently released and rewritten if
+ *  another consumer claims it first - lengths are bounds checked and the copy is discarded in that case.
+ *
+ */
+static struct mosquitto_message *mosquitto_ring_copy(mosquitto_ring_header_t *header, mosquitto_ring_slot_t *slot)
+{
+    struct mosquitto_message *msg;
+    uint32_t topic_len = __atomic_load_n(&slot->topic_len, __ATOMIC_RELAXED);
+    uint32_t payload_len = __atomic_load_n(&slot->payload_len, __ATOMIC_RELAXED);
+    if ((uint64_t)topic_len + payload_len > header->slot_size) return NULL;
+    msg = MOSQ_ALLOC(struct mosquitto_message);
+    if (msg == NULL) return NULL;
+    msg->mid = 0;
+    msg->qos = slot->qos;
+    msg->retain = slot->retain ? true : false;
+    msg->payloadlen = (int)payload_len;
+    msg->topic = malloc(topic_len + 1);
+    /* libmosquitto payloads are always NULL terminated as well */
+    msg->payload = malloc(payload_len + 1);
+    if (msg->topic == NULL || msg->payload == NULL) {
+        mosquitto_message_free(&msg);
+        return NULL;
+    }
+    memcpy(msg->topic, slot->data, topic_len);
+    msg->topic[topic_len] = '\0';
+    memcpy(msg->payload, slot->data + topic_len, payload_len);
+    ((char *)msg->payload)[payload_len] = '\0';
+    return msg;
+}
+
+/*
+ * :nodoc:
+ *  Copies out and claims the next message. Returns NULL when the ring is empty. Claiming advances the consumer
+ *  cursor, releasing hands the slot back to the producer - whichever of the consumer or the producer gets
+ *  there first releases it.
+ *
+ */
+static struct mosquitto_message *mosquitto_ring_shift(mosquitto_ring_header_t *header)
+{
+    mosquitto_ring_slot_t *slot;
+    struct mosquitto_message *msg;
+    uint64_t pos, seq;
+    int64_t diff;
+
+    pos = __atomic_load_n(&header->dequeue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = mosquitto_ring_slot(header, pos);
+        seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        diff = (int64_t)seq - (int64_t)(pos + 1);
+        if (diff == 0) {
+            msg = mosquitto_ring_copy(header, slot);
+            if (__atomic_compare_exchange_n(&header->dequeue_pos, &pos, pos + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+            /* Lost the slot to another consumer - pos now holds the current cursor */
+            if (msg != NULL) mosquitto_message_free(&msg);
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&header->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    seq = pos + 1;
+    __atomic_compare_exchange_n(&slot->sequence, &seq, pos + header->slots, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&header->read, 1, __ATOMIC_RELAXED);
+    return msg;
+}
+
+struct nogvl_ring_shift_args {
+    mosquitto_ring_t *ring;
+    long timeout_ms;
+    bool interrupted;
+    struct mosquitto_message *msg;
+};
+
+static void *rb_mosquitto_ring_shift_nogvl(void *ptr)
+{
+    struct nogvl_ring_shift_args *args = ptr;
+    mosquitto_ring_header_t *header = args->ring->header;
+    struct timespec start, now;
+    long elapsed = 0;
+    uint32_t seen;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!__atomic_load_n(&args->interrupted, __ATOMIC_ACQUIRE)) {
+        seen = __atomic_load_n(&header->futex, __ATOMIC_ACQUIRE);
+        if ((args->msg = mosquitto_ring_shift(header)) != NULL) break;
+        if (args->timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (elapsed >= args->timeout_ms) break;
+        }
+        mosquitto_ring_park(header, seen, args->timeout_ms < 0 ? -1 : args->timeout_ms - elapsed);
+    }
+    return NULL;
+}
+
+/*
+ * :nodoc:
+ *  Interrupts a single blocked shift. Other consumers parked on the ring are woken up as well, but find their
+ *  own call not interrupted and park again.
+ *
+ */
+static void rb_mosquitto_ring_shift_ubf(void *ptr)
+{
+    struct nogvl_ring_shift_args *args = ptr;
+    __atomic_store_n(&args->interrupted, true, __ATOMIC_RELEASE);
+#ifdef __linux__
+    syscall(SYS_futex, &args->ring->header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/*
+ * :nodoc:
+ *  GC callback for releasing an out of scope Mosquitto::SharedRing object. Only unmaps the ring for the
+ *  current process - other processes sharing it are unaffected.
+ *
+ */
+static void rb_mosquitto_free_ring(void *ptr)
+{
+    mosquitto_ring_t *ring = (mosquitto_ring_t *)ptr;
+    if (ring) {
+        if (ring->header) munmap(ring->header, ring->mapping_size);
+        xfree(ring);
+    }
+}
+
+/*
+ * call-seq:
+ *   Mosquitto::SharedRing.new(1024, 4096) -> Mosquitto::SharedRing
+ *
+ * Create a new shared memory ring buffer. The ring is shared with any child processes forked after
+ * creation.
+ *
+ * @param slots [Integer] number of message slots, rounded up to the next power of two. Defaults to 1024.
+ * @param slot_size [Integer] maximum topic and payload bytes per message. Defaults to 4096. Larger
+ *                            messages are dropped.
+ * @return [Mosquitto::SharedRing] shared ring instance
+ * @raise [ArgumentError, SystemCallError] on invalid input params or if the mapping could not be created
+ * @example
+ *   Mosquitto::SharedRing.new -> Mosquitto::SharedRing
+ *   Mosquitto::SharedRing.new(4096, 512) -> Mosquitto::SharedRing
+ *
+ */
+static VALUE rb_mosquitto_ring_s_new(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE obj, slots, slot_size;
+    mosquitto_ring_t *ring = NULL;
+    mosquitto_ring_header_t *header;
+    uint32_t nslots = 1, i;
+    long requested_slots = MOSQ_RING_DEFAULT_SLOTS, requested_size = MOSQ_RING_DEFAULT_SLOT_SIZE;
+    size_t header_size;
+    rb_scan_args(argc, argv, "02", &slots, &slot_size);
+    if (!NIL_P(slots)) {
+        Check_Type(slots, T_FIXNUM);
+        requested_slots = NUM2LONG(slots);
+    }
+    if (!NIL_P(slot_size)) {
+        Check_Type(slot_size, T_FIXNUM);
+        requested_size = NUM2LONG(slot_size);
+    }
+    if (requested_slots < 1 || requested_slots > (1L << 24)) rb_raise(rb_eArgError, "slots must be between 1 and 16777216");
+    if (requested_size < 1 || requested_size > (1L << 28)) rb_raise(rb_eArgError, "slot size must be between 1 and 268435456");
+    while (nslots < (uint32_t)requested_slots) nslots <<= 1;
+
+    obj = Data_Make_Struct(klass, mosquitto_ring_t, 0, rb_mosquitto_free_ring, ring);
+    header_size = (sizeof(mosquitto_ring_header_t) + MOSQ_RING_CACHELINE - 1) & ~((size_t)MOSQ_RING_CACHELINE - 1);
+    ring->mapping_size = header_size + (size_t)nslots * ((sizeof(mosquitto_ring_slot_t) + requested_size + 7) & ~((size_t)7));
+    header = mmap(NULL, ring->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (header == MAP_FAILED) rb_sys_fail("mmap");
+    header->magic = MOSQ_RING_MAGIC;
+    header->slots = nslots;
+    header->slot_size = (uint32_t)requested_size;
+    ring->header = header;
+    for (i = 0; i < nslots; i++) {
+        mosquitto_ring_slot(header, i)->sequence = i;
+    }
+    rb_obj_call_init(obj, 0, NULL);
+    return obj;
+}
+
+/*
+ * call-seq:
+ *   ring.push("topic", "payload") -> Boolean
+ *
+ * Append a message to the ring from Ruby. Messages are usually produced by a client sink instead.
+ *
+ * @param topic [String] message topic
+ * @param payload [String] message payload
+ * @return [true, false] false if the ring is full or the message too large for a slot
+ * @raise [TypeError] on invalid input params
+ * @example
+ *   ring.push("topic", "payload")
+ *
+ */
+static VALUE rb_mosquitto_ring_push(VALUE obj, VALUE topic, VALUE payload)
+{
+    struct mosquitto_message msg;
+    MosquittoGetRing(obj);
+    Check_Type(topic, T_STRING);
+    MosquittoEncode(topic);
+    Check_Type(payload, T_STRING);
+    MosquittoEncode(payload);
+    msg.mid = 0;
+    msg.topic = StringValueCStr(topic);
+    msg.payload = RSTRING_PTR(payload);
+    msg.payloadlen = (int)RSTRING_LEN(payload);
+    msg.qos = 0;
+    msg.retain = false;
+    return (mosquitto_ring_push(ring, &msg) == 0) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   ring.shift(1.5) -> Mosquitto::Message or nil
+ *
+ * Consume the next message from the ring. Blocks without holding the GVL until a message arrives or the
+ * timeout expires. Safe to call concurrently from any number of threads or processes - each message is
+ * delivered once.
+ *
+ * @param timeout [Integer, Float, nil] seconds to wait for a message. 0 returns immediately, nil waits
+ *                                      indefinitely.
+ * @return [Mosquitto::Message, nil] the next message, or nil on timeout
+ * @raise [TypeError] on invalid input params
+ * @raise [ArgumentError] on negative timeouts
+ * @example
+ *   ring.shift(1.5) -> Mosquitto::Message
+ *   ring.shift(0) -> nil
+ *
+ */
+static VALUE rb_mosquitto_ring_shift(int argc, VALUE *argv, VALUE obj)
+{
+    struct nogvl_ring_shift_args args;
+    VALUE timeout;
+    MosquittoGetRing(obj);
+    rb_scan_args(argc, argv, "01", &timeout);
+    if (!NIL_P(timeout) && NUM2DBL(timeout) < 0) rb_raise(rb_eArgError, "timeout must not be negative");
+    args.ring = ring;
+    args.msg = NULL;
+    args.interrupted = false;
+    args.timeout_ms = NIL_P(timeout) ? -1 : (long)(NUM2DBL(timeout) * 1000);
+    if (args.timeout_ms == 0) {
+        args.msg = mosquitto_ring_shift(ring->header);
+    } else {
+        rb_thread_call_without_gvl(rb_mosquitto_ring_shift_nogvl, (void *)&args, rb_mosquitto_ring_shift_ubf, (void *)&args);
+    }
+    if (args.msg == NULL) return Qnil;
+    return rb_mosquitto_message_alloc(args.msg);
+}
+
+/*
+ * call-seq:
+ *   ring.size -> Integer
+ *
+ * Number of messages currently buffered in the ring.
+ *
+ * @return [Integer] buffered messages
+ * @example
+ *   ring.size -> 2
+ *
+ */
+static VALUE rb_mosquitto_ring_size(VALUE obj)
+{
+    uint64_t enqueued, dequeued;
+    MosquittoGetRing(obj);
+    dequeued = __atomic_load_n(&ring->header->dequeue_pos, __ATOMIC_ACQUIRE);
+    enqueued = __atomic_load_n(&ring->header->enqueue_pos, __ATOMIC_ACQUIRE);
+    return ULL2NUM(enqueued > dequeued ? enqueued - dequeued : 0);
+}
+
+/*
+ * call-seq:
+ *   ring.stats -> Hash
+ *
+ * Ring buffer geometry and counters, shared by all processes attached to the ring.
+ *
+ * @return [Hash] ring statistics
+ * @example
+ *   ring.stats -> {:slots => 1024, :slot_size => 4096, :written => 10, :read => 8, :dropped => 0}
+ *
+ */
+static VALUE rb_mosquitto_ring_stats(VALUE obj)
+{
+    VALUE stats;
+    MosquittoGetRing(obj);
+    stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("slots")), UINT2NUM(ring->header->slots));
+    rb_hash_aset(stats, ID2SYM(rb_intern("slot_size")), UINT2NUM(ring->header->slot_size));
+    rb_hash_aset(stats, ID2SYM(rb_intern("written")), ULL2NUM(__atomic_load_n(&ring->header->written, __ATOMIC_RELAXED)));
+    rb_hash_aset(stats, ID2SYM(rb_intern("read")), ULL2NUM(__atomic_load_n(&ring->header->read, __ATOMIC_RELAXED)));
+    rb_hash_aset(stats, ID2SYM(rb_intern("dropped")), ULL2NUM(__atomic_load_n(&ring->header->dropped, __ATOMIC_RELAXED)));
+    return stats;
+}
+
+/*
+ *  A shared memory ring buffer for fanning out messages from a single subscriber process to pre-forked
+ *  worker processes.
+ *
+ */
+
+void _init_rb_mosquitto_shared_ring()
+{
+    rb_cMosquittoSharedRing = rb_define_class_under(rb_mMosquitto, "SharedRing", rb_cObject);
+
+    rb_define_singleton_method(rb_cMosquittoSharedRing, "new", rb_mosquitto_ring_s_new, -1);
+    rb_define_method(rb_cMosquittoSharedRing, "push", rb_mosquitto_ring_push, 2);
+    rb_define_method(rb_cMosquittoSharedRing, "shift", rb_mosquitto_ring_shift, -1);
+    rb_define_method(rb_cMosquittoSharedRing, "size", rb_mosquitto_ring_size, 0);
+    rb_define_method(rb_cMosquittoSharedRing, "stats", rb_mosquitto_ring_stats, 0);
+}
@@ -0,0 +1,52 @@
+#ifndef MOSQUITTO_RING_H
+#define MOSQUITTO_RING_H
+
+#include <sys/mman.h>
+
+#define MOSQ_RING_MAGIC 0x4d515452
+#define MOSQ_RING_CACHELINE 64
+
+#define MOSQ_RING_DEFAULT_SLOTS 1024
+#define MOSQ_RING_DEFAULT_SLOT_SIZE 4096
+
+/*
+ * Shared ring layout : a header followed by a power of two number of fixed size slots. Each slot
+ * carries a sequence number used as a lock-free cursor (bounded MPMC queue) - the producer and consumer
+ * cursors live on separate cache lines.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t futex;
+    uint32_t waiters;
+    uint64_t written;
+    uint64_t read;
+    uint64_t dropped;
+    uint64_t enqueue_pos __attribute__ ((aligned (MOSQ_RING_CACHELINE)));
+    uint64_t dequeue_pos __attribute__ ((aligned (MOSQ_RING_CACHELINE)));
+} mosquitto_ring_header_t;
+
+typedef struct {
+    uint64_t sequence;
+    uint32_t topic_len;
+    uint32_t payload_len;
+    int32_t qos;
+    int32_t retain;
+    char data[];
+} mosquitto_ring_slot_t;
+
+typedef struct {
+    mosquitto_ring_header_t *header;
+    size_t mapping_size;
+} mosquitto_ring_t;
+
+#define MosquittoGetRing(obj) \
+    mosquitto_ring_t *ring = NULL; \
+    Data_Get_Struct(obj, mosquitto_ring_t, ring); \
+    if (!ring || !ring->header) rb_raise(rb_eTypeError, "uninitialized Mosquitto shared ring!");
+
+int mosquitto_ring_push(mosquitto_ring_t *ring, const struct mosquitto_message *msg);
+void _init_rb_mosquitto_shared_ring();
+
+#endif
@@ -0,0 +1,296 @@
+#include "mosquitto_ext.h"
+
+/*
+ * :nodoc:
+ *  Request / response over MQTT 3.1, which has no response topic or correlation data properties. Requests
+ *  carry their reply topic in an envelope - the NUL terminated reply topic followed by the request body. Each
+ *  client subscribes once to _rpc/<token>/+ and replies are matched to waiting callers by the correlation id
+ *  in the last topic level, on the libmosquitto network thread and without touching the Ruby VM.
+ *
+ */
+
+/* Timed waits measure against the monotonic clock where condition variables can be told to */
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+#define MOSQ_RPC_CLOCK CLOCK_MONOTONIC
+#else
+#define MOSQ_RPC_CLOCK CLOCK_REALTIME
+#endif
+
+/* Random token - reply topics of concurrent clients, or of a restarted or forked process, don't collide */
+static void mosquitto_rpc_reply_prefix(mosquitto_rpc_t *rpc, unsigned int seed)
+{
+    rpc->reply_prefix_len = (size_t)snprintf(rpc->reply_prefix, MOSQ_RPC_TOPIC_MAX, MOSQ_RPC_TOPIC_PREFIX "%08x%08x/", (unsigned int)rand_r(&seed), (unsigned int)rand_r(&seed));
+}
+
+mosquitto_rpc_t *mosquitto_rpc_new(unsigned int seed)
+{
+    mosquitto_rpc_t *rpc = MOSQ_ALLOC(mosquitto_rpc_t);
+    if (rpc == NULL) return NULL;
+    if ((rpc->pending = mosquitto_mid_table_new()) == NULL) {
+        free(rpc);
+        return NULL;
+    }
+    mosquitto_rpc_reply_prefix(rpc, seed);
+    pthread_mutex_init(&rpc->mutex, NULL);
+    rpc->next_id = 0;
+    rpc->subscribed = false;
+    rpc->requests = 0;
+    rpc->replies = 0;
+    rpc->timeouts = 0;
+    rpc->unsent = 0;
+    rpc->failures = 0;
+    rpc->orphans = 0;
+    return rpc;
+}
+
+/*
+ * :nodoc:
+ *  Calls are owned by their callers, which can't be waiting anymore once the client is freed.
+ *
+ */
+void mosquitto_rpc_free(mosquitto_rpc_t *rpc)
+{
+    mosquitto_mid_table_free(rpc->pending);
+    pthread_mutex_destroy(&rpc->mutex);
+    free(rpc);
+}
+
+bool mosquitto_rpc_is_reply(const mosquitto_rpc_t *rpc, const char *topic)
+{
+    return strncmp(topic, rpc->reply_prefix, rpc->reply_prefix_len) == 0;
+}
+
+/*
+ * :nodoc:
+ *  Hands a copy of a reply to the caller waiting on its correlation id. Replies arriving after the caller
+ *  gave up are dropped and counted as orphans.
+ *
+ */
+void mosquitto_rpc_resolve(mosquitto_rpc_t *rpc, const struct mosquitto_message *msg)
+{
+    mosquitto_rpc_call_t *call = NULL;
+    struct mosquitto_message *reply;
+    const char *id = msg->topic + rpc->reply_prefix_len;
+    char *end;
+    long key;
+    key = strtol(id, &end, 10);
+    if (end == id || *end != '\0' || key <= 0 || key > INT_MAX) return;
+    reply = MOSQ_ALLOC(struct mosquitto_message);
+    if (reply != NULL && mosquitto_message_copy(reply, msg) != MOSQ_ERR_SUCCESS) {
+        free(reply);
+        reply = NULL;
+    }
+    pthread_mutex_lock(&rpc->mutex);
+    call = mosquitto_mid_table_lookup(rpc->pending, (int)key);
+    if (call != NULL && call->state == MOSQ_RPC_PENDING && reply != NULL) {
+        call->reply = reply;
+        call->state = MOSQ_RPC_REPLIED;
+        rpc->replies++;
+        pthread_cond_signal(&call->cond);
+        reply = NULL;
+    } else if (call == NULL) {
+        rpc->orphans++;
+    }
+    pthread_mutex_unlock(&rpc->mutex);
+    if (reply != NULL) mosquitto_message_free(&reply);
+}
+
+/*
+ * :nodoc:
+ *  Fails all pending calls and forgets the reply subscription - invoked on disconnect.
+ *
+ */
+void mosquitto_rpc_fail_all(mosquitto_rpc_t *rpc)
+{
+    mosquitto_rpc_call_t *call;
+    int i;
+    pthread_mutex_lock(&rpc->mutex);
+    rpc->subscribed = false;
+    for (i = 0; i < rpc->pending->capacity; i++) {
+        if (rpc->pending->entries[i].key <= 0) continue;
+        call = rpc->pending->entries[i].value;
+        if (call->state != MOSQ_RPC_PENDING) continue;
+        call->state = MOSQ_RPC_FAILED;
+        rpc->failures++;
+        pthread_cond_signal(&call->cond);
+    }
+    pthread_mutex_unlock(&rpc->mutex);
+}
+
+/*
+ * :nodoc:
+ *  Forked children only inherit the forking thread - calls of any other thread are never waited on or released
+ *  again and are dropped here. Their condition variables may still count waiters that don't exist in the child, so
+ *  they're never destroyed. A new reply token keeps the parent's replies from reaching the child.
+ *
+ */
+void mosquitto_rpc_after_fork(mosquitto_rpc_t *rpc, unsigned int seed)
+{
+    mosquitto_rpc_call_t *call;
+    int i;
+    pthread_mutex_lock(&rpc->mutex);
+    for (i = 0; i < rpc->pending->capacity; i++) {
+        if (rpc->pending->entries[i].key <= 0) continue;
+        call = mosquitto_mid_table_remove(rpc->pending, rpc->pending->entries[i].key);
+        if (call->reply != NULL) mosquitto_message_free(&call->reply);
+        free(call);
+    }
+    rpc->subscribed = false;
+    mosquitto_rpc_reply_prefix(rpc, seed);
+    pthread_mutex_unlock(&rpc->mutex);
+}
+
+/*
+ * :nodoc:
+ *  Splits a request into its reply topic and body. Returns false for messages not sent with
+ *  Mosquitto::Client#request.
+ *
+ */
+bool mosquitto_rpc_envelope(const struct mosquitto_message *msg, const char **reply_topic, const void **body, int *body_len)
+{
+    const char *payload = (const char *)msg->payload;
+    const char *nul;
+    int prefix_len = (int)strlen(MOSQ_RPC_TOPIC_PREFIX);
+    if (payload == NULL || msg->payloadlen <= prefix_len || strncmp(payload, MOSQ_RPC_TOPIC_PREFIX, prefix_len) != 0) return false;
+    nul = memchr(payload, '\0', msg->payloadlen < MOSQ_RPC_TOPIC_MAX ? msg->payloadlen : MOSQ_RPC_TOPIC_MAX);
+    if (nul == NULL) return false;
+    *reply_topic = payload;
+    *body = nul + 1;
+    *body_len = msg->payloadlen - (int)(nul - payload) - 1;
+    return true;
+}
+
+/*
+ * :nodoc:
+ *  Registers a pending call under the next correlation id.
+ *
+ */
+mosquitto_rpc_call_t *mosquitto_rpc_call_new(mosquitto_rpc_t *rpc)
+{
+    mosquitto_rpc_call_t *call = MOSQ_ALLOC(mosquitto_rpc_call_t);
+    pthread_condattr_t attr;
+    int ret;
+    if (call == NULL) return NULL;
+    call->state = MOSQ_RPC_PENDING;
+    call->sent = false;
+    call->interrupted = false;
+    call->reply = NULL;
+    pthread_condattr_init(&attr);
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+    pthread_condattr_setclock(&attr, MOSQ_RPC_CLOCK);
+#endif
+    pthread_cond_init(&call->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_lock(&rpc->mutex);
+    do {
+        if (rpc->next_id == INT_MAX) rpc->next_id = 0;
+        call->id = ++rpc->next_id;
+    } while (mosquitto_mid_table_lookup(rpc->pending, call->id) != NULL);
+    ret = mosquitto_mid_table_insert(rpc->pending, call->id, call);
+    if (ret == 0) rpc->requests++;
+    pthread_mutex_unlock(&rpc->mutex);
+    if (ret != 0) {
+        pthread_cond_destroy(&call->cond);
+        free(call);
+        return NULL;
+    }
+    return call;
+}
+
+/*
+ * :nodoc:
+ *  Unregisters a call and releases a reply not handed over to Ruby. Late replies become orphans. Requests that
+ *  were throttled or failed to publish never had a chance to be replied to and don't count as timeouts.
+ *
+ */
+void mosquitto_rpc_call_free(mosquitto_rpc_t *rpc, mosquitto_rpc_call_t *call)
+{
+    pthread_mutex_lock(&rpc->mutex);
+    mosquitto_mid_table_remove(rpc->pending, call->id);
+    if (call->state == MOSQ_RPC_PENDING) {
+        if (call->sent) {
+            rpc->timeouts++;
+        } else {
+            rpc->unsent++;
+        }
+    }
+    pthread_mutex_unlock(&rpc->mutex);
+    if (call->reply != NULL) mosquitto_message_free(&call->reply);
+    pthread_cond_destroy(&call->cond);
+    free(call);
+}
+
+struct nogvl_rpc_wait_args {
+    mosquitto_rpc_t *rpc;
+    mosquitto_rpc_call_t *call;
+    long timeout_ms;
+};
+
+static void *rb_mosquitto_rpc_wait_nogvl(void *ptr)
+{
+    struct nogvl_rpc_wait_args *args = ptr;
+    mosquitto_rpc_call_t *call = args->call;
+    struct timespec deadline;
+    if (args->timeout_ms >= 0) {
+        clock_gettime(MOSQ_RPC_CLOCK, &deadline);
+        deadline.tv_sec += args->timeout_ms / 1000;
+        deadline.tv_nsec += (args->timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    pthread_mutex_lock(&args->rpc->mutex);
+    while (call->state == MOSQ_RPC_PENDING && !call->interrupted) {
+        if (args->timeout_ms < 0) {
+            pthread_cond_wait(&call->cond, &args->rpc->mutex);
+        } else if (pthread_cond_timedwait(&call->cond, &args->rpc->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&args->rpc->mutex);
+    return NULL;
+}
+
+static void rb_mosquitto_rpc_wait_ubf(void *ptr)
+{
+    struct nogvl_rpc_wait_args *args = ptr;
+    pthread_mutex_lock(&args->rpc->mutex);
+    args->call->interrupted = true;
+    pthread_cond_signal(&args->call->cond);
+    pthread_mutex_unlock(&args->rpc->mutex);
+}
+
+/*
+ * :nodoc:
+ *  Blocks without the GVL until a call is replied to or failed, or the timeout expired. Returns true if the
+ *  call completed. Each call parks on its own condition variable - a reply wakes exactly one caller.
+ *
+ */
+bool rb_mosquitto_rpc_wait(mosquitto_rpc_t *rpc, mosquitto_rpc_call_t *call, VALUE timeout)
+{
+    struct nogvl_rpc_wait_args args;
+    struct timespec started, now;
+    bool completed;
+    long elapsed_ms, timeout_ms = NIL_P(timeout) ? -1 : (long)(NUM2DBL(timeout) * 1000);
+    args.rpc = rpc;
+    args.call = call;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (;;) {
+        args.timeout_ms = timeout_ms;
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed_ms = (now.tv_sec - started.tv_sec) * 1000 + (now.tv_nsec - started.tv_nsec) / 1000000;
+            args.timeout_ms = elapsed_ms >= timeout_ms ? 0 : timeout_ms - elapsed_ms;
+        }
+        rb_thread_call_without_gvl(rb_mosquitto_rpc_wait_nogvl, (void *)&args, rb_mosquitto_rpc_wait_ubf, (void *)&args);
+        if (call->state != MOSQ_RPC_PENDING || !call->interrupted) break;
+        /* Woken up for pending interrupts - handle them and keep waiting if the thread wasn't killed */
+        rb_thread_check_ints();
+        call->interrupted = false;
+    }
+    pthread_mutex_lock(&rpc->mutex);
+    completed = (call->state != MOSQ_RPC_PENDING);
+    pthread_mutex_unlock(&rpc->mutex);
+    return completed;
+}
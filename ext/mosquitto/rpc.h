@@ -0,0 +1,54 @@
+#ifndef MOSQUITTO_RPC_H
+#define MOSQUITTO_RPC_H
+
+/* Reply topics are _rpc/<token>/<correlation id> */
+#define MOSQ_RPC_TOPIC_PREFIX "_rpc/"
+#define MOSQ_RPC_TOPIC_MAX 64
+#define MOSQ_RPC_DEFAULT_TIMEOUT 5.0
+
+#define MOSQ_RPC_PENDING 0x00
+#define MOSQ_RPC_REPLIED 0x01
+#define MOSQ_RPC_FAILED 0x02
+
+/* An in flight request - owned by the Ruby thread waiting on it */
+typedef struct {
+    int id;
+    int state;
+    bool sent;
+    bool interrupted;
+    pthread_cond_t cond;
+    struct mosquitto_message *reply;
+} mosquitto_rpc_call_t;
+
+/*
+ * Per client request / response state. Pending calls are tracked in an open addressing table keyed by
+ * correlation id and resolved from the libmosquitto on_message and on_disconnect callbacks. All fields
+ * below the mutex are guarded by it.
+ */
+typedef struct {
+    char reply_prefix[MOSQ_RPC_TOPIC_MAX];
+    size_t reply_prefix_len;
+    pthread_mutex_t mutex;
+    mosquitto_mid_table_t *pending;
+    int next_id;
+    bool subscribed;
+    unsigned long requests;
+    unsigned long replies;
+    unsigned long timeouts;
+    unsigned long unsent;
+    unsigned long failures;
+    unsigned long orphans;
+} mosquitto_rpc_t;
+
+mosquitto_rpc_t *mosquitto_rpc_new(unsigned int seed);
+void mosquitto_rpc_free(mosquitto_rpc_t *rpc);
+bool mosquitto_rpc_is_reply(const mosquitto_rpc_t *rpc, const char *topic);
+void mosquitto_rpc_resolve(mosquitto_rpc_t *rpc, const struct mosquitto_message *msg);
+void mosquitto_rpc_fail_all(mosquitto_rpc_t *rpc);
+void mosquitto_rpc_after_fork(mosquitto_rpc_t *rpc, unsigned int seed);
+bool mosquitto_rpc_envelope(const struct mosquitto_message *msg, const char **reply_topic, const void **body, int *body_len);
+mosquitto_rpc_call_t *mosquitto_rpc_call_new(mosquitto_rpc_t *rpc);
+void mosquitto_rpc_call_free(mosquitto_rpc_t *rpc, mosquitto_rpc_call_t *call);
+bool rb_mosquitto_rpc_wait(mosquitto_rpc_t *rpc, mosquitto_rpc_call_t *call, VALUE timeout);
+
+#endif
@@ -0,0 +1,265 @@
+#include "mosquitto_ext.h"
+
+/*
+ * :nodoc:
+ *  Native message sinks. Messages matching a sink's subscription filter are appended to a file descriptor
+ *  straight from the libmosquitto network thread and never enter the Ruby VM. Writes are buffered and
+ *  flushed with writev(2) when the buffer fills up or when buffered data grows older than
+ *  MOSQ_SINK_FLUSH_INTERVAL_MS.
+ *
+ *  Nothing in here may call into the Ruby VM - it runs without the GVL.
+ *
+ */
+
+static long mosquitto_sink_elapsed_ms(struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/*
+ * :nodoc:
+ *  Writes out a full iovec array, resuming after partial writes and interrupts.
+ *
+ */
+static int mosquitto_sink_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t written;
+    while (iovcnt > 0) {
+        written = writev(fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+mosquitto_sink_t *mosquitto_sink_new(const char *filter, int fd, int format)
+{
+    mosquitto_sink_t *sink = MOSQ_ALLOC(mosquitto_sink_t);
+    if (sink == NULL) return NULL;
+    sink->buffer = malloc(MOSQ_SINK_BUFFER_SIZE);
+    sink->filter = strdup(filter);
+    if (sink->buffer == NULL || sink->filter == NULL) {
+        free(sink->buffer);
+        free(sink->filter);
+        free(sink);
+        return NULL;
+    }
+    sink->fd = fd;
+    sink->format = format;
+    sink->ring = NULL;
+    sink->ring_obj = Qnil;
+    sink->buffered = 0;
+    sink->messages = 0;
+    sink->bytes = 0;
+    sink->errors = 0;
+    sink->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &sink->flushed_at);
+    return sink;
+}
+
+/*
+ * :nodoc:
+ *  A sink that fans messages out to a Mosquitto::SharedRing instead of a file descriptor. The ring object
+ *  is kept alive by the client's GC mark function.
+ *
+ */
+mosquitto_sink_t *mosquitto_sink_ring_new(const char *filter, mosquitto_ring_t *ring, VALUE ring_obj)
+{
+    mosquitto_sink_t *sink = MOSQ_ALLOC(mosquitto_sink_t);
+    if (sink == NULL) return NULL;
+    sink->filter = strdup(filter);
+    if (sink->filter == NULL) {
+        free(sink);
+        return NULL;
+    }
+    sink->fd = -1;
+    sink->format = MOSQ_SINK_FORMAT_LENGTH_PREFIXED;
+    sink->ring = ring;
+    sink->ring_obj = ring_obj;
+    sink->buffer = NULL;
+    sink->buffered = 0;
+    sink->messages = 0;
+    sink->bytes = 0;
+    sink->errors = 0;
+    sink->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &sink->flushed_at);
+    return sink;
+}
+
+bool mosquitto_sink_matches(mosquitto_sink_t *sink, const char *topic)
+{
+    bool result = false;
+    if (mosquitto_topic_matches_sub(sink->filter, topic, &result) != MOSQ_ERR_SUCCESS) return false;
+    return result;
+}
+
+/*
+ * :nodoc:
+ *  Writes out any buffered messages.
+ *
+ */
+int mosquitto_sink_flush(mosquitto_sink_t *sink)
+{
+    struct iovec iov;
+    int ret = 0;
+    if (sink->buffered > 0) {
+        iov.iov_base = sink->buffer;
+        iov.iov_len = sink->buffered;
+        if ((ret = mosquitto_sink_writev(sink->fd, &iov, 1)) != 0) sink->errors++;
+        sink->buffered = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &sink->flushed_at);
+    return ret;
+}
+
+/*
+ * :nodoc:
+ *  Appends a message to the sink. Length prefixed records are framed as a 32 bit network order topic length,
+ *  the topic, a 32 bit network order payload length and the payload. Raw records are the payload only.
+ *
+ *  Messages that don't fit the buffer are written out directly in a single writev(2) call, behind any
+ *  already buffered data.
+ *
+ */
+int mosquitto_sink_write(mosquitto_sink_t *sink, const struct mosquitto_message *msg)
+{
+    struct iovec iov[5];
+    int iovcnt = 0;
+    size_t i, len = 0;
+    uint32_t topic_len = 0;
+    uint32_t payload_len = htonl((uint32_t)msg->payloadlen);
+    int ret = 0;
+
+    if (sink->ring != NULL) {
+        if (mosquitto_ring_push(sink->ring, msg) != 0) {
+            sink->errors++;
+            return -1;
+        }
+        sink->messages++;
+        sink->bytes += strlen(msg->topic) + msg->payloadlen;
+        return 0;
+    }
+
+    if (sink->format == MOSQ_SINK_FORMAT_LENGTH_PREFIXED) {
+        topic_len = htonl((uint32_t)strlen(msg->topic));
+        iov[iovcnt].iov_base = &topic_len;
+        iov[iovcnt++].iov_len = sizeof(uint32_t);
+        iov[iovcnt].iov_base = msg->topic;
+        iov[iovcnt++].iov_len = ntohl(topic_len);
+        iov[iovcnt].iov_base = &payload_len;
+        iov[iovcnt++].iov_len = sizeof(uint32_t);
+    }
+    iov[iovcnt].iov_base = msg->payload;
+    iov[iovcnt++].iov_len = msg->payloadlen;
+    for (i = 0; i < (size_t)iovcnt; i++) len += iov[i].iov_len;
+
+    if (sink->buffered + len > MOSQ_SINK_BUFFER_SIZE) {
+        ret = mosquitto_sink_flush(sink);
+        if (len > MOSQ_SINK_BUFFER_SIZE) {
+            if (mosquitto_sink_writev(sink->fd, iov, iovcnt) != 0) {
+                sink->errors++;
+                return -1;
+            }
+            sink->messages++;
+            sink->bytes += len;
+            return ret;
+        }
+    }
+
+    for (i = 0; i < (size_t)iovcnt; i++) {
+        memcpy(sink->buffer + sink->buffered, iov[i].iov_base, iov[i].iov_len);
+        sink->buffered += iov[i].iov_len;
+    }
+    sink->messages++;
+    sink->bytes += len;
+
+    if (mosquitto_sink_elapsed_ms(&sink->flushed_at) >= MOSQ_SINK_FLUSH_INTERVAL_MS) {
+        ret = mosquitto_sink_flush(sink);
+    }
+    return ret;
+}
+
+static const char *mosquitto_sink_log_level(int level)
+{
+    switch (level) {
+        case MOSQ_LOG_INFO: return "INFO";
+        case MOSQ_LOG_NOTICE: return "NOTICE";
+        case MOSQ_LOG_WARNING: return "WARNING";
+        case MOSQ_LOG_ERR: return "ERR";
+        case MOSQ_LOG_DEBUG: return "DEBUG";
+        case MOSQ_LOG_SUBSCRIBE: return "SUBSCRIBE";
+        case MOSQ_LOG_UNSUBSCRIBE: return "UNSUBSCRIBE";
+        default: return "UNKNOWN";
+    }
+}
+
+/*
+ * :nodoc:
+ *  Appends a libmosquitto log line to a raw format sink, as "<UTC timestamp> <level> <message>\n". Errors and
+ *  warnings are written out right away, anything else is buffered like messages are.
+ *
+ */
+int mosquitto_sink_write_log(mosquitto_sink_t *sink, int level, const char *str)
+{
+    struct mosquitto_message line;
+    char buffer[MOSQ_SINK_LOG_LINE_MAX];
+    struct timespec now;
+    struct tm tm;
+    size_t len;
+    int ret;
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &tm);
+    len = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &tm);
+    len += (size_t)snprintf(buffer + len, sizeof(buffer) - len, ".%03ldZ %s %s", now.tv_nsec / 1000000, mosquitto_sink_log_level(level), str);
+    if (len > sizeof(buffer) - 2) len = sizeof(buffer) - 2;
+    buffer[len++] = '\n';
+    memset(&line, 0, sizeof(line));
+    line.topic = sink->filter;
+    line.payload = buffer;
+    line.payloadlen = (int)len;
+    ret = mosquitto_sink_write(sink, &line);
+    if (ret == 0 && (level & (MOSQ_LOG_ERR | MOSQ_LOG_WARNING))) ret = mosquitto_sink_flush(sink);
+    return ret;
+}
+
+void mosquitto_sink_syslog(int level, const char *str)
+{
+    int priority;
+    switch (level) {
+        case MOSQ_LOG_ERR: priority = LOG_ERR; break;
+        case MOSQ_LOG_WARNING: priority = LOG_WARNING; break;
+        case MOSQ_LOG_NOTICE: priority = LOG_NOTICE; break;
+        case MOSQ_LOG_INFO: priority = LOG_INFO; break;
+        default: priority = LOG_DEBUG;
+    }
+    syslog(priority, "mosquitto: %s", str);
+}
+
+/*
+ * :nodoc:
+ *  Flushes and releases a sink. The sink owns its file descriptor.
+ *
+ */
+void mosquitto_sink_free(mosquitto_sink_t *sink)
+{
+    if (sink->ring == NULL) {
+        mosquitto_sink_flush(sink);
+        close(sink->fd);
+    }
+    free(sink->buffer);
+    free(sink->filter);
+    free(sink);
+}
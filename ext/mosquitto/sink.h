@@ -0,0 +1,46 @@
+#ifndef MOSQUITTO_SINK_H
+#define MOSQUITTO_SINK_H
+
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syslog.h>
+
+#define MOSQ_SINK_FORMAT_LENGTH_PREFIXED 0x00
+#define MOSQ_SINK_FORMAT_RAW 0x01
+
+/* Bytes buffered per sink before a writev(2) flush */
+#define MOSQ_SINK_BUFFER_SIZE (64 * 1024)
+/* Max age of buffered data before it's flushed on the next write */
+#define MOSQ_SINK_FLUSH_INTERVAL_MS 100
+/* Log lines longer than this are truncated */
+#define MOSQ_SINK_LOG_LINE_MAX 1024
+
+typedef struct mosquitto_sink_t mosquitto_sink_t;
+struct mosquitto_sink_t {
+    char *filter;
+    int fd;
+    int format;
+    mosquitto_ring_t *ring;
+    VALUE ring_obj;
+    char *buffer;
+    size_t buffered;
+    struct timespec flushed_at;
+    unsigned long long messages;
+    unsigned long long bytes;
+    unsigned long long errors;
+    mosquitto_sink_t *next;
+};
+
+mosquitto_sink_t *mosquitto_sink_new(const char *filter, int fd, int format);
+mosquitto_sink_t *mosquitto_sink_ring_new(const char *filter, mosquitto_ring_t *ring, VALUE ring_obj);
+bool mosquitto_sink_matches(mosquitto_sink_t *sink, const char *topic);
+int mosquitto_sink_write(mosquitto_sink_t *sink, const struct mosquitto_message *msg);
+int mosquitto_sink_flush(mosquitto_sink_t *sink);
+int mosquitto_sink_write_log(mosquitto_sink_t *sink, int level, const char *str);
+void mosquitto_sink_syslog(int level, const char *str);
+void mosquitto_sink_free(mosquitto_sink_t *sink);
+
+#endif
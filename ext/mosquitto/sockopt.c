@@ -0,0 +1,133 @@
+#include "mosquitto_ext.h"
+
+/*
+ * :nodoc:
+ *  Socket tuning for client connections. Pure C and free of Ruby VM calls - options are applied from
+ *  libmosquitto's log callback on reconnects, see rb_mosquitto_client_on_log_cb.
+ *
+ */
+
+void mosquitto_socket_options_init(mosquitto_socket_options_t *options)
+{
+    options->nodelay = -1;
+    options->sndbuf = -1;
+    options->rcvbuf = -1;
+    options->busy_poll = -1;
+    options->user_timeout = -1;
+    options->keepalive = -1;
+    options->keepidle = -1;
+    options->keepintvl = -1;
+    options->keepcnt = -1;
+}
+
+/*
+ * :nodoc:
+ *  Whether any option is configured - clients only need libmosquitto's log callback for applying options then.
+ *
+ */
+bool mosquitto_socket_options_set(mosquitto_socket_options_t *options)
+{
+    return options->nodelay >= 0 || options->sndbuf >= 0 || options->rcvbuf >= 0 || options->busy_poll >= 0 ||
+        options->user_timeout >= 0 || options->keepalive >= 0 || options->keepidle >= 0 ||
+        options->keepintvl >= 0 || options->keepcnt >= 0;
+}
+
+static int mosquitto_setsockopt(int sock, int level, int name, int value)
+{
+    if (value < 0) return 0;
+    return setsockopt(sock, level, name, &value, sizeof(value));
+}
+
+/*
+ * :nodoc:
+ *  Applies all configured options to a connected socket. Options not supported by the platform are ignored.
+ *  Returns 0 on success or -1 with errno set if any option was rejected - the remaining ones are still applied.
+ *
+ */
+int mosquitto_socket_options_apply(int sock, mosquitto_socket_options_t *options)
+{
+    int ret = 0, err = 0;
+    if (sock < 0) return 0;
+#define MOSQ_SETSOCKOPT(level, name, value) \
+    if (mosquitto_setsockopt(sock, level, name, value) != 0) { \
+        ret = -1; \
+        err = errno; \
+    }
+    MOSQ_SETSOCKOPT(IPPROTO_TCP, TCP_NODELAY, options->nodelay);
+    MOSQ_SETSOCKOPT(SOL_SOCKET, SO_SNDBUF, options->sndbuf);
+    MOSQ_SETSOCKOPT(SOL_SOCKET, SO_RCVBUF, options->rcvbuf);
+    MOSQ_SETSOCKOPT(SOL_SOCKET, SO_KEEPALIVE, options->keepalive);
+#ifdef SO_BUSY_POLL
+    MOSQ_SETSOCKOPT(SOL_SOCKET, SO_BUSY_POLL, options->busy_poll);
+#endif
+#ifdef TCP_USER_TIMEOUT
+    MOSQ_SETSOCKOPT(IPPROTO_TCP, TCP_USER_TIMEOUT, options->user_timeout);
+#endif
+#ifdef TCP_KEEPIDLE
+    MOSQ_SETSOCKOPT(IPPROTO_TCP, TCP_KEEPIDLE, options->keepidle);
+#endif
+#ifdef TCP_KEEPINTVL
+    MOSQ_SETSOCKOPT(IPPROTO_TCP, TCP_KEEPINTVL, options->keepintvl);
+#endif
+#ifdef TCP_KEEPCNT
+    MOSQ_SETSOCKOPT(IPPROTO_TCP, TCP_KEEPCNT, options->keepcnt);
+#endif
+#undef MOSQ_SETSOCKOPT
+    if (ret != 0) errno = err;
+    return ret;
+}
+
+/*
+ * :nodoc:
+ *  Copies an option from a fresh socket if it was configured before but isn't anymore.
+ *
+ */
+static void mosquitto_socket_option_default(int probe, int level, int name, int previous, int *option)
+{
+    int value;
+    socklen_t len = sizeof(value);
+    if (previous < 0 || *option >= 0) return;
+    if (getsockopt(probe, level, name, &value, &len) != 0) return;
+#ifdef __linux__
+    /* Linux reports buffer sizes doubled for bookkeeping overhead, and doubles them again when set */
+    if (level == SOL_SOCKET && (name == SO_SNDBUF || name == SO_RCVBUF)) value /= 2;
+#endif
+    *option = value;
+}
+
+/*
+ * :nodoc:
+ *  Applies options to a connected socket that already had previous ones applied. Options no longer configured
+ *  revert to the values a new socket starts out with. Returns 0 on success or -1 with errno set if any option was
+ *  rejected.
+ *
+ */
+int mosquitto_socket_options_reapply(int sock, mosquitto_socket_options_t *previous, mosquitto_socket_options_t *options)
+{
+    mosquitto_socket_options_t reverted = *options;
+    int probe;
+    if (sock < 0) return 0;
+    if ((probe = socket(AF_INET, SOCK_STREAM, 0)) >= 0) {
+        mosquitto_socket_option_default(probe, IPPROTO_TCP, TCP_NODELAY, previous->nodelay, &reverted.nodelay);
+        mosquitto_socket_option_default(probe, SOL_SOCKET, SO_SNDBUF, previous->sndbuf, &reverted.sndbuf);
+        mosquitto_socket_option_default(probe, SOL_SOCKET, SO_RCVBUF, previous->rcvbuf, &reverted.rcvbuf);
+        mosquitto_socket_option_default(probe, SOL_SOCKET, SO_KEEPALIVE, previous->keepalive, &reverted.keepalive);
+#ifdef SO_BUSY_POLL
+        mosquitto_socket_option_default(probe, SOL_SOCKET, SO_BUSY_POLL, previous->busy_poll, &reverted.busy_poll);
+#endif
+#ifdef TCP_USER_TIMEOUT
+        mosquitto_socket_option_default(probe, IPPROTO_TCP, TCP_USER_TIMEOUT, previous->user_timeout, &reverted.user_timeout);
+#endif
+#ifdef TCP_KEEPIDLE
+        mosquitto_socket_option_default(probe, IPPROTO_TCP, TCP_KEEPIDLE, previous->keepidle, &reverted.keepidle);
+#endif
+#ifdef TCP_KEEPINTVL
+        mosquitto_socket_option_default(probe, IPPROTO_TCP, TCP_KEEPINTVL, previous->keepintvl, &reverted.keepintvl);
+#endif
+#ifdef TCP_KEEPCNT
+        mosquitto_socket_option_default(probe, IPPROTO_TCP, TCP_KEEPCNT, previous->keepcnt, &reverted.keepcnt);
+#endif
+        close(probe);
+    }
+    return mosquitto_socket_options_apply(sock, &reverted);
+}
@@ -0,0 +1,25 @@
+#ifndef MOSQUITTO_SOCKOPT_H
+#define MOSQUITTO_SOCKOPT_H
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Socket options applied on every (re)connect. Negative values leave the system default in place. */
+typedef struct {
+    int nodelay;
+    int sndbuf;
+    int rcvbuf;
+    int busy_poll;
+    int user_timeout;
+    int keepalive;
+    int keepidle;
+    int keepintvl;
+    int keepcnt;
+} mosquitto_socket_options_t;
+
+void mosquitto_socket_options_init(mosquitto_socket_options_t *options);
+bool mosquitto_socket_options_set(mosquitto_socket_options_t *options);
+int mosquitto_socket_options_apply(int sock, mosquitto_socket_options_t *options);
+int mosquitto_socket_options_reapply(int sock, mosquitto_socket_options_t *previous, mosquitto_socket_options_t *options);
+
+#endif
@@ -0,0 +1,329 @@
+#include "mosquitto_ext.h"
+
+/*
+ * :nodoc:
+ *  Token buckets for rate limiting and inbound message policies. The mosquitto_* functions are pure C and free
+ *  of Ruby VM calls - safe to use from the libmosquitto network thread.
+ *
+ */
+
+/* Process wide connect rate limit, shared by all clients */
+pthread_mutex_t mosquitto_connect_mutex = PTHREAD_MUTEX_INITIALIZER;
+mosquitto_bucket_t *mosquitto_connect_bucket = NULL;
+
+mosquitto_bucket_t *mosquitto_bucket_new(const char *filter, double rate, double burst, int policy)
+{
+    mosquitto_bucket_t *bucket = MOSQ_ALLOC(mosquitto_bucket_t);
+    if (bucket == NULL) return NULL;
+    bucket->filter = NULL;
+    if (filter != NULL && (bucket->filter = strdup(filter)) == NULL) {
+        free(bucket);
+        return NULL;
+    }
+    bucket->rate = rate;
+    bucket->burst = burst < 1 ? 1 : burst;
+    bucket->tokens = bucket->burst;
+    bucket->policy = policy;
+    bucket->passed = 0;
+    bucket->throttled = 0;
+    bucket->dropped = 0;
+    bucket->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->refilled_at);
+    return bucket;
+}
+
+bool mosquitto_bucket_matches(mosquitto_bucket_t *bucket, const char *topic)
+{
+    bool result = false;
+    if (bucket->filter == NULL) return true;
+    if (mosquitto_topic_matches_sub(bucket->filter, topic, &result) != MOSQ_ERR_SUCCESS) return false;
+    return result;
+}
+
+static void mosquitto_bucket_refill(mosquitto_bucket_t *bucket)
+{
+    struct timespec now;
+    double elapsed;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - bucket->refilled_at.tv_sec) + (now.tv_nsec - bucket->refilled_at.tv_nsec) / 1e9;
+    bucket->refilled_at = now;
+    bucket->tokens += elapsed * bucket->rate;
+    if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+}
+
+/*
+ * :nodoc:
+ *  Takes a token from the bucket. Returns false if the bucket is exhausted.
+ *
+ */
+bool mosquitto_bucket_take(mosquitto_bucket_t *bucket)
+{
+    mosquitto_bucket_refill(bucket);
+    if (bucket->tokens < 1) return false;
+    bucket->tokens -= 1;
+    bucket->passed++;
+    return true;
+}
+
+/*
+ * :nodoc:
+ *  Returns a token taken for an operation that failed.
+ *
+ */
+void mosquitto_bucket_refund(mosquitto_bucket_t *bucket)
+{
+    if (bucket->passed > 0) bucket->passed--;
+    bucket->tokens += 1;
+    if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+}
+
+/*
+ * :nodoc:
+ *  Milliseconds until the next token becomes available.
+ *
+ */
+long mosquitto_bucket_wait_ms(mosquitto_bucket_t *bucket)
+{
+    long wait;
+    mosquitto_bucket_refill(bucket);
+    if (bucket->tokens >= 1) return 0;
+    if (bucket->rate <= 0) return 1000;
+    wait = (long)((1 - bucket->tokens) * 1000 / bucket->rate) + 1;
+    return wait;
+}
+
+void mosquitto_bucket_free(mosquitto_bucket_t *bucket)
+{
+    free(bucket->filter);
+    free(bucket);
+}
+
+uint64_t mosquitto_fnv1a(const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+mosquitto_inbound_policy_t *mosquitto_inbound_policy_new(const char *filter, double max_rate, unsigned long sample, bool changed_only)
+{
+    mosquitto_inbound_policy_t *policy = MOSQ_ALLOC(mosquitto_inbound_policy_t);
+    if (policy == NULL) return NULL;
+    policy->bucket = NULL;
+    if ((policy->filter = strdup(filter)) == NULL) {
+        free(policy);
+        return NULL;
+    }
+    if (max_rate > 0 && (policy->bucket = mosquitto_bucket_new(filter, max_rate, max_rate, MOSQ_THROTTLE_DROP)) == NULL) {
+        free(policy->filter);
+        free(policy);
+        return NULL;
+    }
+    policy->sample = sample;
+    policy->seen = 0;
+    policy->changed_only = changed_only;
+    policy->max_age_ms = 0;
+    policy->digests = NULL;
+    policy->digests_capacity = 0;
+    policy->digests_count = 0;
+    policy->passed = 0;
+    policy->filtered = 0;
+    policy->next = NULL;
+    return policy;
+}
+
+/*
+ * :nodoc:
+ *  Doubles the digest table, or resets it once it tracks MOSQ_DIGEST_MAX_TOPICS topics. A reset only costs
+ *  a spurious "changed" for each topic.
+ *
+ */
+static int mosquitto_digests_grow(mosquitto_inbound_policy_t *policy)
+{
+    mosquitto_digest_entry_t *digests;
+    size_t i, j, capacity = policy->digests_capacity == 0 ? 64 : policy->digests_capacity * 2;
+    if (policy->digests_count >= MOSQ_DIGEST_MAX_TOPICS) {
+        memset(policy->digests, 0, policy->digests_capacity * sizeof(mosquitto_digest_entry_t));
+        policy->digests_count = 0;
+        return 0;
+    }
+    digests = calloc(capacity, sizeof(mosquitto_digest_entry_t));
+    if (digests == NULL) return -1;
+    for (i = 0; i < policy->digests_capacity; i++) {
+        if (policy->digests[i].topic == 0) continue;
+        for (j = policy->digests[i].topic & (capacity - 1); digests[j].topic != 0; j = (j + 1) & (capacity - 1));
+        digests[j] = policy->digests[i];
+    }
+    free(policy->digests);
+    policy->digests = digests;
+    policy->digests_capacity = capacity;
+    return 0;
+}
+
+/*
+ * :nodoc:
+ *  Records the payload digest for a topic and returns true if it differs from the previous one.
+ *
+ */
+static bool mosquitto_inbound_policy_changed(mosquitto_inbound_policy_t *policy, const struct mosquitto_message *msg)
+{
+    uint64_t topic = mosquitto_fnv1a(msg->topic, strlen(msg->topic)) | 1;
+    uint64_t payload = mosquitto_fnv1a(msg->payload, msg->payloadlen);
+    size_t i;
+    if ((policy->digests_count + 1) * 10 > policy->digests_capacity * 7) {
+        if (mosquitto_digests_grow(policy) != 0) return true;
+    }
+    for (i = topic & (policy->digests_capacity - 1); policy->digests[i].topic != 0; i = (i + 1) & (policy->digests_capacity - 1)) {
+        if (policy->digests[i].topic == topic) {
+            if (policy->digests[i].payload == payload) return false;
+            policy->digests[i].payload = payload;
+            return true;
+        }
+    }
+    policy->digests[i].topic = topic;
+    policy->digests[i].payload = payload;
+    policy->digests_count++;
+    return true;
+}
+
+/*
+ * :nodoc:
+ *  Returns true if a message passes the policy and should be dispatched.
+ *
+ */
+bool mosquitto_inbound_policy_admit(mosquitto_inbound_policy_t *policy, const struct mosquitto_message *msg)
+{
+    bool admitted = true;
+    if (policy->changed_only && !mosquitto_inbound_policy_changed(policy, msg)) admitted = false;
+    if (admitted && policy->sample > 1 && (policy->seen++ % policy->sample) != 0) admitted = false;
+    if (admitted && policy->bucket != NULL && !mosquitto_bucket_take(policy->bucket)) admitted = false;
+    if (admitted) {
+        policy->passed++;
+    } else {
+        policy->filtered++;
+    }
+    return admitted;
+}
+
+void mosquitto_inbound_policy_free(mosquitto_inbound_policy_t *policy)
+{
+    if (policy->bucket != NULL) mosquitto_bucket_free(policy->bucket);
+    free(policy->digests);
+    free(policy->filter);
+    free(policy);
+}
+
+/*
+ * :nodoc:
+ *  Takes a token from the process wide connect bucket. Returns 0 if the connect attempt may proceed, otherwise
+ *  the number of milliseconds to wait before trying again.
+ *
+ */
+long mosquitto_connect_throttle(bool first)
+{
+    long wait = 0;
+    pthread_mutex_lock(&mosquitto_connect_mutex);
+    if (mosquitto_connect_bucket != NULL) {
+        if ((wait = mosquitto_bucket_wait_ms(mosquitto_connect_bucket)) == 0) {
+            mosquitto_bucket_take(mosquitto_connect_bucket);
+        } else if (first) {
+            mosquitto_connect_bucket->throttled++;
+        }
+    }
+    pthread_mutex_unlock(&mosquitto_connect_mutex);
+    return wait;
+}
+
+/*
+ * :nodoc:
+ *  Paces a connect attempt from a Ruby thread, sleeping without the GVL.
+ *
+ */
+void rb_mosquitto_connect_throttle(void)
+{
+    struct timeval time;
+    long wait;
+    bool first = true;
+    while ((wait = mosquitto_connect_throttle(first)) > 0) {
+        first = false;
+        time.tv_sec  = wait / 1000;
+        time.tv_usec = (wait % 1000) * 1000;
+        rb_thread_wait_for(time);
+    }
+}
+
+/*
+ * call-seq:
+ *   Mosquitto.connect_rate_limit(50, 10) -> Boolean
+ *
+ * Pace connection attempts across all clients in this process with a shared token bucket. Applies to
+ * Mosquitto::Client#connect, Mosquitto::Client#connect_async, Mosquitto::Client#reconnect and to automatic
+ * reconnects of clients with Mosquitto::Client#reconnect_backoff enabled. Waiting for a token doesn't hold
+ * the GVL.
+ *
+ * @param rate [Integer, Float, nil] connection attempts per second, nil to remove the limit
+ * @param burst [Integer, Float] bucket size, defaults to rate
+ * @return [true, false] true if a limit was set, false if removed
+ * @raise [ArgumentError] on invalid rates
+ * @example
+ *   Mosquitto.connect_rate_limit(50)
+ *
+ */
+static VALUE rb_mosquitto_connect_rate_limit(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE rate, burst;
+    mosquitto_bucket_t *bucket = NULL, *previous;
+    rb_scan_args(argc, argv, "11", &rate, &burst);
+    if (!NIL_P(rate)) {
+        if (NUM2DBL(rate) <= 0) rb_raise(rb_eArgError, "rate must be positive");
+        bucket = mosquitto_bucket_new(NULL, NUM2DBL(rate), NIL_P(burst) ? NUM2DBL(rate) : NUM2DBL(burst), MOSQ_THROTTLE_BLOCK);
+        if (bucket == NULL) rb_memerror();
+    }
+    pthread_mutex_lock(&mosquitto_connect_mutex);
+    previous = mosquitto_connect_bucket;
+    mosquitto_connect_bucket = bucket;
+    pthread_mutex_unlock(&mosquitto_connect_mutex);
+    if (previous != NULL) mosquitto_bucket_free(previous);
+    return bucket == NULL ? Qfalse : Qtrue;
+}
+
+/*
+ * call-seq:
+ *   Mosquitto.connect_stats -> Hash
+ *
+ * Counters for the process wide connect rate limit : attempts let through and attempts that had to wait.
+ *
+ * @return [Hash, nil] counters, nil if no limit is set
+ * @example
+ *   Mosquitto.connect_stats -> {:passed => 2000, :throttled => 1950}
+ *
+ */
+static VALUE rb_mosquitto_connect_stats(VALUE obj)
+{
+    VALUE stats = Qnil;
+    unsigned long passed = 0, throttled = 0;
+    bool limited;
+    pthread_mutex_lock(&mosquitto_connect_mutex);
+    if ((limited = (mosquitto_connect_bucket != NULL))) {
+        passed = mosquitto_connect_bucket->passed;
+        throttled = mosquitto_connect_bucket->throttled;
+    }
+    pthread_mutex_unlock(&mosquitto_connect_mutex);
+    if (limited) {
+        stats = rb_hash_new();
+        rb_hash_aset(stats, ID2SYM(rb_intern("passed")), ULONG2NUM(passed));
+        rb_hash_aset(stats, ID2SYM(rb_intern("throttled")), ULONG2NUM(throttled));
+    }
+    return stats;
+}
+
+void _init_rb_mosquitto_throttle()
+{
+    rb_define_module_function(rb_mMosquitto, "connect_rate_limit", rb_mosquitto_connect_rate_limit, -1);
+    rb_define_module_function(rb_mMosquitto, "connect_stats", rb_mosquitto_connect_stats, 0);
+}
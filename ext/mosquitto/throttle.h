@@ -0,0 +1,80 @@
+#ifndef MOSQUITTO_THROTTLE_H
+#define MOSQUITTO_THROTTLE_H
+
+#define MOSQ_THROTTLE_BLOCK 0x00
+#define MOSQ_THROTTLE_RAISE 0x01
+#define MOSQ_THROTTLE_DROP 0x02
+
+/*
+ * Token bucket : refills at rate tokens per second, up to burst tokens. A NULL filter matches every topic.
+ * Not thread safe - callers serialize access.
+ */
+typedef struct mosquitto_bucket_t mosquitto_bucket_t;
+struct mosquitto_bucket_t {
+    char *filter;
+    double rate;
+    double burst;
+    double tokens;
+    struct timespec refilled_at;
+    int policy;
+    unsigned long passed;
+    unsigned long throttled;
+    unsigned long dropped;
+    mosquitto_bucket_t *next;
+};
+
+mosquitto_bucket_t *mosquitto_bucket_new(const char *filter, double rate, double burst, int policy);
+bool mosquitto_bucket_matches(mosquitto_bucket_t *bucket, const char *topic);
+bool mosquitto_bucket_take(mosquitto_bucket_t *bucket);
+void mosquitto_bucket_refund(mosquitto_bucket_t *bucket);
+long mosquitto_bucket_wait_ms(mosquitto_bucket_t *bucket);
+void mosquitto_bucket_free(mosquitto_bucket_t *bucket);
+
+#define MOSQ_DIGEST_MAX_TOPICS 65536
+
+/* 64 bit FNV-1a */
+uint64_t mosquitto_fnv1a(const void *data, size_t len);
+
+/*
+ * Per topic payload digests (64 bit FNV-1a) for change detection. Open addressing, a zero topic hash marks
+ * an empty slot.
+ */
+typedef struct {
+    uint64_t topic;
+    uint64_t payload;
+} mosquitto_digest_entry_t;
+
+/*
+ * Inbound policy for messages matching a subscription filter, evaluated on the libmosquitto network thread
+ * before a message is copied for the Ruby VM. A message is admitted if its payload changed (changed_only),
+ * it's the Nth one seen (sample) and the bucket has a token to spare (max rate), in that order. Admitted
+ * messages older than max_age_ms by the time the callback thread gets to them are discarded.
+ */
+typedef struct mosquitto_inbound_policy_t mosquitto_inbound_policy_t;
+struct mosquitto_inbound_policy_t {
+    char *filter;
+    mosquitto_bucket_t *bucket;
+    unsigned long sample;
+    unsigned long seen;
+    bool changed_only;
+    long max_age_ms;
+    mosquitto_digest_entry_t *digests;
+    size_t digests_capacity;
+    size_t digests_count;
+    unsigned long passed;
+    unsigned long filtered;
+    mosquitto_inbound_policy_t *next;
+};
+
+mosquitto_inbound_policy_t *mosquitto_inbound_policy_new(const char *filter, double max_rate, unsigned long sample, bool changed_only);
+bool mosquitto_inbound_policy_admit(mosquitto_inbound_policy_t *policy, const struct mosquitto_message *msg);
+void mosquitto_inbound_policy_free(mosquitto_inbound_policy_t *policy);
+
+extern pthread_mutex_t mosquitto_connect_mutex;
+extern mosquitto_bucket_t *mosquitto_connect_bucket;
+
+long mosquitto_connect_throttle(bool first);
+void rb_mosquitto_connect_throttle(void);
+void _init_rb_mosquitto_throttle();
+
+#endif
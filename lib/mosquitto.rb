@@ -8,4 +8,6 @@ end
 
 require 'mosquitto/version' unless defined? Mosquitto::VERSION
 
-require 'mosquitto/client'
\ No newline at end of file
+require 'mosquitto/client'
+require 'mosquitto/pool'
+require 'mosquitto/fork'
\ No newline at end of file
@@ -0,0 +1,47 @@
+# encoding: utf-8
+
+module Mosquitto
+  class << self
+    # Reinitialise inherited clients in every forked child on Ruby 3.1 and later. Off by default - reconnecting
+    # is left to the child, which may not want to talk to the broker at all.
+    #
+    # @return [true, false]
+    attr_accessor :auto_after_fork
+  end
+  self.auto_after_fork = false
+
+  # Reinitialise every client inherited from the parent process. Call this first thing in a forked child -
+  # from a pre-forking server's after fork hook for example, or have it run for every Kernel#fork and
+  # Process.fork with Mosquitto.auto_after_fork= on Ruby 3.1 and later.
+  #
+  # @return [Array<Mosquitto::Client>] clients reinitialised
+  # @see Mosquitto::Client#after_fork
+  # @see Mosquitto.inherited_clients
+  # @example
+  #   # config/puma.rb
+  #   on_worker_boot { Mosquitto.after_fork }
+  #
+  def self.after_fork
+    inherited_clients.select { |client| client.after_fork }
+  end
+
+  # Process._fork hook - failing to reinitialise a client must not fail the fork itself. Clients that would
+  # connect synchronously are left for the child to reinitialise.
+  module ForkHook
+    def _fork
+      pid = super
+      if pid == 0 && Mosquitto.auto_after_fork
+        Mosquitto.inherited_clients.each do |client|
+          begin
+            client.after_fork(:blocking => false)
+          rescue StandardError => e
+            warn "mosquitto: could not reinitialise client after fork: #{e.message} - call Mosquitto::Client#after_fork to retry"
+          end
+        end
+      end
+      pid
+    end
+  end
+
+  Process.singleton_class.prepend(ForkHook) if Process.respond_to?(:_fork)
+end
@@ -16,6 +16,7 @@ module Mosquitto::Logging
   # @param logger [Logger] a Ruby logger instance. Compatible with SyslogLogger and other
   #                        implementations as well.
   # @raise [Argument] on invalid input params
+  # @see Mosquitto::Client#log_to for writing logs to a file or syslog without dispatching them to Ruby
   # @example
   #   client.logger = Logger.new(STDOUT)
   #
@@ -0,0 +1,164 @@
+# encoding: utf-8
+
+require 'zlib'
+require 'thread'
+
+# A pool of Mosquitto::Client connections for publish heavy workloads. Publishes are routed to a pool
+# member by topic hash, which preserves per topic ordering while spreading load across several TCP
+# streams and libmosquitto network threads.
+#
+# Every member runs the threaded event loop (Mosquitto::Client#loop_start) and reconnects independently -
+# a dropped member doesn't affect publishes routed to the others.
+#
+class Mosquitto::Pool
+  include Enumerable
+
+  attr_reader :clients
+
+  # Create a new pool of clients.
+  #
+  # @param size [Integer] number of connections
+  # @param client_id [String, nil] client identifier prefix. Members are identified as "<client_id>-<n>".
+  #                                Set to nil to have random identifiers generated.
+  # @param clean_session [true, false] clean session flag for all members, see Mosquitto::Client.new
+  # @raise [ArgumentError] on invalid input params
+  # @example
+  #   Mosquitto::Pool.new(4)
+  #   Mosquitto::Pool.new(4, "backfill", false)
+  #
+  def initialize(size, client_id = nil, clean_session = true)
+    raise ArgumentError, "pool size must be a positive Integer" unless size.is_a?(Integer) && size > 0
+    @lock = Mutex.new
+    @stats = Array.new(size) { Hash.new(0) }
+    @connected = Array.new(size, false)
+    @clients = Array.new(size) do |i|
+      client = if client_id
+        Mosquitto::Client.new("#{client_id}-#{i}", clean_session)
+      else
+        Mosquitto::Client.new(nil, true)
+      end
+      setup(client, i)
+      client
+    end
+  end
+
+  # Number of pool members.
+  #
+  # @return [Integer] pool size
+  def size
+    @clients.size
+  end
+
+  # Iterates over all pool members.
+  #
+  # @yield [Mosquitto::Client] each member
+  def each(&block)
+    @clients.each(&block)
+  end
+
+  # Connect all pool members to a broker. Connections are established asynchronously by each member's
+  # network thread.
+  #
+  # @param host [String] the hostname or ip address of the broker to connect to.
+  # @param port [Integer] the network port to connect to. Usually 1883 (or 8883 for TLS)
+  # @param keepalive [Integer] the number of seconds after which the broker should send a PING message
+  # @return [true] on success
+  # @raise [Mosquitto::Error, SystemCallError] on invalid input params or system call errors
+  # @example
+  #   pool.connect("localhost", 1883, 10)
+  #
+  def connect(host, port, keepalive)
+    @clients.each do |client|
+      client.loop_start
+      client.connect_async(host, port, keepalive)
+    end
+    true
+  end
+
+  # Disconnect all pool members and stop their network threads.
+  #
+  # @return [true] on success
+  def disconnect
+    @clients.each do |client|
+      begin
+        client.disconnect
+      rescue Mosquitto::Error
+        # not connected
+      end
+      client.loop_stop(true)
+    end
+    true
+  end
+
+  # The pool member a given topic is routed to.
+  #
+  # @param topic [String] message topic
+  # @return [Mosquitto::Client] pool member
+  def client_for(topic)
+    @clients[Zlib.crc32(topic) % @clients.size]
+  end
+
+  # Publish a message through the pool member the topic hashes to. Same arguments and semantics as
+  # Mosquitto::Client#publish.
+  #
+  # @return [true] on success
+  # @raise [Mosquitto::Error, SystemCallError] on invalid input params or system call errors
+  # @example
+  #   pool.publish(nil, "backfill/42", "payload", Mosquitto::AT_LEAST_ONCE, false)
+  #
+  def publish(mid, topic, payload, qos, retain)
+    index = Zlib.crc32(topic) % @clients.size
+    begin
+      @clients[index].publish(mid, topic, payload, qos, retain)
+    rescue Mosquitto::Error
+      count(index, :errors)
+      raise
+    end
+    count(index, :published)
+    true
+  end
+
+  # Aggregate and per member counters.
+  #
+  # @return [Hash] pool statistics
+  # @example
+  #   pool.stats -> {:size => 2, :connected => 2, :published => 10, :acked => 10, :errors => 0,
+  #                  :reconnects => 0, :members => [{...}, {...}]}
+  #
+  def stats
+    @lock.synchronize do
+      members = @stats.each_with_index.map do |member, i|
+        { :connected => @connected[i], :published => member[:published], :acked => member[:acked],
+          :errors => member[:errors], :reconnects => member[:reconnects] }
+      end
+      { :size => size, :connected => @connected.count(true),
+        :published => members.inject(0) {|sum, m| sum + m[:published] },
+        :acked => members.inject(0) {|sum, m| sum + m[:acked] },
+        :errors => members.inject(0) {|sum, m| sum + m[:errors] },
+        :reconnects => members.inject(0) {|sum, m| sum + m[:reconnects] },
+        :members => members }
+    end
+  end
+
+  private
+
+  def setup(client, index)
+    client.on_connect do |rc|
+      @lock.synchronize do
+        @stats[index][:reconnects] += 1 if @stats[index][:connects] > 0
+        @stats[index][:connects] += 1
+        @connected[index] = true
+      end
+    end
+    client.on_disconnect do |rc|
+      @lock.synchronize { @connected[index] = false }
+    end
+    client.on_publish do |mid|
+      count(index, :acked)
+    end
+  end
+
+  def count(index, counter)
+    @lock.synchronize { @stats[index][counter] += 1 }
+  end
+end
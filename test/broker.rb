@@ -0,0 +1,548 @@
+# encoding: utf-8
+
+require 'socket'
+require 'openssl'
+require 'thread'
+require 'fiddle'
+
+# Minimal in-process MQTT 3.1 / 3.1.1 broker for hermetic tests and benchmarks. A single event loop thread
+# multiplexes all connections with IO.select. Supports CONNECT (with wills and persistent sessions), SUBSCRIBE /
+# UNSUBSCRIBE with + and # wildcards, QoS 0, 1 and 2 in both directions, retained messages, PINGREQ, TLS with
+# client certificates and TLS-PSK.
+#
+# Faults can be injected for throughput and failover benchmarks. All randomness comes from a seeded PRNG, so runs
+# are reproducible :
+#
+#   broker = TestBroker.new(:port => 1883, :tls_port => 8883, :ssl_dir => "test/ssl", :seed => 42)
+#   broker = TestBroker.new(:psk_port => 8884, :psk => {"psk-id" => "deadbeef"})  # identity => hex key
+#   broker.start
+#   broker.latency = 0.005          # delay every outbound packet by 5ms
+#   broker.loss = 0.01              # drop 1% of PUBLISH packets, in either direction
+#   broker.disconnect_rate = 0.001  # drop the connection on 0.1% of inbound packets
+#   broker.disconnect("client-id")  # or all clients, with no argument
+#   broker.stats # => {:connections => 2, :received => 1000, :delivered => 990, :dropped => 10, :disconnects => 1}
+#   broker.stop
+#
+# Dropped QoS 1 and 2 messages are retried after retry_interval seconds, like a real broker would. An exception
+# while serving a client closes that client's connection and is counted in stats[:errors] - it never reaches the
+# event loop thread, as the suite runs with Thread.abort_on_exception.
+class TestBroker
+  CONNECT = 1
+  CONNACK = 2
+  PUBLISH = 3
+  PUBACK = 4
+  PUBREC = 5
+  PUBREL = 6
+  PUBCOMP = 7
+  SUBSCRIBE = 8
+  SUBACK = 9
+  UNSUBSCRIBE = 10
+  UNSUBACK = 11
+  PINGREQ = 12
+  PINGRESP = 13
+  DISCONNECT = 14
+
+  Message = Struct.new(:topic, :payload, :qos, :retain)
+
+  # Per client session state - outlives the connection for clean_session = false clients
+  class Session
+    attr_reader :client_id, :subscriptions, :inflight, :incoming
+    attr_accessor :clean, :next_mid
+
+    def initialize(client_id, clean)
+      @client_id = client_id
+      @clean = clean
+      @subscriptions = {}
+      @inflight = {}
+      @incoming = {}
+      @next_mid = 0
+    end
+
+    def mid
+      @next_mid = @next_mid % 65535 + 1
+    end
+  end
+
+  class Connection
+    attr_reader :io
+    attr_accessor :session, :will, :rbuf, :wbuf, :outbox, :handshaking
+
+    def initialize(io, handshaking = nil)
+      @io = io
+      @handshaking = handshaking
+      @rbuf = binary("")
+      @wbuf = binary("")
+      @outbox = []
+    end
+
+    def binary(str)
+      str.force_encoding(Encoding::BINARY)
+    end
+  end
+
+  attr_reader :port, :tls_port, :psk_port
+  attr_accessor :latency, :jitter, :loss, :disconnect_rate, :retry_interval
+
+  def initialize(options = {})
+    @port = options.fetch(:port, 1883)
+    @tls_port = options[:tls_port]
+    @ssl_dir = options[:ssl_dir]
+    @psk_port = options[:psk_port]
+    @psk = options.fetch(:psk, {})
+    @host = options.fetch(:host, "127.0.0.1")
+    @latency = options.fetch(:latency, 0)
+    @jitter = options.fetch(:jitter, 0)
+    @loss = options.fetch(:loss, 0)
+    @disconnect_rate = options.fetch(:disconnect_rate, 0)
+    @retry_interval = options.fetch(:retry_interval, 20)
+    @random = Random.new(options.fetch(:seed, 0))
+    @connections = {}
+    @sessions = {}
+    @retained = {}
+    @commands = Queue.new
+    @stats = Hash.new(0)
+    @running = false
+  end
+
+  def start
+    @servers = {}
+    @servers[TCPServer.new(@host, @port)] = nil
+    @servers[TCPServer.new(@host, @tls_port)] = ssl_context if @tls_port
+    @servers[TCPServer.new(@host, @psk_port)] = psk_context if @psk_port
+    @wakeup_r, @wakeup_w = IO.pipe
+    @running = true
+    @thread = Thread.new { run }
+    self
+  end
+
+  def stop
+    return unless @running
+    command { @running = false }
+    @thread.join
+    @connections.keys.each { |conn| close(conn, false) }
+    @servers.keys.each(&:close)
+    @wakeup_r.close
+    @wakeup_w.close
+  end
+
+  # Drops the connection of the given client, or of all clients. Wills are published, as for network failures.
+  def disconnect(client_id = nil)
+    command do
+      @connections.keys.each do |conn|
+        close(conn, true) if client_id.nil? || (conn.session && conn.session.client_id == client_id)
+      end
+    end
+  end
+
+  def retained
+    command { @retained.dup }
+  end
+
+  def stats
+    command { @stats.merge(:connections => @connections.size) }
+  end
+
+  private
+
+  # Runs a block on the event loop thread and returns its value, or raises its exception in the caller
+  def command(&block)
+    result = Queue.new
+    @commands << lambda do
+      begin
+        result << [true, block.call]
+      rescue StandardError => e
+        result << [false, e]
+      end
+    end
+    @wakeup_w.write_nonblock(".") rescue nil
+    ok, value = result.pop
+    raise value unless ok
+    value
+  end
+
+  def ssl_context
+    context = OpenSSL::SSL::SSLContext.new
+    context.cert = OpenSSL::X509::Certificate.new(File.read(File.join(@ssl_dir, "server.crt")))
+    context.key = OpenSSL::PKey.read(File.read(File.join(@ssl_dir, "server.key")))
+    context.extra_chain_cert = [OpenSSL::X509::Certificate.new(File.read(File.join(@ssl_dir, "test-signing-ca.crt")))]
+    context.ca_file = File.join(@ssl_dir, "all-ca.crt")
+    context.verify_mode = OpenSSL::SSL::VERIFY_PEER | OpenSSL::SSL::VERIFY_FAIL_IF_NO_PEER_CERT
+    # The fixtures in test/ssl are long expired 1024 bit certificates
+    context.verify_callback = lambda { |ok, store| ok || store.error == OpenSSL::X509::V_ERR_CERT_HAS_EXPIRED }
+    context.security_level = 0 if context.respond_to?(:security_level=)
+    context
+  end
+
+  # Ruby's openssl extension has no server side PSK API, so the callback is installed on the SSL_CTX it wraps.
+  # TLS 1.2 only - libmosquitto offers PSK cipher suites, but no TLS 1.3 external PSKs.
+  def psk_context
+    context = OpenSSL::SSL::SSLContext.new
+    context.max_version = OpenSSL::SSL::TLS1_2_VERSION
+    context.ciphers = "PSK"
+    context.security_level = 0 if context.respond_to?(:security_level=)
+    keys = Hash[@psk.map { |identity, key| [identity.to_s, [key].pack("H*")] }]
+    @psk_callback = Fiddle::Closure::BlockCaller.new(Fiddle::TYPE_INT,
+                                                     [Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP, Fiddle::TYPE_INT]) do |ssl, identity, psk, max_len|
+      key = identity.null? ? nil : keys[identity.to_s]
+      if key && key.bytesize <= max_len
+        psk[0, key.bytesize] = key
+        key.bytesize
+      else
+        0
+      end
+    end
+    set_callback = Fiddle::Function.new(Fiddle::Handle::DEFAULT["SSL_CTX_set_psk_server_callback"],
+                                        [Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP], Fiddle::TYPE_VOID)
+    set_callback.call(ssl_ctx(context), @psk_callback)
+    context
+  end
+
+  # The SSL_CTX pointer of an OpenSSL::SSL::SSLContext - RTypedData lays out the type, the typed flag (1) on
+  # Ruby < 3.4, then the data pointer. The type's name is checked so a layout change fails loudly.
+  def ssl_ctx(context)
+    object = Fiddle::Pointer.new(Fiddle.dlwrap(context))
+    type = object[16, Fiddle::SIZEOF_VOIDP].unpack("J").first
+    name = Fiddle::Pointer.new(Fiddle::Pointer.new(type)[0, Fiddle::SIZEOF_VOIDP].unpack("J").first).to_s
+    raise NotImplementedError, "unexpected SSLContext layout (#{name})" unless name == "OpenSSL/SSL/CTX"
+    offset = object[24, Fiddle::SIZEOF_VOIDP].unpack("J").first == 1 ? 32 : 24
+    Fiddle::Pointer.new(object[offset, Fiddle::SIZEOF_VOIDP].unpack("J").first)
+  end
+
+  def run
+    while @running
+      readers = @servers.keys + [@wakeup_r] + @connections.keys.map(&:io)
+      writers = @connections.keys.select { |conn| !conn.wbuf.empty? || conn.handshaking == :write }.map(&:io)
+      ready = IO.select(readers, writers, nil, select_timeout)
+      if ready
+        ready[0].each { |io| serve(connection(io)) { readable(io) } }
+        ready[1].each { |io| conn = connection(io) and serve(conn) { flush(conn) } }
+      end
+      # TLS sockets may hold decrypted data that IO.select can't see
+      @connections.keys.each { |conn| serve(conn) { read(conn) } if !conn.handshaking && conn.io.respond_to?(:pending) && conn.io.pending > 0 }
+      serve(nil) { deliver_due }
+      serve(nil) { retry_inflight }
+    end
+  end
+
+  def serve(conn)
+    yield
+  rescue StandardError => e
+    @stats[:errors] += 1
+    warn "TestBroker: #{e.class}: #{e.message}"
+    close(conn, true) if conn
+  end
+
+  def select_timeout
+    due = @connections.keys.map { |conn| conn.outbox.first && conn.outbox.first[0] }.compact.min
+    return 1 unless due
+    [[due - now, 0].max, 1].min
+  end
+
+  def now
+    defined?(Process::CLOCK_MONOTONIC) ? Process.clock_gettime(Process::CLOCK_MONOTONIC) : Time.now.to_f
+  end
+
+  def connection(io)
+    @connections.keys.find { |conn| conn.io == io }
+  end
+
+  def readable(io)
+    if io == @wakeup_r
+      io.read_nonblock(1024) rescue nil
+      @commands.pop.call until @commands.empty?
+    elsif @servers.key?(io)
+      accept(io)
+    elsif conn = connection(io)
+      conn.handshaking ? handshake(conn) : read(conn)
+    end
+  end
+
+  def accept(server)
+    socket = server.accept_nonblock
+    socket.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+    if context = @servers[server]
+      conn = Connection.new(OpenSSL::SSL::SSLSocket.new(socket, context), :read)
+      conn.io.sync_close = true
+      @connections[conn] = true
+      handshake(conn)
+    else
+      @connections[conn = Connection.new(socket)] = true
+    end
+  rescue IO::WaitReadable, Errno::ECONNABORTED
+  end
+
+  def handshake(conn)
+    conn.io.accept_nonblock
+    conn.handshaking = nil
+  rescue IO::WaitReadable
+    conn.handshaking = :read
+  rescue IO::WaitWritable
+    conn.handshaking = :write
+  rescue OpenSSL::SSL::SSLError, SystemCallError, EOFError
+    close(conn, false)
+  end
+
+  def read(conn)
+    conn.rbuf << conn.io.read_nonblock(65536)
+    while packet = parse_packet(conn)
+      type, flags, body = packet
+      @stats[:packets] += 1
+      if @disconnect_rate > 0 && @random.rand < @disconnect_rate
+        @stats[:disconnects] += 1
+        return close(conn, true)
+      end
+      handle(conn, type, flags, body)
+      return unless @connections.key?(conn)
+    end
+  rescue IO::WaitReadable, IO::WaitWritable
+  rescue EOFError, SystemCallError, OpenSSL::SSL::SSLError
+    close(conn, true)
+  end
+
+  # Pops a complete packet off the read buffer, nil if incomplete
+  def parse_packet(conn)
+    buf = conn.rbuf
+    return nil if buf.bytesize < 2
+    length, multiplier, pos = 0, 1, 1
+    begin
+      return nil if pos >= buf.bytesize
+      byte = buf.getbyte(pos)
+      length += (byte & 127) * multiplier
+      multiplier *= 128
+      pos += 1
+    end while byte & 128 != 0
+    return nil if buf.bytesize < pos + length
+    header = buf.getbyte(0)
+    body = buf.byteslice(pos, length)
+    conn.rbuf = buf.byteslice(pos + length, buf.bytesize - pos - length)
+    [header >> 4, header & 0x0f, body]
+  end
+
+  def handle(conn, type, flags, body)
+    return close(conn, false) if conn.session.nil? && type != CONNECT
+    case type
+    when CONNECT then handle_connect(conn, body)
+    when PUBLISH then handle_publish(conn, flags, body)
+    when PUBACK, PUBCOMP then conn.session.inflight.delete(body.unpack("n")[0])
+    when PUBREC
+      mid = body.unpack("n")[0]
+      if entry = conn.session.inflight[mid]
+        entry[:state] = :pubrel
+        entry[:sent_at] = now
+      end
+      send_packet(conn, (PUBREL << 4) | 0x02, [mid].pack("n"))
+    when PUBREL
+      mid = body.unpack("n")[0]
+      conn.session.incoming.delete(mid)
+      send_packet(conn, PUBCOMP << 4, [mid].pack("n"))
+    when SUBSCRIBE then handle_subscribe(conn, body)
+    when UNSUBSCRIBE then handle_unsubscribe(conn, body)
+    when PINGREQ then send_packet(conn, PINGRESP << 4, "")
+    when DISCONNECT
+      conn.will = nil
+      close(conn, false)
+    else
+      close(conn, false)
+    end
+  end
+
+  def read_string(body, pos)
+    length = body.byteslice(pos, 2).unpack("n")[0]
+    [body.byteslice(pos + 2, length), pos + 2 + length]
+  end
+
+  def encode_string(str)
+    [str.bytesize].pack("n") + str.dup.force_encoding(Encoding::BINARY)
+  end
+
+  def handle_connect(conn, body)
+    _protocol, pos = read_string(body, 0)
+    _version, flags, _keepalive = body.byteslice(pos, 4).unpack("CCn")
+    client_id, pos = read_string(body, pos + 4)
+    if flags & 0x04 != 0
+      will_topic, pos = read_string(body, pos)
+      will_payload, pos = read_string(body, pos)
+      conn.will = Message.new(will_topic, will_payload, (flags >> 3) & 0x03, flags & 0x20 != 0)
+    end
+    clean = flags & 0x02 != 0
+    client_id = "auto-#{object_id}-#{@stats[:connects]}" if client_id.empty?
+    @connections.keys.each do |other|
+      close(other, true) if other != conn && other.session && other.session.client_id == client_id
+    end
+    @sessions.delete(client_id) if clean
+    conn.session = (@sessions[client_id] ||= Session.new(client_id, clean))
+    conn.session.clean = clean
+    @stats[:connects] += 1
+    send_packet(conn, CONNACK << 4, [0, 0].pack("CC"))
+    conn.session.inflight.each_value { |entry| entry[:sent_at] = 0 }
+  end
+
+  def handle_publish(conn, flags, body)
+    qos = (flags >> 1) & 0x03
+    topic, pos = read_string(body, 0)
+    if qos > 0
+      mid = body.byteslice(pos, 2).unpack("n")[0]
+      pos += 2
+    end
+    if @loss > 0 && @random.rand < @loss
+      @stats[:dropped] += 1
+      return
+    end
+    message = Message.new(topic, body.byteslice(pos, body.bytesize - pos), qos, flags & 0x01 != 0)
+    @stats[:received] += 1
+    case qos
+    when 0 then route(message)
+    when 1
+      route(message)
+      send_packet(conn, PUBACK << 4, [mid].pack("n"))
+    when 2
+      # Route on first receipt only - duplicates arrive if our PUBREC got lost
+      route(message) unless conn.session.incoming[mid]
+      conn.session.incoming[mid] = true
+      send_packet(conn, PUBREC << 4, [mid].pack("n"))
+    end
+  end
+
+  def route(message)
+    if message.retain
+      if message.payload.empty?
+        @retained.delete(message.topic)
+      else
+        @retained[message.topic] = message
+      end
+    end
+    @sessions.each_value do |session|
+      granted = session.subscriptions.select { |filter, _| matches?(filter, message.topic) }.map { |_, qos| qos }.max
+      deliver(session, message, [granted, message.qos].min, false) if granted
+    end
+  end
+
+  def handle_subscribe(conn, body)
+    mid = body.unpack("n")[0]
+    pos, granted, filters = 2, [], []
+    while pos < body.bytesize
+      filter, pos = read_string(body, pos)
+      qos = body.getbyte(pos) & 0x03
+      pos += 1
+      conn.session.subscriptions[filter] = qos
+      granted << qos
+      filters << [filter, qos]
+    end
+    send_packet(conn, SUBACK << 4, [mid].pack("n") + granted.pack("C*"))
+    filters.each do |filter, qos|
+      @retained.each_value do |message|
+        deliver(conn.session, message, [qos, message.qos].min, true) if matches?(filter, message.topic)
+      end
+    end
+  end
+
+  def handle_unsubscribe(conn, body)
+    mid = body.unpack("n")[0]
+    pos = 2
+    while pos < body.bytesize
+      filter, pos = read_string(body, pos)
+      conn.session.subscriptions.delete(filter)
+    end
+    send_packet(conn, UNSUBACK << 4, [mid].pack("n"))
+  end
+
+  def matches?(filter, topic)
+    filter_levels = filter.split("/", -1)
+    topic_levels = topic.split("/", -1)
+    return false if topic.start_with?("$") && %w(+ #).include?(filter_levels.first)
+    filter_levels.each_with_index do |level, i|
+      return true if level == "#"
+      return false if i >= topic_levels.size
+      return false if level != "+" && level != topic_levels[i]
+    end
+    filter_levels.size == topic_levels.size
+  end
+
+  # Sends a message to a session. Offline persistent sessions keep QoS 1 and 2 messages until they reconnect.
+  def deliver(session, message, qos, retain)
+    conn = @connections.keys.find { |c| c.session.equal?(session) }
+    return if conn.nil? && (session.clean || qos == 0)
+    mid = qos > 0 ? session.mid : nil
+    session.inflight[mid] = {:message => message, :qos => qos, :retain => retain, :state => :publish, :sent_at => conn ? now : 0} if mid
+    send_publish(conn, message, qos, retain, mid, false) if conn
+  end
+
+  def send_publish(conn, message, qos, retain, mid, dup)
+    if @loss > 0 && @random.rand < @loss
+      @stats[:dropped] += 1
+      return
+    end
+    flags = (dup ? 0x08 : 0) | (qos << 1) | (retain ? 0x01 : 0)
+    body = encode_string(message.topic)
+    body << [mid].pack("n") if mid
+    body << message.payload.dup.force_encoding(Encoding::BINARY)
+    @stats[:delivered] += 1
+    send_packet(conn, (PUBLISH << 4) | flags, body)
+  end
+
+  # Resends unacknowledged QoS 1 and 2 messages
+  def retry_inflight
+    @connections.keys.each do |conn|
+      next unless conn.session
+      conn.session.inflight.each do |mid, entry|
+        next if now - entry[:sent_at] < (entry[:sent_at].zero? ? 0 : @retry_interval)
+        if entry[:state] == :pubrel
+          send_packet(conn, (PUBREL << 4) | 0x02, [mid].pack("n"))
+        else
+          send_publish(conn, entry[:message], entry[:qos], entry[:retain], mid, entry[:sent_at] > 0)
+        end
+        entry[:sent_at] = now
+      end
+    end
+  end
+
+  def send_packet(conn, header, body)
+    length = body.bytesize
+    packet = [header].pack("C")
+    begin
+      byte = length % 128
+      length /= 128
+      packet << [length > 0 ? byte | 128 : byte].pack("C")
+    end while length > 0
+    packet << body
+    delay = @latency + (@jitter > 0 ? @random.rand * @jitter : 0)
+    if delay > 0 || !conn.outbox.empty?
+      conn.outbox << [now + delay, packet]
+    else
+      conn.wbuf << packet
+      flush(conn)
+    end
+  end
+
+  def deliver_due
+    time = now
+    @connections.keys.each do |conn|
+      moved = false
+      while (entry = conn.outbox.first) && entry[0] <= time
+        conn.wbuf << conn.outbox.shift[1]
+        moved = true
+      end
+      flush(conn) if moved
+    end
+  end
+
+  def flush(conn)
+    return handshake(conn) if conn.handshaking
+    until conn.wbuf.empty?
+      written = conn.io.write_nonblock(conn.wbuf)
+      conn.wbuf = conn.wbuf.byteslice(written, conn.wbuf.bytesize - written)
+    end
+  rescue IO::WaitWritable, IO::WaitReadable
+  rescue SystemCallError, OpenSSL::SSL::SSLError, IOError
+    close(conn, true)
+  end
+
+  def close(conn, publish_will)
+    return unless @connections.delete(conn)
+    conn.io.close rescue nil
+    if session = conn.session
+      @sessions.delete(session.client_id) if session.clean && @sessions[session.client_id].equal?(session)
+      route(conn.will) if publish_will && conn.will
+    end
+  end
+end
@@ -10,12 +10,22 @@ require 'timeout'
 Thread.abort_on_exception = true
 STDOUT.sync
 
+# EMBEDDED_BROKER=1 runs the suite against the in-process broker in test/broker.rb instead of a separately
+# started mosquitto
+if ENV['EMBEDDED_BROKER'] == '1'
+  require File.join(File.dirname(__FILE__), 'broker')
+  EMBEDDED_BROKER = TestBroker.new(:port => 1883, :tls_port => 8883, :ssl_dir => File.expand_path("../ssl", __FILE__),
+                                   :psk_port => 8884, :psk => {"psk-id" => "deadbeef"}).start
+  at_exit { EMBEDDED_BROKER.stop }
+end
+
 class MosquittoTestCase < Test::Unit::TestCase
   TEST_HOST = "localhost"
   TEST_PORT = 1883
 
   TLS_TEST_HOST = "localhost"
   TLS_TEST_PORT = 8883
+  PSK_TEST_PORT = 8884
   TIMEOUT = 240
 
   undef_method :default_test if method_defined? :default_test
@@ -0,0 +1,158 @@
+# encoding: utf-8
+
+# Soak test - drives sustained pub/sub through the threaded event loop for a while and samples RSS, Ruby object
+# allocations, live objects and callback queue residue. Fails when RSS keeps growing faster than the configured
+# slope after warmup. Requires a broker - defaults to localhost:1883, override with MQTT_HOST / MQTT_PORT, or use
+# the embedded one.
+#
+#   rake test:soak
+#   SOAK_MINUTES=30 SOAK_MAX_SLOPE_KB=256 rake test:soak
+#
+# SOAK_MINUTES      - run time (default 5)
+# SOAK_INTERVAL     - seconds between samples (default 10)
+# SOAK_RATE         - messages published per second (default 20000)
+# SOAK_PAYLOAD      - payload size in bytes (default 256)
+# SOAK_MAX_SLOPE_KB - tolerated RSS growth in KB per minute after warmup (default 512)
+# SOAK_WARMUP       - fraction of samples ignored for the slope (default 0.25)
+# EMBEDDED_BROKER   - set to 1 to run test/broker.rb in a child process and use that
+
+$:.unshift(File.expand_path(File.dirname(__FILE__)) + '/../lib')
+
+require 'mosquitto'
+require 'objspace'
+require 'thread'
+require 'socket'
+require 'rbconfig'
+
+HOST = ENV['MQTT_HOST'] || 'localhost'
+PORT = Integer(ENV['MQTT_PORT'] || 1883)
+MINUTES = Float(ENV['SOAK_MINUTES'] || 5)
+INTERVAL = Float(ENV['SOAK_INTERVAL'] || 10)
+RATE = Integer(ENV['SOAK_RATE'] || 20_000)
+PAYLOAD = "x" * Integer(ENV['SOAK_PAYLOAD'] || 256)
+MAX_SLOPE_KB = Float(ENV['SOAK_MAX_SLOPE_KB'] || 512)
+WARMUP = Float(ENV['SOAK_WARMUP'] || 0.25)
+
+Thread.abort_on_exception = true
+
+if ENV['EMBEDDED_BROKER'] == '1'
+  # A child process keeps the broker's sessions and buffers out of the RSS samples
+  broker = Process.spawn(RbConfig.ruby, "-r", File.expand_path("../broker", __FILE__), "-e",
+                         "TestBroker.new(:host => ARGV[0], :port => Integer(ARGV[1])).start; sleep", HOST, PORT.to_s)
+  at_exit do
+    Process.kill(:TERM, broker)
+    Process.wait(broker)
+  end
+  listening = Time.now + 10
+  begin
+    TCPSocket.new(HOST, PORT).close
+  rescue Errno::ECONNREFUSED
+    abort "FAIL: embedded broker did not start on #{HOST}:#{PORT}" if Time.now > listening
+    sleep 0.05
+    retry
+  end
+end
+
+def rss_kb
+  if File.readable?("/proc/self/status")
+    File.read("/proc/self/status")[/VmRSS:\s+(\d+)/, 1].to_i
+  else
+    `ps -o rss= -p #{Process.pid}`.to_i
+  end
+end
+
+def allocated_objects
+  stat = GC.stat
+  stat[:total_allocated_objects] || stat[:total_allocated_object] || 0
+end
+
+def live_objects
+  counts = ObjectSpace.count_objects
+  counts[:TOTAL] - counts[:FREE]
+end
+
+# Least squares slope of RSS (KB) over time (minutes)
+def slope(samples)
+  return 0.0 if samples.size < 2
+  xs = samples.map { |s| s[:minutes] }
+  ys = samples.map { |s| s[:rss] }
+  mean_x = xs.inject(:+) / xs.size
+  mean_y = ys.inject(:+) / ys.size.to_f
+  num = xs.zip(ys).inject(0.0) { |sum, (x, y)| sum + (x - mean_x) * (y - mean_y) }
+  den = xs.inject(0.0) { |sum, x| sum + (x - mean_x) ** 2 }
+  den.zero? ? 0.0 : num / den
+end
+
+def connected_client
+  client = Mosquitto::Client.new
+  client.loop_start
+  client.connect(HOST, PORT, 10)
+  client.wait_readable
+  client
+end
+
+received = 0
+subscriber = connected_client
+subscriber.on_message { |msg| received += 1 }
+subscriber.on_subscribe { |mid, granted_qos| }
+subscriber.on_log { |level, msg| }
+subscriber.subscribe(nil, "soak/#", Mosquitto::AT_MOST_ONCE)
+publisher = connected_client
+
+published = 0
+running = true
+started = Time.now
+deadline = started + MINUTES * 60
+
+producer = Thread.new do
+  batch = [RATE / 100, 1].max
+  while running
+    tick = Time.now
+    batch.times do |i|
+      qos = (i % 10).zero? ? Mosquitto::AT_LEAST_ONCE : Mosquitto::AT_MOST_ONCE
+      publisher.publish(nil, "soak/#{i % 16}", PAYLOAD, qos, false)
+    end
+    published += batch
+    publisher.flush(5)
+    pause = 0.01 - (Time.now - tick)
+    sleep(pause) if pause > 0
+  end
+end
+
+samples = []
+puts "%8s %10s %12s %14s %12s %12s %12s" % %w(minutes rss_kb published received allocated live queued)
+while Time.now < deadline
+  sleep INTERVAL
+  # Resubscribing exercises the subscribe callback (copied granted QoS) and the control lane
+  subscriber.subscribe(nil, "soak/#", Mosquitto::AT_MOST_ONCE)
+  GC.start
+  sample = {
+    :minutes => (Time.now - started) / 60.0,
+    :rss => rss_kb,
+    :published => published,
+    :received => received,
+    :allocated => allocated_objects,
+    :live => live_objects,
+    :queued => ObjectSpace.memsize_of(subscriber)
+  }
+  samples << sample
+  puts "%8.2f %10d %12d %14d %12d %12d %12d" % sample.values_at(:minutes, :rss, :published, :received, :allocated, :live, :queued)
+end
+
+running = false
+producer.join
+publisher.disconnect
+subscriber.disconnect
+publisher.loop_stop(true)
+subscriber.loop_stop(true)
+
+steady = samples.drop((samples.size * WARMUP).ceil)
+growth = slope(steady)
+live_growth = steady.size < 2 ? 0 : steady.last[:live] - steady.first[:live]
+puts "RSS slope after warmup: %.1f KB/min (max %.1f), live objects %+d" % [growth, MAX_SLOPE_KB, live_growth]
+if received.zero?
+  abort "FAIL: no messages received - is a broker running on #{HOST}:#{PORT}?"
+elsif growth > MAX_SLOPE_KB
+  abort "FAIL: RSS grows by %.1f KB/min" % growth
+end
+puts "OK"
@@ -94,4 +94,147 @@ class TestCallbacks < MosquittoTestCase
     subscriber.loop_stop(true)
     assert_equal "test", message.to_s
   end
-end
\ No newline at end of file
+
+  def test_message_memsize
+    require 'objspace'
+    message = nil
+    payload = "x" * 1_000_000
+    subscriber = Mosquitto::Client.new
+    subscriber.loop_start
+    subscriber.on_connect do |rc|
+      subscriber.subscribe(nil, "message_memsize", Mosquitto::AT_MOST_ONCE)
+    end
+    subscriber.on_message do |msg|
+      message = msg
+    end
+    subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    subscriber.wait_readable
+
+    publisher = Mosquitto::Client.new
+    publisher.loop_start
+    publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable
+    publisher.publish(nil, "message_memsize", payload, Mosquitto::AT_MOST_ONCE, false)
+
+    wait{ message }
+    assert ObjectSpace.memsize_of(message) > payload.bytesize
+  ensure
+    publisher.loop_stop(true)
+    subscriber.loop_stop(true)
+  end
+
+  def test_message_max_age
+    messages = []
+    subscriber = Mosquitto::Client.new
+    assert_raises ArgumentError do
+      subscriber.max_age_ms = -1
+    end
+    subscriber.max_age_ms = 100
+    assert_equal 100, subscriber.max_age_ms
+    subscriber.loop_start
+    subscriber.on_connect do |rc|
+      subscriber.subscribe(nil, "max_age", Mosquitto::AT_MOST_ONCE)
+    end
+    subscriber.on_message do |msg|
+      messages << msg
+      sleep 0.5
+    end
+    subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    subscriber.wait_readable
+
+    publisher = Mosquitto::Client.new
+    publisher.loop_start
+    publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable
+    10.times do |i|
+      publisher.publish(nil, "max_age", i.to_s, Mosquitto::AT_MOST_ONCE, false)
+    end
+    assert publisher.flush(5)
+
+    sleep 1.5
+    # Messages expire while earlier ones in the same batch are handled too
+    assert messages.size <= 2
+    assert_equal 10, messages.size + subscriber.expired_messages
+  ensure
+    publisher.loop_stop(true)
+    subscriber.loop_stop(true)
+  end
+
+  def test_callback_latency
+    messages = []
+    subscriber = Mosquitto::Client.new
+    assert_raises ArgumentError do
+      subscriber.callback_spin_us = -1
+    end
+    subscriber.callback_spin_us = 100
+    assert_equal 100, subscriber.callback_spin_us
+    subscriber.loop_start
+    subscriber.on_connect do |rc|
+      subscriber.subscribe(nil, "latency", Mosquitto::AT_MOST_ONCE)
+    end
+    subscriber.on_message do |msg|
+      messages << msg
+      sleep 0.005
+    end
+    subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    subscriber.wait_readable
+    subscriber.callback_latency(true)
+
+    publisher = Mosquitto::Client.new
+    publisher.loop_start
+    publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable
+    10.times do |i|
+      publisher.publish(nil, "latency", i.to_s, Mosquitto::AT_MOST_ONCE, false)
+    end
+    assert publisher.flush(5)
+
+    wait{ messages.size == 10 }
+    latency = subscriber.callback_latency
+    assert latency[:count] >= 10
+    assert latency[:p50] <= latency[:p99]
+    assert_equal latency[:count], latency[:histogram].values.inject(:+)
+    # Includes the wait behind slow handlers for earlier messages of the same batch
+    assert latency[:max] >= 10_000
+  ensure
+    publisher.loop_stop(true)
+    subscriber.loop_stop(true)
+  end
+
+  def test_control_callbacks_bypass_message_backlog
+    events = []
+    subscriber = Mosquitto::Client.new
+    subscriber.loop_start
+    subscriber.on_connect do |rc|
+      subscriber.subscribe(nil, "backlog", Mosquitto::AT_MOST_ONCE)
+    end
+    subscriber.on_message do |msg|
+      events << msg.to_s
+      sleep 0.01
+    end
+    subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    subscriber.wait_readable
+
+    publisher = Mosquitto::Client.new
+    publisher.loop_start
+    publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable
+    200.times do |i|
+      publisher.publish(nil, "backlog", i.to_s, Mosquitto::AT_MOST_ONCE, false)
+    end
+    assert publisher.flush(5)
+    sleep 0.1
+
+    subscriber.on_unsubscribe do |mid|
+      events << :unsubscribed
+    end
+    subscriber.unsubscribe(nil, "backlog")
+    wait{ events.size == 201 }
+    assert events.index(:unsubscribed) < 100
+    messages = events - [:unsubscribed]
+    assert_equal (0...200).map(&:to_s), messages
+  ensure
+    publisher.loop_stop(true)
+    subscriber.loop_stop(true)
+  end
+end
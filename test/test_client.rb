@@ -20,6 +20,31 @@ class TestClient < MosquittoTestCase
     end
   end
 
+  def test_reinitialise_resets_subscriptions
+    messages = []
+    client = Mosquitto::Client.new
+    client.on_message { |msg| messages << msg.to_s }
+    client.loop_start
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+    assert client.subscribe(nil, "reinitialise/a", Mosquitto::AT_MOST_ONCE)
+    assert_equal({"reinitialise/a" => 0}, client.subscriptions)
+    client.loop_stop(true)
+
+    assert client.reinitialise
+    assert_equal({}, client.subscriptions)
+    client.loop_start
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+    assert client.subscribe(nil, "reinitialise/b", Mosquitto::AT_MOST_ONCE)
+    sleep 0.5
+    client.publish(nil, "reinitialise/b", "test", Mosquitto::AT_MOST_ONCE, false)
+    wait{ messages.size == 1 }
+    assert_equal ["test"], messages
+  ensure
+    client.loop_stop(true)
+  end
+
   def test_will_set
     client = Mosquitto::Client.new
     assert client.will_set("will_set", "test", Mosquitto::AT_MOST_ONCE, true)
@@ -125,6 +150,68 @@ class TestClient < MosquittoTestCase
     assert client.reconnect_delay_set(2, 10, true)
   end
 
+  def test_reconnect_backoff
+    client = Mosquitto::Client.new
+    assert_raises TypeError do
+      client.reconnect_backoff(:invalid, 10)
+    end
+    assert_raises ArgumentError do
+      client.reconnect_backoff(20, 10)
+    end
+    assert client.reconnect_backoff(0.5, 30)
+    assert client.reconnect_backoff(nil, 0)
+  end
+
+  def test_connect_rate_limit
+    assert_raises ArgumentError do
+      Mosquitto.connect_rate_limit(0)
+    end
+    assert Mosquitto.connect_rate_limit(5, 1)
+    client = Mosquitto::Client.new
+    started = Time.now
+    3.times do
+      assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    end
+    assert (Time.now - started) >= 0.35
+    stats = Mosquitto.connect_stats
+    assert_equal 3, stats[:passed]
+    assert_equal 2, stats[:throttled]
+  ensure
+    assert !Mosquitto.connect_rate_limit(nil)
+    assert_nil Mosquitto.connect_stats
+  end
+
+  def test_socket_options
+    require 'socket'
+    client = Mosquitto::Client.new
+    assert_raises TypeError do
+      client.socket_options = :invalid
+    end
+    assert_raises TypeError do
+      client.socket_options = {:sndbuf => "1024"}
+    end
+    assert_raises ArgumentError do
+      client.socket_options = {:rcvbuf => -1}
+    end
+    options = {:nodelay => true, :sndbuf => 256 * 1024, :rcvbuf => 256 * 1024, :keepalive => true, :keepidle => 30}
+    client.socket_options = options
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    socket = Socket.for_fd(client.socket)
+    socket.autoclose = false
+    assert socket.getsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY).bool
+    assert socket.getsockopt(Socket::SOL_SOCKET, Socket::SO_KEEPALIVE).bool
+    client.socket_options = {:nodelay => false}
+    assert !socket.getsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY).bool
+    assert !socket.getsockopt(Socket::SOL_SOCKET, Socket::SO_KEEPALIVE).bool
+    client.socket_options = options
+    assert client.reconnect
+    socket = Socket.for_fd(client.socket)
+    socket.autoclose = false
+    assert socket.getsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY).bool
+  ensure
+    client.disconnect rescue nil
+  end
+
   def test_max_inflight_messages
     client = Mosquitto::Client.new
     assert_raises TypeError do
@@ -140,4 +227,61 @@ class TestClient < MosquittoTestCase
     end
     assert client.message_retry = 10
   end
-end
\ No newline at end of file
+
+  def test_after_fork
+    connects = 0
+    messages = []
+    client = Mosquitto::Client.new("after_fork")
+    client.auto_resubscribe = true
+    client.loop_start
+    client.on_connect { |rc| connects += 1 }
+    client.on_message { |msg| messages << msg.to_s }
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    wait{ connects == 1 }
+    assert client.subscribe(nil, "after_fork/#", Mosquitto::AT_MOST_ONCE)
+    assert_equal false, client.after_fork
+    assert_equal false, Mosquitto.auto_after_fork
+
+    pid = fork do
+      status = begin
+        raise "reinitialised without auto_after_fork" unless Mosquitto.inherited_clients == [client]
+        def client.loop_start(*args)
+          raise ArgumentError, "replay failed"
+        end
+        begin
+          Mosquitto.after_fork
+          raise "after_fork did not raise"
+        rescue ArgumentError
+        end
+        raise "not retryable" unless Mosquitto.inherited_clients == [client]
+        client.singleton_class.send(:remove_method, :loop_start)
+        raise "not reinitialised" unless Mosquitto.after_fork == [client]
+        raise "still inherited" unless Mosquitto.inherited_clients.empty?
+        wait{ connects == 2 }
+        client.publish(nil, "after_fork/child", "child", Mosquitto::AT_MOST_ONCE, false)
+        wait{ messages.include?("child") }
+        0
+      rescue Exception
+        1
+      end
+      exit!(status)
+    end
+    Process.wait(pid)
+    assert_equal 0, $?.exitstatus
+
+    assert client.publish(nil, "after_fork/parent", "parent", Mosquitto::AT_MOST_ONCE, false)
+    wait{ messages.include?("parent") }
+    assert_equal 1, connects
+  ensure
+    client.loop_stop(true)
+  end
+
+  def test_memsize
+    require 'objspace'
+    client = Mosquitto::Client.new
+    size = ObjectSpace.memsize_of(client)
+    assert size > 0
+    assert client.sink("memsize/#", "/dev/null")
+    assert ObjectSpace.memsize_of(client) > size + 65536 - 1
+  end
+end
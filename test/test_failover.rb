@@ -0,0 +1,113 @@
+# encoding: utf-8
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+# Fault injection scenarios - these need the embedded broker (EMBEDDED_BROKER=1)
+class TestFailover < MosquittoTestCase
+  def setup
+    super
+    omit("requires EMBEDDED_BROKER=1") unless defined?(EMBEDDED_BROKER)
+  end
+
+  def teardown
+    super
+    return unless defined?(EMBEDDED_BROKER)
+    EMBEDDED_BROKER.latency = 0
+    EMBEDDED_BROKER.loss = 0
+  end
+
+  def test_reconnect_after_broker_disconnect
+    connects = 0
+    disconnects = []
+    client = Mosquitto::Client.new("failover")
+    client.reconnect_delay_set(1, 1, false)
+    client.loop_start
+    client.on_connect { |rc| connects += 1 }
+    client.on_disconnect { |rc| disconnects << rc }
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    wait{ connects == 1 }
+
+    EMBEDDED_BROKER.disconnect("failover")
+    wait{ connects == 2 }
+    assert disconnects.size >= 1
+    assert disconnects.all? { |rc| rc != 0 }
+  ensure
+    client.loop_stop(true)
+  end
+
+  def test_auto_resubscribe_after_clean_session_reconnect
+    connects = 0
+    messages = []
+    subscriber = Mosquitto::Client.new
+    subscriber.auto_resubscribe = true
+    subscriber.reconnect_delay_set(1, 1, false)
+    subscriber.loop_start
+    subscriber.on_connect { |rc| connects += 1 }
+    subscriber.on_message { |msg| messages << msg.to_s }
+    assert subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    wait{ connects == 1 }
+    assert subscriber.subscribe(nil, "failover/resubscribe/+", Mosquitto::AT_LEAST_ONCE)
+    assert subscriber.subscribe(nil, "failover/other", Mosquitto::AT_MOST_ONCE)
+    assert_equal({"failover/resubscribe/+" => 1, "failover/other" => 0}, subscriber.subscriptions)
+
+    EMBEDDED_BROKER.disconnect
+    wait{ connects == 2 }
+    assert_equal 2, subscriber.resubscribe_stats[:replayed]
+
+    publisher = Mosquitto::Client.new
+    publisher.loop_start
+    assert publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable
+    publisher.publish(nil, "failover/resubscribe/a", "after", Mosquitto::AT_LEAST_ONCE, false)
+    wait{ messages.size == 1 }
+    assert_equal ["after"], messages
+  ensure
+    publisher.loop_stop(true) if publisher
+    subscriber.loop_stop(true)
+  end
+
+  def test_latency
+    messages = []
+    client = Mosquitto::Client.new
+    client.loop_start
+    client.on_connect { |rc| client.subscribe(nil, "failover/latency", Mosquitto::AT_MOST_ONCE) }
+    client.on_message { |msg| messages << Time.now }
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable && sleep(0.5)
+
+    EMBEDDED_BROKER.latency = 0.5
+    published_at = Time.now
+    assert client.publish(nil, "failover/latency", "test", Mosquitto::AT_MOST_ONCE, false)
+    wait{ messages.size == 1 }
+    assert messages.first - published_at >= 0.5
+  ensure
+    client.loop_stop(true)
+  end
+
+  def test_qos1_survives_packet_loss
+    messages = []
+    EMBEDDED_BROKER.retry_interval = 1
+    subscriber = Mosquitto::Client.new
+    subscriber.loop_start
+    subscriber.on_connect { |rc| subscriber.subscribe(nil, "failover/loss", Mosquitto::AT_LEAST_ONCE) }
+    subscriber.on_message { |msg| messages << msg.to_s }
+    assert subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    subscriber.wait_readable && sleep(0.5)
+
+    publisher = Mosquitto::Client.new
+    publisher.message_retry = 1
+    publisher.loop_start
+    assert publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable && sleep(0.5)
+    EMBEDDED_BROKER.loss = 0.3
+    10.times { |i| publisher.publish(nil, "failover/loss", i.to_s, Mosquitto::AT_LEAST_ONCE, false) }
+    sleep 0.5
+    EMBEDDED_BROKER.loss = 0
+    Timeout.timeout(30) { sleep 0.2 until messages.uniq.size == 10 }
+    assert_equal (0..9).map(&:to_s), messages.uniq.sort_by(&:to_i)
+  ensure
+    EMBEDDED_BROKER.retry_interval = 20
+    publisher&.loop_stop(true)
+    subscriber.loop_stop(true)
+  end
+end
@@ -0,0 +1,74 @@
+# encoding: utf-8
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestInboundPolicy < MosquittoTestCase
+  def test_inbound_policy_args
+    client = Mosquitto::Client.new
+    assert_raises TypeError do
+      client.inbound_policy(:invalid, :sample => 2)
+    end
+    assert_raises TypeError do
+      client.inbound_policy("inbound/#", :invalid)
+    end
+    assert_raises ArgumentError do
+      client.inbound_policy("inbound/#", :max_rate => 0)
+    end
+    assert_raises ArgumentError do
+      client.inbound_policy("inbound/#", :sample => 0)
+    end
+    assert_raises ArgumentError do
+      client.inbound_policy("inbound/#", :max_age_ms => -1)
+    end
+    assert_raises ArgumentError do
+      client.remove_inbound_policy("inbound/\0#")
+    end
+    assert client.inbound_policy("inbound/#", :sample => 2)
+    assert client.inbound_policy("inbound/#", :max_rate => 5, :changed_only => true)
+    assert_equal 1, client.inbound_stats.size
+    assert client.remove_inbound_policy("inbound/#")
+    assert !client.remove_inbound_policy("inbound/#")
+    assert_equal [], client.inbound_stats
+  end
+
+  def test_inbound_policies
+    messages = []
+    subscriber = Mosquitto::Client.new
+    subscriber.loop_start
+    subscriber.on_message do |msg|
+      messages << msg
+    end
+    subscriber.on_connect do |rc|
+      subscriber.subscribe(nil, "inbound/#", Mosquitto::AT_MOST_ONCE)
+    end
+    assert subscriber.inbound_policy("inbound/changed/#", :changed_only => true)
+    assert subscriber.inbound_policy("inbound/sampled/#", :sample => 10)
+    assert subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    subscriber.wait_readable
+
+    publisher = Mosquitto::Client.new
+    publisher.loop_start
+    assert publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable
+
+    %w(1 1 2 2 2 1).each do |value|
+      publisher.publish(nil, "inbound/changed/a", value, Mosquitto::AT_LEAST_ONCE, false)
+    end
+    100.times do |i|
+      publisher.publish(nil, "inbound/sampled/a", i.to_s, Mosquitto::AT_LEAST_ONCE, false)
+    end
+    publisher.publish(nil, "inbound/other", "test", Mosquitto::AT_LEAST_ONCE, false)
+    assert publisher.flush(5)
+
+    wait{ messages.size == 14 }
+    assert_equal 3, messages.count{|m| m.topic == "inbound/changed/a" }
+    assert_equal 10, messages.count{|m| m.topic == "inbound/sampled/a" }
+    assert_equal 1, messages.count{|m| m.topic == "inbound/other" }
+    stats = subscriber.inbound_stats
+    assert_equal({:filter => "inbound/changed/#", :passed => 3, :filtered => 3}, stats[0])
+    assert_equal({:filter => "inbound/sampled/#", :passed => 10, :filtered => 90}, stats[1])
+  ensure
+    subscriber.loop_stop(true)
+    publisher.loop_stop(true)
+  end
+end
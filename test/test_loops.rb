@@ -57,6 +57,31 @@ class TestLoops < MosquittoTestCase
     assert client.loop_stop(true)
   end
 
+  def test_loop_start_thread_placement
+    client = Mosquitto::Client.new("placement")
+    assert_raises TypeError do
+      client.loop_start(:invalid)
+    end
+    assert_raises ArgumentError do
+      client.loop_start(:cpu => -1)
+    end
+    assert client.loop_start(:cpu => 0, :callback_cpu => 0)
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+    if File.directory?("/proc/self/task")
+      sleep 0.5
+      names = Dir["/proc/self/task/*/comm"].map { |comm| File.read(comm).strip }
+      assert names.include?("mosq-net:placem")
+      assert names.include?("mosq-cb:placeme")
+    end
+    assert client.loop_stop(true)
+    if File.directory?("/proc/self/task")
+      # Native threads the Ruby VM keeps around for reuse get their name back
+      names = Dir["/proc/self/task/*/comm"].map { |comm| File.read(comm).strip }
+      assert !names.include?("mosq-cb:placeme")
+    end
+  end
+
   def test_want_write_p
     client = Mosquitto::Client.new
     client.loop_start
@@ -25,4 +25,15 @@ class TestMosquitto < MosquittoTestCase
     assert_equal 64, Mosquitto::LOG_UNSUBSCRIBE
     assert_equal 65535, Mosquitto::LOG_ALL
   end
+
+  def test_probes
+    skip "built without sys/sdt.h" unless Mosquitto::PROBES
+    ext = $LOADED_FEATURES.grep(/mosquitto_ext\.(so|bundle)\z/).first
+    notes = `readelf -n #{ext} 2>/dev/null`
+    skip "readelf not available" unless $?.success?
+    %w(callback__enqueue callback__dequeue handler__start handler__end publish__start publish__end
+       connect disconnect).each do |probe|
+      assert_match(/Provider: mosquitto\n\s+Name: #{probe}\n/, notes)
+    end
+  end
 end
\ No newline at end of file
@@ -0,0 +1,36 @@
+# encoding: utf-8
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestPool < MosquittoTestCase
+  def test_init
+    pool = Mosquitto::Pool.new(3)
+    assert_equal 3, pool.size
+    assert pool.all?{|client| client.is_a?(Mosquitto::Client) }
+    assert_raises ArgumentError do
+      Mosquitto::Pool.new(0)
+    end
+  end
+
+  def test_topic_affinity
+    pool = Mosquitto::Pool.new(4)
+    assert_equal pool.client_for("affinity/a"), pool.client_for("affinity/a")
+    assert_equal 4, ('a'..'z').map{|t| pool.client_for("affinity/#{t}") }.uniq.size
+  end
+
+  def test_publish
+    pool = Mosquitto::Pool.new(3)
+    assert pool.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    wait{ pool.stats[:connected] == 3 }
+    ('a'..'z').each do |t|
+      assert pool.publish(nil, "pool/#{t}", t, Mosquitto::AT_LEAST_ONCE, false)
+    end
+    wait{ pool.stats[:acked] == 26 }
+    stats = pool.stats
+    assert_equal 26, stats[:published]
+    assert_equal 0, stats[:errors]
+    assert_equal 3, stats[:members].size
+  ensure
+    pool.disconnect
+  end
+end
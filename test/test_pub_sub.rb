@@ -19,6 +19,49 @@ class TestPubSub < MosquittoTestCase
     assert client.publish(3, "publish", "test", Mosquitto::AT_MOST_ONCE, true)
   end
 
+  def test_publish_async
+    client = Mosquitto::Client.new
+    client.loop_start
+    assert_raises Mosquitto::Error do
+      client.publish_async("publish_async", "test", Mosquitto::AT_LEAST_ONCE, false)
+    end
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+
+    assert_raises TypeError do
+      client.publish_async(:invalid, "test", Mosquitto::AT_LEAST_ONCE, false)
+    end
+    futures = (1..10).map do |i|
+      client.publish_async("publish_async", i.to_s, Mosquitto::AT_LEAST_ONCE, false)
+    end
+    assert futures.all?{|f| f.is_a?(Mosquitto::Future) && f.mid > 0 }
+    waiters = [futures.first(5), futures.last(5), futures].map{|batch| Thread.new { Mosquitto.wait_all(batch, 5) } }
+    assert Mosquitto.wait_all(futures, 5)
+    assert waiters.all?(&:value)
+    assert futures.all?(&:done?)
+    assert !futures.any?(&:failed?)
+    assert futures.first.value(1)
+  ensure
+    client.loop_stop(true)
+  end
+
+  def test_flush
+    client = Mosquitto::Client.new
+    client.loop_start
+    assert_equal 0, client.inflight
+    assert client.flush(1)
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+
+    100.times do |i|
+      client.publish(nil, "flush", i.to_s, Mosquitto::AT_LEAST_ONCE, false)
+    end
+    assert client.flush(5)
+    assert_equal 0, client.inflight
+  ensure
+    client.loop_stop(true)
+  end
+
   def test_subscribe
     client = Mosquitto::Client.new
     client.loop_start
@@ -62,4 +105,41 @@ class TestPubSub < MosquittoTestCase
     assert client.subscribe(nil, "subscribe_unsubscribe", Mosquitto::AT_MOST_ONCE)
     assert client.unsubscribe(nil, "subscribe_unsubscribe")
   end
-end
\ No newline at end of file
+
+  def test_borrow_messages
+    borrowed = []
+    copies = []
+    clones = []
+    foreign = []
+    client = Mosquitto::Client.new
+    assert !client.borrow_messages?
+    client.borrow_messages = true
+    assert client.borrow_messages?
+    client.loop_start
+    client.on_message do |msg|
+      borrowed << msg
+      copies << msg.dup
+      clones << msg.clone(:freeze => true)
+      foreign << Thread.new { begin; msg.to_s; rescue Mosquitto::Error => e; e; end }.value
+    end
+    client.on_connect { |rc| client.subscribe(nil, "borrow_messages", Mosquitto::AT_MOST_ONCE) }
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+    %w(a b).each { |m| client.publish(nil, "borrow_messages", m, Mosquitto::AT_MOST_ONCE, false) }
+    wait{ copies.size == 2 }
+
+    assert borrowed.all?(&:borrowed?)
+    assert borrowed.first.equal?(borrowed.last)
+    assert_raises Mosquitto::Error do
+      borrowed.first.to_s
+    end
+    assert_equal %w(a b), copies.map(&:to_s)
+    assert_equal ["borrow_messages"], copies.map(&:topic).uniq
+    assert copies.none?(&:borrowed?)
+    assert_equal %w(a b), clones.map(&:to_s)
+    assert clones.all?(&:frozen?)
+    assert foreign.all? { |e| Mosquitto::Error === e }
+  ensure
+    client.loop_stop(true)
+  end
+end
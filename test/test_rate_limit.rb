@@ -0,0 +1,80 @@
+# encoding: utf-8
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestRateLimit < MosquittoTestCase
+  def test_rate_limit_args
+    client = Mosquitto::Client.new
+    assert_raises TypeError do
+      client.rate_limit(:invalid, 10)
+    end
+    assert_raises ArgumentError do
+      client.rate_limit("rate/#", 0)
+    end
+    assert_raises ArgumentError do
+      client.rate_limit("rate/#", 10, :policy => :invalid)
+    end
+    assert client.rate_limit("rate/#", 10)
+    assert client.rate_limit("rate/#", 20, :burst => 40)
+    assert client.rate_limit(nil, 100, :policy => :raise)
+    assert_equal 2, client.throttle_stats.size
+    assert client.remove_rate_limit("rate/#")
+    assert !client.remove_rate_limit("rate/#")
+    assert client.remove_rate_limit(nil)
+    assert_equal [], client.throttle_stats
+  end
+
+  def test_rate_limit_drop
+    client = Mosquitto::Client.new
+    assert client.rate_limit("rate/#", 1, :burst => 1, :policy => :drop)
+    assert_raises Mosquitto::Error do
+      client.publish(nil, "rate/drop", "test", Mosquitto::AT_MOST_ONCE, false)
+    end
+    assert_equal 0, client.throttle_stats.first[:passed]
+
+    client.loop_start
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+    assert client.publish(nil, "rate/drop", "test", Mosquitto::AT_MOST_ONCE, false)
+    assert_equal false, client.publish(nil, "rate/drop", "test", Mosquitto::AT_MOST_ONCE, false)
+    assert_nil client.publish_async("rate/drop", "test", Mosquitto::AT_MOST_ONCE, false)
+    stats = client.throttle_stats.first
+    assert_equal "rate/#", stats[:filter]
+    assert_equal 1, stats[:passed]
+    assert_equal 2, stats[:dropped]
+  ensure
+    client.loop_stop(true)
+  end
+
+  def test_rate_limit_block
+    client = Mosquitto::Client.new
+    client.loop_start
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+
+    assert client.rate_limit("rate/#", 50, :burst => 10)
+    started = Time.now
+    20.times do |i|
+      assert client.publish(nil, "rate/block", i.to_s, Mosquitto::AT_LEAST_ONCE, false)
+    end
+    assert (Time.now - started) >= 0.15
+    assert client.throttle_stats.first[:throttled] > 0
+  ensure
+    client.loop_stop(true)
+  end
+
+  def test_rate_limit_raise
+    client = Mosquitto::Client.new
+    client.loop_start
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+
+    assert client.rate_limit(nil, 1, :burst => 1, :policy => :raise)
+    assert client.publish(nil, "rate/raise", "test", Mosquitto::AT_LEAST_ONCE, false)
+    assert_raises Mosquitto::Error do
+      client.publish(nil, "rate/raise", "test", Mosquitto::AT_LEAST_ONCE, false)
+    end
+  ensure
+    client.loop_stop(true)
+  end
+end
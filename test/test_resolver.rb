@@ -0,0 +1,58 @@
+# encoding: utf-8
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestResolver < MosquittoTestCase
+  def teardown
+    Mosquitto.resolver_flush
+    Mosquitto.resolver_cache(nil)
+  end
+
+  def test_resolver_args
+    assert_raises ArgumentError do
+      Mosquitto.resolver_cache(-1)
+    end
+    assert_raises TypeError do
+      Mosquitto.resolver_seed(:invalid, "127.0.0.1")
+    end
+    assert_raises ArgumentError do
+      Mosquitto.resolver_seed("broker.invalid", "not an address")
+    end
+    assert Mosquitto.resolver_seed("broker.invalid", "::1", 10)
+    assert !Mosquitto.resolver_cache(nil)
+    assert Mosquitto.resolver_cache(60)
+  end
+
+  def test_resolver_cache
+    assert Mosquitto.resolver_cache(60)
+    stats = Mosquitto.resolver_stats
+    3.times do
+      client = Mosquitto::Client.new
+      assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+      client.disconnect
+    end
+    assert_equal stats[:misses] + 1, Mosquitto.resolver_stats[:misses]
+    assert_equal stats[:hits] + 2, Mosquitto.resolver_stats[:hits]
+  end
+
+  def test_resolver_seed
+    assert Mosquitto.resolver_seed("mosquitto.broker.invalid", "127.0.0.1")
+    client = Mosquitto::Client.new
+    assert client.connect("mosquitto.broker.invalid", TEST_PORT, TIMEOUT)
+    assert client.reconnect
+    assert_equal 0, Mosquitto.resolver_stats[:failures]
+  end
+
+  def test_resolver_flush
+    assert Mosquitto.resolver_cache(60)
+    client = Mosquitto::Client.new
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    misses = Mosquitto.resolver_stats[:misses]
+    Mosquitto.resolver_flush
+    assert_equal 0, Mosquitto.resolver_stats[:entries]
+    assert client.reconnect
+    assert_equal misses + 1, Mosquitto.resolver_stats[:misses]
+  ensure
+    client.disconnect rescue nil
+  end
+end
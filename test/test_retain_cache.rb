@@ -0,0 +1,90 @@
+# encoding: utf-8
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestRetainCache < MosquittoTestCase
+  def test_retain_cache_args
+    client = Mosquitto::Client.new
+    assert_nil client.retain_cache_stats
+    assert_nil client.retained("retain/a")
+    assert_equal({}, client.retained_snapshot)
+    assert_raises TypeError do
+      client.retain_cache(:invalid)
+    end
+    assert_raises TypeError do
+      client.retain_cache("retain/#", :invalid)
+    end
+    assert_raises ArgumentError do
+      client.retain_cache("retain/#", :max_topics => 0)
+    end
+    assert client.retain_cache("retain/#", :latest => true, :max_topics => 100)
+    assert_equal 0, client.retain_cache_stats[:topics]
+    assert client.remove_retain_cache("retain/#")
+    assert !client.remove_retain_cache("retain/#")
+  end
+
+  def test_most_specific_filter
+    subscriber = Mosquitto::Client.new
+    subscriber.loop_start
+    assert subscriber.retain_cache("retain/+/secret")
+    assert subscriber.retain_cache("retain/#", :latest => true)
+    subscriber.on_connect do |rc|
+      subscriber.subscribe(nil, "retain/#", Mosquitto::AT_LEAST_ONCE)
+    end
+    assert subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    subscriber.wait_readable && sleep(0.5)
+
+    publisher = Mosquitto::Client.new
+    publisher.loop_start
+    assert publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable
+    publisher.publish(nil, "retain/other/secret", "a", Mosquitto::AT_LEAST_ONCE, false)
+    publisher.publish(nil, "retain/other/public", "b", Mosquitto::AT_LEAST_ONCE, false)
+    wait{ subscriber.retained("retain/other/public") }
+    assert_nil subscriber.retained("retain/other/secret")
+    assert_equal "b", subscriber.retained("retain/other/public").to_s
+  ensure
+    publisher.loop_stop(true) if publisher
+    subscriber.loop_stop(true)
+  end
+
+  def test_retained
+    publisher = Mosquitto::Client.new
+    publisher.loop_start
+    assert publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable
+    publisher.publish(nil, "retain/config/a", "1", Mosquitto::AT_LEAST_ONCE, true)
+    publisher.publish(nil, "retain/config/b", "2", Mosquitto::AT_LEAST_ONCE, true)
+    assert publisher.flush(5)
+
+    subscriber = Mosquitto::Client.new
+    subscriber.loop_start
+    assert subscriber.retain_cache("retain/config/#")
+    assert subscriber.retain_cache("retain/status/#", :latest => true)
+    subscriber.on_connect do |rc|
+      subscriber.subscribe(nil, "retain/#", Mosquitto::AT_LEAST_ONCE)
+    end
+    assert subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    subscriber.wait_readable
+
+    wait{ subscriber.retained_snapshot("retain/config/+").size == 2 }
+    assert_equal "1", subscriber.retained("retain/config/a").to_s
+    assert_equal "2", subscriber.retained("retain/config/b").to_s
+
+    # Live messages reach established subscriptions without the RETAIN flag - they still update cached topics
+    publisher.publish(nil, "retain/config/a", "3", Mosquitto::AT_LEAST_ONCE, true)
+    publisher.publish(nil, "retain/config/c", "4", Mosquitto::AT_LEAST_ONCE, false)
+    publisher.publish(nil, "retain/status/a", "up", Mosquitto::AT_LEAST_ONCE, false)
+    publisher.publish(nil, "retain/config/b", "", Mosquitto::AT_LEAST_ONCE, true)
+    wait{ subscriber.retained("retain/status/a") && subscriber.retained("retain/config/b").nil? }
+    assert_equal "3", subscriber.retained("retain/config/a").to_s
+    assert_equal "up", subscriber.retained("retain/status/a").to_s
+    assert_nil subscriber.retained("retain/config/c")
+    assert_equal ["retain/config/a", "retain/status/a"], subscriber.retained_snapshot.keys.sort
+    assert subscriber.retain_cache_stats[:hits] > 0
+  ensure
+    publisher.publish(nil, "retain/config/a", "", Mosquitto::AT_LEAST_ONCE, true)
+    publisher.loop_stop(true)
+    subscriber.loop_stop(true)
+  end
+end
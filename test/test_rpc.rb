@@ -0,0 +1,86 @@
+# encoding: utf-8
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestRpc < MosquittoTestCase
+  def test_request_args
+    client = Mosquitto::Client.new
+    assert_nil client.request_stats
+    assert_raises TypeError do
+      client.request(:invalid, "payload")
+    end
+    assert_raises TypeError do
+      client.request("rpc/echo", :invalid)
+    end
+    assert_raises TypeError do
+      client.request("rpc/echo", "payload", :invalid)
+    end
+    assert_raises ArgumentError do
+      client.request("rpc/echo", "payload", :timeout => -1)
+    end
+  end
+
+  def test_request
+    server = Mosquitto::Client.new
+    server.loop_start
+    server.on_message do |msg|
+      server.respond(msg, msg.request_payload.upcase) if msg.request?
+    end
+    server.on_connect do |rc|
+      server.subscribe(nil, "rpc/upcase", Mosquitto::AT_LEAST_ONCE)
+    end
+    assert server.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    server.wait_readable
+
+    client = Mosquitto::Client.new
+    client.loop_start
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+
+    reply = client.request("rpc/upcase", "hello\0world", :timeout => 5)
+    assert_equal "HELLO\0WORLD", reply.to_s
+    assert !reply.request?
+
+    threads = (1..4).map do |i|
+      Thread.new { (1..25).map { |j| client.request("rpc/upcase", "t#{i}-#{j}").to_s } }
+    end
+    assert_equal (1..4).map { |i| (1..25).map { |j| "T#{i}-#{j}" } }, threads.map(&:value)
+
+    assert_nil client.request("rpc/nobody", "ping", :timeout => 0.2)
+    stats = client.request_stats
+    assert_equal 0, stats[:pending]
+    assert_equal 102, stats[:requests]
+    assert_equal 101, stats[:replies]
+    assert_equal 1, stats[:timeouts]
+    assert_equal 0, stats[:unsent]
+
+    assert client.rate_limit("rpc/limited", 1, :burst => 1, :policy => :drop)
+    client.publish(nil, "rpc/limited", "fill", Mosquitto::AT_MOST_ONCE, false)
+    assert_equal false, client.request("rpc/limited", "ping", :timeout => 0.2, :qos => Mosquitto::AT_MOST_ONCE)
+    stats = client.request_stats
+    assert_equal 1, stats[:timeouts]
+    assert_equal 1, stats[:unsent]
+  ensure
+    client.loop_stop(true)
+    server.loop_stop(true)
+  end
+
+  def test_respond_to_plain_message
+    client = Mosquitto::Client.new
+    messages = []
+    client.loop_start
+    client.on_message { |msg| messages << msg }
+    client.on_connect { |rc| client.subscribe(nil, "rpc/plain", Mosquitto::AT_MOST_ONCE) }
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+    client.publish(nil, "rpc/plain", "test", Mosquitto::AT_MOST_ONCE, false)
+    wait{ messages.size == 1 }
+    assert !messages.first.request?
+    assert_equal "test", messages.first.request_payload
+    assert_raises ArgumentError do
+      client.respond(messages.first, "reply")
+    end
+  ensure
+    client.loop_stop(true)
+  end
+end
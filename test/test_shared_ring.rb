@@ -0,0 +1,100 @@
+# encoding: utf-8
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestSharedRing < MosquittoTestCase
+  def test_init
+    ring = Mosquitto::SharedRing.new
+    assert_instance_of Mosquitto::SharedRing, ring
+    assert_equal 1024, ring.stats[:slots]
+    assert_equal 4096, ring.stats[:slot_size]
+    assert_equal 8, Mosquitto::SharedRing.new(5, 16).stats[:slots]
+    assert_raises TypeError do
+      Mosquitto::SharedRing.new(:invalid)
+    end
+    assert_raises ArgumentError do
+      Mosquitto::SharedRing.new(0)
+    end
+  end
+
+  def test_push_shift
+    ring = Mosquitto::SharedRing.new(2, 16)
+    assert ring.push("ring", "a")
+    assert ring.push("ring", "b")
+    assert !ring.push("ring", "c")
+    assert !ring.push("ring", "x" * 16)
+    assert_equal 2, ring.size
+    msg = ring.shift(0)
+    assert_equal "ring", msg.topic
+    assert_equal "a", msg.to_s
+    assert_equal "b", ring.shift(0).to_s
+    assert_nil ring.shift(0)
+    assert_nil ring.shift(0.1)
+    assert_equal 2, ring.stats[:dropped]
+    assert_raises ArgumentError do
+      ring.shift(-1)
+    end
+  end
+
+  def test_interrupt_single_consumer
+    ring = Mosquitto::SharedRing.new(2, 16)
+    killed = Thread.new { ring.shift }
+    waiting = Thread.new { ring.shift }
+    sleep 0.2
+    killed.kill.join
+    assert waiting.alive?
+    assert ring.push("ring", "a")
+    assert_equal "a", waiting.value.to_s
+  end
+
+  def test_wraps_around
+    ring = Mosquitto::SharedRing.new(2, 16)
+    10.times do |i|
+      assert ring.push("ring", i.to_s)
+      assert_equal i.to_s, ring.shift(0).to_s
+    end
+    assert_equal 10, ring.stats[:read]
+  end
+
+  def test_fork_consumers
+    ring = Mosquitto::SharedRing.new(64, 64)
+    workers = 2.times.map do
+      fork do
+        count = 0
+        count += 1 while ring.shift(1)
+        exit!(count)
+      end
+    end
+    20.times{|i| assert ring.push("ring/#{i}", i.to_s) }
+    consumed = workers.map{|pid| Process.wait2(pid)[1].exitstatus }
+    assert_equal 20, consumed.inject(:+)
+    assert_equal 20, ring.stats[:read]
+  end
+
+  def test_sink
+    ring = Mosquitto::SharedRing.new
+    subscriber = Mosquitto::Client.new
+    subscriber.loop_start
+    subscriber.on_connect do |rc|
+      subscriber.subscribe(nil, "shared_ring/#", Mosquitto::AT_MOST_ONCE)
+    end
+    assert subscriber.sink("shared_ring/#", ring)
+    assert subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    subscriber.wait_readable
+
+    publisher = Mosquitto::Client.new
+    publisher.loop_start
+    publisher.on_connect do |rc|
+      publisher.publish(nil, "shared_ring/test", "test", Mosquitto::AT_MOST_ONCE, false)
+    end
+    assert publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable
+    publisher.loop_stop(true)
+
+    msg = ring.shift(5)
+    assert_equal "shared_ring/test", msg.topic
+    assert_equal "test", msg.to_s
+  ensure
+    subscriber.loop_stop(true)
+  end
+end
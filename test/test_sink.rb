@@ -0,0 +1,123 @@
+# encoding: utf-8
+
+require File.join(File.dirname(__FILE__), 'helper')
+require 'tempfile'
+
+class TestSink < MosquittoTestCase
+  def test_sink_args
+    client = Mosquitto::Client.new
+    assert_raises TypeError do
+      client.sink(:invalid, STDOUT)
+    end
+    assert_raises TypeError do
+      client.sink("sink/#", :invalid)
+    end
+    assert_raises ArgumentError do
+      client.sink("sink/#", STDOUT, :format => :invalid)
+    end
+    assert client.sink("sink/#", STDOUT, :format => :raw)
+    assert_equal 1, client.sink_stats.size
+    assert_raises ArgumentError do
+      client.unsink("sink/\0#")
+    end
+    assert client.unsink("sink/#")
+    assert !client.unsink("sink/#")
+    assert_equal [], client.sink_stats
+  end
+
+  def test_sink_flushes_quiet_topics
+    archive = Tempfile.new('mosquitto_sink')
+    subscriber = Mosquitto::Client.new
+    subscriber.loop_start
+    subscriber.on_connect do |rc|
+      subscriber.subscribe(nil, "sink/quiet", Mosquitto::AT_MOST_ONCE)
+    end
+    assert subscriber.sink("sink/quiet", archive.path, :format => :raw)
+    assert subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    subscriber.wait_readable
+
+    publisher = Mosquitto::Client.new
+    publisher.loop_start
+    assert publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable
+    publisher.publish(nil, "sink/quiet", "once", Mosquitto::AT_MOST_ONCE, false)
+    wait{ File.size(archive.path) > 0 }
+    assert_equal "once", File.binread(archive.path)
+  ensure
+    publisher.loop_stop(true) if publisher
+    subscriber.loop_stop(true)
+    archive.close!
+  end
+
+  def test_sink_length_prefixed
+    messages = []
+    archive = Tempfile.new('mosquitto_sink')
+    subscriber = Mosquitto::Client.new
+    subscriber.loop_start
+    subscriber.on_message do |msg|
+      messages << msg.to_s
+    end
+    subscriber.on_connect do |rc|
+      subscriber.subscribe(nil, "sink/#", Mosquitto::AT_MOST_ONCE)
+      subscriber.subscribe(nil, "no_sink", Mosquitto::AT_MOST_ONCE)
+    end
+    assert subscriber.sink("sink/#", archive.path)
+    assert subscriber.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    subscriber.wait_readable
+
+    publisher = Mosquitto::Client.new
+    publisher.loop_start
+    publisher.on_connect do |rc|
+      %w(a b c).each do |message|
+        publisher.publish(nil, "sink/#{message}", message, Mosquitto::AT_MOST_ONCE, false)
+      end
+      publisher.publish(nil, "no_sink", "d", Mosquitto::AT_MOST_ONCE, false)
+    end
+    assert publisher.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    publisher.wait_readable
+    publisher.loop_stop(true)
+
+    assert subscriber.flush_sinks
+    assert_equal 3, subscriber.sink_stats[0][:messages]
+    assert_equal ["d"], messages
+
+    records = []
+    data = File.binread(archive.path)
+    until data.empty?
+      topic_len = data.slice!(0, 4).unpack('N')[0]
+      topic = data.slice!(0, topic_len)
+      payload_len = data.slice!(0, 4).unpack('N')[0]
+      records << [topic, data.slice!(0, payload_len)]
+    end
+    assert_equal [["sink/a", "a"], ["sink/b", "b"], ["sink/c", "c"]], records
+  ensure
+    subscriber.loop_stop(true)
+    archive.close!
+  end
+
+  def test_log_to
+    log = Tempfile.new('mosquitto_log')
+    client = Mosquitto::Client.new
+    assert_raises ArgumentError do
+      client.log_to(:invalid)
+    end
+    assert_raises TypeError do
+      client.log_to(log.path, :invalid)
+    end
+    assert client.log_to(log.path, Mosquitto::LOG_ALL & ~Mosquitto::LOG_SUBSCRIBE)
+    client.loop_start
+    assert client.connect(TEST_HOST, TEST_PORT, TIMEOUT)
+    client.wait_readable
+    assert client.subscribe(nil, "log_to", Mosquitto::AT_MOST_ONCE)
+    # Buffered DEBUG lines reach the file through the background flusher, without flush_sinks
+    wait{ File.read(log.path) =~ /sending SUBSCRIBE/ }
+
+    logs = File.read(log.path)
+    assert_match(/^\d{4}-\d{2}-\d{2}T\d{2}:\d{2}:\d{2}\.\d{3}Z DEBUG .*sending CONNECT$/, logs)
+    assert_match(/sending SUBSCRIBE/, logs)
+    assert client.log_to(nil)
+  ensure
+    client.loop_stop(true)
+    log.close!
+  end
+end
@@ -65,4 +65,21 @@ class TestTls < MosquittoTestCase
     end
     assert client.tls_psk_set("deadbeef", "psk-id", nil)
   end
+
+  def test_connect_psk
+    omit("requires EMBEDDED_BROKER=1") unless defined?(EMBEDDED_BROKER)
+    connected = false
+    client = Mosquitto::Client.new
+    assert client.loop_start
+    client.on_connect do |rc|
+      connected = true
+    end
+    assert client.tls_psk_set("deadbeef", "psk-id", nil)
+    assert client.connect(TLS_TEST_HOST, PSK_TEST_PORT, TIMEOUT)
+    client.wait_readable && sleep(3)
+
+    assert connected
+  ensure
+    client.loop_stop(true)
+  end
 end
\ No newline at end of file